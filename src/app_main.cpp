@@ -1,3 +1,10 @@
+#include "cpu_affinity.h"
+#include "llm_kv_pool.h"
+#include "llm_prefill_tune.h"
+#include "llm_prefix_cache.h"
+#include "llm_session_cache.h"
+#include "rag_collections.h"
+#include "rag_context_pack.h"
 #include "rag_ingest.h"
 #include "rag_text.h"
 #include "rag_vector_db.h"
@@ -6,12 +13,14 @@
 #include "ncnn_llm_gpt.h"
 #include "util.h"
 #include "utils/prompt.h"
+#include "warmup_queries.h"
 #include "web_assets_embedded.h"
 
 #include <httplib.h>
 #include <nlohmann/json.hpp>
 
 #if defined(NCNN_RAG_HAS_VULKAN_API) && NCNN_RAG_HAS_VULKAN_API
+#include <ncnn/cpu.h>
 #include <ncnn/gpu.h>
 #endif
 
@@ -21,17 +30,26 @@
 
 #include <cstdlib>
 #include <algorithm>
+#include <atomic>
+#include <cerrno>
 #include <chrono>
 #include <cctype>
 #include <cinttypes>
+#include <condition_variable>
 #include <cstdio>
+#include <deque>
 #include <filesystem>
 #include <fstream>
+#include <functional>
 #include <iostream>
 #include <memory>
 #include <mutex>
+#include <optional>
+#include <set>
 #include <sstream>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <unordered_set>
 
 #if defined(_WIN32)
@@ -40,6 +58,12 @@
 #include <unistd.h>
 #endif
 
+#if defined(__linux__)
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#endif
+
 using nlohmann::json;
 
 namespace {
@@ -63,11 +87,32 @@ enum class LlmBackend {
     OpenAICompat,
 };
 
+// What a streaming request does when its client falls --sse-buffer tokens behind.
+enum class SseOverflow {
+    Coalesce,   // merge further tokens into the newest pending chunk
+    Disconnect, // stop generating and end the stream with an error
+};
+
 struct MemSnapshot {
     size_t rss_bytes = 0;
     size_t hwm_bytes = 0;
 };
 
+constexpr size_t kKvPoolBlockBytes = 64 * 1024;
+// Retry-After sent with the 503 that chat returns while the local model is still loading.
+constexpr int kModelLoadingRetryAfterSec = 5;
+// Tokens decoded by the synthetic warm-up generation.
+constexpr int kWarmupDecodeTokens = 16;
+
+std::optional<double> parse_double(const std::string& s) {
+    if (s.empty()) return std::nullopt;
+    char* end = nullptr;
+    errno = 0;
+    double v = std::strtod(s.c_str(), &end);
+    if (errno != 0 || !end || *end != '\0') return std::nullopt;
+    return v;
+}
+
 bool getenv_int(const char* name, int* out) {
     if (!out) return false;
     const char* v = std::getenv(name);
@@ -344,6 +389,26 @@ bool is_model_complete(const std::filesystem::path& model_dir, std::vector<std::
     return ok;
 }
 
+// Starts kernel readahead of every file in the model dir, so the loader (and each further
+// replica) reads the weights from the page cache. Returns the bytes hinted.
+size_t prefetch_model_files(const std::filesystem::path& model_dir) {
+    size_t total = 0;
+#if defined(__linux__)
+    std::error_code ec;
+    for (std::filesystem::directory_iterator it(model_dir, ec), end; !ec && it != end; it.increment(ec)) {
+        std::error_code file_ec;
+        if (!it->is_regular_file(file_ec)) continue;
+        int fd = ::open(it->path().c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) continue;
+        if (::posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED) == 0) total += static_cast<size_t>(it->file_size(file_ec));
+        ::close(fd);
+    }
+#else
+    (void)model_dir;
+#endif
+    return total;
+}
+
 struct CurlDownloadOptions {
     long connect_timeout_sec = 15;
     long stall_timeout_sec = 60;
@@ -894,7 +959,8 @@ bool openai_chat_completions_stream_to_sink(ClientT& cli,
                                             const std::string& resp_id,
                                             const json& rag_payload,
                                             httplib::DataSink& sink,
-                                            std::string* err) {
+                                            std::string* err,
+                                            bool* client_disconnected) {
     std::string upstream_model;
     int upstream_status = 0;
     bool got_status = false;
@@ -902,14 +968,20 @@ bool openai_chat_completions_stream_to_sink(ClientT& cli,
     std::string err_body;
 
     bool in_think = false;
+    // Set once a write to our client fails; the upstream request is then aborted.
+    bool client_gone = false;
 
+    auto write_raw = [&](const char* data, size_t len) {
+        if (client_gone) return;
+        if (!sink.write(data, len)) client_gone = true;
+    };
     auto write_chunk = [&](const json& j) {
         std::string data = "data: " + dump_json_safe(j) + "\n\n";
-        sink.write(data.data(), data.size());
+        write_raw(data.data(), data.size());
     };
     auto write_done = [&]() {
         const char done[] = "data: [DONE]\n\n";
-        sink.write(done, sizeof(done) - 1);
+        write_raw(done, sizeof(done) - 1);
     };
     auto write_error_as_chat = [&](int status, const std::string& msg) {
         json chunk = {
@@ -957,6 +1029,10 @@ bool openai_chat_completions_stream_to_sink(ClientT& cli,
     };
 
     req.content_receiver = [&](const char* data, size_t data_length, uint64_t, uint64_t) {
+        if (client_gone || (sink.is_writable && !sink.is_writable())) {
+            client_gone = true;
+            return false;
+        }
         if (!ok_status) {
             err_body.append(data, data_length);
             return true;
@@ -995,7 +1071,7 @@ bool openai_chat_completions_stream_to_sink(ClientT& cli,
                 } catch (...) {
                     // Unknown format: pass through.
                     std::string raw = "data: " + payload + "\n\n";
-                    sink.write(raw.data(), raw.size());
+                    write_raw(raw.data(), raw.size());
                     continue;
                 }
 
@@ -1063,12 +1139,18 @@ bool openai_chat_completions_stream_to_sink(ClientT& cli,
                 write_chunk(j);
             }
         }
-        return true;
+        // Returning false makes httplib drop the upstream connection.
+        return !client_gone;
     };
 
     httplib::Response res;
     httplib::Error error = httplib::Error::Success;
     bool ok = cli.send(req, res, error);
+    if (client_gone) {
+        if (err) *err = "client disconnected";
+        if (client_disconnected) *client_disconnected = true;
+        return false;
+    }
     if (!ok_status) {
         std::string msg = "upstream http " + std::to_string(upstream_status);
         std::string clipped = truncate_for_log(err_body, 1500);
@@ -1151,22 +1233,267 @@ std::vector<std::string> split_prompt_chunks(const std::string& prompt, size_t c
     return out;
 }
 
+// How prompts are cut for prefill. Chunks are `bytes` long unless `tokens` is set, in which case
+// they hold about that many tokens, converted to bytes with the estimator's rate for the text at
+// hand. In auto mode the tuner picks the token count and is fed every chunk's speed and RSS.
+struct PrefillChunking {
+    size_t bytes = 2048;
+    size_t tokens = 0;
+    const TokenEstimator* estimator = nullptr;
+    PrefillTuner* tuner = nullptr;
+
+    size_t chunk_tokens() const { return tuner ? tuner->chunk_tokens() : tokens; }
+
+    size_t bytes_for(const std::string& text, size_t chunk_tokens) const {
+        if (chunk_tokens == 0 || !estimator || text.empty()) return bytes;
+        const size_t est = std::max<size_t>(1, estimator->estimate(text));
+        return std::max<size_t>(1, chunk_tokens * text.size() / est);
+    }
+
+    bool fits(const std::string& text, size_t chunk_tokens) const { return bytes_for(text, chunk_tokens) >= text.size(); }
+};
+
+// One model.prefill call. With a tuner, the chunk's token count, duration and the RSS after it
+// are recorded against `chunk_tokens`.
+std::shared_ptr<ncnn_llm_gpt_ctx> prefill_chunk(const ncnn_llm_gpt& model,
+                                                const std::string& text,
+                                                std::shared_ptr<ncnn_llm_gpt_ctx> ctx,
+                                                const PrefillChunking& chunking,
+                                                size_t chunk_tokens) {
+    if (!chunking.tuner || chunk_tokens == 0 || chunking.tuner->tuned()) return ctx ? model.prefill(text, ctx) : model.prefill(text);
+    const size_t before = ctx ? llm_ctx_tokens(*ctx) : 0;
+    auto t0 = std::chrono::steady_clock::now();
+    auto out = ctx ? model.prefill(text, ctx) : model.prefill(text);
+    const double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    const size_t after = out ? llm_ctx_tokens(*out) : 0;
+    // Tail chunks are shorter than the target and would understate the candidate's speed.
+    if (after > before && (after - before) * 2 >= chunk_tokens) {
+        chunking.tuner->record(chunk_tokens, after - before, sec, read_self_mem_snapshot().rss_bytes);
+    }
+    return out;
+}
+
+const char kSystemPromptPreamble[] =
+    "You are a helpful assistant. Answer using the provided context. "
+    "If the context does not contain the answer, say you do not know. "
+    "Keep responses concise and cite sources by their bracketed ids.";
+
+// Offsets in a templated prompt where a prefix snapshot is worth keeping: after the fixed
+// instructions (shared by every request), after the system message (shared by requests that
+// retrieved the same context) and before the last user turn (shared by follow-ups).
+std::vector<size_t> prompt_cache_cuts(const std::string& prompt) {
+    static const std::string kTurnStart = "<|im_start|>";
+    std::vector<size_t> cuts;
+    size_t pre = prompt.find(kSystemPromptPreamble);
+    if (pre != std::string::npos) cuts.push_back(pre + sizeof(kSystemPromptPreamble) - 1);
+    size_t second_turn = prompt.find(kTurnStart, 1);
+    if (second_turn != std::string::npos) cuts.push_back(second_turn);
+    size_t last_user = prompt.rfind(kTurnStart + "user");
+    if (last_user != std::string::npos && last_user > 0) cuts.push_back(last_user);
+    std::sort(cuts.begin(), cuts.end());
+    cuts.erase(std::unique(cuts.begin(), cuts.end()), cuts.end());
+    cuts.erase(std::remove_if(cuts.begin(), cuts.end(), [&](size_t c) { return c == 0 || c >= prompt.size(); }), cuts.end());
+    return cuts;
+}
+
+// Cuts the prompt at `cuts` and chunks each piece on its own, so the blocks before a cut depend
+// only on the text before it and line up across prompts sharing that text. *cut_blocks receives
+// the number of blocks that end at each cut. Blocks are always `chunking.bytes` long: the token
+// target moves with the estimator's rate and the tuner, and would change the cache keys.
+std::vector<std::string> split_prompt_blocks(const std::string& prompt,
+                                             const std::vector<size_t>& cuts,
+                                             const PrefillChunking& chunking,
+                                             std::vector<size_t>* cut_blocks) {
+    std::vector<std::string> blocks;
+    size_t pos = 0;
+    for (size_t i = 0; i <= cuts.size(); ++i) {
+        size_t end = i < cuts.size() ? cuts[i] : prompt.size();
+        if (end <= pos) continue;
+        const std::string piece = prompt.substr(pos, end - pos);
+        for (auto& c : split_prompt_chunks(piece, chunking.bytes)) blocks.push_back(std::move(c));
+        if (i < cuts.size() && cut_blocks) cut_blocks->push_back(blocks.size());
+        pos = end;
+    }
+    return blocks;
+}
+
+// Prefill through the prefix cache: resumes from the longest cached run of leading blocks and
+// snapshots the context at each cut it passes. The final block is always computed, so the
+// next-token state comes from this request's own prefill. In token mode the blocks up to the next
+// cut are regrouped into prefill calls of about chunk_tokens: short blocks are joined, long ones
+// split.
+std::shared_ptr<ncnn_llm_gpt_ctx> prefill_with_prefix_cache(const ncnn_llm_gpt& model,
+                                                            const std::string& prompt,
+                                                            const PrefillChunking& chunking,
+                                                            const std::string& req_id,
+                                                            LlmPrefixCache& cache,
+                                                            size_t* cached_tokens,
+                                                            const std::atomic<bool>* cancel) {
+    std::vector<size_t> cut_blocks;
+    const size_t chunk_tokens = chunking.chunk_tokens();
+    auto blocks = split_prompt_blocks(prompt, prompt_cache_cuts(prompt), chunking, &cut_blocks);
+    if (blocks.empty()) return nullptr;
+
+    std::shared_ptr<ncnn_llm_gpt_ctx> ctx;
+    size_t restored_tokens = 0;
+    size_t start = cache.lookup(blocks, blocks.size() - 1, &ctx, &restored_tokens);
+    if (cached_tokens) *cached_tokens = restored_tokens;
+    LlmPrefixCacheStats st = cache.stats();
+    log_event("chat.prefix_cache", "id=" + req_id +
+                                   " hit=" + std::string(start > 0 ? "1" : "0") +
+                                   " blocks=" + std::to_string(start) + "/" + std::to_string(blocks.size()) +
+                                   " cached_tokens=" + std::to_string(restored_tokens) +
+                                   " entries=" + std::to_string(st.entries) +
+                                   " bytes=" + std::to_string(st.bytes));
+
+    size_t i = start;
+    while (i < blocks.size()) {
+        size_t stop = blocks.size();
+        for (size_t c : cut_blocks) {
+            if (c > i) {
+                stop = c;
+                break;
+            }
+        }
+        std::string text = blocks[i];
+        size_t next = i + 1;
+        if (chunk_tokens > 0) {
+            while (next < stop && chunking.fits(text + blocks[next], chunk_tokens)) text += blocks[next++];
+        }
+        std::vector<std::string> parts;
+        if (chunk_tokens > 0) {
+            parts = split_prompt_chunks(text, chunking.bytes_for(text, chunk_tokens));
+        } else {
+            parts.push_back(std::move(text));
+        }
+        for (const auto& part : parts) {
+            if (cancel && *cancel) {
+                log_event("chat.prefill.cancelled", "id=" + req_id + " idx=" + std::to_string(i) + " total_chunks=" + std::to_string(blocks.size()));
+                return nullptr;
+            }
+            if (blocks.size() > 1 || parts.size() > 1) {
+                log_event("chat.prefill.chunk", "id=" + req_id +
+                                                " idx=" + std::to_string(i) +
+                                                " blocks=" + std::to_string(next - i) +
+                                                " bytes=" + std::to_string(part.size()) +
+                                                " total_chunks=" + std::to_string(blocks.size()));
+            }
+            ctx = prefill_chunk(model, part, std::move(ctx), chunking, chunk_tokens);
+        }
+        i = next;
+        if (std::find(cut_blocks.begin(), cut_blocks.end(), i) != cut_blocks.end()) cache.insert(blocks, i, ctx);
+    }
+    return ctx;
+}
+
+std::shared_ptr<ncnn_llm_gpt_ctx> prefill_chunked(const ncnn_llm_gpt& model,
+                                                  const std::string& prompt,
+                                                  const PrefillChunking& chunking,
+                                                  const std::string& req_id,
+                                                  LlmPrefixCache* cache = nullptr,
+                                                  size_t* cached_tokens = nullptr,
+                                                  const std::atomic<bool>* cancel = nullptr);
+
+// Prefill for one chat turn. When the prompt extends the text a session's KV cache covers, only
+// the new suffix is prefilled on top of it; otherwise the whole prompt goes through
+// prefill_chunked (and the prefix cache). `cancel` is checked before every chunk; a cancelled
+// prefill returns null.
+std::shared_ptr<ncnn_llm_gpt_ctx> prefill_turn(const ncnn_llm_gpt& model,
+                                               const std::string& prompt,
+                                               const PrefillChunking& chunking,
+                                               const std::string& req_id,
+                                               LlmPrefixCache* cache,
+                                               LlmSession* session,
+                                               size_t* cached_tokens,
+                                               const std::atomic<bool>* cancel = nullptr) {
+    if (session && session->ctx) {
+        if (prompt.size() > session->text.size() && prompt.compare(0, session->text.size(), session->text) == 0) {
+            std::shared_ptr<ncnn_llm_gpt_ctx> ctx = std::move(session->ctx);
+            const std::string suffix = prompt.substr(session->text.size());
+            if (cached_tokens) *cached_tokens = session->tokens;
+            log_event("chat.session", "id=" + req_id +
+                                      " hit=1 cached_tokens=" + std::to_string(session->tokens) +
+                                      " suffix_bytes=" + std::to_string(suffix.size()));
+            const size_t chunk_tokens = chunking.chunk_tokens();
+            for (const auto& chunk : split_prompt_chunks(suffix, chunking.bytes_for(suffix, chunk_tokens))) {
+                if (cancel && *cancel) {
+                    log_event("chat.prefill.cancelled", "id=" + req_id + " session=1");
+                    return nullptr;
+                }
+                ctx = prefill_chunk(model, chunk, std::move(ctx), chunking, chunk_tokens);
+            }
+            return ctx;
+        }
+        // Happens when the template re-renders history differently, e.g. with thinking enabled.
+        log_event("chat.session", "id=" + req_id + " hit=0 reason=prompt_mismatch");
+        session->ctx.reset();
+    }
+    return prefill_chunked(model, prompt, chunking, req_id, cache, cached_tokens, cancel);
+}
+
+// Keeps a finished turn's KV cache for the session's next request. The context must hold exactly
+// the prompt plus the streamed tokens, otherwise it cannot be matched to text and is dropped.
+void remember_session_turn(LlmSessionCache& cache,
+                           const std::string& session_id,
+                           const std::string& req_id,
+                           std::vector<Message> client_messages,
+                           std::vector<Message> prompt_messages,
+                           const std::string& prompt,
+                           const std::string& raw_output,
+                           const std::string& reply,
+                           size_t expected_tokens,
+                           std::shared_ptr<ncnn_llm_gpt_ctx> ctx) {
+    if (!ctx) return;
+    const size_t tokens = llm_ctx_tokens(*ctx);
+    if (tokens != expected_tokens) {
+        log_event("chat.session.skip", "id=" + req_id + " reason=kv_length tokens=" + std::to_string(tokens) +
+                                           " expected=" + std::to_string(expected_tokens));
+        return;
+    }
+    LlmSession s;
+    s.client_messages = std::move(client_messages);
+    s.client_messages.push_back(Message{"assistant", reply});
+    s.prompt_messages = std::move(prompt_messages);
+    s.prompt_messages.push_back(Message{"assistant", reply});
+    s.text = prompt + raw_output;
+    s.tokens = tokens;
+    s.bytes = llm_ctx_kv_bytes(*ctx);
+    s.ctx = std::move(ctx);
+    cache.put(session_id, std::move(s));
+    LlmSessionCacheStats st = cache.stats();
+    log_event("chat.session.store", "id=" + req_id +
+                                    " tokens=" + std::to_string(tokens) +
+                                    " sessions=" + std::to_string(st.sessions) +
+                                    " bytes=" + std::to_string(st.bytes));
+}
+
 std::shared_ptr<ncnn_llm_gpt_ctx> prefill_chunked(const ncnn_llm_gpt& model,
                                                   const std::string& prompt,
-                                                  size_t chunk_bytes,
-                                                  const std::string& req_id) {
-    auto chunks = split_prompt_chunks(prompt, chunk_bytes);
+                                                  const PrefillChunking& chunking,
+                                                  const std::string& req_id,
+                                                  LlmPrefixCache* cache,
+                                                  size_t* cached_tokens,
+                                                  const std::atomic<bool>* cancel) {
+    if (cached_tokens) *cached_tokens = 0;
+    if (cache && cache->enabled()) {
+        return prefill_with_prefix_cache(model, prompt, chunking, req_id, *cache, cached_tokens, cancel);
+    }
+    const size_t chunk_tokens = chunking.chunk_tokens();
+    auto chunks = split_prompt_chunks(prompt, chunking.bytes_for(prompt, chunk_tokens));
     if (chunks.empty()) return nullptr;
-    if (chunks.size() == 1) return model.prefill(prompt);
+    if (chunks.size() == 1) return prefill_chunk(model, prompt, nullptr, chunking, chunk_tokens);
 
     std::shared_ptr<ncnn_llm_gpt_ctx> ctx;
     for (size_t i = 0; i < chunks.size(); ++i) {
+        if (cancel && *cancel) {
+            log_event("chat.prefill.cancelled", "id=" + req_id + " idx=" + std::to_string(i) + " total_chunks=" + std::to_string(chunks.size()));
+            return nullptr;
+        }
         log_event("chat.prefill.chunk", "id=" + req_id +
                                         " idx=" + std::to_string(i) +
                                         " bytes=" + std::to_string(chunks[i].size()) +
                                         " total_chunks=" + std::to_string(chunks.size()));
-        if (ctx) ctx = model.prefill(chunks[i], ctx);
-        else ctx = model.prefill(chunks[i]);
+        ctx = prefill_chunk(model, chunks[i], std::move(ctx), chunking, chunk_tokens);
     }
     return ctx;
 }
@@ -1219,8 +1546,22 @@ std::string summarize_hits(const std::vector<RagSearchHit>& hits, size_t max_ite
     return oss.str();
 }
 
-std::string doc_chunk_url(size_t doc_id, int chunk_index) {
-    return "/rag/doc/" + std::to_string(doc_id) + "#chunk-" + std::to_string(chunk_index);
+bool is_named_collection(const std::string& name) {
+    return !name.empty() && name != RagCollections::kDefaultName;
+}
+
+std::string collection_label(const std::string& name) {
+    return is_named_collection(name) ? name : std::string(RagCollections::kDefaultName);
+}
+
+std::string doc_url(size_t doc_id, const std::string& collection = std::string()) {
+    std::string url = "/rag/doc/" + std::to_string(doc_id);
+    if (is_named_collection(collection)) url += "?collection=" + collection;
+    return url;
+}
+
+std::string doc_chunk_url(size_t doc_id, int chunk_index, const std::string& collection = std::string()) {
+    return doc_url(doc_id, collection) + "#chunk-" + std::to_string(chunk_index);
 }
 
 std::string escape_html(const std::string& s) {
@@ -1254,8 +1595,37 @@ struct AppOptions {
     size_t rag_top_k = 10;
     int rag_neighbor_chunks = 1;
     size_t rag_chunk_max_chars = 1800;
+    size_t rag_context_tokens = 2048; // token budget of the packed RAG context, 0 = unlimited
+    double rag_min_score = 0.0;
+    size_t rag_max_per_doc = 0;
+    int rag_near_dup_bits = 4; // SimHash distance for near-duplicate chunks, 0 = exact only
+    int rag_shards = 1;        // shard files for a newly created DB
+    int rag_max_collections = 8; // named collections kept open at once
     size_t llm_prefill_chunk_bytes = 2048;
+    size_t llm_prefill_chunk_tokens = 0; // overrides the byte size when set
+    bool llm_prefill_auto = false;       // tune the token size by measured prefill speed
+    size_t llm_prefill_mem_limit_mb = 0; // RSS ceiling for the tuned size, 0 = none
+    size_t llm_prefix_cache_mb = 256; // KV snapshots of shared prompt prefixes, 0 = off
+    size_t llm_session_cache_mb = 512; // KV caches kept per chat session_id, 0 = off
+    int llm_session_idle_sec = 600;
+    KvStoreMode kv_store = KvStoreMode::Float32; // storage of cached KV snapshots; live KV stays fp32
+    size_t kv_snapshot_pool_mb = 0; // preallocated arena for KV snapshot capture/restore, 0 = heap
+    int model_replicas = 1;      // local model instances, each with its own scheduler
+    int threads_per_replica = 0; // 0 = ncnn default (one replica) or physical cores / replicas
+    std::string replica_cpus;    // numa | auto | "0-15;16-31", empty = unpinned
+    std::string worker_cpus;     // cpulist for handler/search/ingest threads, empty = CPUs left by replicas
+    int sched_max_active = 8;    // local generations interleaved by the scheduler
+    int sched_slice_tokens = 0; // tokens decoded per turn, 0 = run each generation to completion
+    size_t sse_buffer_tokens = 256; // pending chunks per streaming request, 0 = unbounded
+    SseOverflow sse_overflow = SseOverflow::Coalesce;
+    int sse_flush_ms = 0;          // coalesce streamed tokens over this window, 0 = one event per token
+    size_t sse_flush_bytes = 256;  // flush a window early at this size, 0 = no limit
+    bool warmup = true;
+    size_t warmup_tokens = 256; // synthetic warm-up prompt length, 0 = no model warm-up
+    size_t warmup_replay = 0;   // recent real requests saved and replayed at startup
     bool save_pdf_txt = true;
+    int pdf_workers = 0; // 0 = hardware concurrency
+    int pdf_page_timeout_sec = 10;
     bool auto_download_model = true;
     int model_download_connect_timeout_sec = 15;
     int model_download_stall_timeout_sec = 60;
@@ -1263,6 +1633,13 @@ struct AppOptions {
     bool model_download_use_proxy = false;
     std::string model_download_proxy = "";
     bool malloc_trim = false;
+    int docs_sync_interval_sec = 0; // 0 = sync only at startup
+    bool docs_watch = false;
+    int rag_vacuum_interval_sec = 60; // 0 = no background vacuum
+    bool index_only = false;
+    std::string export_pack;
+    std::string import_pack;
+    bool pack_verify = false; // full payload checksum on open; reads the whole pack
 
     LlmBackend llm_backend = LlmBackend::Local;
     std::string api_base;
@@ -1283,20 +1660,55 @@ void print_usage(const char* argv0) {
               << "  --model-dl-timeout N          Overall timeout per file (0=disable, default: 0)\n"
               << "  --model-dl-proxy HOST:PORT    Use HTTP proxy for downloads (default: none)\n"
               << "  --no-model-dl-proxy           Disable download proxy\n"
-              << "  --docs PATH       Seed docs directory (default: assets/rag)\n"
+              << "  --docs PATH       Docs directory synced into the DB (default: assets/rag)\n"
+              << "  --docs-sync-interval N  Re-sync the docs directory every N seconds (default: 0=startup only)\n"
+              << "  --docs-watch      Re-sync when files in the docs directory change (Linux inotify)\n"
+              << "  --rag-vacuum-interval N  Return freed DB pages to the OS every N seconds (default: 60, 0=off)\n"
+              << "  --index-only      Sync the docs directory into the DB (bulk load) and exit\n"
+              << "  --export-pack PATH  Write the DB as a binary index pack and exit (after --index-only if given)\n"
+              << "  --import-pack PATH  Serve retrieval read-only from an index pack (mmap) instead of --db\n"
+              << "  --pack-verify     Checksum the whole --import-pack payload on open (slow for large packs)\n"
               << "  --web PATH        Web root to serve (default: :embedded:)\n"
               << "  --data PATH       Data directory (default: data)\n"
               << "  --db PATH         SQLite database path (default: data/rag.sqlite)\n"
               << "  --pdf-txt PATH    Exported PDF text directory (default: data/pdf_txt)\n"
+              << "  --pdf-workers N   Parallel pdftotext processes per PDF (default: 0=CPU count)\n"
+              << "  --pdf-page-timeout N  Seconds allowed per PDF page before pdftotext is killed (default: 10)\n"
               << "  --chunk-size N    Chunk size for indexing (default: 600)\n"
               << "  --embed-dim N     Embedding dimension (default: 256)\n"
               << "  --port N          HTTP port (default: 8080)\n"
               << "  --rag-top-k N     Retrieved chunks (default: 10)\n"
               << "  --rag-neighbors N Include neighbor chunks around each hit (default: 1)\n"
               << "  --rag-chunk-max N Max chars per returned chunk after expansion (default: 1800)\n"
+              << "  --rag-context-tokens N  Token budget for retrieved context in the prompt (default: 2048, 0 = unlimited)\n"
+              << "  --rag-min-score F Drop retrieved chunks scoring below F (default: 0 = keep all)\n"
+              << "  --rag-max-per-doc N  Retrieved chunks kept per document (default: 0 = unlimited)\n"
+              << "  --rag-near-dup N  SimHash bits (0-5) for near-duplicate chunk collapsing, 0=exact only (default: 4)\n"
+              << "  --rag-shards N    Create a new DB as N shard files, ingested/searched in parallel (default: 1)\n"
+              << "  --rag-max-collections N  Named collections kept open; idle ones beyond this are closed (default: 8)\n"
               << "  --prefill-chunk-bytes N Chunk prompt for prefill to reduce memory (default: 2048)\n"
+              << "  --prefill-chunk-tokens N|auto  Chunk prefill by estimated tokens; auto tunes it per model (default: off)\n"
+              << "  --prefill-mem-limit-mb N  Peak RSS allowed while auto-tuning the prefill chunk (default: 0 = none)\n"
+              << "  --prefix-cache-mb N  Memory for reusable KV snapshots of shared prompt prefixes, 0=off (default: 256)\n"
+              << "  --session-cache-mb N Memory for per-session KV caches of multi-turn chats, 0=off (default: 512)\n"
+              << "  --session-idle N  Seconds before an idle session's KV cache is dropped (default: 600)\n"
+              << "  --kv-store MODE     Storage of cached KV snapshots (prefix/session cache): fp32|fp16|int8 (default: fp32)\n"
+              << "  --kv-snapshot-pool-mb N Block pool for KV snapshot capture/restore only, not live KV (default: 0 = heap)\n"
+              << "  --model-replicas N  Local model instances serving requests in parallel (default: 1)\n"
+              << "  --threads-per-replica N  Inference threads per replica (default: physical cores / replicas)\n"
+              << "  --replica-cpus S    Pin replicas: numa | auto | cpulists like 0-15;16-31 (default: unpinned)\n"
+              << "  --worker-cpus LIST  CPUs for HTTP, search and ingest threads (default: those left by replicas)\n"
+              << "  --sched-max-active N  Generations interleaved per replica; more wait in queue (default: 8)\n"
+              << "  --sched-slice-tokens N  Time-slice decoding every N tokens; not batching (default: 0 = no slicing)\n"
+              << "  --sse-buffer N      Chunks buffered per streaming client before overflow (default: 256, 0 = unbounded)\n"
+              << "  --sse-overflow P    On overflow: coalesce|disconnect (default: coalesce)\n"
+              << "  --sse-flush-ms N    Send streamed tokens in one event per N ms window (default: 0 = per token)\n"
+              << "  --sse-flush-bytes N Flush a window early at N bytes of text (default: 256, 0 = no limit)\n"
               << "  --no-model-download Disable automatic model download\n"
               << "  --no-rag          Disable retrieval\n"
+              << "  --no-warmup       Skip the startup warm-up pass\n"
+              << "  --warmup-tokens N Synthetic warm-up prompt length in tokens, 0 = skip model warm-up (default: 256)\n"
+              << "  --warmup-replay N Save the last N chat requests and replay them at the next start (default: 0)\n"
               << "  --no-pdf-txt      Disable exporting extracted PDF text\n"
               << "  --vulkan          Enable Vulkan compute\n"
               << "  --malloc-trim     Call malloc_trim(0) after each request (glibc)\n"
@@ -1351,6 +1763,20 @@ AppOptions parse_options(int argc, char** argv) {
             opt.model_download_use_proxy = false;
         } else if (arg == "--docs" && i + 1 < argc) {
             opt.docs_path = argv[++i];
+        } else if (arg == "--docs-sync-interval" && i + 1 < argc) {
+            if (auto v = parse_int(argv[++i])) opt.docs_sync_interval_sec = std::max(0, *v);
+        } else if (arg == "--docs-watch") {
+            opt.docs_watch = true;
+        } else if (arg == "--rag-vacuum-interval" && i + 1 < argc) {
+            if (auto v = parse_int(argv[++i])) opt.rag_vacuum_interval_sec = std::max(0, *v);
+        } else if (arg == "--index-only") {
+            opt.index_only = true;
+        } else if (arg == "--export-pack" && i + 1 < argc) {
+            opt.export_pack = argv[++i];
+        } else if (arg == "--import-pack" && i + 1 < argc) {
+            opt.import_pack = argv[++i];
+        } else if (arg == "--pack-verify") {
+            opt.pack_verify = true;
         } else if (arg == "--web" && i + 1 < argc) {
             opt.web_root = argv[++i];
         } else if (arg == "--data" && i + 1 < argc) {
@@ -1359,6 +1785,10 @@ AppOptions parse_options(int argc, char** argv) {
             opt.db_path = argv[++i];
         } else if (arg == "--pdf-txt" && i + 1 < argc) {
             opt.pdf_txt_dir = argv[++i];
+        } else if (arg == "--pdf-workers" && i + 1 < argc) {
+            if (auto v = parse_int(argv[++i])) opt.pdf_workers = std::max(0, *v);
+        } else if (arg == "--pdf-page-timeout" && i + 1 < argc) {
+            if (auto v = parse_int(argv[++i])) opt.pdf_page_timeout_sec = std::max(1, *v);
         } else if (arg == "--chunk-size" && i + 1 < argc) {
             if (auto v = parse_int(argv[++i])) opt.chunk_size = static_cast<size_t>(*v);
         } else if (arg == "--embed-dim" && i + 1 < argc) {
@@ -1371,14 +1801,74 @@ AppOptions parse_options(int argc, char** argv) {
             if (auto v = parse_int(argv[++i])) opt.rag_neighbor_chunks = *v;
         } else if (arg == "--rag-chunk-max" && i + 1 < argc) {
             if (auto v = parse_int(argv[++i])) opt.rag_chunk_max_chars = static_cast<size_t>(*v);
+        } else if (arg == "--rag-context-tokens" && i + 1 < argc) {
+            if (auto v = parse_int(argv[++i])) opt.rag_context_tokens = static_cast<size_t>(std::max(0, *v));
+        } else if (arg == "--rag-min-score" && i + 1 < argc) {
+            if (auto v = parse_double(argv[++i])) opt.rag_min_score = *v;
+        } else if (arg == "--rag-max-per-doc" && i + 1 < argc) {
+            if (auto v = parse_int(argv[++i])) opt.rag_max_per_doc = static_cast<size_t>(std::max(0, *v));
+        } else if (arg == "--rag-shards" && i + 1 < argc) {
+            if (auto v = parse_int(argv[++i])) opt.rag_shards = std::max(1, std::min(*v, 256));
+        } else if (arg == "--rag-max-collections" && i + 1 < argc) {
+            if (auto v = parse_int(argv[++i])) opt.rag_max_collections = std::max(1, *v);
+        } else if (arg == "--rag-near-dup" && i + 1 < argc) {
+            if (auto v = parse_int(argv[++i])) opt.rag_near_dup_bits = std::max(0, std::min(*v, 5));
+        } else if (arg == "--session-cache-mb" && i + 1 < argc) {
+            if (auto v = parse_int(argv[++i])) opt.llm_session_cache_mb = static_cast<size_t>(std::max(0, *v));
+        } else if (arg == "--session-idle" && i + 1 < argc) {
+            if (auto v = parse_int(argv[++i])) opt.llm_session_idle_sec = std::max(0, *v);
+        } else if (arg == "--kv-store" && i + 1 < argc) {
+            parse_kv_store_mode(argv[++i], &opt.kv_store);
+        } else if (arg == "--kv-snapshot-pool-mb" && i + 1 < argc) {
+            if (auto v = parse_int(argv[++i])) opt.kv_snapshot_pool_mb = static_cast<size_t>(std::max(0, *v));
+        } else if (arg == "--model-replicas" && i + 1 < argc) {
+            if (auto v = parse_int(argv[++i])) opt.model_replicas = std::clamp(*v, 1, 64);
+        } else if (arg == "--threads-per-replica" && i + 1 < argc) {
+            if (auto v = parse_int(argv[++i])) opt.threads_per_replica = std::max(0, *v);
+        } else if (arg == "--replica-cpus" && i + 1 < argc) {
+            opt.replica_cpus = argv[++i];
+        } else if (arg == "--worker-cpus" && i + 1 < argc) {
+            opt.worker_cpus = argv[++i];
+        } else if (arg == "--sched-max-active" && i + 1 < argc) {
+            if (auto v = parse_int(argv[++i])) opt.sched_max_active = std::max(1, *v);
+        } else if (arg == "--sched-slice-tokens" && i + 1 < argc) {
+            if (auto v = parse_int(argv[++i])) opt.sched_slice_tokens = std::max(0, *v);
+        } else if (arg == "--sse-buffer" && i + 1 < argc) {
+            if (auto v = parse_int(argv[++i])) opt.sse_buffer_tokens = static_cast<size_t>(std::max(0, *v));
+        } else if (arg == "--sse-overflow" && i + 1 < argc) {
+            std::string v = argv[++i];
+            if (v == "coalesce") opt.sse_overflow = SseOverflow::Coalesce;
+            else if (v == "disconnect") opt.sse_overflow = SseOverflow::Disconnect;
+        } else if (arg == "--sse-flush-ms" && i + 1 < argc) {
+            if (auto v = parse_int(argv[++i])) opt.sse_flush_ms = std::clamp(*v, 0, 1000);
+        } else if (arg == "--sse-flush-bytes" && i + 1 < argc) {
+            if (auto v = parse_int(argv[++i])) opt.sse_flush_bytes = static_cast<size_t>(std::max(0, *v));
+        } else if (arg == "--prefix-cache-mb" && i + 1 < argc) {
+            if (auto v = parse_int(argv[++i])) opt.llm_prefix_cache_mb = static_cast<size_t>(std::max(0, *v));
         } else if (arg == "--prefill-chunk-bytes" && i + 1 < argc) {
             if (auto v = parse_int(argv[++i])) {
                 if (*v > 0) opt.llm_prefill_chunk_bytes = static_cast<size_t>(*v);
             }
+        } else if (arg == "--prefill-chunk-tokens" && i + 1 < argc) {
+            std::string v = argv[++i];
+            if (v == "auto") {
+                opt.llm_prefill_auto = true;
+            } else if (auto n = parse_int(v)) {
+                opt.llm_prefill_auto = false;
+                opt.llm_prefill_chunk_tokens = static_cast<size_t>(std::max(0, *n));
+            }
+        } else if (arg == "--prefill-mem-limit-mb" && i + 1 < argc) {
+            if (auto v = parse_int(argv[++i])) opt.llm_prefill_mem_limit_mb = static_cast<size_t>(std::max(0, *v));
         } else if (arg == "--no-model-download") {
             opt.auto_download_model = false;
         } else if (arg == "--no-rag") {
             opt.rag_enabled = false;
+        } else if (arg == "--no-warmup") {
+            opt.warmup = false;
+        } else if (arg == "--warmup-tokens" && i + 1 < argc) {
+            if (auto v = parse_int(argv[++i])) opt.warmup_tokens = static_cast<size_t>(std::max(0, *v));
+        } else if (arg == "--warmup-replay" && i + 1 < argc) {
+            if (auto v = parse_int(argv[++i])) opt.warmup_replay = static_cast<size_t>(std::clamp(*v, 0, 256));
         } else if (arg == "--no-pdf-txt") {
             opt.save_pdf_txt = false;
         } else if (arg == "--vulkan") {
@@ -1403,7 +1893,7 @@ std::string build_rag_context(const std::vector<RagSearchHit>& hits) {
     if (hits.empty()) return {};
     std::string ctx;
     for (size_t i = 0; i < hits.size(); ++i) {
-        ctx += "[" + std::to_string(i + 1) + "] Source: " + sanitize_utf8_strict(hits[i].source) + "\n";
+        ctx += rag_context_header(i + 1, sanitize_utf8_strict(hits[i].source));
         ctx += sanitize_utf8_strict(hits[i].text) + "\n\n";
     }
     return ctx;
@@ -1478,11 +1968,19 @@ void expand_hits_with_neighbors(const RagVectorDb& rag,
     }
 }
 
+// Session turns carry their retrieved context in the last user message instead of the system
+// message, so the rest of the conversation renders the same on every turn.
+void attach_rag_context(std::vector<Message>* messages, const std::string& rag_context) {
+    for (auto it = messages->rbegin(); it != messages->rend(); ++it) {
+        if (it->role != "user") continue;
+        it->content = "Context:\n" + (rag_context.empty() ? std::string("(No relevant sources found.)") : rag_context) +
+                      "\n\nQuestion:\n" + it->content;
+        return;
+    }
+}
+
 std::string build_system_prompt(const std::string& rag_context, bool rag_enabled) {
-    std::string prompt =
-        "You are a helpful assistant. Answer using the provided context. "
-        "If the context does not contain the answer, say you do not know. "
-        "Keep responses concise and cite sources by their bracketed ids.";
+    std::string prompt = kSystemPromptPreamble;
     if (rag_enabled && !rag_context.empty()) {
         prompt += "\n\nContext:\n" + rag_context;
     } else if (rag_enabled) {
@@ -1496,6 +1994,7 @@ json build_rag_payload(const std::vector<RagSearchHit>& hits,
                        size_t top_k,
                        size_t doc_count,
                        size_t chunk_count,
+                       const std::string& collection,
                        const std::vector<std::string>* trace = nullptr,
                        const std::string* error = nullptr) {
     json rag = {
@@ -1505,6 +2004,7 @@ json build_rag_payload(const std::vector<RagSearchHit>& hits,
         {"chunk_count", chunk_count},
         {"chunks", json::array()}
     };
+    if (!collection.empty()) rag["collection"] = collection;
     if (trace) rag["trace"] = *trace;
     if (error && !error->empty()) rag["error"] = *error;
     for (const auto& hit : hits) {
@@ -1514,7 +2014,7 @@ json build_rag_payload(const std::vector<RagSearchHit>& hits,
             {"text", sanitize_utf8_strict(hit.text)},
             {"doc_id", hit.doc_id},
             {"chunk_index", hit.chunk_index},
-            {"url", doc_chunk_url(hit.doc_id, hit.chunk_index)}
+            {"url", doc_chunk_url(hit.doc_id, hit.chunk_index, collection)}
         });
     }
     return rag;
@@ -1528,7 +2028,8 @@ json rag_tool_schema() {
             {"type", "object"},
             {"properties", {
                 {"query", {{"type", "string"}, {"description", "User query"}}},
-                {"top_k", {{"type", "integer"}, {"minimum", 1}, {"maximum", 10}}}
+                {"top_k", {{"type", "integer"}, {"minimum", 1}, {"maximum", 10}}},
+                {"collection", {{"type", "string"}, {"description", "Named collection to search (default: main store)"}}}
             }},
             {"required", json::array({"query"})}
         }}
@@ -1542,6 +2043,7 @@ json rag_tool_call(const json& args,
                    int neighbor_chunks,
                    size_t max_chunk_chars) {
     const std::string query = args.value("query", std::string());
+    const std::string collection = args.value("collection", std::string());
     size_t top_k = default_top_k;
     if (args.contains("top_k") && args["top_k"].is_number_integer()) {
         int v = args["top_k"].get<int>();
@@ -1581,7 +2083,7 @@ json rag_tool_call(const json& args,
             {"text", sanitize_utf8_strict(hit.text)},
             {"doc_id", hit.doc_id},
             {"chunk_index", hit.chunk_index},
-            {"url", doc_chunk_url(hit.doc_id, hit.chunk_index)}
+            {"url", doc_chunk_url(hit.doc_id, hit.chunk_index, collection)}
         });
     }
     return result;
@@ -1647,15 +2149,47 @@ bool write_text_file_utf8(const std::filesystem::path& path, const std::string&
     return true;
 }
 
-bool write_file(const std::filesystem::path& path, const std::string& data, std::string* err) {
-    std::ofstream ofs(path, std::ios::binary);
-    if (!ofs) {
-        if (err) *err = "failed to write file";
-        return false;
-    }
-    ofs.write(data.data(), static_cast<std::streamsize>(data.size()));
-    if (!ofs) {
-        if (err) *err = "failed to write file";
+// Decodes a text file in bounded blocks and feeds it through the incremental chunker straight into
+// the DB, so peak memory is a read block plus a few chunks regardless of the file size.
+bool add_text_file_streaming(const std::filesystem::path& path,
+                             const std::string& filename,
+                             const std::string& mime,
+                             RagVectorDb& rag,
+                             size_t chunk_size,
+                             size_t* out_doc_id,
+                             size_t* out_chunks,
+                             std::string* err) {
+    Utf8TextReader reader;
+    if (!reader.open(path, err)) return false;
+
+    TextChunker chunker(chunk_size);
+    std::vector<std::string> pending;
+    size_t next = 0;
+    bool input_done = false;
+    auto next_chunk = [&](std::string* chunk, std::string* src_err) {
+        while (next >= pending.size()) {
+            if (input_done) return false;
+            pending.clear();
+            next = 0;
+            std::string piece;
+            std::string read_err;
+            if (reader.read(&piece, &read_err)) {
+                chunker.feed(piece.data(), piece.size(), &pending);
+            } else if (!read_err.empty()) {
+                *src_err = read_err;
+                return false;
+            } else {
+                chunker.finish(&pending);
+                input_done = true;
+            }
+        }
+        *chunk = std::move(pending[next++]);
+        return true;
+    };
+
+    std::string local_err;
+    if (!rag.add_document_stream(filename, mime, next_chunk, &local_err, out_doc_id, out_chunks)) {
+        if (err) *err = (local_err == "no text chunks generated") ? "empty text file" : local_err;
         return false;
     }
     return true;
@@ -1675,14 +2209,32 @@ bool ingest_document(const std::string& filename,
     std::string normalized_filename = filename;
     std::string ext = file_ext_lower(filename);
 
+    // Ensure source/metadata is valid UTF-8 for web/UI output.
+    {
+        std::string name_err;
+        if (!normalize_utf8(&normalized_filename, &name_err)) {
+            if (trace) trace->push_back("warn: filename not utf8 (" + name_err + ")");
+            normalized_filename = filename;
+        }
+    }
+
     if (trace) trace->push_back("read content");
     if (ext == ".txt") {
-        if (!read_text_file(path, &text, &local_err)) {
+        if (trace) trace->push_back("stream chunk+embed+store");
+        size_t doc_id = 0;
+        size_t chunk_count = 0;
+        if (!add_text_file_streaming(path, normalized_filename, mime, rag, opt.chunk_size, &doc_id, &chunk_count, &local_err)) {
             if (err) *err = local_err;
             return false;
         }
+        if (out_doc_id) *out_doc_id = doc_id;
+        if (out_chunks) *out_chunks = chunk_count;
+        return true;
     } else if (ext == ".pdf") {
-        if (!extract_pdf_text(path, &text, &local_err)) {
+        PdfExtractOptions pdf_opt;
+        pdf_opt.workers = opt.pdf_workers;
+        pdf_opt.page_timeout_sec = opt.pdf_page_timeout_sec;
+        if (!extract_pdf_text(path, pdf_opt, &text, &local_err)) {
             if (err) *err = local_err;
             return false;
         }
@@ -1713,15 +2265,6 @@ bool ingest_document(const std::string& filename,
         return false;
     }
 
-    // Ensure source/metadata is valid UTF-8 for web/UI output.
-    {
-        std::string name_err;
-        if (!normalize_utf8(&normalized_filename, &name_err)) {
-            if (trace) trace->push_back("warn: filename not utf8 (" + name_err + ")");
-            normalized_filename = filename;
-        }
-    }
-
     if (trace) trace->push_back("chunk+embed+store");
     size_t doc_id = 0;
     size_t chunk_count = 0;
@@ -1734,85 +2277,1294 @@ bool ingest_document(const std::string& filename,
     return true;
 }
 
-size_t ingest_directory(const std::string& dir,
-                        RagVectorDb& rag,
-                        const AppOptions& opt,
-                        std::vector<std::string>* trace) {
+struct DocsSyncStats {
+    size_t added = 0;
+    size_t updated = 0;
+    size_t removed = 0;
+    size_t unchanged = 0;
+    size_t failed = 0;
+};
+
+int64_t file_mtime_stamp(const std::filesystem::path& path, std::error_code& ec) {
+    auto t = std::filesystem::last_write_time(path, ec);
+    if (ec) return 0;
+    return static_cast<int64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(t.time_since_epoch()).count());
+}
+
+// Brings the DB in line with the docs directory using the per-document source manifest:
+// unchanged files cost a stat, touched-but-identical files a hash, and only new or modified
+// files are (re-)ingested. Files that disappeared from the directory are deleted from the DB.
+// With `bulk`, ingestion runs in RagVectorDb bulk mode (entered only once there is something to
+// ingest) and replaced/removed documents are deleted after the indexes have been rebuilt; only
+// for callers that have the DB to themselves (--index-only), never while serving requests.
+DocsSyncStats sync_docs_directory(const std::string& dir,
+                                  RagVectorDb& rag,
+                                  std::mutex& rag_mutex,
+                                  const AppOptions& opt,
+                                  bool bulk,
+                                  std::vector<std::string>* trace) {
+    DocsSyncStats stats;
     std::error_code ec;
     std::filesystem::path root(dir);
-    if (!std::filesystem::exists(root, ec)) return 0;
+    // A missing (or empty, see below) directory is not "everything was deleted": leave the DB alone.
+    if (!std::filesystem::is_directory(root, ec)) return stats;
+
+    std::unordered_map<std::string, RagDocSource> known;
+    std::unordered_map<std::string, std::vector<size_t>> legacy_by_name;
+    size_t legacy_max_id = 0;
+    {
+        std::lock_guard<std::mutex> lock(rag_mutex);
+        for (auto& src : rag.list_doc_sources()) {
+            std::string key = src.path;
+            known.emplace(std::move(key), std::move(src));
+        }
+        // DBs seeded before the manifest existed: adopt their unsourced rows by filename once,
+        // instead of ingesting every file a second time. Only rows older than the manifest
+        // qualify; anything uploaded since must never be taken over by a docs file.
+        legacy_max_id = rag.legacy_doc_max_id();
+        if (legacy_max_id > 0) {
+            for (const auto& d : rag.list_docs(rag.doc_count(), 0)) {
+                if (d.source_path.empty() && d.id <= legacy_max_id) legacy_by_name[d.filename].push_back(d.id);
+            }
+        }
+    }
 
-    size_t count = 0;
+    struct IngestJob {
+        std::filesystem::path path;
+        std::string filename;
+        std::string mime;
+        RagDocSource src;
+        bool replaces = false;
+        size_t old_doc_id = 0;
+    };
+    std::unordered_set<std::string> seen;
+    std::vector<IngestJob> jobs;
+    std::vector<size_t> replaced;
+    bool bulk_started = false;
+    bool walk_ok = true;
     for (auto it = std::filesystem::recursive_directory_iterator(root, ec);
          it != std::filesystem::recursive_directory_iterator();
          it.increment(ec)) {
-        if (ec) break;
+        if (ec) {
+            walk_ok = false;
+            break;
+        }
         if (!it->is_regular_file()) continue;
         const auto path = it->path();
         std::string ext = file_ext_lower(path.string());
         if (ext != ".txt" && ext != ".pdf") continue;
 
+        RagDocSource src;
+        src.path = path.lexically_normal().string();
+        seen.insert(src.path);
+
+        std::error_code stat_ec;
+        src.size = static_cast<int64_t>(std::filesystem::file_size(path, stat_ec));
+        if (!stat_ec) src.mtime = file_mtime_stamp(path, stat_ec);
+        if (stat_ec) {
+            ++stats.failed;
+            if (trace) trace->push_back("skip " + src.path + ": " + stat_ec.message());
+            continue;
+        }
+
+        auto found = known.find(src.path);
+        if (found != known.end() && found->second.size == src.size && found->second.mtime == src.mtime) {
+            ++stats.unchanged;
+            continue;
+        }
+
+        std::string err;
+        if (!hash_file_contents(path, &src.content_hash, &err)) {
+            ++stats.failed;
+            if (trace) trace->push_back("skip " + src.path + ": " + err);
+            continue;
+        }
+
         std::string filename = path.filename().string();
+        {
+            std::lock_guard<std::mutex> lock(rag_mutex);
+            if (found != known.end() && found->second.content_hash == src.content_hash) {
+                // Touched but identical: refresh the stat so the next sync skips it cheaply.
+                src.doc_id = found->second.doc_id;
+                rag.set_doc_source(src, &err);
+                ++stats.unchanged;
+                continue;
+            }
+            if (found == known.end()) {
+                auto legacy = legacy_by_name.find(filename);
+                if (legacy != legacy_by_name.end() && !legacy->second.empty()) {
+                    src.doc_id = legacy->second.back();
+                    legacy->second.pop_back();
+                    if (rag.set_doc_source(src, &err)) {
+                        ++stats.unchanged;
+                        continue;
+                    }
+                }
+            }
+        }
+
+        IngestJob job;
+        job.path = path;
+        job.filename = std::move(filename);
+        job.mime = ext == ".pdf" ? "application/pdf" : "text/plain";
+        job.src = std::move(src);
+        if (found != known.end()) {
+            job.replaces = true;
+            job.old_doc_id = found->second.doc_id;
+        }
+        jobs.push_back(std::move(job));
+    }
+
+    if (bulk && !jobs.empty()) {
+        std::lock_guard<std::mutex> lock(rag_mutex);
+        std::string err;
+        if (rag.begin_bulk(&err)) {
+            bulk_started = true;
+        } else if (trace) {
+            trace->push_back("warn: bulk mode unavailable: " + err);
+        }
+    }
+
+    // Ingest the new version before dropping the old one so a failed re-ingest keeps the
+    // previous content searchable. A sharded store is safe to call concurrently, so files are
+    // ingested in parallel (one worker per shard) without holding rag_mutex; otherwise one at a
+    // time under it.
+    std::mutex stats_mutex;
+    auto ingest_job = [&](const IngestJob& job) {
+        std::vector<std::string> job_trace;
         std::string err;
         size_t doc_id = 0;
         size_t chunks = 0;
-        if (ingest_document(filename, ext == ".pdf" ? "application/pdf" : "text/plain", path, rag, opt, trace, &doc_id, &chunks, &err)) {
-            ++count;
-        } else if (trace) {
-            trace->push_back("skip " + filename + ": " + err);
+        bool ok = ingest_document(job.filename, job.mime, job.path, rag, opt, trace ? &job_trace : nullptr, &doc_id, &chunks, &err);
+        bool replaced_now = false;
+        if (ok) {
+            RagDocSource src = job.src;
+            src.doc_id = doc_id;
+            if (!rag.set_doc_source(src, &err)) {
+                job_trace.push_back("warn: manifest update failed for " + job.filename + ": " + err);
+            }
+            if (job.replaces && !bulk_started) {
+                rag.delete_doc(job.old_doc_id, &err);
+                replaced_now = true;
+            }
+        }
+        std::lock_guard<std::mutex> lock(stats_mutex);
+        if (trace) trace->insert(trace->end(), job_trace.begin(), job_trace.end());
+        if (!ok) {
+            ++stats.failed;
+            if (trace) trace->push_back("skip " + job.filename + ": " + err);
+            return;
+        }
+        if (job.replaces) {
+            if (!replaced_now) replaced.push_back(job.old_doc_id);
+            ++stats.updated;
+        } else {
+            ++stats.added;
+        }
+    };
+    size_t workers = rag.shard_count() > 1
+                         ? std::min<size_t>({rag.shard_count(), std::max(1u, std::thread::hardware_concurrency()), jobs.size()})
+                         : 1;
+    if (workers > 1) {
+        std::atomic<size_t> next_job{0};
+        std::vector<std::thread> pool;
+        for (size_t w = 0; w < workers; ++w) {
+            pool.emplace_back([&]() {
+                for (size_t i = next_job++; i < jobs.size(); i = next_job++) ingest_job(jobs[i]);
+            });
+        }
+        for (auto& t : pool) t.join();
+    } else {
+        for (const auto& job : jobs) {
+            std::lock_guard<std::mutex> lock(rag_mutex);
+            ingest_job(job);
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(rag_mutex);
+    if (bulk_started) {
+        std::string err;
+        if (!rag.end_bulk(&err) && trace) trace->push_back("warn: bulk load finish failed: " + err);
+    }
+    for (size_t doc_id : replaced) {
+        std::string err;
+        if (!rag.delete_doc(doc_id, &err) && trace) {
+            trace->push_back("warn: removing replaced doc " + std::to_string(doc_id) + " failed: " + err);
+        }
+    }
+    // An empty directory next to a non-empty manifest is far more likely an unmounted or
+    // half-restored volume than every document having been deleted; keep them.
+    if (walk_ok && seen.empty() && !known.empty()) {
+        walk_ok = false;
+        if (trace) {
+            trace->push_back("warn: " + dir + " has no documents; keeping the " + std::to_string(known.size()) +
+                             " synced ones");
         }
     }
-    return count;
+    if (walk_ok) {
+        for (const auto& kv : known) {
+            if (seen.count(kv.first)) continue;
+            std::string err;
+            if (rag.delete_doc(kv.second.doc_id, &err)) {
+                ++stats.removed;
+            } else if (trace) {
+                trace->push_back("remove " + kv.first + " failed: " + err);
+            }
+        }
+        // Every file has been matched once; legacy rows left unadopted stay plain documents.
+        std::string err;
+        if (legacy_max_id > 0 && !rag.clear_legacy_docs(&err) && trace) {
+            trace->push_back("warn: clearing legacy adoption failed: " + err);
+        }
+    }
+    return stats;
 }
 
-} // namespace
+std::string summarize_sync(const DocsSyncStats& s) {
+    return "added=" + std::to_string(s.added) +
+           " updated=" + std::to_string(s.updated) +
+           " removed=" + std::to_string(s.removed) +
+           " unchanged=" + std::to_string(s.unchanged) +
+           " failed=" + std::to_string(s.failed);
+}
 
-int main(int argc, char** argv) {
-    AppOptions opt = parse_options(argc, argv);
-    configure_glibc_malloc_from_env();
+// Upgrades the DB schema in small batches with the RAG lock released in between, so requests are
+// served from the old tables meanwhile. Once `running` (if given) goes false, it returns between
+// batches.
+bool migrate_rag_schema(RagVectorDb& rag, std::mutex& rag_mutex, const std::atomic<bool>* running, std::string* err) {
+    if (!rag.migration_pending()) return true;
+    auto t0 = std::chrono::steady_clock::now();
+    int from = rag.schema_version();
+    log_event("rag.migrate.start", "from=" + std::to_string(from) + " to=" + std::to_string(RagVectorDb::kSchemaVersion) +
+                                       " doc_count=" + std::to_string(rag.doc_count()));
+    bool done = false;
+    size_t steps = 0;
+    while (!done) {
+        if (running && !*running) return true;
+        std::lock_guard<std::mutex> lock(rag_mutex);
+        if (!rag.migrate_step(64, &done, err)) return false;
+        ++steps;
+    }
+    int64_t elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - t0).count();
+    size_t dropped_chunks = 0;
+    size_t dropped_vectors = 0;
     {
-        int trim_enabled = 0;
-        if (getenv_int("NCNN_RAG_MALLOC_TRIM", &trim_enabled)) {
-            opt.malloc_trim = (trim_enabled != 0);
+        std::lock_guard<std::mutex> lock(rag_mutex);
+        dropped_chunks = rag.migrate_dropped_chunks();
+        dropped_vectors = rag.migrate_dropped_vectors();
+    }
+    log_event("rag.migrate", "from=" + std::to_string(from) + " to=" + std::to_string(rag.schema_version()) +
+                                 " steps=" + std::to_string(steps) + " elapsed_ms=" + std::to_string(elapsed_ms) +
+                                 " dropped_chunks=" + std::to_string(dropped_chunks) +
+                                 " dropped_vectors=" + std::to_string(dropped_vectors));
+    if (dropped_chunks || dropped_vectors) {
+        std::cerr << "RAG migration skipped " << dropped_chunks << " chunk row(s) and " << dropped_vectors
+                  << " vector row(s) without a unique (doc_id, chunk_index)\n";
+    }
+    return true;
+}
+
+// --index-only: sync the docs directory into the DB in bulk mode and exit, without loading a
+// model or starting the server. Meant for building/refreshing large DBs offline.
+int run_offline_index(const AppOptions& opt) {
+    RagVectorDb rag;
+    std::mutex rag_mutex;
+    std::string err;
+    rag.set_near_dup_distance(opt.rag_near_dup_bits);
+    rag.set_shard_count(opt.rag_shards);
+    if (!rag.open(opt.db_path, opt.embed_dim, &err)) {
+        std::cerr << "Failed to open RAG db " << opt.db_path << ": " << err << "\n";
+        return 1;
+    }
+    std::error_code ec;
+    if (!std::filesystem::is_directory(opt.docs_path, ec)) {
+        std::cerr << "Docs directory not found: " << opt.docs_path << "\n";
+        return 1;
+    }
+
+    if (rag.migration_pending()) {
+        std::cerr << "Upgrading " << opt.db_path << " to schema v" << RagVectorDb::kSchemaVersion << "...\n";
+        if (!migrate_rag_schema(rag, rag_mutex, nullptr, &err)) {
+            std::cerr << "Schema migration failed: " << err << "\n";
+            return 1;
         }
     }
-    opt.model_path = normalize_path(opt.model_path, "./assets");
-    opt.docs_path = normalize_path(opt.docs_path, ".");
-    opt.data_dir = normalize_path(opt.data_dir, ".");
-    opt.db_path = normalize_path(opt.db_path, opt.data_dir);
-    opt.pdf_txt_dir = normalize_path(opt.pdf_txt_dir, opt.data_dir);
 
-    OpenAICompatOptions openai;
-    if (opt.llm_backend == LlmBackend::OpenAICompat) {
-        std::string api_err;
-        if (!init_openai_compat(opt.api_base,
-                               opt.api_key,
-                               opt.api_model,
-                               opt.api_verify_tls,
-                               opt.api_timeout_sec,
-                               opt.api_proxy,
-                               opt.api_use_proxy,
-                               &openai,
-                               &api_err)) {
-            std::cerr << "API backend init failed: " << api_err << "\n";
-            return 2;
+    std::vector<std::string> trace;
+    auto t0 = std::chrono::steady_clock::now();
+    DocsSyncStats stats = sync_docs_directory(opt.docs_path, rag, rag_mutex, opt, true, &trace);
+    int64_t elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - t0).count();
+    for (const auto& line : trace) {
+        if (line.rfind("skip ", 0) == 0 || line.rfind("warn", 0) == 0) std::cerr << line << "\n";
+    }
+    std::cerr << "Indexed " << opt.docs_path << " into " << opt.db_path << ": " << summarize_sync(stats)
+              << " docs=" << rag.doc_count() << " chunks=" << rag.chunk_count()
+              << " elapsed_ms=" << elapsed_ms << "\n";
+    log_event("rag.index", summarize_sync(stats) + " doc_count=" + std::to_string(rag.doc_count()) +
+                               " chunk_count=" + std::to_string(rag.chunk_count()) +
+                               " elapsed_ms=" + std::to_string(elapsed_ms));
+    return stats.failed ? 1 : 0;
+}
+
+// --export-pack: snapshot --db into a binary index pack for provisioning read-only nodes.
+int run_export_pack(const AppOptions& opt) {
+    RagVectorDb rag;
+    std::string err;
+    if (!rag.open(opt.db_path, opt.embed_dim, &err)) {
+        std::cerr << "Failed to open RAG db " << opt.db_path << ": " << err << "\n";
+        return 1;
+    }
+    auto t0 = std::chrono::steady_clock::now();
+    if (!rag.export_pack(opt.export_pack, &err)) {
+        std::cerr << "Pack export failed: " << err << "\n";
+        return 1;
+    }
+    int64_t elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - t0).count();
+    std::error_code ec;
+    auto bytes = std::filesystem::file_size(opt.export_pack, ec);
+    std::cerr << "Exported " << opt.db_path << " to " << opt.export_pack << ": docs=" << rag.doc_count()
+              << " chunks=" << rag.chunk_count() << " bytes=" << (ec ? 0 : bytes) << " elapsed_ms=" << elapsed_ms << "\n";
+    log_event("rag.pack.export", "path=" + opt.export_pack + " doc_count=" + std::to_string(rag.doc_count()) +
+                                     " chunk_count=" + std::to_string(rag.chunk_count()) +
+                                     " elapsed_ms=" + std::to_string(elapsed_ms));
+    return 0;
+}
+
+// Re-runs the docs sync periodically and/or when the directory changes (inotify on Linux).
+// Each pass is a stat walk, so the watcher only needs to say "something changed".
+class DocsSyncWorker {
+public:
+    DocsSyncWorker(RagVectorDb& rag, std::mutex& rag_mutex, const AppOptions& opt)
+        : rag_(rag), rag_mutex_(rag_mutex), opt_(opt) {}
+    ~DocsSyncWorker() { stop(); }
+
+    void start() {
+        if (opt_.docs_sync_interval_sec <= 0 && !opt_.docs_watch) return;
+        running_ = true;
+        thread_ = std::thread([this]() { run(); });
+#if defined(__linux__)
+        if (opt_.docs_watch) start_watch();
+#endif
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+            if (!running_) return;
+            running_ = false;
         }
-        log_event("llm.backend", "name=api base=" + openai.base.scheme + "://" + openai.base.host + ":" +
-                                   std::to_string(openai.base.port) + openai.base.base_path +
-                                   " model_override=" + (openai.model_override.empty() ? "(none)" : openai.model_override) +
-                                   " key=" + redact_api_key_for_log(openai.api_key) +
-                                   " timeout_sec=" + std::to_string(openai.timeout_sec) +
-                                   " verify_tls=" + std::string(openai.verify_tls ? "1" : "0") +
-                                   " proxy=" + (openai.proxy_host.empty() ? "(none)" : (openai.proxy_host + ":" + std::to_string(openai.proxy_port))));
+        cv_.notify_all();
+#if defined(__linux__)
+        if (watch_thread_.joinable()) watch_thread_.join();
+        if (inotify_fd_ >= 0) {
+            ::close(inotify_fd_);
+            inotify_fd_ = -1;
+        }
+#endif
+        if (thread_.joinable()) thread_.join();
     }
 
-    if (opt.llm_backend == LlmBackend::Local) {
-        std::vector<std::string> missing;
-        std::string model_err;
-        if (!is_model_complete(opt.model_path, &missing, &model_err)) {
-            if (opt.auto_download_model) {
-                log_event("model.download", "needed=1 model_path=" + opt.model_path +
-                                               " url=" + opt.model_url +
+    void trigger() {
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+            dirty_ = true;
+        }
+        cv_.notify_all();
+    }
+
+private:
+    RagVectorDb& rag_;
+    std::mutex& rag_mutex_;
+    const AppOptions& opt_;
+    std::mutex mu_;
+    std::condition_variable cv_;
+    std::atomic<bool> running_{false};
+    bool dirty_ = false;
+    std::thread thread_;
+#if defined(__linux__)
+    int inotify_fd_ = -1;
+    std::thread watch_thread_;
+#endif
+
+    void run() {
+        const auto interval = std::chrono::seconds(opt_.docs_sync_interval_sec > 0 ? opt_.docs_sync_interval_sec : 3600);
+        std::unique_lock<std::mutex> lock(mu_);
+        while (running_) {
+            bool woke = cv_.wait_for(lock, interval, [&]() { return !running_ || dirty_; });
+            if (!running_) break;
+            if (!woke && opt_.docs_sync_interval_sec <= 0) continue;
+            if (woke) {
+                // Debounce bursts of file events (editors, copies) into one pass.
+                cv_.wait_for(lock, std::chrono::seconds(1), [&]() { return !running_; });
+                if (!running_) break;
+            }
+            dirty_ = false;
+            lock.unlock();
+            auto t0 = std::chrono::steady_clock::now();
+            std::vector<std::string> trace;
+            DocsSyncStats stats = sync_docs_directory(opt_.docs_path, rag_, rag_mutex_, opt_, false, &trace);
+            int64_t elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - t0).count();
+            if (stats.added || stats.updated || stats.removed || stats.failed) {
+                log_event("rag.sync", summarize_sync(stats) + " elapsed_ms=" + std::to_string(elapsed_ms));
+            }
+            for (const auto& line : trace) {
+                if (line.rfind("warn", 0) == 0) log_event("rag.sync.trace", line);
+            }
+            lock.lock();
+        }
+    }
+
+#if defined(__linux__)
+    void add_watches(const std::filesystem::path& dir) {
+        const uint32_t mask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_CREATE | IN_DELETE_SELF;
+        inotify_add_watch(inotify_fd_, dir.c_str(), mask);
+        std::error_code ec;
+        for (auto it = std::filesystem::recursive_directory_iterator(dir, ec);
+             it != std::filesystem::recursive_directory_iterator();
+             it.increment(ec)) {
+            if (ec) break;
+            if (it->is_directory()) inotify_add_watch(inotify_fd_, it->path().c_str(), mask);
+        }
+    }
+
+    void start_watch() {
+        inotify_fd_ = inotify_init1(IN_CLOEXEC);
+        if (inotify_fd_ < 0) {
+            log_event("rag.sync.watch", "enabled=0 err=inotify_init failed");
+            return;
+        }
+        add_watches(opt_.docs_path);
+        log_event("rag.sync.watch", "enabled=1 path=" + opt_.docs_path);
+        watch_thread_ = std::thread([this]() {
+            alignas(struct inotify_event) char buf[16 * 1024];
+            while (running_) {
+                // Poll with a timeout so stop() does not depend on close() waking a blocked read.
+                struct pollfd pfd = {inotify_fd_, POLLIN, 0};
+                int rc = ::poll(&pfd, 1, 500);
+                if (rc == 0) continue;
+                if (rc < 0) {
+                    if (errno == EINTR) continue;
+                    break;
+                }
+                ssize_t n = ::read(inotify_fd_, buf, sizeof(buf));
+                if (n <= 0) break;
+                bool new_dir = false;
+                for (char* p = buf; p < buf + n;) {
+                    auto* ev = reinterpret_cast<struct inotify_event*>(p);
+                    if ((ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE | IN_MOVED_TO))) new_dir = true;
+                    p += sizeof(struct inotify_event) + ev->len;
+                }
+                // inotify is not recursive: pick up newly created subdirectories.
+                if (new_dir) add_watches(opt_.docs_path);
+                trigger();
+            }
+        });
+    }
+#endif
+};
+
+// Pages freed by deletes are returned to the OS in small incremental_vacuum steps, with the RAG
+// lock released between steps so searches and uploads only ever wait for one step.
+constexpr int64_t kRagVacuumMinFreePages = 1024;
+constexpr int kRagVacuumStepPages = 256;
+
+int64_t vacuum_free_pages(RagVectorDb& rag, std::mutex& rag_mutex, int64_t min_free, std::string* err) {
+    int64_t freed = 0;
+    for (;;) {
+        std::lock_guard<std::mutex> lock(rag_mutex);
+        if (!rag.incremental_vacuum_enabled() || rag.in_bulk()) break;
+        int64_t before = rag.free_pages();
+        if (before <= min_free) break;
+        if (!rag.incremental_vacuum(kRagVacuumStepPages, err)) break;
+        int64_t after = rag.free_pages();
+        if (after >= before) break;
+        freed += before - after;
+    }
+    return freed;
+}
+
+// Background DB upkeep: finishes a pending schema migration, then periodically vacuums.
+class RagMaintenanceWorker {
+public:
+    RagMaintenanceWorker(RagVectorDb& rag, std::mutex& rag_mutex, const AppOptions& opt)
+        : rag_(rag), rag_mutex_(rag_mutex), opt_(opt) {}
+    ~RagMaintenanceWorker() { stop(); }
+
+    void start() {
+        if (opt_.rag_vacuum_interval_sec <= 0 && !rag_.migration_pending()) return;
+        running_ = true;
+        thread_ = std::thread([this]() { run(); });
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+            if (!running_) return;
+            running_ = false;
+        }
+        cv_.notify_all();
+        if (thread_.joinable()) thread_.join();
+    }
+
+private:
+    RagVectorDb& rag_;
+    std::mutex& rag_mutex_;
+    const AppOptions& opt_;
+    std::mutex mu_;
+    std::condition_variable cv_;
+    std::atomic<bool> running_{false};
+    std::thread thread_;
+
+    void run() {
+        std::string migrate_err;
+        if (!migrate_rag_schema(rag_, rag_mutex_, &running_, &migrate_err)) {
+            log_event("rag.migrate.error", "err=" + migrate_err);
+        }
+        if (opt_.rag_vacuum_interval_sec <= 0) return;
+        const auto interval = std::chrono::seconds(opt_.rag_vacuum_interval_sec);
+        std::unique_lock<std::mutex> lock(mu_);
+        while (running_) {
+            cv_.wait_for(lock, interval, [&]() { return !running_; });
+            if (!running_) break;
+            lock.unlock();
+            auto t0 = std::chrono::steady_clock::now();
+            std::string err;
+            int64_t freed = vacuum_free_pages(rag_, rag_mutex_, kRagVacuumMinFreePages, &err);
+            int64_t elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - t0).count();
+            if (!err.empty()) {
+                log_event("rag.vacuum.error", "err=" + err);
+            } else if (freed > 0) {
+                log_event("rag.vacuum", "freed_pages=" + std::to_string(freed) + " elapsed_ms=" + std::to_string(elapsed_ms));
+            }
+            lock.lock();
+        }
+    }
+};
+
+json kv_snapshot_pool_json(const LlmKvPool& pool) {
+    LlmKvPoolStats st = pool.stats();
+    return json{
+        {"enabled", pool.enabled()},
+        {"bytes", st.arena_bytes},
+        {"used_bytes", st.blocks_used * st.block_bytes},
+        {"peak_used_bytes", st.peak_blocks_used * st.block_bytes},
+        {"block_bytes", st.block_bytes},
+        {"occupancy", st.blocks_total ? static_cast<double>(st.blocks_used) / st.blocks_total : 0.0},
+        {"allocations", st.allocations},
+        {"fallback_allocations", st.fallback_allocations}
+    };
+}
+
+// Output of a generation not yet written to the client; holds several tokens once coalesced.
+struct PendingText {
+    std::string text;
+    size_t tokens = 0;
+};
+
+// One local chat generation. The HTTP handler submits it to the LlmScheduler and consumes
+// `pending` as it fills; the fields below `mu` are guarded by it. The scheduler never waits
+// for the handler: once `max_pending` chunks are queued, the overflow policy applies.
+struct LlmJob {
+    std::string id;
+    std::string prompt;
+    GenerateConfig cfg;
+    bool use_session = false;
+    std::string session_id;
+    LlmSession session;
+    std::vector<Message> client_messages;
+    std::vector<Message> prompt_messages;
+    size_t max_pending = 0; // 0 = unbounded
+    SseOverflow overflow = SseOverflow::Coalesce;
+    int flush_ms = 0;       // SSE coalescing window, 0 = one event per chunk
+    size_t flush_bytes = 0; // flush a window early at this many bytes, 0 = no limit
+
+    std::mutex mu;
+    std::condition_variable cv;
+    std::deque<PendingText> pending; // sanitized output not yet taken by the handler
+    bool done = false;
+    std::atomic<bool> cancelled{false}; // nobody reads the output any more; checked between prefill chunks and tokens
+    std::string error;
+    size_t prompt_tokens = 0;
+    size_t cached_tokens = 0;
+    size_t completion_tokens = 0;
+    size_t coalesced_tokens = 0;
+    size_t kv_bytes = 0;
+    std::chrono::steady_clock::time_point submitted_at;
+    int64_t queue_wait_ms = 0; // submit to admission by a replica
+    size_t replica = 0;
+
+    void cancel(const std::string& reason) {
+        {
+            std::lock_guard<std::mutex> lock(mu);
+            if (cancelled) return;
+            cancelled = true;
+            error = reason;
+        }
+        cv.notify_all();
+    }
+
+    // Called by the scheduler for every generated token. Returns false once the job has been
+    // cancelled and further output would be discarded.
+    bool push_token(std::string token) {
+        {
+            std::lock_guard<std::mutex> lock(mu);
+            if (cancelled) return false;
+            if (max_pending == 0 || pending.size() < max_pending) {
+                pending.push_back(PendingText{std::move(token), 1});
+            } else if (overflow == SseOverflow::Coalesce) {
+                if (coalesced_tokens == 0) log_event("sse.overflow", "id=" + id + " policy=coalesce pending=" + std::to_string(pending.size()));
+                pending.back().text += token;
+                ++pending.back().tokens;
+                ++coalesced_tokens;
+            } else {
+                log_event("sse.overflow", "id=" + id + " policy=disconnect pending=" + std::to_string(pending.size()));
+                cancelled = true;
+                error = "client is not reading the stream fast enough";
+                return false;
+            }
+        }
+        cv.notify_all();
+        return true;
+    }
+
+    // Blocks until output is available (true) or the job has finished (false). While waiting,
+    // `client_gone` is polled so a client that leaves during prefill or queueing cancels the job.
+    bool next_chunk(PendingText* out, const std::function<bool()>& client_gone = nullptr) {
+        std::unique_lock<std::mutex> lock(mu);
+        while (pending.empty() && !done) {
+            if (client_gone) {
+                if (cv.wait_for(lock, std::chrono::milliseconds(250), [&]() { return !pending.empty() || done; })) break;
+                if (!cancelled && client_gone()) {
+                    lock.unlock();
+                    cancel("client disconnected");
+                    return false;
+                }
+            } else {
+                cv.wait(lock);
+            }
+        }
+        if (pending.empty()) return false;
+        *out = std::move(pending.front());
+        pending.pop_front();
+        return true;
+    }
+
+    // Appends output arriving until `deadline` to *batch, stopping early once it holds
+    // `max_bytes` (0 = no limit) or the job has finished.
+    void gather(PendingText* batch, std::chrono::steady_clock::time_point deadline, size_t max_bytes) {
+        std::unique_lock<std::mutex> lock(mu);
+        for (;;) {
+            while (!pending.empty() && (max_bytes == 0 || batch->text.size() < max_bytes)) {
+                batch->text += pending.front().text;
+                batch->tokens += pending.front().tokens;
+                pending.pop_front();
+            }
+            if (done || cancelled || (max_bytes > 0 && batch->text.size() >= max_bytes)) return;
+            if (!cv.wait_until(lock, deadline, [&]() { return !pending.empty() || done || cancelled; })) return;
+        }
+    }
+};
+
+struct LlmSchedulerStats {
+    size_t queued = 0;
+    size_t active = 0;
+    uint64_t completed = 0;
+    uint64_t cancelled = 0;
+    uint64_t cancelled_tokens_saved = 0; // max_new_tokens left unused by cancelled jobs
+    uint64_t admitted = 0;
+    uint64_t queue_wait_ms_total = 0;
+    int64_t queue_wait_ms_max = 0;
+
+    double queue_wait_ms_avg() const { return admitted ? static_cast<double>(queue_wait_ms_total) / admitted : 0.0; }
+};
+
+// Owns the local model and runs admitted generations on one thread. This is not batching:
+// ncnn_llm exposes only whole prefill/generate calls, so sequences take turns on the model and
+// aggregate throughput stays that of one sequence. By default each job decodes to completion.
+// With --sched-slice-tokens N, jobs are time-sliced round-robin every N tokens so a new request
+// starts between the slices of running ones; every slice is a fresh generate() call, so sampling
+// state restarts and a short slice is taken to mean a stop token. Jobs with a repetition
+// penalty are never sliced, as the penalty would forget the previous slices' tokens. With
+// --model-replicas, one scheduler runs per model instance (see LlmDispatcher). Batched decode
+// of the active sequences stays blocked until ncnn_llm offers a step-level decode entry point
+// (see "已知限制" in the README).
+class LlmScheduler {
+public:
+    LlmScheduler(const ncnn_llm_gpt* model,
+                 const AppOptions& opt,
+                 LlmPrefixCache& prefix_cache,
+                 LlmSessionCache& session_cache,
+                 const PrefillChunking& chunking,
+                 size_t replica = 0,
+                 int threads = 0,
+                 std::vector<int> cpus = {})
+        : model_(model),
+          opt_(opt),
+          prefix_cache_(prefix_cache),
+          session_cache_(session_cache),
+          chunking_(chunking),
+          replica_(replica),
+          threads_(threads),
+          cpus_(std::move(cpus)) {}
+    ~LlmScheduler() { stop(); }
+
+    void start() {
+        running_ = true;
+        thread_ = std::thread([this]() { run(); });
+    }
+
+    // Jobs submitted and not yet finished.
+    size_t load() const { return load_; }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+            if (!running_) return;
+            running_ = false;
+        }
+        cv_.notify_all();
+        if (thread_.joinable()) thread_.join();
+    }
+
+    void submit(const std::shared_ptr<LlmJob>& job) {
+        size_t depth = 0;
+        job->submitted_at = std::chrono::steady_clock::now();
+        job->replica = replica_;
+        ++load_;
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+            queue_.push_back(job);
+            depth = queue_.size();
+        }
+        cv_.notify_one();
+        log_event("sched.submit", "id=" + job->id + " replica=" + std::to_string(replica_) + " queued=" + std::to_string(depth));
+    }
+
+    LlmSchedulerStats stats() {
+        LlmSchedulerStats st;
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+            st.queued = queue_.size();
+        }
+        st.active = active_count_;
+        st.completed = completed_;
+        st.cancelled = cancelled_;
+        st.cancelled_tokens_saved = cancelled_tokens_saved_;
+        st.admitted = admitted_;
+        st.queue_wait_ms_total = queue_wait_ms_total_;
+        st.queue_wait_ms_max = queue_wait_ms_max_;
+        return st;
+    }
+
+private:
+    // Thrown from the token callback to stop generate() once the job is cancelled.
+    struct GenerationCancelled {};
+
+    // Scheduler-side state of an admitted job.
+    struct Active {
+        std::shared_ptr<LlmJob> job;
+        std::shared_ptr<ncnn_llm_gpt_ctx> ctx;
+        int remaining = 0;
+        size_t emitted = 0;
+        std::string raw_output;
+        std::string reply;
+        bool cancelled = false;
+        std::chrono::steady_clock::time_point gen_start;
+    };
+
+    const ncnn_llm_gpt* model_;
+    const AppOptions& opt_;
+    LlmPrefixCache& prefix_cache_;
+    LlmSessionCache& session_cache_;
+    PrefillChunking chunking_;
+    size_t replica_;
+    int threads_; // OpenMP team size for this replica's inference, 0 = ncnn default
+    std::vector<int> cpus_; // pinned CPU set, empty = unpinned
+    std::mutex mu_;
+    std::condition_variable cv_;
+    std::deque<std::shared_ptr<LlmJob>> queue_;
+    bool running_ = false;
+    bool slicing_ok_ = true; // cleared if generate() turns out not to return a resumable context
+    std::thread thread_;
+    std::atomic<size_t> active_count_{0};
+    std::atomic<uint64_t> completed_{0};
+    std::atomic<uint64_t> cancelled_{0};
+    std::atomic<uint64_t> cancelled_tokens_saved_{0};
+    std::atomic<size_t> load_{0};
+    std::atomic<uint64_t> admitted_{0};
+    std::atomic<uint64_t> queue_wait_ms_total_{0};
+    std::atomic<int64_t> queue_wait_ms_max_{0};
+
+    void run() {
+        // Both apply to this thread and the OpenMP team it starts, i.e. this replica's layers. KV
+        // blobs created here are first touched on the pinned CPUs' node.
+        if (!cpus_.empty() && !pin_current_thread(cpus_)) {
+            log_event("cpu.affinity", "role=replica idx=" + std::to_string(replica_) + " ok=0");
+        }
+        if (threads_ > 0) ncnn::set_omp_num_threads(threads_);
+        // ncnn layers size their teams from the net's Option::num_threads, which ncnn_llm sets
+        // itself and does not expose, so threads_ only caps OpenMP's default team. Log both.
+        log_event("sched.replica.threads", "idx=" + std::to_string(replica_) +
+                                           " requested=" + std::to_string(threads_) +
+                                           " omp_threads=" + std::to_string(ncnn::get_omp_num_threads()) +
+                                           " layer_threads_default=" + std::to_string(ncnn::Option().num_threads));
+        std::vector<Active> active;
+        size_t next = 0;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(mu_);
+                cv_.wait(lock, [&]() { return !running_ || !queue_.empty() || !active.empty(); });
+                if (!running_) break;
+                const size_t max_active = static_cast<size_t>(std::max(1, opt_.sched_max_active));
+                while (!queue_.empty() && active.size() < max_active) {
+                    Active a;
+                    a.job = std::move(queue_.front());
+                    queue_.pop_front();
+                    admit(*a.job);
+                    active.push_back(std::move(a));
+                }
+                active_count_ = active.size();
+            }
+            if (active.empty()) continue;
+            if (next >= active.size()) next = 0;
+            Active& a = active[next];
+            bool finished = a.ctx ? decode_slice(a) : prefill(a);
+            if (finished) {
+                finish(a);
+                active.erase(active.begin() + static_cast<std::ptrdiff_t>(next));
+                active_count_ = active.size();
+            } else {
+                ++next;
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(mu_);
+        for (auto& a : active) queue_.push_front(std::move(a.job));
+        for (auto& job : queue_) {
+            std::lock_guard<std::mutex> job_lock(job->mu);
+            job->error = "server shutting down";
+            job->done = true;
+            job->cv.notify_all();
+        }
+        load_ -= std::min<size_t>(load_, queue_.size());
+        queue_.clear();
+    }
+
+    void admit(LlmJob& job) {
+        const int64_t wait_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - job.submitted_at).count();
+        job.queue_wait_ms = wait_ms;
+        ++admitted_;
+        queue_wait_ms_total_ += static_cast<uint64_t>(std::max<int64_t>(0, wait_ms));
+        int64_t prev = queue_wait_ms_max_;
+        while (wait_ms > prev && !queue_wait_ms_max_.compare_exchange_weak(prev, wait_ms)) {
+        }
+        if (wait_ms > 0) log_event("sched.admit", "id=" + job.id + " replica=" + std::to_string(replica_) + " wait_ms=" + std::to_string(wait_ms));
+    }
+
+    // Returns true when the job is already finished (failed or nothing to generate).
+    bool prefill(Active& a) {
+        LlmJob& job = *a.job;
+        if (!model_) {
+            std::lock_guard<std::mutex> lock(job.mu);
+            job.error = "local model not initialized";
+            return true;
+        }
+        a.remaining = job.cfg.max_new_tokens;
+        if (job.cancelled) {
+            a.cancelled = true;
+            return true;
+        }
+        log_event("chat.prefill.start", "id=" + job.id + " prompt_len=" + std::to_string(job.prompt.size()));
+        auto prefill_start = std::chrono::steady_clock::now();
+        size_t cached_tokens = 0;
+        a.ctx = prefill_turn(*model_, job.prompt, chunking_, job.id, &prefix_cache_, &job.session, &cached_tokens, &job.cancelled);
+        if (job.cancelled) {
+            a.cancelled = true;
+            a.ctx.reset();
+            return true;
+        }
+        int64_t prefill_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - prefill_start).count();
+        log_event("chat.prefill.done", "id=" + job.id + " cached_tokens=" + std::to_string(cached_tokens) +
+                                           " elapsed_ms=" + std::to_string(prefill_ms));
+        {
+            std::lock_guard<std::mutex> lock(job.mu);
+            job.prompt_tokens = a.ctx ? llm_ctx_tokens(*a.ctx) : 0;
+            job.cached_tokens = cached_tokens;
+        }
+        a.gen_start = std::chrono::steady_clock::now();
+        return !a.ctx || a.remaining <= 0;
+    }
+
+    // Runs one slice of decoding. Returns true when the job has stopped.
+    bool decode_slice(Active& a) {
+        LlmJob& job = *a.job;
+        if (job.cancelled) {
+            a.cancelled = true;
+            return true;
+        }
+        // Beam search and the repetition penalty have to see the whole continuation, so those
+        // jobs are never sliced.
+        const bool sliced = slicing_ok_ && opt_.sched_slice_tokens > 0 && job.cfg.beam_size <= 1 &&
+                            job.cfg.repetition_penalty == 1.0f;
+        const int want = sliced ? std::min(a.remaining, opt_.sched_slice_tokens) : a.remaining;
+        GenerateConfig cfg = job.cfg;
+        cfg.max_new_tokens = want;
+        const size_t kv_before = llm_ctx_tokens(*a.ctx);
+        int emitted = 0;
+        std::shared_ptr<ncnn_llm_gpt_ctx> out;
+        try {
+            out = model_->generate(a.ctx, cfg, [&](const std::string& token) {
+                ++emitted;
+                std::string safe_token = sanitize_utf8(token);
+                if (job.use_session) {
+                    a.raw_output += token;
+                    a.reply += safe_token;
+                }
+                // ncnn_llm has no stop hook, so a cancel unwinds out of generate() from here, between
+                // two tokens (outside any ncnn layer).
+                if (!job.push_token(std::move(safe_token)) || job.cancelled) throw GenerationCancelled();
+            });
+        } catch (const GenerationCancelled&) {
+            // a.ctx may be half-updated now; a cancelled turn is never kept, so that is harmless.
+            a.remaining -= emitted;
+            a.emitted += static_cast<size_t>(emitted);
+            a.cancelled = true;
+            return true;
+        }
+        if (!out) out = a.ctx;
+        a.remaining -= emitted;
+        a.emitted += static_cast<size_t>(emitted);
+        if (sliced && emitted > 0 && llm_ctx_tokens(*out) != kv_before + static_cast<size_t>(emitted)) {
+            // The next slice would not continue where this one stopped; end the reply here and
+            // run later jobs unsliced.
+            slicing_ok_ = false;
+            log_event("sched.slice.unsupported", "id=" + job.id + " kv_before=" + std::to_string(kv_before) +
+                                                     " kv_after=" + std::to_string(llm_ctx_tokens(*out)) +
+                                                     " emitted=" + std::to_string(emitted));
+            a.ctx = std::move(out);
+            return true;
+        }
+        a.ctx = std::move(out);
+        // Fewer tokens than asked for means generate() hit a stop token.
+        return emitted < want || a.remaining <= 0;
+    }
+
+    void finish(Active& a) {
+        LlmJob& job = *a.job;
+        if (a.ctx) {
+            int64_t gen_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - a.gen_start).count();
+            log_event("chat.generate.done", "id=" + job.id +
+                                            " tokens=" + std::to_string(a.emitted) +
+                                            " output_bytes=" + std::to_string(a.reply.size()) +
+                                            " cancelled=" + std::string(a.cancelled ? "1" : "0") +
+                                            " elapsed_ms=" + std::to_string(gen_ms));
+        }
+        if (a.cancelled) {
+            // A cancel stops the job before decode or at the next token, so these tokens were never
+            // generated; still an upper bound, since the reply might have ended earlier on its own.
+            const size_t saved = static_cast<size_t>(std::max(0, a.remaining));
+            ++cancelled_;
+            cancelled_tokens_saved_ += saved;
+            log_event("chat.cancelled", "id=" + job.id + " emitted=" + std::to_string(a.emitted) +
+                                        " tokens_saved=" + std::to_string(saved) +
+                                        " prefilled=" + std::string(a.ctx ? "1" : "0"));
+        } else {
+            ++completed_;
+        }
+        size_t kv_bytes = kv_cache_bytes(a.ctx);
+        // The client never saw the whole reply of a cancelled turn, so it is not kept as history.
+        if (job.use_session && a.ctx && !a.cancelled) {
+            remember_session_turn(session_cache_, job.session_id, job.id, std::move(job.client_messages),
+                                  std::move(job.prompt_messages), job.prompt, a.raw_output, a.reply,
+                                  job.prompt_tokens + a.emitted, std::move(a.ctx));
+        }
+        a.ctx.reset();
+        {
+            std::lock_guard<std::mutex> lock(job.mu);
+            job.completion_tokens = a.emitted;
+            job.kv_bytes = kv_bytes;
+            job.done = true;
+        }
+        job.cv.notify_all();
+        --load_;
+    }
+};
+
+// Routes local generations across the model replicas: each job goes to the replica with the
+// fewest unfinished jobs, so an idle replica is always picked when there is one; ties rotate.
+// The prefix and session caches are shared, so any replica can continue any session.
+class LlmDispatcher {
+public:
+    void add(std::unique_ptr<LlmScheduler> replica) { replicas_.push_back(std::move(replica)); }
+    size_t size() const { return replicas_.size(); }
+
+    void start() {
+        for (auto& r : replicas_) r->start();
+    }
+
+    void stop() {
+        for (auto& r : replicas_) r->stop();
+    }
+
+    // Bypasses load balancing; used to warm up every replica.
+    void submit_to(size_t replica, const std::shared_ptr<LlmJob>& job) { replicas_[replica]->submit(job); }
+
+    void submit(const std::shared_ptr<LlmJob>& job) {
+        if (replicas_.empty()) {
+            std::lock_guard<std::mutex> lock(job->mu);
+            job->error = "local model not initialized";
+            job->done = true;
+            return;
+        }
+        const size_t start = next_++ % replicas_.size();
+        size_t best = start;
+        for (size_t k = 1; k < replicas_.size(); ++k) {
+            const size_t i = (start + k) % replicas_.size();
+            if (replicas_[i]->load() < replicas_[best]->load()) best = i;
+        }
+        replicas_[best]->submit(job);
+    }
+
+    std::vector<LlmSchedulerStats> replica_stats() {
+        std::vector<LlmSchedulerStats> out;
+        for (auto& r : replicas_) out.push_back(r->stats());
+        return out;
+    }
+
+    LlmSchedulerStats stats() {
+        LlmSchedulerStats total;
+        for (const auto& st : replica_stats()) {
+            total.queued += st.queued;
+            total.active += st.active;
+            total.completed += st.completed;
+            total.cancelled += st.cancelled;
+            total.cancelled_tokens_saved += st.cancelled_tokens_saved;
+            total.admitted += st.admitted;
+            total.queue_wait_ms_total += st.queue_wait_ms_total;
+            total.queue_wait_ms_max = std::max(total.queue_wait_ms_max, st.queue_wait_ms_max);
+        }
+        return total;
+    }
+
+private:
+    std::vector<std::unique_ptr<LlmScheduler>> replicas_;
+    std::atomic<size_t> next_{0};
+};
+
+// Filler for the synthetic warm-up prompt, shaped like retrieved context: mixed-language prose
+// with numbers and code, so tokenizer paths and KV sizes match real requests.
+const char* const kWarmupParagraphs[] = {
+    "The service stores documents as overlapping chunks of about 600 characters. Each chunk is "
+    "embedded into a 256-dimensional vector and indexed for cosine search; the top 10 hits are "
+    "expanded with their neighbours before they are packed into the prompt.",
+    "检索增强生成会先在本地向量库中查找与问题最相关的片段，再把这些片段连同来源编号一起放入系统提示词，"
+    "模型据此作答并在回答中引用对应的编号。",
+    "Example: `curl -s http://localhost:8080/rag/upload -F \"file=@./report.pdf\"` returns "
+    "{\"doc_id\": 42, \"chunks\": 118} once the PDF text has been extracted and indexed.",
+    "若上下文中没有答案，应明确说明不知道，而不是编造内容。回答应简洁，并按 [1]、[2] 的形式标注出处。",
+};
+
+// Synthetic retrieved context of about `tokens` tokens. Each `variant` starts with a different
+// first block, so no two variants share a prefix past the fixed instructions.
+std::string warmup_context(size_t tokens, size_t variant, const TokenEstimator& estimator) {
+    constexpr size_t n = sizeof(kWarmupParagraphs) / sizeof(kWarmupParagraphs[0]);
+    const std::string source = "(warmup-" + std::to_string(variant) + ".txt) ";
+    std::string out;
+    for (size_t i = 0; estimator.estimate(out) < tokens; ++i) {
+        out += "[" + std::to_string(i + 1) + "] " + source + kWarmupParagraphs[(i + variant) % n] + "\n\n";
+    }
+    return out;
+}
+
+struct WarmupRun {
+    int64_t first_token_ms = -1;
+    int64_t total_ms = 0;
+    size_t prompt_tokens = 0;
+    size_t tokens = 0;
+    std::string error;
+};
+
+// Runs one generation to completion, timed from submission.
+WarmupRun run_warmup_job(const std::function<void(const std::shared_ptr<LlmJob>&)>& submit,
+                         const std::string& id,
+                         const std::string& prompt,
+                         int max_new_tokens) {
+    auto job = std::make_shared<LlmJob>();
+    job->id = id;
+    job->prompt = prompt;
+    job->cfg.max_new_tokens = max_new_tokens;
+    WarmupRun run;
+    auto t0 = std::chrono::steady_clock::now();
+    auto elapsed_ms = [&]() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - t0).count();
+    };
+    submit(job);
+    PendingText piece;
+    while (job->next_chunk(&piece)) {
+        if (run.first_token_ms < 0) run.first_token_ms = elapsed_ms();
+        run.tokens += piece.tokens;
+    }
+    run.total_ms = elapsed_ms();
+    std::lock_guard<std::mutex> lock(job->mu);
+    run.error = job->error;
+    run.prompt_tokens = job->prompt_tokens;
+    return run;
+}
+
+// Startup warm-up, run before chat is accepted: a synthetic prefill/decode on every replica
+// (twice, to log cold against warm), a vector search, JSON serialization, then a replay of saved
+// real requests so the prefix cache and the DB pages reflect production traffic. `dispatcher` is
+// null with the API backend.
+void run_startup_warmup(const AppOptions& opt,
+                        LlmDispatcher* dispatcher,
+                        TokenEstimator& estimator,
+                        RagVectorDb& rag,
+                        std::mutex& rag_mutex,
+                        bool rag_ready,
+                        const RagEmbedder& embedder,
+                        const std::vector<WarmupQuery>& replay) {
+    auto t_start = std::chrono::steady_clock::now();
+    auto since_us = [](std::chrono::steady_clock::time_point t0) {
+        return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - t0).count();
+    };
+
+    if (dispatcher && opt.warmup_tokens > 0) {
+        for (size_t r = 0; r < dispatcher->size(); ++r) {
+            auto submit = [&](const std::shared_ptr<LlmJob>& job) { dispatcher->submit_to(r, job); };
+            WarmupRun runs[2];
+            for (int k = 0; k < 2; ++k) {
+                // A different filler for every run, so neither the warm run nor a later replica's
+                // cold run is served from the shared prefix cache.
+                std::string context = warmup_context(opt.warmup_tokens, 2 * r + static_cast<size_t>(k), estimator);
+                std::vector<Message> messages = {Message{"system", build_system_prompt(context, true)},
+                                                 Message{"user", "Summarize the context in one sentence."}};
+                const std::string prompt = apply_chat_template(messages, {}, true, false);
+                runs[k] = run_warmup_job(submit, "warmup-" + std::to_string(r) + "-" + std::to_string(k), prompt, kWarmupDecodeTokens);
+                if (runs[k].error.empty() && runs[k].prompt_tokens > 0) estimator.observe(prompt, runs[k].prompt_tokens);
+            }
+            log_event("warmup.llm", "replica=" + std::to_string(r) +
+                                    " prompt_tokens=" + std::to_string(runs[1].prompt_tokens) +
+                                    " decode_tokens=" + std::to_string(runs[1].tokens) +
+                                    " cold_first_token_ms=" + std::to_string(runs[0].first_token_ms) +
+                                    " warm_first_token_ms=" + std::to_string(runs[1].first_token_ms) +
+                                    " cold_total_ms=" + std::to_string(runs[0].total_ms) +
+                                    " warm_total_ms=" + std::to_string(runs[1].total_ms) +
+                                    (runs[0].error.empty() ? std::string() : " err=" + runs[0].error));
+        }
+    }
+
+    if (rag_ready) {
+        int64_t search_us[2] = {0, 0};
+        for (int k = 0; k < 2; ++k) {
+            auto t0 = std::chrono::steady_clock::now();
+            std::vector<float> qvec = embedder.embed("warmup query: how are documents chunked and indexed?");
+            std::lock_guard<std::mutex> lock(rag_mutex);
+            std::vector<RagSearchHit> hits = rag.search(qvec, opt.rag_top_k);
+            expand_hits_with_neighbors(rag, hits, opt.rag_neighbor_chunks, opt.rag_chunk_max_chars);
+            search_us[k] = since_us(t0);
+        }
+        log_event("warmup.search", "cold_us=" + std::to_string(search_us[0]) + " warm_us=" + std::to_string(search_us[1]));
+    }
+
+    int64_t json_us[2] = {0, 0};
+    size_t json_bytes = 0;
+    for (int k = 0; k < 2; ++k) {
+        auto t0 = std::chrono::steady_clock::now();
+        json chunk = {
+            {"id", "chatcmpl-warmup"},
+            {"object", "chat.completion.chunk"},
+            {"model", "warmup"},
+            {"choices", json::array({json{{"index", 0}, {"delta", {{"role", "assistant"}, {"content", "预热 warmup"}}}, {"finish_reason", nullptr}}})},
+            {"usage", {{"prompt_tokens", 1}, {"completion_tokens", 1}, {"total_tokens", 2}}}
+        };
+        json_bytes = dump_json_safe(chunk).size();
+        json_us[k] = since_us(t0);
+    }
+    log_event("warmup.json", "bytes=" + std::to_string(json_bytes) + " cold_us=" + std::to_string(json_us[0]) +
+                             " warm_us=" + std::to_string(json_us[1]));
+
+    if (!replay.empty()) {
+        auto t0 = std::chrono::steady_clock::now();
+        size_t prefilled = 0;
+        size_t searched = 0;
+        for (size_t i = 0; i < replay.size(); ++i) {
+            const WarmupQuery& q = replay[i];
+            if (rag_ready && !q.query.empty()) {
+                std::vector<float> qvec = embedder.embed(q.query);
+                std::lock_guard<std::mutex> lock(rag_mutex);
+                std::vector<RagSearchHit> hits = rag.search(qvec, opt.rag_top_k);
+                expand_hits_with_neighbors(rag, hits, opt.rag_neighbor_chunks, opt.rag_chunk_max_chars);
+                ++searched;
+            }
+            if (dispatcher) {
+                // One token is enough: the prefill leaves the prompt's shared prefixes in the cache.
+                WarmupRun run = run_warmup_job([&](const std::shared_ptr<LlmJob>& job) { dispatcher->submit(job); },
+                                               "warmup-replay-" + std::to_string(i), q.prompt, 1);
+                if (run.error.empty()) ++prefilled;
+            }
+        }
+        log_event("warmup.replay", "queries=" + std::to_string(replay.size()) +
+                                   " searched=" + std::to_string(searched) +
+                                   " prefilled=" + std::to_string(prefilled) +
+                                   " elapsed_ms=" + std::to_string(since_us(t0) / 1000));
+    }
+    log_event("warmup.done", "elapsed_ms=" + std::to_string(since_us(t_start) / 1000));
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    AppOptions opt = parse_options(argc, argv);
+    configure_glibc_malloc_from_env();
+    {
+        int trim_enabled = 0;
+        if (getenv_int("NCNN_RAG_MALLOC_TRIM", &trim_enabled)) {
+            opt.malloc_trim = (trim_enabled != 0);
+        }
+    }
+    opt.model_path = normalize_path(opt.model_path, "./assets");
+    opt.docs_path = normalize_path(opt.docs_path, ".");
+    opt.data_dir = normalize_path(opt.data_dir, ".");
+    opt.db_path = normalize_path(opt.db_path, opt.data_dir);
+    opt.pdf_txt_dir = normalize_path(opt.pdf_txt_dir, opt.data_dir);
+
+    if (opt.index_only) {
+        int rc = run_offline_index(opt);
+        if (rc != 0 || opt.export_pack.empty()) return rc;
+    }
+    if (!opt.export_pack.empty()) return run_export_pack(opt);
+
+    OpenAICompatOptions openai;
+    if (opt.llm_backend == LlmBackend::OpenAICompat) {
+        std::string api_err;
+        if (!init_openai_compat(opt.api_base,
+                               opt.api_key,
+                               opt.api_model,
+                               opt.api_verify_tls,
+                               opt.api_timeout_sec,
+                               opt.api_proxy,
+                               opt.api_use_proxy,
+                               &openai,
+                               &api_err)) {
+            std::cerr << "API backend init failed: " << api_err << "\n";
+            return 2;
+        }
+        log_event("llm.backend", "name=api base=" + openai.base.scheme + "://" + openai.base.host + ":" +
+                                   std::to_string(openai.base.port) + openai.base.base_path +
+                                   " model_override=" + (openai.model_override.empty() ? "(none)" : openai.model_override) +
+                                   " key=" + redact_api_key_for_log(openai.api_key) +
+                                   " timeout_sec=" + std::to_string(openai.timeout_sec) +
+                                   " verify_tls=" + std::string(openai.verify_tls ? "1" : "0") +
+                                   " proxy=" + (openai.proxy_host.empty() ? "(none)" : (openai.proxy_host + ":" + std::to_string(openai.proxy_port))));
+    }
+
+    if (opt.llm_backend == LlmBackend::Local) {
+        std::vector<std::string> missing;
+        std::string model_err;
+        if (!is_model_complete(opt.model_path, &missing, &model_err)) {
+            if (opt.auto_download_model) {
+                log_event("model.download", "needed=1 model_path=" + opt.model_path +
+                                               " url=" + opt.model_url +
                                                " missing_files=" + std::to_string(missing.size()));
                 std::string dl_err;
                 CurlDownloadOptions dlopt;
@@ -1899,12 +3651,77 @@ int main(int argc, char** argv) {
                          " rag_neighbor_chunks=" + std::to_string(opt.rag_neighbor_chunks) +
                          " rag_chunk_max_chars=" + std::to_string(opt.rag_chunk_max_chars) +
                          " prefill_chunk_bytes=" + std::to_string(opt.llm_prefill_chunk_bytes) +
+                         " prefill_chunk_tokens=" + (opt.llm_prefill_auto ? std::string("auto") : std::to_string(opt.llm_prefill_chunk_tokens)) +
                          " rag_enabled=" + std::string(opt.rag_enabled ? "1" : "0") +
                          " save_pdf_txt=" + std::string(opt.save_pdf_txt ? "1" : "0") +
                          " vulkan=" + std::string(opt.use_vulkan ? "1" : "0") +
                          " vulkan_runtime=" + std::string(use_vulkan_runtime ? "1" : "0") +
+                         " model_replicas=" + std::to_string(opt.model_replicas) +
                          " llm_backend=" + std::string(opt.llm_backend == LlmBackend::Local ? "local" : "api"));
 
+    const bool local_llm = opt.llm_backend == LlmBackend::Local;
+    CpuTopology cpu_topo = read_cpu_topology();
+    {
+        std::string nodes;
+        for (size_t n = 0; n < cpu_topo.nodes.size(); ++n) {
+            nodes += " node" + std::to_string(n) + "=" + format_cpu_list(cpu_topo.nodes[n]);
+        }
+        log_event("cpu.topology", "cpus=" + std::to_string(cpu_topo.cpus.size()) +
+                                  " online=" + format_cpu_list(cpu_topo.cpus) +
+                                  " numa_nodes=" + std::to_string(cpu_topo.nodes.size()) + nodes);
+    }
+    AffinityPlan affinity;
+    if ((local_llm && !opt.replica_cpus.empty()) || !opt.worker_cpus.empty()) {
+        std::string affinity_err;
+        if (!plan_affinity(cpu_topo, local_llm ? opt.replica_cpus : std::string(), opt.worker_cpus, opt.model_replicas,
+                           opt.threads_per_replica, &affinity, &affinity_err)) {
+            std::cerr << "Warning: CPU affinity disabled: " << affinity_err << "\n";
+            log_event("cpu.affinity", "ok=0 err=" + affinity_err);
+            affinity = AffinityPlan();
+        }
+    }
+    // Inference threads per replica: explicit, else the replica's pinned CPUs, else an even share.
+    std::vector<int> replica_threads(static_cast<size_t>(opt.model_replicas), opt.threads_per_replica);
+    for (size_t i = 0; i < replica_threads.size(); ++i) {
+        if (replica_threads[i] > 0) continue;
+        if (i < affinity.replicas.size()) replica_threads[i] = static_cast<int>(affinity.replicas[i].size());
+        else if (opt.model_replicas > 1) replica_threads[i] = std::max(1, ncnn::get_physical_cpu_count() / opt.model_replicas);
+    }
+    if (local_llm && opt.model_replicas > 1) {
+        // See LlmScheduler::run: the per-replica thread count does not reach ncnn's layers.
+        const int layer_threads = ncnn::Option().num_threads;
+        const int cpus = ncnn::get_cpu_count();
+        if (opt.model_replicas * layer_threads > cpus) {
+            std::cerr << "Warning: " << opt.model_replicas << " replicas x " << layer_threads
+                      << " ncnn layer threads exceed " << cpus << " CPUs; ncnn_llm does not expose its thread count, "
+                      << "so --threads-per-replica cannot cap it" << (affinity.replicas.empty() ? "" : " (each replica stays on its pinned CPUs)")
+                      << "\n";
+            log_event("model.replica.oversubscribed", "replicas=" + std::to_string(opt.model_replicas) +
+                                                      " layer_threads=" + std::to_string(layer_threads) +
+                                                      " cpus=" + std::to_string(cpus) +
+                                                      " pinned=" + std::string(affinity.replicas.empty() ? "0" : "1"));
+        }
+    }
+    for (size_t i = 0; i < affinity.replicas.size(); ++i) {
+        std::set<int> nodes;
+        for (int c : affinity.replicas[i]) nodes.insert(cpu_topo.node_of(c));
+        std::string node_list;
+        for (int n : nodes) node_list += (node_list.empty() ? "" : ",") + std::to_string(n);
+        log_event("cpu.affinity", "role=replica idx=" + std::to_string(i) +
+                                  " cpus=" + format_cpu_list(affinity.replicas[i]) +
+                                  " nodes=" + node_list +
+                                  " threads=" + std::to_string(replica_threads[i]));
+    }
+    if (!affinity.workers.empty()) {
+        // Set on the main thread before any worker, handler or ingest thread exists, so they all
+        // inherit it; replica threads re-pin themselves.
+        bool pinned = pin_current_thread(affinity.workers);
+        log_event("cpu.affinity", "role=workers cpus=" + format_cpu_list(affinity.workers) +
+                                  " ok=" + std::string(pinned ? "1" : "0"));
+    } else if (!affinity.replicas.empty()) {
+        log_event("cpu.affinity", "role=workers cpus=unpinned reason=no CPUs left by the replicas");
+    }
+
     std::filesystem::path data_root(opt.data_dir);
     std::filesystem::path upload_dir = data_root / "uploads";
     std::filesystem::path pdf_txt_dir(opt.pdf_txt_dir);
@@ -1925,34 +3742,167 @@ int main(int argc, char** argv) {
     RagEmbedder embedder(opt.embed_dim);
     std::mutex rag_mutex;
     std::string rag_err;
-    bool rag_ready = rag.open(opt.db_path, opt.embed_dim, &rag_err);
+    rag.set_near_dup_distance(opt.rag_near_dup_bits);
+    rag.set_shard_count(opt.rag_shards);
+    bool rag_ready = false;
+    if (!opt.import_pack.empty()) {
+        auto t0 = std::chrono::steady_clock::now();
+        rag_ready = rag.open_pack(opt.import_pack, opt.pack_verify, &rag_err);
+        int64_t elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - t0).count();
+        if (rag_ready && rag.embed_dim() != opt.embed_dim) {
+            // Queries are embedded with --embed-dim; a pack built with another dim would never match.
+            rag_ready = false;
+            rag_err = "embedding dim mismatch in index pack (pack=" + std::to_string(rag.embed_dim()) + ")";
+        }
+        if (rag_ready) {
+            log_event("rag.pack", "ready=1 path=" + opt.import_pack + " doc_count=" + std::to_string(rag.doc_count()) +
+                                      " chunk_count=" + std::to_string(rag.chunk_count()) +
+                                      " verify=" + std::string(opt.pack_verify ? "1" : "0") +
+                                      " open_ms=" + std::to_string(elapsed_ms));
+        }
+    } else {
+        rag_ready = rag.open(opt.db_path, opt.embed_dim, &rag_err);
+        if (rag_ready && opt.rag_shards > 1 && rag.shard_count() != static_cast<size_t>(opt.rag_shards)) {
+            log_event("rag.shards.warn", "requested=" + std::to_string(opt.rag_shards) +
+                                             " actual=" + std::to_string(rag.shard_count()) +
+                                             " reason=shard count is fixed when the DB is created");
+        }
+    }
     std::string rag_open_err = rag_err;
     if (!rag_ready) {
         std::cerr << "RAG db warning: " << rag_err << "\n";
         log_event("rag.db", "ready=0 err=" + rag_err);
-    } else if (rag.chunk_count() == 0) {
-        std::vector<std::string> seed_trace;
-        size_t ingested = ingest_directory(opt.docs_path, rag, opt, &seed_trace);
-        if (ingested > 0) {
-            std::cerr << "Seeded " << ingested << " document(s) from " << opt.docs_path << "\n";
-        }
-        log_event("rag.db", "ready=1 doc_count=" + std::to_string(rag.doc_count()) +
-                              " chunk_count=" + std::to_string(rag.chunk_count()) +
-                              " seeded=" + std::to_string(ingested));
-    } else {
-        log_event("rag.db", "ready=1 doc_count=" + std::to_string(rag.doc_count()) +
-                              " chunk_count=" + std::to_string(rag.chunk_count()));
     }
-
-    std::unique_ptr<ncnn_llm_gpt> model;
-    if (opt.llm_backend == LlmBackend::Local) {
-        model = std::make_unique<ncnn_llm_gpt>(opt.model_path, use_vulkan_runtime);
+    DocsSyncWorker docs_sync(rag, rag_mutex, opt);
+    RagMaintenanceWorker rag_maintenance(rag, rag_mutex, opt);
+    // Seeding from --docs runs while the server is already up: /rag/* serves the documents
+    // already in the DB (and new ones as they are ingested). It ingests one document at a time
+    // rather than in bulk mode, so concurrent /rag/* writes and deletes never land in a bulk
+    // load. The periodic workers start after it.
+    std::atomic<bool> rag_seeding{false};
+    std::thread rag_seed_thread;
+    if (rag_ready && !rag.read_only()) {
+        rag_seeding = true;
+        rag_seed_thread = std::thread([&]() {
+            std::vector<std::string> sync_trace;
+            auto t0 = std::chrono::steady_clock::now();
+            DocsSyncStats stats = sync_docs_directory(opt.docs_path, rag, rag_mutex, opt, false, &sync_trace);
+            int64_t elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - t0).count();
+            if (stats.added + stats.updated > 0) {
+                std::cerr << "Synced " << (stats.added + stats.updated) << " document(s) from " << opt.docs_path << "\n";
+            }
+            for (const auto& line : sync_trace) {
+                if (line.rfind("skip ", 0) == 0 || line.rfind("warn", 0) == 0) log_event("rag.sync.trace", line);
+            }
+            {
+                std::lock_guard<std::mutex> lock(rag_mutex);
+                log_event("rag.db", "ready=1 doc_count=" + std::to_string(rag.doc_count()) +
+                                      " chunk_count=" + std::to_string(rag.chunk_count()) +
+                                      " shards=" + std::to_string(rag.shard_count()) +
+                                      " " + summarize_sync(stats) +
+                                      " sync_ms=" + std::to_string(elapsed_ms));
+            }
+            rag_seeding = false;
+            docs_sync.start();
+            rag_maintenance.start();
+        });
+    }
+    std::atomic<bool> rag_compacting{false};
+    // Named collections live under <data>/collections, one store and lock each; "default" is --db.
+    RagCollections rag_collections((data_root / "collections").string(),
+                                   opt.embed_dim,
+                                   opt.rag_near_dup_bits,
+                                   static_cast<size_t>(opt.rag_max_collections));
+    rag_collections.add_default(&rag, &rag_mutex);
+
+    // ncnn_llm_gpt loads its own copy of the weights, so every replica costs one model's memory.
+    // Filled by the loader thread below; declared first so it outlives the schedulers.
+    std::vector<std::unique_ptr<ncnn_llm_gpt>> models;
+    // Declared before the caches: every Mat allocated from the pool must be gone before it is.
+    LlmKvPool kv_pool(opt.kv_snapshot_pool_mb * 1024 * 1024, kKvPoolBlockBytes);
+    ncnn::Allocator* kv_allocator = kv_pool.enabled() ? &kv_pool : nullptr;
+    if (kv_pool.enabled()) {
+        LlmKvPoolStats ps = kv_pool.stats();
+        log_event("kv_snapshot_pool.init", "bytes=" + std::to_string(ps.arena_bytes) + " blocks=" + std::to_string(ps.blocks_total));
+    }
+    if (opt.kv_store != KvStoreMode::Float32) {
+        log_event("kv.store", "mode=" + std::string(kv_store_mode_name(opt.kv_store)) +
+                              " scope=cached_snapshots live_kv=fp32");
+    }
+    LlmPrefixCache prefix_cache(opt.llm_prefix_cache_mb * 1024 * 1024, opt.kv_store, kv_allocator);
+    LlmSessionCache session_cache(opt.llm_session_cache_mb * 1024 * 1024, opt.llm_session_idle_sec, opt.kv_store, kv_allocator);
+    // Calibrated by the local model's prompt token counts; with the API backend it keeps its defaults.
+    TokenEstimator token_estimator;
+    std::unique_ptr<PrefillTuner> prefill_tuner;
+    if (local_llm && opt.llm_prefill_auto) {
+        // The choice depends on the model and the device it runs on, so both make up the key.
+        const std::string tune_key = opt.model_path + (use_vulkan_runtime ? "#vulkan" : "#cpu") +
+                                     (replica_threads[0] > 0 ? "#t" + std::to_string(replica_threads[0]) : std::string());
+        prefill_tuner = std::make_unique<PrefillTuner>((data_root / "prefill_tune.json").string(),
+                                                       tune_key,
+                                                       opt.llm_prefill_mem_limit_mb * 1024 * 1024);
+        log_event("prefill.tune", "tuned=" + std::string(prefill_tuner->tuned() ? "1" : "0") +
+                                  " chunk_tokens=" + std::to_string(prefill_tuner->chunk_tokens()) +
+                                  " mem_limit_mb=" + std::to_string(opt.llm_prefill_mem_limit_mb));
+    }
+    PrefillChunking prefill_chunking;
+    prefill_chunking.bytes = opt.llm_prefill_chunk_bytes;
+    prefill_chunking.tokens = opt.llm_prefill_chunk_tokens;
+    prefill_chunking.estimator = &token_estimator;
+    prefill_chunking.tuner = prefill_tuner.get();
+    // Replicas are added by the loader thread; until llm_ready is set, chat answers 503 and
+    // nothing else touches the dispatcher.
+    LlmDispatcher dispatcher;
+    std::atomic<bool> llm_ready{!local_llm};
+    std::atomic<int64_t> llm_load_ms{0};
+    std::unique_ptr<WarmupQueryLog> warmup_log;
+    std::vector<WarmupQuery> warmup_replay;
+    if (opt.warmup_replay > 0) {
+        warmup_log = std::make_unique<WarmupQueryLog>((data_root / "warmup_queries.json").string(), opt.warmup_replay);
+        if (opt.warmup) warmup_replay = warmup_log->load();
+    }
+    std::thread model_load_thread;
+    if (local_llm) {
+        model_load_thread = std::thread([&]() {
+            auto load_start = std::chrono::steady_clock::now();
+            size_t hinted = prefetch_model_files(opt.model_path);
+            log_event("model.prefetch", "bytes=" + std::to_string(hinted));
+            models.resize(static_cast<size_t>(opt.model_replicas));
+            for (size_t i = 0; i < models.size(); ++i) {
+                // Loaded one at a time, each on a thread pinned like its replica, so first-touch
+                // places the weights on the replica's NUMA node.
+                std::thread loader([&, i]() {
+                    if (i < affinity.replicas.size()) pin_current_thread(affinity.replicas[i]);
+                    auto t0 = std::chrono::steady_clock::now();
+                    models[i] = std::make_unique<ncnn_llm_gpt>(opt.model_path, use_vulkan_runtime);
+                    int64_t elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - t0).count();
+                    log_event("model.replica", "idx=" + std::to_string(i) + " threads=" + std::to_string(replica_threads[i]) +
+                                               " load_ms=" + std::to_string(elapsed_ms));
+                });
+                loader.join();
+                dispatcher.add(std::make_unique<LlmScheduler>(models[i].get(), opt, prefix_cache, session_cache, prefill_chunking, i,
+                                                              replica_threads[i],
+                                                              i < affinity.replicas.size() ? affinity.replicas[i] : std::vector<int>()));
+            }
+            dispatcher.start();
+            llm_load_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - load_start).count();
+            if (opt.warmup) {
+                run_startup_warmup(opt, &dispatcher, token_estimator, rag, rag_mutex, rag_ready, embedder, warmup_replay);
+            }
+            llm_ready = true;
+            log_event("model.ready", "replicas=" + std::to_string(models.size()) + " load_ms=" + std::to_string(llm_load_ms.load()));
+        });
+    } else if (opt.warmup) {
+        model_load_thread = std::thread([&]() {
+            run_startup_warmup(opt, nullptr, token_estimator, rag, rag_mutex, rag_ready, embedder, warmup_replay);
+        });
     }
-    std::mutex model_mutex;
+    std::atomic<uint64_t> upstream_streams_cancelled{0};
 
     httplib::Server server;
     // Avoid silent hangs when clients stall (common on Windows with AV/proxy).
-    // Note: handlers are invoked only after the full request body is received.
+    // Note: handlers are invoked only after the full request body is received (except /rag/upload,
+    // which streams its body through a content reader).
     server.set_read_timeout(std::chrono::seconds(120));
     server.set_payload_max_length(256ULL * 1024 * 1024);
     server.set_exception_handler([&](const httplib::Request& req, httplib::Response& res, std::exception_ptr ep) {
@@ -1983,6 +3933,39 @@ int main(int argc, char** argv) {
             std::cerr << "Warning: failed to mount web root at " << opt.web_root << " (fallback to embedded)\n";
         }
     }
+    // Pins the collection a request names (empty = the --db store) and writes the error response
+    // when it cannot be used.
+    auto resolve_rag_collection = [&](const std::string& name,
+                                      bool create,
+                                      RagCollections::Handle* out,
+                                      httplib::Response& res,
+                                      const std::string& log_tag) -> bool {
+        if (!is_named_collection(name) && !rag_ready) {
+            res.status = 500;
+            std::string msg = "RAG database not ready";
+            if (!rag_open_err.empty()) msg += ": " + rag_open_err;
+            res.set_content(dump_json_safe(make_error(500, msg)), "application/json");
+            log_event(log_tag, "rag_not_ready");
+            return false;
+        }
+        if (is_named_collection(name) && !opt.import_pack.empty()) {
+            res.status = 403;
+            res.set_content(dump_json_safe(make_error(403, "named collections are not available on an index pack node")), "application/json");
+            log_event(log_tag, "read_only_pack collection=" + name);
+            return false;
+        }
+        std::string err;
+        bool not_found = false;
+        if (!rag_collections.acquire(name, create, out, &not_found, &err)) {
+            int status = not_found ? 404 : (RagCollections::valid_name(name) ? 500 : 400);
+            res.status = status;
+            res.set_content(dump_json_safe(make_error(status, err)), "application/json");
+            log_event(log_tag, "collection=" + name + " err=" + err);
+            return false;
+        }
+        return true;
+    };
+
     if (!mounted_web_root) {
         auto serve_embedded = [&](const httplib::Request& req, httplib::Response& res) {
             ncnn_llm_rag_demo_web::AssetView asset;
@@ -2032,7 +4015,8 @@ int main(int argc, char** argv) {
                 log_event("mcp.call.error", "unknown_tool name=" + name);
                 return;
             }
-            if (!rag_ready) {
+            const std::string collection = args.value("collection", std::string());
+            if (!is_named_collection(collection) && !rag_ready) {
                 res.status = 500;
                 std::string msg = "RAG database not ready";
                 if (!rag_open_err.empty()) msg += ": " + rag_open_err;
@@ -2053,12 +4037,15 @@ int main(int argc, char** argv) {
             log_event("mcp.call", "name=" + name +
                                   " query_len=" + std::to_string(query.size()) +
                                   " query=\"" + truncate_for_log(query, 200) + "\"" +
-                                  " top_k=" + std::to_string(top_k));
+                                  " top_k=" + std::to_string(top_k) +
+                                  " collection=" + collection_label(collection));
 
+            RagCollections::Handle col;
+            if (!resolve_rag_collection(collection, false, &col, res, "mcp.call.error")) return;
             json result;
             {
-                std::lock_guard<std::mutex> lock(rag_mutex);
-                result = rag_tool_call(args, rag, embedder, opt.rag_top_k, opt.rag_neighbor_chunks, opt.rag_chunk_max_chars);
+                std::lock_guard<std::mutex> lock(col.mutex());
+                result = rag_tool_call(args, col.db(), embedder, opt.rag_top_k, opt.rag_neighbor_chunks, opt.rag_chunk_max_chars);
             }
             size_t hit_count = 0;
             if (result.contains("chunks") && result["chunks"].is_array()) {
@@ -2079,33 +4066,99 @@ int main(int argc, char** argv) {
         }
     });
 
-    server.Post("/rag/upload", [&](const httplib::Request& req, httplib::Response& res) {
-        if (!req.is_multipart_form_data() || !req.has_file("file")) {
+    // Uploads are read through the content reader so the multipart body is streamed to disk in
+    // small pieces instead of being buffered whole by httplib (up to the 256 MB payload limit).
+    server.Post("/rag/upload", [&](const httplib::Request& req, httplib::Response& res, const httplib::ContentReader& content_reader) {
+        if (!req.is_multipart_form_data()) {
             res.status = 400;
             res.set_content(dump_json_safe(make_error(400, "multipart file field 'file' required")), "application/json");
             log_event("rag.upload.error", "invalid_form");
             return;
         }
-        if (!rag_ready) {
-            res.status = 500;
-            std::string msg = "RAG database not ready";
-            if (!rag_open_err.empty()) msg += ": " + rag_open_err;
-            res.set_content(dump_json_safe(make_error(500, msg)), "application/json");
-            log_event("rag.upload.error", "rag_not_ready");
+        const std::string collection = req.get_param_value("collection");
+        RagCollections::Handle col;
+        if (!resolve_rag_collection(collection, true, &col, res, "rag.upload.error")) return;
+        if (col.db().read_only()) {
+            res.status = 403;
+            res.set_content(dump_json_safe(make_error(403, "RAG store is a read-only index pack")), "application/json");
+            log_event("rag.upload.error", "read_only_pack");
             return;
         }
 
-        const auto file = req.get_file_value("file");
-        std::string filename = file.filename.empty() ? "upload.txt" : file.filename;
-        std::string ext = file_ext_lower(filename);
-        if (ext != ".txt" && ext != ".pdf") {
+        std::string filename;
+        std::string ext;
+        std::filesystem::path partpath;
+        std::ofstream ofs;
+        bool has_file = false;
+        bool in_file = false;
+        bool bad_ext = false;
+        bool write_ok = true;
+        uint64_t received = 0;
+        bool read_ok = content_reader(
+            [&](const httplib::MultipartFormData& field) {
+                in_file = false;
+                if (field.name != "file" || has_file) return true;
+                has_file = true;
+                filename = field.filename.empty() ? "upload.txt" : field.filename;
+                ext = file_ext_lower(filename);
+                if (ext != ".txt" && ext != ".pdf") {
+                    bad_ext = true;
+                    return false;
+                }
+                std::string base = std::to_string(now_ms_epoch());
+                partpath = upload_dir / path_from_utf8(base + ext + ".part");
+                std::error_code exists_ec;
+                for (int i = 1; std::filesystem::exists(partpath, exists_ec) && i < 1000; ++i) {
+                    partpath = upload_dir / path_from_utf8(base + "_" + std::to_string(i) + ext + ".part");
+                }
+                ofs.open(partpath, std::ios::binary);
+                write_ok = static_cast<bool>(ofs);
+                in_file = true;
+                return write_ok;
+            },
+            [&](const char* data, size_t data_length) {
+                if (!in_file) return true;
+                ofs.write(data, static_cast<std::streamsize>(data_length));
+                received += data_length;
+                write_ok = static_cast<bool>(ofs);
+                return write_ok;
+            });
+        ofs.close();
+
+        auto remove_part = [&]() {
+            if (partpath.empty()) return;
+            std::error_code rm_ec;
+            std::filesystem::remove(partpath, rm_ec);
+        };
+        if (bad_ext) {
             res.status = 400;
             res.set_content(dump_json_safe(make_error(400, "only .txt and .pdf are supported")), "application/json");
             log_event("rag.upload.error", "unsupported_ext filename=" + filename + " ext=" + ext);
             return;
         }
+        if (!has_file) {
+            res.status = 400;
+            res.set_content(dump_json_safe(make_error(400, "multipart file field 'file' required")), "application/json");
+            log_event("rag.upload.error", "invalid_form");
+            return;
+        }
+        if (!write_ok) {
+            remove_part();
+            res.status = 500;
+            res.set_content(dump_json_safe(make_error(500, "failed to write file")), "application/json");
+            log_event("rag.upload.error", "write_failed path=" + partpath.string());
+            return;
+        }
+        if (!read_ok) {
+            remove_part();
+            res.status = 400;
+            res.set_content(dump_json_safe(make_error(400, "failed to read upload body")), "application/json");
+            log_event("rag.upload.error", "read_failed filename=" + filename + " received=" + std::to_string(received));
+            return;
+        }
 
-        log_event("rag.upload", "filename=" + filename + " size=" + std::to_string(file.content.size()));
+        log_event("rag.upload", "filename=" + filename + " size=" + std::to_string(received) +
+                                    " collection=" + collection_label(collection));
 
         size_t doc_id = 0;
         size_t chunks = 0;
@@ -2113,70 +4166,51 @@ int main(int argc, char** argv) {
         size_t chunk_count = 0;
         std::string err;
         std::vector<std::string> trace;
+        trace.push_back("streamed upload to disk (" + std::to_string(received) + " bytes)");
+
+        std::filesystem::path outpath = partpath;
+        if (ext == ".pdf") {
+            // Keep uploaded PDFs next to their exported text, as before.
+            outpath.replace_extension();
+            std::error_code rename_ec;
+            std::filesystem::rename(partpath, outpath, rename_ec);
+            if (rename_ec) {
+                remove_part();
+                res.status = 500;
+                res.set_content(dump_json_safe(make_error(500, "failed to write file")), "application/json");
+                log_event("rag.upload.error", "rename_failed err=" + rename_ec.message());
+                return;
+            }
+            trace.push_back("saved to " + outpath.string());
+        }
 
+        bool ok = false;
         {
-            std::lock_guard<std::mutex> lock(rag_mutex);
-            if (ext == ".txt") {
-                trace.push_back("read content (in-memory)");
-                std::string text = file.content;
-                std::string norm_err;
-                if (!normalize_utf8(&text, &norm_err)) {
-                    res.status = 500;
-                    res.set_content(dump_json_safe(make_error(500, norm_err)), "application/json");
-                    log_event("rag.upload.error", "normalize_failed err=" + norm_err);
-                    return;
-                }
-                text = trim_text(text);
-                if (text.empty()) {
-                    res.status = 500;
-                    res.set_content(dump_json_safe(make_error(500, "empty text file")), "application/json");
-                    log_event("rag.upload.error", "empty_text");
-                    return;
-                }
-                trace.push_back("add document");
-                if (!rag.add_document(filename, "text/plain", text, opt.chunk_size, &err, &doc_id, &chunks)) {
-                    res.status = 500;
-                    res.set_content(dump_json_safe(make_error(500, err)), "application/json");
-                    log_event("rag.upload.error", "add_doc_failed err=" + err);
-                    return;
-                }
-            } else {
-                std::string base = std::to_string(now_ms_epoch());
-                std::string stored = base + ext;
-                std::filesystem::path outpath = upload_dir / path_from_utf8(stored);
-                std::error_code exists_ec;
-                for (int i = 1; std::filesystem::exists(outpath, exists_ec) && i < 1000; ++i) {
-                    outpath = upload_dir / path_from_utf8(base + "_" + std::to_string(i) + ext);
-                }
-
-                if (!write_file(outpath, file.content, &err)) {
-                    res.status = 500;
-                    res.set_content(dump_json_safe(make_error(500, err)), "application/json");
-                    log_event("rag.upload.error", "write_failed err=" + err);
-                    return;
-                }
-                trace.push_back("saved to " + outpath.string());
-
-                if (!ingest_document(filename,
-                                     "application/pdf",
-                                     outpath,
-                                     rag,
-                                     opt,
-                                     &trace,
-                                     &doc_id,
-                                     &chunks,
-                                     &err)) {
-                    res.status = 500;
-                    res.set_content(dump_json_safe(make_error(500, err)), "application/json");
-                    log_event("rag.upload.error", "ingest_failed err=" + err);
-                    return;
-                }
-            }
-            doc_count = rag.doc_count();
-            chunk_count = rag.chunk_count();
+            // Only this collection's lock is held, so ingest never stalls queries on other collections.
+            std::lock_guard<std::mutex> lock(col.mutex());
+            ok = ingest_document(filename,
+                                 ext == ".pdf" ? "application/pdf" : "text/plain",
+                                 outpath,
+                                 col.db(),
+                                 opt,
+                                 &trace,
+                                 &doc_id,
+                                 &chunks,
+                                 &err);
+            doc_count = col.db().doc_count();
+            chunk_count = col.db().chunk_count();
+        }
+        // Text uploads are only indexed, not kept.
+        if (ext == ".txt") remove_part();
+        if (!ok) {
+            res.status = 500;
+            res.set_content(dump_json_safe(make_error(500, err)), "application/json");
+            log_event("rag.upload.error", "ingest_failed err=" + err);
+            return;
         }
 
         log_event("rag.upload.done", "filename=" + filename +
+                                     " collection=" + collection_label(collection) +
                                      " doc_id=" + std::to_string(doc_id) +
                                      " chunks=" + std::to_string(chunks) +
                                      " doc_count=" + std::to_string(doc_count) +
@@ -2188,10 +4222,12 @@ int main(int argc, char** argv) {
                 {"id", doc_id},
                 {"filename", filename},
                 {"mime", ext == ".pdf" ? "application/pdf" : "text/plain"},
-                {"chunks", chunks}
+                {"chunks", chunks},
+                {"url", doc_url(doc_id, collection)}
             }},
             {"trace", trace},
             {"rag", {
+                {"collection", collection_label(collection)},
                 {"doc_count", doc_count},
                 {"chunk_count", chunk_count}
             }}
@@ -2199,35 +4235,64 @@ int main(int argc, char** argv) {
         res.set_content(dump_json_safe(resp), "application/json");
     });
 
-    server.Get("/rag/info", [&](const httplib::Request&, httplib::Response& res) {
+    server.Get("/rag/info", [&](const httplib::Request& req, httplib::Response& res) {
+        const std::string collection = req.get_param_value("collection");
+        RagCollections::Handle col;
+        if (is_named_collection(collection) && !resolve_rag_collection(collection, false, &col, res, "rag.info.error")) return;
+        RagVectorDb& db = col ? col.db() : rag;
+        std::mutex& db_mutex = col ? col.mutex() : rag_mutex;
+        const bool ready = col ? true : rag_ready;
         size_t doc_count = 0;
         size_t chunk_count = 0;
+        size_t vector_count = 0;
+        size_t near_dup_count = 0;
+        int64_t free_pages = 0;
+        int schema_version = 0;
         int embed_dim = 0;
         {
-            std::lock_guard<std::mutex> lock(rag_mutex);
-            doc_count = rag.doc_count();
-            chunk_count = rag.chunk_count();
-            embed_dim = rag.embed_dim();
+            std::lock_guard<std::mutex> lock(db_mutex);
+            doc_count = db.doc_count();
+            chunk_count = db.chunk_count();
+            vector_count = db.vector_count();
+            near_dup_count = db.near_dup_count();
+            free_pages = db.free_pages();
+            schema_version = db.schema_version();
+            embed_dim = db.embed_dim();
         }
+        size_t exact_dups = chunk_count > vector_count ? chunk_count - vector_count : 0;
         json info = {
-            {"enabled", opt.rag_enabled && rag_ready},
-            {"ready", rag_ready},
+            {"enabled", opt.rag_enabled && ready},
+            {"ready", ready},
+            {"seeding", !col && rag_seeding.load()},
+            {"collection", collection_label(collection)},
+            {"collections_loaded", rag_collections.loaded_count()},
+            {"collections_max_loaded", rag_collections.max_loaded()},
             {"doc_count", doc_count},
             {"chunk_count", chunk_count},
-            {"embed_dim", embed_dim}
+            {"embed_dim", embed_dim},
+            {"read_only", db.read_only()},
+            {"shards", db.shard_count()},
+            {"free_pages", free_pages},
+            {"schema_version", schema_version},
+            {"migration_pending", !db.read_only() && schema_version < RagVectorDb::kSchemaVersion},
+            {"dedup", {
+                {"stored_vectors", vector_count},
+                {"exact_duplicate_chunks", exact_dups},
+                {"near_duplicate_chunks", near_dup_count},
+                {"near_dup_bits", opt.rag_near_dup_bits},
+                // Share of chunks that needed no vector of their own / that search collapses away.
+                {"exact_ratio", chunk_count ? static_cast<double>(exact_dups) / chunk_count : 0.0},
+                {"total_ratio", chunk_count ? static_cast<double>(exact_dups + near_dup_count) / chunk_count : 0.0}
+            }}
         };
-        if (!rag_ready && !rag_open_err.empty()) info["error"] = rag_open_err;
+        if (!ready && !rag_open_err.empty()) info["error"] = rag_open_err;
         res.set_content(dump_json_safe(info), "application/json");
     });
 
     server.Get("/rag/docs", [&](const httplib::Request& req, httplib::Response& res) {
-        if (!rag_ready) {
-            res.status = 500;
-            std::string msg = "RAG database not ready";
-            if (!rag_open_err.empty()) msg += ": " + rag_open_err;
-            res.set_content(dump_json_safe(make_error(500, msg)), "application/json");
-            return;
-        }
+        const std::string collection = req.get_param_value("collection");
+        RagCollections::Handle col;
+        if (!resolve_rag_collection(collection, false, &col, res, "rag.docs.error")) return;
         size_t limit = 200;
         if (auto it = req.params.find("limit"); it != req.params.end()) {
             if (auto v = parse_int(it->second)) {
@@ -2236,10 +4301,10 @@ int main(int argc, char** argv) {
         }
         std::vector<RagDocInfo> docs;
         {
-            std::lock_guard<std::mutex> lock(rag_mutex);
-            docs = rag.list_docs(limit, 0);
+            std::lock_guard<std::mutex> lock(col.mutex());
+            docs = col.db().list_docs(limit, 0);
         }
-        json out = {{"docs", json::array()}};
+        json out = {{"collection", collection_label(collection)}, {"docs", json::array()}};
         for (const auto& d : docs) {
             out["docs"].push_back({
                 {"id", d.id},
@@ -2247,20 +4312,40 @@ int main(int argc, char** argv) {
                 {"mime", sanitize_utf8_strict(d.mime)},
                 {"added_at", d.added_at},
                 {"chunk_count", d.chunk_count},
-                {"url", "/rag/doc/" + std::to_string(d.id)}
+                {"url", doc_url(d.id, collection)}
             });
         }
         res.set_content(dump_json_safe(out), "application/json");
     });
 
-    server.Delete(R"(/rag/doc/(\d+))", [&](const httplib::Request& req, httplib::Response& res) {
-        if (!rag_ready) {
-            res.status = 500;
-            std::string msg = "RAG database not ready";
-            if (!rag_open_err.empty()) msg += ": " + rag_open_err;
-            res.set_content(dump_json_safe(make_error(500, msg)), "application/json");
-            return;
+    server.Get("/rag/collections", [&](const httplib::Request&, httplib::Response& res) {
+        json out = {
+            {"loaded", rag_collections.loaded_count()},
+            {"max_loaded", rag_collections.max_loaded()},
+            {"collections", json::array()}
+        };
+        for (const auto& c : rag_collections.list()) {
+            if (c.is_default && !rag_ready) continue;
+            json item = {
+                {"name", c.name},
+                {"default", c.is_default},
+                {"loaded", c.loaded},
+                {"last_used_ms", c.last_used_ms}
+            };
+            // Counts are only known for open collections; listing never loads a cold one.
+            if (c.loaded) {
+                item["doc_count"] = c.doc_count;
+                item["chunk_count"] = c.chunk_count;
+            }
+            out["collections"].push_back(std::move(item));
         }
+        res.set_content(dump_json_safe(out), "application/json");
+    });
+
+    server.Delete(R"(/rag/doc/(\d+))", [&](const httplib::Request& req, httplib::Response& res) {
+        const std::string collection = req.get_param_value("collection");
+        RagCollections::Handle col;
+        if (!resolve_rag_collection(collection, false, &col, res, "rag.doc.delete.error")) return;
         size_t doc_id = 0;
         try {
             doc_id = static_cast<size_t>(std::stoull(req.matches[1]));
@@ -2274,15 +4359,15 @@ int main(int argc, char** argv) {
         size_t doc_count = 0;
         size_t chunk_count = 0;
         {
-            std::lock_guard<std::mutex> lock(rag_mutex);
-            if (!rag.delete_doc(doc_id, &err)) {
+            std::lock_guard<std::mutex> lock(col.mutex());
+            if (!col.db().delete_doc(doc_id, &err)) {
                 res.status = 404;
                 res.set_content(dump_json_safe(make_error(404, err)), "application/json");
                 log_event("rag.doc.delete.error", "doc_id=" + std::to_string(doc_id) + " err=" + err);
                 return;
             }
-            doc_count = rag.doc_count();
-            chunk_count = rag.chunk_count();
+            doc_count = col.db().doc_count();
+            chunk_count = col.db().chunk_count();
         }
 
         json out = {
@@ -2292,16 +4377,101 @@ int main(int argc, char** argv) {
             {"chunk_count", chunk_count}
         };
         res.set_content(dump_json_safe(out), "application/json");
-        log_event("rag.doc.delete", "doc_id=" + std::to_string(doc_id));
+        log_event("rag.doc.delete", "doc_id=" + std::to_string(doc_id) + " collection=" + collection_label(collection));
     });
 
-    server.Get(R"(/rag/doc/(\d+))", [&](const httplib::Request& req, httplib::Response& res) {
-        if (!rag_ready) {
+    // Rewrites vector storage in chunk order and releases free pages. Runs in batches with the
+    // RAG lock dropped in between, so searches keep being served; ?full=1 does a blocking VACUUM
+    // instead (needed once to switch DBs created before auto_vacuum=INCREMENTAL).
+    server.Post("/rag/compact", [&](const httplib::Request& req, httplib::Response& res) {
+        const std::string collection = req.get_param_value("collection");
+        RagCollections::Handle col;
+        if (!resolve_rag_collection(collection, false, &col, res, "rag.compact.error")) return;
+        RagVectorDb& db = col.db();
+        if (db.read_only()) {
+            res.status = 403;
+            res.set_content(dump_json_safe(make_error(403, "index pack is read-only")), "application/json");
+            return;
+        }
+        if (rag_compacting.exchange(true)) {
+            res.status = 409;
+            res.set_content(dump_json_safe(make_error(409, "compaction already running")), "application/json");
+            return;
+        }
+        struct CompactGuard {
+            std::atomic<bool>& flag;
+            ~CompactGuard() { flag = false; }
+        } guard{rag_compacting};
+
+        bool full = false;
+        if (auto it = req.params.find("full"); it != req.params.end()) {
+            full = (it->second == "1" || it->second == "true");
+        }
+        auto t0 = std::chrono::steady_clock::now();
+        std::string err;
+        size_t rows = 0;
+        int64_t free_before = 0;
+        int64_t free_after = 0;
+        bool ok = true;
+        if (full) {
+            std::lock_guard<std::mutex> lock(col.mutex());
+            free_before = db.free_pages();
+            ok = db.vacuum_full(&err);
+            rows = db.vector_count();
+            free_after = db.free_pages();
+        } else {
+            {
+                std::lock_guard<std::mutex> lock(col.mutex());
+                free_before = db.free_pages();
+                ok = db.begin_compact(&err);
+            }
+            bool done = false;
+            while (ok && !done) {
+                std::lock_guard<std::mutex> lock(col.mutex());
+                ok = db.compact_step(2048, &done, &err);
+                if (!ok) db.abort_compact();
+            }
+            if (ok) {
+                std::lock_guard<std::mutex> lock(col.mutex());
+                ok = db.finish_compact(&rows, &err);
+            }
+            if (ok) {
+                vacuum_free_pages(db, col.mutex(), 0, &err);
+                std::lock_guard<std::mutex> lock(col.mutex());
+                free_after = db.free_pages();
+            }
+        }
+        int64_t elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - t0).count();
+        if (!ok) {
             res.status = 500;
-            res.set_content("RAG database not ready", "text/plain; charset=utf-8");
+            res.set_content(dump_json_safe(make_error(500, err)), "application/json");
+            log_event("rag.compact.error", "err=" + err);
             return;
         }
 
+        json out = {
+            {"ok", true},
+            {"collection", collection_label(collection)},
+            {"full", full},
+            {"vector_rows", rows},
+            {"free_pages_before", free_before},
+            {"free_pages_after", free_after},
+            {"incremental_vacuum", db.incremental_vacuum_enabled()},
+            {"elapsed_ms", elapsed_ms}
+        };
+        res.set_content(dump_json_safe(out), "application/json");
+        log_event("rag.compact", "collection=" + collection_label(collection) +
+                                     " full=" + std::to_string(full ? 1 : 0) + " rows=" + std::to_string(rows) +
+                                     " free_pages_before=" + std::to_string(free_before) +
+                                     " free_pages_after=" + std::to_string(free_after) +
+                                     " elapsed_ms=" + std::to_string(elapsed_ms));
+    });
+
+    server.Get(R"(/rag/doc/(\d+))", [&](const httplib::Request& req, httplib::Response& res) {
+        const std::string collection = req.get_param_value("collection");
+        RagCollections::Handle col;
+        if (!resolve_rag_collection(collection, false, &col, res, "rag.doc.error")) return;
+
         size_t doc_id = 0;
         try {
             doc_id = static_cast<size_t>(std::stoull(req.matches[1]));
@@ -2315,8 +4485,8 @@ int main(int argc, char** argv) {
         std::vector<RagSearchHit> chunks;
         std::string err;
         {
-            std::lock_guard<std::mutex> lock(rag_mutex);
-            if (!rag.get_document_chunks(doc_id, &filename, &chunks, &err)) {
+            std::lock_guard<std::mutex> lock(col.mutex());
+            if (!col.db().get_document_chunks(doc_id, &filename, &chunks, &err)) {
                 res.status = 404;
                 res.set_content("document not found", "text/plain; charset=utf-8");
                 log_event("rag.doc.error", "doc_id=" + std::to_string(doc_id) + " err=" + err);
@@ -2352,7 +4522,85 @@ int main(int argc, char** argv) {
         log_event("rag.doc", "doc_id=" + std::to_string(doc_id) + " chunks=" + std::to_string(chunks.size()));
     });
 
+    server.Get("/llm/stats", [&](const httplib::Request&, httplib::Response& res) {
+        // The loader thread is still adding replicas until llm_ready is set.
+        LlmSchedulerStats sched = llm_ready ? dispatcher.stats() : LlmSchedulerStats();
+        LlmPrefixCacheStats prefix = prefix_cache.stats();
+        LlmSessionCacheStats sessions = session_cache.stats();
+        json out = {
+            {"backend", opt.llm_backend == LlmBackend::Local ? "local" : "api"},
+            {"ready", llm_ready.load()},
+            {"load_ms", llm_load_ms.load()},
+            {"kv_store", kv_store_mode_name(opt.kv_store)},
+            {"kv_snapshot_pool", kv_snapshot_pool_json(kv_pool)},
+            {"scheduler", {
+                {"queued", sched.queued},
+                {"active", sched.active},
+                {"max_active", opt.sched_max_active},
+                {"slice_tokens", opt.sched_slice_tokens},
+                {"completed", sched.completed},
+                {"cancelled", sched.cancelled},
+                {"cancelled_tokens_saved", sched.cancelled_tokens_saved},
+                {"queue_wait_ms_avg", sched.queue_wait_ms_avg()},
+                {"queue_wait_ms_max", sched.queue_wait_ms_max}
+            }},
+            {"upstream", {{"streams_cancelled", upstream_streams_cancelled.load()}}},
+            {"prefix_cache", {
+                {"hits", prefix.hits},
+                {"misses", prefix.misses},
+                {"saved_tokens", prefix.saved_tokens},
+                {"entries", prefix.entries},
+                {"bytes", prefix.bytes},
+                {"budget_bytes", prefix.budget_bytes}
+            }},
+            {"session_cache", {
+                {"hits", sessions.hits},
+                {"misses", sessions.misses},
+                {"evictions", sessions.evictions},
+                {"idle_evictions", sessions.idle_evictions},
+                {"sessions", sessions.sessions},
+                {"bytes", sessions.bytes},
+                {"budget_bytes", sessions.budget_bytes}
+            }}
+        };
+        if (llm_ready && dispatcher.size() > 1) {
+            json replicas = json::array();
+            for (const auto& st : dispatcher.replica_stats()) {
+                replicas.push_back({{"queued", st.queued},
+                                    {"active", st.active},
+                                    {"completed", st.completed},
+                                    {"queue_wait_ms_avg", st.queue_wait_ms_avg()},
+                                    {"queue_wait_ms_max", st.queue_wait_ms_max}});
+            }
+            out["scheduler"]["threads_per_replica"] = replica_threads;
+            out["scheduler"]["replicas"] = std::move(replicas);
+        }
+        json prefill = {{"chunk_bytes", prefill_chunking.bytes}, {"chunk_tokens", prefill_chunking.chunk_tokens()}};
+        if (prefill_tuner) {
+            json candidates = json::array();
+            for (const auto& c : prefill_tuner->candidates()) {
+                candidates.push_back({{"chunk_tokens", c.chunk_tokens},
+                                      {"chunks", c.chunks},
+                                      {"tokens_per_sec", c.tokens_per_sec()},
+                                      {"peak_rss_bytes", c.peak_rss_bytes},
+                                      {"over_limit", c.over_limit}});
+            }
+            prefill["auto"] = {{"tuned", prefill_tuner->tuned()},
+                               {"mem_limit_bytes", opt.llm_prefill_mem_limit_mb * 1024 * 1024},
+                               {"candidates", candidates}};
+        }
+        out["prefill"] = std::move(prefill);
+        res.set_content(dump_json_safe(out), "application/json");
+    });
+
     server.Post("/v1/chat/completions", [&](const httplib::Request& req, httplib::Response& res) {
+        if (!llm_ready) {
+            res.status = 503;
+            res.set_header("Retry-After", std::to_string(kModelLoadingRetryAfterSec));
+            res.set_content(dump_json_safe(make_error(503, "model is loading, retry shortly")), "application/json");
+            log_event("chat.error", "model_loading=1");
+            return;
+        }
         json body;
         try {
             body = json::parse(req.body);
@@ -2394,17 +4642,27 @@ int main(int argc, char** argv) {
             int v = body["rag_top_k"].get<int>();
             if (v > 0) rag_top_k = static_cast<size_t>(v);
         }
+        const std::string collection = body.value("collection", std::string());
         const bool stream = body.value("stream", false);
         const bool enable_thinking = body.value("enable_thinking", false);
         const std::string model_name = body.value("model", std::string("qwen3-0.6b"));
         const std::string resp_id = make_response_id();
 
+        // A named collection that cannot be opened fails the request; the default store keeps the
+        // old behaviour of answering without retrieval when it is not ready.
+        RagCollections::Handle rag_col;
+        if (!client_rag && rag_enabled && (rag_ready || is_named_collection(collection))) {
+            if (!resolve_rag_collection(collection, false, &rag_col, res, "chat.error")) return;
+        }
+        const bool rag_available = static_cast<bool>(rag_col);
+
         log_event("chat.request", "id=" + resp_id +
                                    " " + summarize_messages(messages, user_query) +
                                    " rag_mode=" + rag_mode +
                                    " rag_enabled=" + std::string(rag_enabled ? "1" : "0") +
                                    " rag_ready=" + std::string(rag_ready ? "1" : "0") +
                                    " rag_top_k=" + std::to_string(rag_top_k) +
+                                   " collection=" + collection_label(collection) +
                                    " stream=" + std::string(stream ? "1" : "0") +
                                    " thinking=" + std::string(enable_thinking ? "1" : "0") +
                                    " model=" + model_name);
@@ -2412,17 +4670,37 @@ int main(int argc, char** argv) {
         std::vector<std::string> rag_trace;
         std::string rag_error;
         std::vector<RagSearchHit> hits;
-        if (!client_rag && rag_enabled && rag_ready && !user_query.empty()) {
+        RagPackOptions rag_pack_opt;
+        rag_pack_opt.budget_tokens = opt.rag_context_tokens;
+        rag_pack_opt.min_score = opt.rag_min_score;
+        rag_pack_opt.max_per_doc = opt.rag_max_per_doc;
+        if (body.contains("rag_context_tokens") && body["rag_context_tokens"].is_number_integer()) {
+            rag_pack_opt.budget_tokens = static_cast<size_t>(std::max(0, body["rag_context_tokens"].get<int>()));
+        }
+        RagPackResult rag_pack;
+        bool rag_packed = false;
+        if (!client_rag && rag_enabled && rag_available && !user_query.empty()) {
             rag_trace.push_back("tokenize+embed");
             rag_trace.push_back("vector search");
             auto t0 = std::chrono::steady_clock::now();
             std::vector<float> qvec = embedder.embed(user_query);
             {
-                std::lock_guard<std::mutex> lock(rag_mutex);
-                hits = rag.search(qvec, rag_top_k);
+                std::lock_guard<std::mutex> lock(rag_col.mutex());
+                hits = rag_col.db().search(qvec, rag_top_k);
                 rag_trace.push_back("expand neighbors");
-                expand_hits_with_neighbors(rag, hits, opt.rag_neighbor_chunks, opt.rag_chunk_max_chars);
+                expand_hits_with_neighbors(rag_col.db(), hits, opt.rag_neighbor_chunks, opt.rag_chunk_max_chars);
             }
+            rag_trace.push_back("pack context");
+            rag_pack = pack_rag_hits(&hits, rag_pack_opt, token_estimator);
+            rag_packed = true;
+            log_event("rag.pack", "id=" + resp_id +
+                                  " candidates=" + std::to_string(rag_pack.candidates) +
+                                  " kept=" + std::to_string(hits.size()) +
+                                  " tokens=" + std::to_string(rag_pack.used_tokens) + "/" + std::to_string(rag_pack_opt.budget_tokens) +
+                                  " dropped_score=" + std::to_string(rag_pack.dropped_score) +
+                                  " dropped_doc_cap=" + std::to_string(rag_pack.dropped_doc_cap) +
+                                  " dropped_budget=" + std::to_string(rag_pack.dropped_budget) +
+                                  " truncated=" + std::string(rag_pack.truncated ? "1" : "0"));
             auto t1 = std::chrono::steady_clock::now();
             int64_t elapsed_ms = std::chrono::duration_cast<std::chrono::milliseconds>(t1 - t0).count();
             log_event("rag.search", "id=" + resp_id +
@@ -2436,7 +4714,7 @@ int main(int argc, char** argv) {
                 reason = "client_mode";
             } else if (!rag_enabled) {
                 reason = "disabled";
-            } else if (!rag_ready) {
+            } else if (!rag_available) {
                 reason = "db_not_ready";
                 rag_error = rag_open_err;
             } else if (user_query.empty()) {
@@ -2448,14 +4726,35 @@ int main(int argc, char** argv) {
             }
         }
 
+        // Sessions keep the previous turn's KV cache (local backend only). A request continues a
+        // session when its messages extend the ones the session ended with; the earlier turns are
+        // then rendered from the session's own copy so the prompt text lines up with the cache.
+        const std::string session_id = body.value("session_id", std::string());
+        const bool use_session = !session_id.empty() && opt.llm_backend == LlmBackend::Local && session_cache.enabled();
+        const std::vector<Message> client_messages = messages;
+        LlmSession session;
+        bool session_hit = false;
+        if (use_session && session_cache.take(session_id, &session)) {
+            session_hit = messages_extend(session.client_messages, client_messages);
+            if (!session_hit) session = LlmSession();
+        }
+
         std::string rag_context;
-        if (client_rag) {
+        if (!client_rag) rag_context = build_rag_context(hits);
+        if (session_hit) {
+            std::vector<Message> tail(client_messages.begin() + static_cast<std::ptrdiff_t>(session.client_messages.size()),
+                                      client_messages.end());
+            if (!client_rag && rag_enabled && rag_available) attach_rag_context(&tail, rag_context);
+            messages = session.prompt_messages;
+            messages.insert(messages.end(), tail.begin(), tail.end());
+        } else if (client_rag) {
             if (messages.empty() || messages.front().role != "system") {
                 messages.insert(messages.begin(), Message{"system", "You are a helpful assistant."});
             }
         } else {
-            rag_context = build_rag_context(hits);
-            std::string system_prompt = build_system_prompt(rag_context, rag_enabled && rag_ready);
+            const bool context_in_system = rag_enabled && rag_available && !use_session;
+            std::string system_prompt = build_system_prompt(context_in_system ? rag_context : std::string(), context_in_system);
+            if (use_session && rag_enabled && rag_available) attach_rag_context(&messages, rag_context);
 
             if (!messages.empty() && messages.front().role == "system") {
                 if (!messages.front().content.empty()) {
@@ -2477,20 +4776,46 @@ int main(int argc, char** argv) {
         } else {
             size_t doc_count = 0;
             size_t chunk_count = 0;
-            {
+            if (rag_col) {
+                std::lock_guard<std::mutex> lock(rag_col.mutex());
+                doc_count = rag_col.db().doc_count();
+                chunk_count = rag_col.db().chunk_count();
+            } else {
                 std::lock_guard<std::mutex> lock(rag_mutex);
                 doc_count = rag.doc_count();
                 chunk_count = rag.chunk_count();
             }
             rag_payload = build_rag_payload(hits,
-                                            rag_enabled && rag_ready,
+                                            rag_enabled && rag_available,
                                             rag_top_k,
                                             doc_count,
                                             chunk_count,
+                                            is_named_collection(collection) ? collection : std::string(),
                                             rag_trace.empty() ? nullptr : &rag_trace,
                                             rag_error.empty() ? nullptr : &rag_error);
+            if (rag_packed) {
+                rag_payload["context_tokens"] = rag_pack.used_tokens;
+                rag_payload["context_budget"] = rag_pack_opt.budget_tokens;
+                rag_payload["packing"] = {
+                    {"candidates", rag_pack.candidates},
+                    {"kept", hits.size()},
+                    {"dropped_score", rag_pack.dropped_score},
+                    {"dropped_doc_cap", rag_pack.dropped_doc_cap},
+                    {"dropped_budget", rag_pack.dropped_budget},
+                    {"truncated", rag_pack.truncated},
+                    {"estimator_scale", token_estimator.scale()}
+                };
+            }
+        }
+        // Unpin before generation so an idle collection can be unloaded while the model runs.
+        rag_col = RagCollections::Handle();
+
+        if (use_session) {
+            log_event("chat.session.lookup", "id=" + resp_id +
+                                             " session_id=" + truncate_for_log(session_id, 64) +
+                                             " continues=" + std::string(session_hit ? "1" : "0") +
+                                             " history=" + std::to_string(session.client_messages.size()));
         }
-
         log_event("prompt.build", "id=" + resp_id +
                                   " system_prompt_len=" + std::to_string(system_prompt_len) +
                                   " rag_context_len=" + std::to_string(rag_context.size()) +
@@ -2530,6 +4855,7 @@ int main(int argc, char** argv) {
                     "text/event-stream",
                     [&, headers, path, req_body, resp_id, rag_payload](size_t, httplib::DataSink& sink) mutable {
                         std::string stream_err;
+                        bool client_disconnected = false;
                         if (openai.base.scheme == "https") {
                             httplib::SSLClient cli(openai.base.host, openai.base.port);
                             cli.set_follow_location(true);
@@ -2537,14 +4863,18 @@ int main(int argc, char** argv) {
                             cli.set_read_timeout(openai.timeout_sec);
                             if (!openai.proxy_host.empty() && openai.proxy_port > 0) cli.set_proxy(openai.proxy_host, openai.proxy_port);
                             cli.enable_server_certificate_verification(openai.verify_tls);
-                            openai_chat_completions_stream_to_sink(cli, path, headers, req_body, resp_id, rag_payload, sink, &stream_err);
+                            openai_chat_completions_stream_to_sink(cli, path, headers, req_body, resp_id, rag_payload, sink, &stream_err, &client_disconnected);
                         } else {
                             httplib::Client cli(openai.base.host, openai.base.port);
                             cli.set_follow_location(true);
                             cli.set_connection_timeout(openai.timeout_sec);
                             cli.set_read_timeout(openai.timeout_sec);
                             if (!openai.proxy_host.empty() && openai.proxy_port > 0) cli.set_proxy(openai.proxy_host, openai.proxy_port);
-                            openai_chat_completions_stream_to_sink(cli, path, headers, req_body, resp_id, rag_payload, sink, &stream_err);
+                            openai_chat_completions_stream_to_sink(cli, path, headers, req_body, resp_id, rag_payload, sink, &stream_err, &client_disconnected);
+                        }
+                        if (client_disconnected) {
+                            ++upstream_streams_cancelled;
+                            log_event("chat.cancelled", "id=" + resp_id + " backend=api");
                         }
                         return false;
                     },
@@ -2626,6 +4956,34 @@ int main(int argc, char** argv) {
 
         const std::string prompt = apply_chat_template(messages, {}, true, enable_thinking);
         log_event("prompt.local", "id=" + resp_id + " prompt_len=" + std::to_string(prompt.size()));
+        if (warmup_log) warmup_log->record(user_query, prompt);
+
+        auto job = std::make_shared<LlmJob>();
+        job->id = resp_id;
+        job->prompt = prompt;
+        job->cfg = cfg;
+        job->use_session = use_session;
+        if (stream) {
+            job->max_pending = opt.sse_buffer_tokens;
+            job->overflow = opt.sse_overflow;
+            job->flush_ms = opt.sse_flush_ms;
+            job->flush_bytes = opt.sse_flush_bytes;
+            // Per request: "stream_options": {"flush_ms": 0} keeps single-token events.
+            if (body.contains("stream_options") && body["stream_options"].is_object()) {
+                const json& so = body["stream_options"];
+                if (so.contains("flush_ms") && so["flush_ms"].is_number_integer()) job->flush_ms = std::clamp(so["flush_ms"].get<int>(), 0, 1000);
+                if (so.contains("flush_bytes") && so["flush_bytes"].is_number_integer()) {
+                    job->flush_bytes = static_cast<size_t>(std::max(0, so["flush_bytes"].get<int>()));
+                }
+            }
+        }
+        if (use_session) {
+            job->session_id = session_id;
+            job->session = std::move(session);
+            job->client_messages = std::move(client_messages);
+            job->prompt_messages = messages;
+        }
+        dispatcher.submit(job);
 
 	        if (stream) {
 	            res.set_header("Content-Type", "text/event-stream");
@@ -2634,32 +4992,26 @@ int main(int argc, char** argv) {
 
 	            res.set_chunked_content_provider(
 	                "text/event-stream",
-	                [&, prompt, cfg, resp_id, model_name, rag_payload](size_t, httplib::DataSink& sink) mutable {
-	                    std::lock_guard<std::mutex> lock(model_mutex);
-
-	                    log_event("chat.prefill.start", "id=" + resp_id + " prompt_len=" + std::to_string(prompt.size()));
-	                    auto prefill_start = std::chrono::steady_clock::now();
-                        if (!model) {
-                            json errj = make_error(500, "local model not initialized");
-                            std::string data = "data: " + dump_json_safe(errj) + "\n\n";
-                            sink.write(data.data(), data.size());
-                            const char done[] = "data: [DONE]\n\n";
-                            sink.write(done, sizeof(done) - 1);
-                            return false;
-                        }
-	                    auto ctx = prefill_chunked(*model, prompt, opt.llm_prefill_chunk_bytes, resp_id);
-	                    const size_t prompt_tokens = (!ctx || ctx->kv_cache.empty()) ? 0u : static_cast<size_t>(ctx->kv_cache[0].first.h);
-	                    auto prefill_end = std::chrono::steady_clock::now();
-	                    int64_t prefill_ms = std::chrono::duration_cast<std::chrono::milliseconds>(prefill_end - prefill_start).count();
-	                    log_event("chat.prefill.done", "id=" + resp_id + " elapsed_ms=" + std::to_string(prefill_ms));
-
+	                [&, job, resp_id, model_name, rag_payload](size_t, httplib::DataSink& sink) {
+	                    auto client_gone = [&sink]() { return sink.is_writable && !sink.is_writable(); };
 	                    size_t token_count = 0;
-	                    size_t output_bytes = 0;
-	                    auto gen_start = std::chrono::steady_clock::now();
-	                    model->generate(ctx, cfg, [&](const std::string& token) {
-	                        std::string safe_token = sanitize_utf8(token);
-	                        ++token_count;
-	                        output_bytes += safe_token.size();
+	                    size_t events = 0;
+	                    PendingText piece;
+	                    while (job->next_chunk(&piece, client_gone)) {
+	                        if (job->flush_ms > 0) {
+	                            // One event per window instead of per token: a JSON build, a dump and a
+	                            // socket write each.
+	                            job->gather(&piece, std::chrono::steady_clock::now() + std::chrono::milliseconds(job->flush_ms), job->flush_bytes);
+	                        }
+	                        ++events;
+	                        token_count += piece.tokens;
+	                        size_t prompt_tokens = 0;
+	                        size_t cached_tokens = 0;
+	                        {
+	                            std::lock_guard<std::mutex> lock(job->mu);
+	                            prompt_tokens = job->prompt_tokens;
+	                            cached_tokens = job->cached_tokens;
+	                        }
 	                        json chunk = {
 	                            {"id", resp_id},
 	                            {"object", "chat.completion.chunk"},
@@ -2667,26 +5019,46 @@ int main(int argc, char** argv) {
 	                            {"choices", json::array({
 	                                json{
 	                                    {"index", 0},
-	                                    {"delta", {{"role", "assistant"}, {"content", safe_token}}},
+	                                    {"delta", {{"role", "assistant"}, {"content", piece.text}}},
 	                                    {"finish_reason", nullptr}
 	                                }
 	                            })},
 	                            {"usage", {{"prompt_tokens", prompt_tokens},
+	                                       {"prompt_tokens_details", {{"cached_tokens", cached_tokens}}},
 	                                       {"completion_tokens", token_count},
 	                                       {"total_tokens", prompt_tokens + token_count}}}
 	                        };
 	                        std::string data = "data: " + dump_json_safe(chunk) + "\n\n";
+	                        if (!sink.write(data.data(), data.size())) {
+	                            job->cancel("client disconnected");
+	                            return false;
+	                        }
+	                    }
+	                    if (client_gone()) {
+	                        job->cancel("client disconnected");
+	                        return false;
+	                    }
+
+	                    std::string error;
+	                    size_t prompt_tokens = 0;
+	                    size_t cached_tokens = 0;
+	                    size_t kv_bytes = 0;
+	                    {
+	                        std::lock_guard<std::mutex> lock(job->mu);
+	                        error = job->error;
+	                        prompt_tokens = job->prompt_tokens;
+	                        cached_tokens = job->cached_tokens;
+	                        kv_bytes = job->kv_bytes;
+	                    }
+	                    if (error.empty()) token_estimator.observe(job->prompt, prompt_tokens);
+	                    if (!error.empty()) {
+	                        json errj = make_error(500, error);
+	                        std::string data = "data: " + dump_json_safe(errj) + "\n\n";
 	                        sink.write(data.data(), data.size());
-	                    });
-	                    auto gen_end = std::chrono::steady_clock::now();
-	                    int64_t gen_ms = std::chrono::duration_cast<std::chrono::milliseconds>(gen_end - gen_start).count();
-	                    log_event("chat.generate.done", "id=" + resp_id +
-	                                                   " tokens=" + std::to_string(token_count) +
-	                                                   " output_bytes=" + std::to_string(output_bytes) +
-	                                                   " elapsed_ms=" + std::to_string(gen_ms));
-
-	                    const size_t kv_bytes = kv_cache_bytes(ctx);
-	                    ctx.reset();
+	                        const char done[] = "data: [DONE]\n\n";
+	                        sink.write(done, sizeof(done) - 1);
+	                        return false;
+	                    }
 	                    maybe_malloc_trim(opt.malloc_trim);
 	                    MemSnapshot mem = read_self_mem_snapshot();
 	                    json done_chunk = {
@@ -2701,6 +5073,7 @@ int main(int argc, char** argv) {
 	                            }
 	                        })},
 	                        {"usage", {{"prompt_tokens", prompt_tokens},
+	                                   {"prompt_tokens_details", {{"cached_tokens", cached_tokens}}},
 	                                   {"completion_tokens", token_count},
 	                                   {"total_tokens", prompt_tokens + token_count}}},
 	                        {"mem", {{"rss_bytes", mem.rss_bytes},
@@ -2708,9 +5081,19 @@ int main(int argc, char** argv) {
 	                                 {"kv_cache_bytes", kv_bytes}}},
 	                        {"rag", rag_payload}
 	                    };
+	                    {
+	                        std::lock_guard<std::mutex> lock(job->mu);
+	                        done_chunk["sched"] = {{"replica", job->replica}, {"queue_wait_ms", job->queue_wait_ms}};
+	                    }
+	                    if (kv_pool.enabled()) done_chunk["mem"]["kv_snapshot_pool"] = kv_snapshot_pool_json(kv_pool);
 
 	                    std::string end_data = "data: " + dump_json_safe(done_chunk) + "\n\n";
 	                    sink.write(end_data.data(), end_data.size());
+	                    if (job->flush_ms > 0) {
+	                        log_event("sse.flush", "id=" + resp_id + " tokens=" + std::to_string(token_count) +
+	                                               " events=" + std::to_string(events) +
+	                                               " window_ms=" + std::to_string(job->flush_ms));
+	                    }
 
                     const char done[] = "data: [DONE]\n\n";
                     sink.write(done, sizeof(done) - 1);
@@ -2721,43 +5104,27 @@ int main(int argc, char** argv) {
         }
 
 	        std::string generated;
+	        PendingText piece;
+	        while (job->next_chunk(&piece)) generated += piece.text;
 	        size_t prompt_tokens = 0;
+	        size_t cached_tokens = 0;
 	        size_t completion_tokens = 0;
 	        size_t kv_bytes = 0;
-	        MemSnapshot mem;
 	        {
-	            std::lock_guard<std::mutex> lock(model_mutex);
-	            log_event("chat.prefill.start", "id=" + resp_id + " prompt_len=" + std::to_string(prompt.size()));
-	            auto prefill_start = std::chrono::steady_clock::now();
-                if (!model) {
-                    res.status = 500;
-                    res.set_content(dump_json_safe(make_error(500, "local model not initialized")), "application/json");
-                    return;
-                }
-	            auto ctx = prefill_chunked(*model, prompt, opt.llm_prefill_chunk_bytes, resp_id);
-	            prompt_tokens = (!ctx || ctx->kv_cache.empty()) ? 0u : static_cast<size_t>(ctx->kv_cache[0].first.h);
-	            auto prefill_end = std::chrono::steady_clock::now();
-	            int64_t prefill_ms = std::chrono::duration_cast<std::chrono::milliseconds>(prefill_end - prefill_start).count();
-	            log_event("chat.prefill.done", "id=" + resp_id + " elapsed_ms=" + std::to_string(prefill_ms));
-
-            size_t token_count = 0;
-            auto gen_start = std::chrono::steady_clock::now();
-            model->generate(ctx, cfg, [&](const std::string& token) {
-                generated += sanitize_utf8(token);
-                ++token_count;
-            });
-	            auto gen_end = std::chrono::steady_clock::now();
-	            completion_tokens = token_count;
-	            kv_bytes = kv_cache_bytes(ctx);
-	            ctx.reset();
-	            int64_t gen_ms = std::chrono::duration_cast<std::chrono::milliseconds>(gen_end - gen_start).count();
-	            log_event("chat.generate.done", "id=" + resp_id +
-	                                               " tokens=" + std::to_string(token_count) +
-	                                               " output_bytes=" + std::to_string(generated.size()) +
-	                                               " elapsed_ms=" + std::to_string(gen_ms));
+	            std::lock_guard<std::mutex> lock(job->mu);
+	            if (!job->error.empty()) {
+	                res.status = 500;
+	                res.set_content(dump_json_safe(make_error(500, job->error)), "application/json");
+	                return;
+	            }
+	            prompt_tokens = job->prompt_tokens;
+	            cached_tokens = job->cached_tokens;
+	            completion_tokens = job->completion_tokens;
+	            token_estimator.observe(job->prompt, prompt_tokens);
+	            kv_bytes = job->kv_bytes;
 	        }
 	        maybe_malloc_trim(opt.malloc_trim);
-	        mem = read_self_mem_snapshot();
+	        MemSnapshot mem = read_self_mem_snapshot();
 
         json resp = {
             {"id", resp_id},
@@ -2771,6 +5138,7 @@ int main(int argc, char** argv) {
                 }
             })},
 	            {"usage", {{"prompt_tokens", prompt_tokens},
+	                       {"prompt_tokens_details", {{"cached_tokens", cached_tokens}}},
 	                       {"completion_tokens", completion_tokens},
 	                       {"total_tokens", prompt_tokens + completion_tokens}}},
 	            {"mem", {{"rss_bytes", mem.rss_bytes},
@@ -2778,12 +5146,23 @@ int main(int argc, char** argv) {
 	                     {"kv_cache_bytes", kv_bytes}}},
 	            {"rag", rag_payload}
 	        };
+	        resp["sched"] = {{"replica", job->replica}, {"queue_wait_ms", job->queue_wait_ms}};
+	        if (kv_pool.enabled()) resp["mem"]["kv_snapshot_pool"] = kv_snapshot_pool_json(kv_pool);
 	        res.set_content(dump_json_safe(resp), "application/json");
 	    });
 
     std::cout << "RAG web app listening on http://0.0.0.0:" << opt.port << "\n";
     std::cout << "POST /v1/chat/completions and open / for the demo UI.\n";
     server.listen("0.0.0.0", opt.port);
+    if (model_load_thread.joinable()) model_load_thread.join();
+    dispatcher.stop();
+    if (warmup_log) {
+        std::string warmup_err;
+        if (!warmup_log->save(&warmup_err)) log_event("warmup.save", "ok=0 err=" + warmup_err);
+    }
+    if (rag_seed_thread.joinable()) rag_seed_thread.join();
+    docs_sync.stop();
+    rag_maintenance.stop();
 
 #if defined(NCNN_RAG_HAS_VULKAN_API) && NCNN_RAG_HAS_VULKAN_API
     if (opt.llm_backend == LlmBackend::Local && use_vulkan_runtime) {
@@ -0,0 +1,189 @@
+#include "cpu_affinity.h"
+
+#include <ncnn/cpu.h>
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <set>
+#include <thread>
+
+namespace {
+
+bool read_line(const std::filesystem::path& path, std::string* out) {
+    std::ifstream f(path);
+    if (!f) return false;
+    std::getline(f, *out);
+    return true;
+}
+
+bool parse_uint(const std::string& s, int* out) {
+    if (s.empty() || s.size() > 6) return false;
+    int v = 0;
+    for (char c : s) {
+        if (c < '0' || c > '9') return false;
+        v = v * 10 + (c - '0');
+    }
+    *out = v;
+    return true;
+}
+
+} // namespace
+
+int CpuTopology::node_of(int cpu) const {
+    for (size_t n = 0; n < nodes.size(); ++n) {
+        if (std::find(nodes[n].begin(), nodes[n].end(), cpu) != nodes[n].end()) return static_cast<int>(n);
+    }
+    return -1;
+}
+
+bool parse_cpu_list(const std::string& text, std::vector<int>* out) {
+    std::set<int> cpus;
+    size_t pos = 0;
+    while (pos <= text.size()) {
+        size_t comma = text.find(',', pos);
+        if (comma == std::string::npos) comma = text.size();
+        std::string item = text.substr(pos, comma - pos);
+        item.erase(std::remove_if(item.begin(), item.end(), [](char c) { return c == ' ' || c == '\n' || c == '\t'; }), item.end());
+        if (!item.empty()) {
+            size_t dash = item.find('-');
+            int lo = 0;
+            int hi = 0;
+            if (dash == std::string::npos) {
+                if (!parse_uint(item, &lo)) return false;
+                hi = lo;
+            } else if (!parse_uint(item.substr(0, dash), &lo) || !parse_uint(item.substr(dash + 1), &hi) || hi < lo) {
+                return false;
+            }
+            for (int c = lo; c <= hi; ++c) cpus.insert(c);
+        }
+        pos = comma + 1;
+    }
+    out->assign(cpus.begin(), cpus.end());
+    return !out->empty();
+}
+
+std::string format_cpu_list(const std::vector<int>& cpus) {
+    std::vector<int> sorted(cpus);
+    std::sort(sorted.begin(), sorted.end());
+    std::string out;
+    for (size_t i = 0; i < sorted.size();) {
+        size_t j = i;
+        while (j + 1 < sorted.size() && sorted[j + 1] == sorted[j] + 1) ++j;
+        if (!out.empty()) out += ',';
+        out += std::to_string(sorted[i]);
+        if (j > i) out += "-" + std::to_string(sorted[j]);
+        i = j + 1;
+    }
+    return out;
+}
+
+CpuTopology read_cpu_topology() {
+    CpuTopology topo;
+    const std::filesystem::path sys("/sys/devices/system");
+    std::string line;
+    if (!read_line(sys / "cpu" / "online", &line) || !parse_cpu_list(line, &topo.cpus)) {
+        const int n = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+        for (int c = 0; c < n; ++c) topo.cpus.push_back(c);
+    }
+
+    std::error_code ec;
+    std::vector<std::pair<int, std::vector<int>>> nodes;
+    for (std::filesystem::directory_iterator it(sys / "node", ec), end; !ec && it != end; it.increment(ec)) {
+        const std::string name = it->path().filename().string();
+        int id = 0;
+        if (name.rfind("node", 0) != 0 || !parse_uint(name.substr(4), &id)) continue;
+        std::vector<int> cpus;
+        if (!read_line(it->path() / "cpulist", &line) || !parse_cpu_list(line, &cpus)) continue; // memory-only node
+        cpus.erase(std::remove_if(cpus.begin(), cpus.end(), [&](int c) {
+                       return std::find(topo.cpus.begin(), topo.cpus.end(), c) == topo.cpus.end();
+                   }),
+                   cpus.end());
+        if (!cpus.empty()) nodes.emplace_back(id, std::move(cpus));
+    }
+    std::sort(nodes.begin(), nodes.end());
+    for (auto& n : nodes) topo.nodes.push_back(std::move(n.second));
+    if (topo.nodes.empty()) topo.nodes.push_back(topo.cpus);
+    return topo;
+}
+
+bool plan_affinity(const CpuTopology& topo,
+                   const std::string& replica_spec,
+                   const std::string& worker_spec,
+                   int replicas,
+                   int threads_per_replica,
+                   AffinityPlan* out,
+                   std::string* err) {
+    AffinityPlan plan;
+    replicas = std::max(1, replicas);
+    if (replica_spec == "numa") {
+        for (int i = 0; i < replicas; ++i) plan.replicas.push_back(topo.nodes[static_cast<size_t>(i) % topo.nodes.size()]);
+    } else if (replica_spec == "auto") {
+        std::vector<int> ordered;
+        for (const auto& node : topo.nodes) ordered.insert(ordered.end(), node.begin(), node.end());
+        const size_t per = threads_per_replica > 0 ? static_cast<size_t>(threads_per_replica) : std::max<size_t>(1, ordered.size() / replicas);
+        if (per * replicas > ordered.size()) {
+            if (err) *err = "auto affinity needs " + std::to_string(per * replicas) + " CPUs, " + std::to_string(ordered.size()) + " online";
+            return false;
+        }
+        for (int i = 0; i < replicas; ++i) {
+            auto first = ordered.begin() + static_cast<std::ptrdiff_t>(per * i);
+            plan.replicas.emplace_back(first, first + static_cast<std::ptrdiff_t>(per));
+        }
+    } else if (!replica_spec.empty()) {
+        std::vector<std::vector<int>> lists;
+        size_t pos = 0;
+        while (pos <= replica_spec.size()) {
+            size_t semi = replica_spec.find(';', pos);
+            if (semi == std::string::npos) semi = replica_spec.size();
+            std::vector<int> cpus;
+            if (!parse_cpu_list(replica_spec.substr(pos, semi - pos), &cpus)) {
+                if (err) *err = "invalid replica cpulist: " + replica_spec.substr(pos, semi - pos);
+                return false;
+            }
+            lists.push_back(std::move(cpus));
+            pos = semi + 1;
+        }
+        for (int i = 0; i < replicas; ++i) plan.replicas.push_back(lists[static_cast<size_t>(i) % lists.size()]);
+    }
+
+    if (!worker_spec.empty()) {
+        if (!parse_cpu_list(worker_spec, &plan.workers)) {
+            if (err) *err = "invalid worker cpulist: " + worker_spec;
+            return false;
+        }
+    } else if (!plan.replicas.empty()) {
+        std::set<int> used;
+        for (const auto& r : plan.replicas) used.insert(r.begin(), r.end());
+        for (int c : topo.cpus) {
+            if (!used.count(c)) plan.workers.push_back(c);
+        }
+    }
+
+    auto offline = [&](const std::vector<int>& cpus) {
+        for (int c : cpus) {
+            if (std::find(topo.cpus.begin(), topo.cpus.end(), c) == topo.cpus.end()) return c;
+        }
+        return -1;
+    };
+    for (const auto& r : plan.replicas) {
+        if (int c = offline(r); c >= 0) {
+            if (err) *err = "cpu " + std::to_string(c) + " is not online";
+            return false;
+        }
+    }
+    if (int c = offline(plan.workers); c >= 0) {
+        if (err) *err = "cpu " + std::to_string(c) + " is not online";
+        return false;
+    }
+    *out = std::move(plan);
+    return true;
+}
+
+bool pin_current_thread(const std::vector<int>& cpus) {
+    if (cpus.empty()) return true;
+    ncnn::CpuSet set;
+    set.disable_all();
+    for (int c : cpus) set.enable(c);
+    return ncnn::set_cpu_thread_affinity(set) == 0;
+}
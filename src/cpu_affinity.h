@@ -0,0 +1,44 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+// Online CPUs grouped by NUMA node, read from /sys. Hosts without NUMA information (or other
+// platforms) report a single node holding every CPU.
+struct CpuTopology {
+    std::vector<int> cpus;
+    std::vector<std::vector<int>> nodes;
+
+    int node_of(int cpu) const;
+};
+
+CpuTopology read_cpu_topology();
+
+// Kernel cpulist syntax: "0-3,8,10-11". Returns false on malformed input.
+bool parse_cpu_list(const std::string& text, std::vector<int>* out);
+std::string format_cpu_list(const std::vector<int>& cpus);
+
+// CPU sets for the model replicas and for everything else (HTTP handlers, search, ingest).
+// An empty set means "not pinned".
+struct AffinityPlan {
+    std::vector<std::vector<int>> replicas;
+    std::vector<int> workers;
+};
+
+// `replica_spec`:
+//   ""    no pinning;
+//   numa  replica i gets all CPUs of node i % nodes;
+//   auto  replica i gets the next `threads_per_replica` CPUs in node order, so a replica
+//         only spans nodes when a node has fewer CPUs than it needs;
+//   L0;L1;...  explicit cpulists, reused round-robin when there are fewer lists than replicas.
+// `worker_spec` is a cpulist, or "" for the CPUs no replica uses (unpinned if there are none).
+bool plan_affinity(const CpuTopology& topo,
+                   const std::string& replica_spec,
+                   const std::string& worker_spec,
+                   int replicas,
+                   int threads_per_replica,
+                   AffinityPlan* out,
+                   std::string* err);
+
+// Pins the calling thread and the ncnn/OpenMP threads it starts to `cpus`.
+bool pin_current_thread(const std::vector<int>& cpus);
@@ -0,0 +1,93 @@
+#include "llm_kv_pool.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+
+namespace {
+
+// ncnn kernels may read up to 64 bytes past a blob, as with ncnn::fastMalloc's own padding.
+constexpr size_t kOverreadBytes = 64;
+constexpr size_t kAlign = 64;
+
+} // namespace
+
+LlmKvPool::LlmKvPool(size_t arena_bytes, size_t block_bytes)
+    : block_bytes_(((block_bytes + kAlign - 1) / kAlign) * kAlign) {
+    if (block_bytes_ == 0) block_bytes_ = kAlign;
+    blocks_total_ = arena_bytes / block_bytes_;
+    stats_.block_bytes = block_bytes_;
+    if (blocks_total_ == 0) return;
+    arena_ = static_cast<unsigned char*>(ncnn::fastMalloc(blocks_total_ * block_bytes_));
+    if (!arena_) {
+        blocks_total_ = 0;
+        return;
+    }
+    // Fault every page in now rather than on the first requests that use them.
+    std::memset(arena_, 0, blocks_total_ * block_bytes_);
+    free_runs_[0] = blocks_total_;
+    stats_.arena_bytes = blocks_total_ * block_bytes_;
+    stats_.blocks_total = blocks_total_;
+}
+
+LlmKvPool::~LlmKvPool() {
+    if (arena_) ncnn::fastFree(arena_);
+}
+
+void* LlmKvPool::fastMalloc(size_t size) {
+    const size_t need = (size + kOverreadBytes + block_bytes_ - 1) / block_bytes_;
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        ++stats_.allocations;
+        for (auto it = free_runs_.begin(); it != free_runs_.end(); ++it) {
+            if (it->second < need) continue;
+            const size_t start = it->first;
+            const size_t rest = it->second - need;
+            free_runs_.erase(it);
+            if (rest > 0) free_runs_[start + need] = rest;
+            used_runs_[start] = need;
+            stats_.blocks_used += need;
+            if (stats_.blocks_used > stats_.peak_blocks_used) stats_.peak_blocks_used = stats_.blocks_used;
+            return arena_ + start * block_bytes_;
+        }
+        ++stats_.fallback_allocations;
+    }
+    return ncnn::fastMalloc(size);
+}
+
+void LlmKvPool::fastFree(void* ptr) {
+    if (!ptr) return;
+    unsigned char* p = static_cast<unsigned char*>(ptr);
+    if (!arena_ || p < arena_ || p >= arena_ + blocks_total_ * block_bytes_) {
+        ncnn::fastFree(ptr);
+        return;
+    }
+    const size_t start = static_cast<size_t>(p - arena_) / block_bytes_;
+    std::lock_guard<std::mutex> lock(mu_);
+    auto used = used_runs_.find(start);
+    if (used == used_runs_.end()) return;
+    size_t first = start;
+    size_t count = used->second;
+    used_runs_.erase(used);
+    stats_.blocks_used -= count;
+
+    auto next = free_runs_.lower_bound(start);
+    if (next != free_runs_.end() && next->first == start + count) {
+        count += next->second;
+        next = free_runs_.erase(next);
+    }
+    if (next != free_runs_.begin()) {
+        auto prev = std::prev(next);
+        if (prev->first + prev->second == first) {
+            first = prev->first;
+            count += prev->second;
+            free_runs_.erase(prev);
+        }
+    }
+    free_runs_[first] = count;
+}
+
+LlmKvPoolStats LlmKvPool::stats() const {
+    std::lock_guard<std::mutex> lock(mu_);
+    return stats_;
+}
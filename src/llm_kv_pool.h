@@ -0,0 +1,52 @@
+#pragma once
+
+#include <ncnn/mat.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+
+struct LlmKvPoolStats {
+    size_t arena_bytes = 0;
+    size_t block_bytes = 0;
+    size_t blocks_total = 0;
+    size_t blocks_used = 0;
+    size_t peak_blocks_used = 0;
+    uint64_t allocations = 0;
+    uint64_t fallback_allocations = 0; // served by the heap because the arena had no free run
+};
+
+// KV snapshot pool: an ncnn allocator backed by one preallocated arena split into fixed-size
+// blocks. An allocation takes a run of contiguous blocks from the free list (first fit) and
+// returns it on free, with neighbouring free runs merged. The arena is touched up front, so KV
+// snapshots captured into the prefix/session caches, and contexts restored from them, reuse
+// resident pages instead of growing and trimming the heap on every request. It does not back
+// the live KV cache: ncnn_llm allocates that itself and does not expose the net's
+// blob_allocator/workspace_allocator, so per-request churn is unchanged (see "已知限制" in the
+// README). Requests that do not fit fall back to ncnn::fastMalloc. Thread-safe; must outlive
+// every Mat it backs.
+class LlmKvPool : public ncnn::Allocator {
+public:
+    LlmKvPool(size_t arena_bytes, size_t block_bytes);
+    ~LlmKvPool() override;
+    LlmKvPool(const LlmKvPool&) = delete;
+    LlmKvPool& operator=(const LlmKvPool&) = delete;
+
+    bool enabled() const { return arena_ != nullptr; }
+
+    void* fastMalloc(size_t size) override;
+    void fastFree(void* ptr) override;
+
+    LlmKvPoolStats stats() const;
+
+private:
+    unsigned char* arena_ = nullptr;
+    size_t block_bytes_;
+    size_t blocks_total_ = 0;
+    mutable std::mutex mu_;
+    std::map<size_t, size_t> free_runs_;          // first block -> block count
+    std::unordered_map<size_t, size_t> used_runs_; // first block -> block count
+    LlmKvPoolStats stats_;
+};
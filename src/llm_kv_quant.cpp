@@ -0,0 +1,151 @@
+#include "llm_kv_quant.h"
+
+#include "llm_prefix_cache.h"
+#include "ncnn_llm_gpt.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+struct LlmKvSnapshot::Tensor {
+    int w = 0; // head_dim
+    int h = 0; // tokens
+    int c = 0; // heads
+    std::vector<uint16_t> half;
+    std::vector<int8_t> q;
+    std::vector<float> scales; // int8: [head][block]
+
+    size_t bytes() const { return half.size() * sizeof(uint16_t) + q.size() + scales.size() * sizeof(float); }
+};
+
+namespace {
+
+bool packable(const ncnn::Mat& m) {
+    return !m.empty() && m.dims == 3 && m.elemsize == 4u && m.elempack == 1;
+}
+
+size_t mat_bytes(const ncnn::Mat& m) {
+    return static_cast<size_t>(m.total()) * static_cast<size_t>(m.elemsize);
+}
+
+int blocks_per_head(int h) {
+    return (h + kKvQuantBlockTokens - 1) / kKvQuantBlockTokens;
+}
+
+} // namespace
+
+bool parse_kv_store_mode(const std::string& s, KvStoreMode* out) {
+    if (s == "fp32") *out = KvStoreMode::Float32;
+    else if (s == "fp16") *out = KvStoreMode::Float16;
+    else if (s == "int8") *out = KvStoreMode::Int8;
+    else return false;
+    return true;
+}
+
+const char* kv_store_mode_name(KvStoreMode mode) {
+    switch (mode) {
+    case KvStoreMode::Float16: return "fp16";
+    case KvStoreMode::Int8: return "int8";
+    default: return "fp32";
+    }
+}
+
+LlmKvSnapshot::LlmKvSnapshot() = default;
+LlmKvSnapshot::~LlmKvSnapshot() = default;
+
+std::shared_ptr<const LlmKvSnapshot> LlmKvSnapshot::capture(const ncnn_llm_gpt_ctx& ctx,
+                                                            KvStoreMode mode,
+                                                            ncnn::Allocator* allocator) {
+    auto snap = std::make_shared<LlmKvSnapshot>();
+    snap->mode_ = mode;
+    snap->tokens_ = llm_ctx_tokens(ctx);
+    if (mode == KvStoreMode::Float32) {
+        snap->meta_ = clone_llm_ctx(ctx, allocator);
+        snap->bytes_ = llm_ctx_kv_bytes(ctx);
+        snap->packed_.resize(ctx.kv_cache.size());
+        return snap;
+    }
+
+    snap->meta_ = std::make_shared<ncnn_llm_gpt_ctx>(ctx);
+    snap->packed_.resize(ctx.kv_cache.size());
+    auto pack = [&](const ncnn::Mat& m, ncnn::Mat* kept) -> std::unique_ptr<Tensor> {
+        if (!packable(m)) {
+            *kept = m.clone(allocator);
+            snap->bytes_ += mat_bytes(m);
+            return nullptr;
+        }
+        *kept = ncnn::Mat();
+        auto t = std::make_unique<Tensor>();
+        t->w = m.w;
+        t->h = m.h;
+        t->c = m.c;
+        const size_t per_head = static_cast<size_t>(m.w) * m.h;
+        if (mode == KvStoreMode::Float16) {
+            t->half.resize(per_head * m.c);
+            for (int q = 0; q < m.c; ++q) {
+                const float* src = static_cast<const float*>(m.channel(q).data);
+                uint16_t* dst = t->half.data() + per_head * q;
+                for (size_t i = 0; i < per_head; ++i) dst[i] = ncnn::float32_to_float16(src[i]);
+            }
+        } else {
+            const int nb = blocks_per_head(m.h);
+            t->q.resize(per_head * m.c);
+            t->scales.resize(static_cast<size_t>(nb) * m.c);
+            for (int q = 0; q < m.c; ++q) {
+                const float* src = static_cast<const float*>(m.channel(q).data);
+                int8_t* dst = t->q.data() + per_head * q;
+                for (int b = 0; b < nb; ++b) {
+                    const size_t begin = static_cast<size_t>(b) * kKvQuantBlockTokens * m.w;
+                    const size_t end = std::min(per_head, begin + static_cast<size_t>(kKvQuantBlockTokens) * m.w);
+                    float absmax = 0.f;
+                    for (size_t i = begin; i < end; ++i) absmax = std::max(absmax, std::fabs(src[i]));
+                    const float scale = absmax > 0.f ? absmax / 127.f : 1.f;
+                    const float inv = 1.f / scale;
+                    t->scales[static_cast<size_t>(q) * nb + b] = scale;
+                    for (size_t i = begin; i < end; ++i) {
+                        float v = std::nearbyint(src[i] * inv);
+                        dst[i] = static_cast<int8_t>(std::max(-127.f, std::min(127.f, v)));
+                    }
+                }
+            }
+        }
+        snap->bytes_ += t->bytes();
+        return t;
+    };
+    for (size_t i = 0; i < ctx.kv_cache.size(); ++i) {
+        auto& kept = snap->meta_->kv_cache[i];
+        snap->packed_[i].first = pack(ctx.kv_cache[i].first, &kept.first);
+        snap->packed_[i].second = pack(ctx.kv_cache[i].second, &kept.second);
+    }
+    return snap;
+}
+
+std::shared_ptr<ncnn_llm_gpt_ctx> LlmKvSnapshot::restore(ncnn::Allocator* allocator) const {
+    // Copies never share memory with the snapshot, which other requests may restore concurrently.
+    auto out = clone_llm_ctx(*meta_, allocator);
+    auto unpack = [&](const Tensor& t, ncnn::Mat* m) {
+        m->create(t.w, t.h, t.c, 4u, allocator);
+        const size_t per_head = static_cast<size_t>(t.w) * t.h;
+        const int nb = blocks_per_head(t.h);
+        for (int q = 0; q < t.c; ++q) {
+            float* dst = static_cast<float*>(m->channel(q).data);
+            if (!t.half.empty()) {
+                const uint16_t* src = t.half.data() + per_head * q;
+                for (size_t i = 0; i < per_head; ++i) dst[i] = ncnn::float16_to_float32(src[i]);
+            } else {
+                const int8_t* src = t.q.data() + per_head * q;
+                for (int b = 0; b < nb; ++b) {
+                    const size_t begin = static_cast<size_t>(b) * kKvQuantBlockTokens * t.w;
+                    const size_t end = std::min(per_head, begin + static_cast<size_t>(kKvQuantBlockTokens) * t.w);
+                    const float scale = t.scales[static_cast<size_t>(q) * nb + b];
+                    for (size_t i = begin; i < end; ++i) dst[i] = src[i] * scale;
+                }
+            }
+        }
+    };
+    for (size_t i = 0; i < packed_.size() && i < out->kv_cache.size(); ++i) {
+        if (packed_[i].first) unpack(*packed_[i].first, &out->kv_cache[i].first);
+        if (packed_[i].second) unpack(*packed_[i].second, &out->kv_cache[i].second);
+    }
+    return out;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+struct ncnn_llm_gpt_ctx;
+namespace ncnn {
+class Allocator;
+}
+
+// How cached KV snapshots are stored while they sit in the prefix or session cache. The live KV
+// cache is not affected: attention always runs on the fp32 tensors ncnn_llm produces, and
+// snapshots are converted on capture and restore. Quantizing the live KV needs attention in
+// ncnn_llm to read fp16/int8 KV, so that part stays open (see "已知限制" in the README).
+enum class KvStoreMode {
+    Float32,
+    Float16,
+    Int8, // symmetric, one scale per head and block of kKvQuantBlockTokens positions
+};
+
+constexpr int kKvQuantBlockTokens = 32;
+
+bool parse_kv_store_mode(const std::string& s, KvStoreMode* out);
+const char* kv_store_mode_name(KvStoreMode mode);
+
+// Immutable copy of a context's KV cache in a given storage mode. Tensors that are not plain
+// fp32 3-D blobs (head_dim x tokens x heads) are kept as exact copies.
+class LlmKvSnapshot {
+public:
+    LlmKvSnapshot();
+    ~LlmKvSnapshot();
+    LlmKvSnapshot(const LlmKvSnapshot&) = delete;
+    LlmKvSnapshot& operator=(const LlmKvSnapshot&) = delete;
+
+    // `allocator` backs the fp32 tensors the snapshot keeps (all of them in Float32 mode).
+    static std::shared_ptr<const LlmKvSnapshot> capture(const ncnn_llm_gpt_ctx& ctx,
+                                                        KvStoreMode mode,
+                                                        ncnn::Allocator* allocator = nullptr);
+
+    // A fresh fp32 context the model can continue from.
+    std::shared_ptr<ncnn_llm_gpt_ctx> restore(ncnn::Allocator* allocator = nullptr) const;
+
+    KvStoreMode mode() const { return mode_; }
+    size_t bytes() const { return bytes_; }
+    size_t tokens() const { return tokens_; }
+
+private:
+    struct Tensor;
+
+    KvStoreMode mode_ = KvStoreMode::Float32;
+    // cur_token/position_id and the tensors kept as exact copies; packed tensors are left empty.
+    std::shared_ptr<ncnn_llm_gpt_ctx> meta_;
+    std::vector<std::pair<std::unique_ptr<Tensor>, std::unique_ptr<Tensor>>> packed_;
+    size_t bytes_ = 0;
+    size_t tokens_ = 0;
+};
@@ -0,0 +1,124 @@
+#include "llm_prefill_tune.h"
+
+#include <nlohmann/json.hpp>
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+
+using nlohmann::json;
+
+namespace {
+
+constexpr size_t kCandidateTokens[] = {128, 256, 512, 1024, 2048};
+// Chunks measured per candidate; the first chunk of a prompt is cheaper (short attention span),
+// so a few are averaged.
+constexpr uint64_t kSamplesPerCandidate = 4;
+
+} // namespace
+
+PrefillTuner::PrefillTuner(std::string state_path, std::string model_key, size_t mem_limit_bytes)
+    : state_path_(std::move(state_path)), model_key_(std::move(model_key)), mem_limit_bytes_(mem_limit_bytes) {
+    for (size_t t : kCandidateTokens) {
+        PrefillTuneCandidate c;
+        c.chunk_tokens = t;
+        candidates_.push_back(c);
+    }
+    load();
+}
+
+void PrefillTuner::load() {
+    std::ifstream f(state_path_, std::ios::binary);
+    if (!f) return;
+    json state = json::parse(f, nullptr, false);
+    if (!state.is_object() || !state.contains(model_key_) || !state[model_key_].is_object()) return;
+    const json& m = state[model_key_];
+    // A choice made under a different memory ceiling is not reused.
+    if (m.value("mem_limit_bytes", static_cast<size_t>(0)) != mem_limit_bytes_) return;
+    const size_t chosen = m.value("chunk_tokens", static_cast<size_t>(0));
+    for (const auto& c : candidates_) {
+        if (c.chunk_tokens == chosen) chosen_ = chosen;
+    }
+}
+
+void PrefillTuner::save_locked() const {
+    json state = json::object();
+    {
+        std::ifstream f(state_path_, std::ios::binary);
+        if (f) {
+            json old = json::parse(f, nullptr, false);
+            if (old.is_object()) state = std::move(old);
+        }
+    }
+    json measured = json::array();
+    for (const auto& c : candidates_) {
+        measured.push_back({{"chunk_tokens", c.chunk_tokens},
+                            {"tokens_per_sec", c.tokens_per_sec()},
+                            {"peak_rss_bytes", c.peak_rss_bytes},
+                            {"over_limit", c.over_limit}});
+    }
+    state[model_key_] = {{"chunk_tokens", chosen_}, {"mem_limit_bytes", mem_limit_bytes_}, {"candidates", measured}};
+
+    std::error_code ec;
+    std::filesystem::create_directories(std::filesystem::path(state_path_).parent_path(), ec);
+    std::string tmp = state_path_ + ".tmp";
+    {
+        std::ofstream f(tmp, std::ios::binary | std::ios::trunc);
+        if (!f) return;
+        f << state.dump(2);
+        if (!f.flush()) return;
+    }
+    std::filesystem::rename(tmp, state_path_, ec);
+    if (ec) std::filesystem::remove(tmp, ec);
+}
+
+size_t PrefillTuner::chunk_tokens() const {
+    std::lock_guard<std::mutex> lock(mu_);
+    if (chosen_) return chosen_;
+    for (const auto& c : candidates_) {
+        if (c.over_limit) break;
+        if (c.chunks < kSamplesPerCandidate) return c.chunk_tokens;
+    }
+    return candidates_.front().chunk_tokens;
+}
+
+bool PrefillTuner::tuned() const {
+    std::lock_guard<std::mutex> lock(mu_);
+    return chosen_ != 0;
+}
+
+void PrefillTuner::record(size_t chunk_tokens, size_t tokens, double seconds, size_t rss_bytes) {
+    std::lock_guard<std::mutex> lock(mu_);
+    if (chosen_) return;
+    for (size_t i = 0; i < candidates_.size(); ++i) {
+        auto& c = candidates_[i];
+        if (c.chunk_tokens != chunk_tokens) continue;
+        ++c.chunks;
+        c.tokens += tokens;
+        c.seconds += seconds;
+        c.peak_rss_bytes = std::max(c.peak_rss_bytes, rss_bytes);
+        if (mem_limit_bytes_ > 0 && rss_bytes > mem_limit_bytes_) {
+            // Larger chunks only need more activation memory, so they are not tried.
+            for (size_t j = i; j < candidates_.size(); ++j) candidates_[j].over_limit = true;
+        }
+        break;
+    }
+    choose_locked();
+}
+
+void PrefillTuner::choose_locked() {
+    const PrefillTuneCandidate* best = nullptr;
+    for (const auto& c : candidates_) {
+        if (c.over_limit) break;
+        if (c.chunks < kSamplesPerCandidate) return;
+        if (!best || c.tokens_per_sec() > best->tokens_per_sec()) best = &c;
+    }
+    // Even the smallest size exceeds the ceiling: settle on it, it is the least memory-hungry.
+    chosen_ = best ? best->chunk_tokens : candidates_.front().chunk_tokens;
+    save_locked();
+}
+
+std::vector<PrefillTuneCandidate> PrefillTuner::candidates() const {
+    std::lock_guard<std::mutex> lock(mu_);
+    return candidates_;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct PrefillTuneCandidate {
+    size_t chunk_tokens = 0;
+    uint64_t chunks = 0;
+    uint64_t tokens = 0;
+    double seconds = 0.0;
+    size_t peak_rss_bytes = 0;
+    bool over_limit = false;
+
+    double tokens_per_sec() const { return seconds > 0.0 ? tokens / seconds : 0.0; }
+};
+
+// Picks the prefill chunk size (in tokens) with the best throughput under a process-RSS ceiling.
+// Candidates are tried smallest first for a few chunks each; a candidate whose chunks push RSS
+// over the ceiling is rejected together with every larger one. Once all are measured, the
+// fastest is kept and saved under the model's key, so later runs of the same model start tuned.
+// Thread-safe.
+class PrefillTuner {
+public:
+    PrefillTuner(std::string state_path, std::string model_key, size_t mem_limit_bytes);
+
+    // Chunk size the next prefill should use.
+    size_t chunk_tokens() const;
+    bool tuned() const;
+
+    // Feeds one prefill chunk run at `chunk_tokens`: tokens it added, its duration and the RSS
+    // right after it.
+    void record(size_t chunk_tokens, size_t tokens, double seconds, size_t rss_bytes);
+
+    std::vector<PrefillTuneCandidate> candidates() const;
+
+private:
+    std::string state_path_;
+    std::string model_key_;
+    size_t mem_limit_bytes_;
+    mutable std::mutex mu_;
+    std::vector<PrefillTuneCandidate> candidates_;
+    size_t chosen_ = 0; // chunk tokens, 0 = still exploring
+
+    void load();
+    void choose_locked();
+    void save_locked() const;
+};
@@ -0,0 +1,155 @@
+#include "llm_prefix_cache.h"
+
+#include "ncnn_llm_gpt.h"
+
+#include <algorithm>
+#include <iterator>
+
+namespace {
+
+constexpr uint64_t kFnvOffset = 1469598103934665603ull;
+constexpr uint64_t kFnvPrime = 1099511628211ull;
+
+// FNV-1a continued over the next block; a block separator keeps "ab"+"c" apart from "a"+"bc",
+// which tokenize differently.
+uint64_t chain_hash(uint64_t h, const std::string& block) {
+    for (unsigned char c : block) {
+        h ^= c;
+        h *= kFnvPrime;
+    }
+    h ^= 0xff;
+    h *= kFnvPrime;
+    return h;
+}
+
+bool prefix_matches(const std::string& prefix, const std::vector<std::string>& blocks, size_t n) {
+    size_t pos = 0;
+    for (size_t i = 0; i < n; ++i) {
+        const std::string& b = blocks[i];
+        if (prefix.compare(pos, b.size(), b) != 0) return false;
+        pos += b.size();
+    }
+    return pos == prefix.size();
+}
+
+} // namespace
+
+std::shared_ptr<ncnn_llm_gpt_ctx> clone_llm_ctx(const ncnn_llm_gpt_ctx& ctx, ncnn::Allocator* allocator) {
+    auto out = std::make_shared<ncnn_llm_gpt_ctx>(ctx);
+    for (auto& kv : out->kv_cache) {
+        kv.first = kv.first.clone(allocator);
+        kv.second = kv.second.clone(allocator);
+    }
+    return out;
+}
+
+size_t llm_ctx_kv_bytes(const ncnn_llm_gpt_ctx& ctx) {
+    size_t total = 0;
+    for (const auto& kv : ctx.kv_cache) {
+        total += static_cast<size_t>(kv.first.total()) * static_cast<size_t>(kv.first.elemsize);
+        total += static_cast<size_t>(kv.second.total()) * static_cast<size_t>(kv.second.elemsize);
+    }
+    return total;
+}
+
+size_t llm_ctx_tokens(const ncnn_llm_gpt_ctx& ctx) {
+    return ctx.kv_cache.empty() ? 0u : static_cast<size_t>(ctx.kv_cache[0].first.h);
+}
+
+LlmPrefixCache::LlmPrefixCache(size_t budget_bytes, KvStoreMode mode, ncnn::Allocator* allocator)
+    : budget_bytes_(budget_bytes), mode_(mode), allocator_(allocator) {
+    stats_.budget_bytes = budget_bytes;
+}
+
+size_t LlmPrefixCache::lookup(const std::vector<std::string>& blocks,
+                              size_t max_blocks,
+                              std::shared_ptr<ncnn_llm_gpt_ctx>* ctx,
+                              size_t* tokens) {
+    if (tokens) *tokens = 0;
+    if (!enabled()) return 0;
+    max_blocks = std::min(max_blocks, blocks.size());
+    std::vector<uint64_t> keys;
+    keys.reserve(max_blocks);
+    uint64_t h = kFnvOffset;
+    for (size_t i = 0; i < max_blocks; ++i) {
+        h = chain_hash(h, blocks[i]);
+        keys.push_back(h);
+    }
+
+    std::shared_ptr<const LlmKvSnapshot> snapshot;
+    size_t n = 0;
+    size_t snapshot_tokens = 0;
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        for (size_t i = keys.size(); i > 0; --i) {
+            auto it = index_.find(keys[i - 1]);
+            if (it == index_.end()) continue;
+            if (!prefix_matches(it->second->prefix, blocks, i)) continue;
+            lru_.splice(lru_.begin(), lru_, it->second);
+            snapshot = it->second->snap;
+            snapshot_tokens = it->second->tokens;
+            n = i;
+            break;
+        }
+        if (n == 0) {
+            ++stats_.misses;
+            return 0;
+        }
+        ++stats_.hits;
+        stats_.saved_tokens += snapshot_tokens;
+    }
+    // Copied outside the lock: the stored snapshot is immutable and kept alive by `snapshot`.
+    *ctx = snapshot->restore(allocator_);
+    if (tokens) *tokens = snapshot_tokens;
+    return n;
+}
+
+void LlmPrefixCache::insert(const std::vector<std::string>& blocks, size_t n_blocks, const std::shared_ptr<ncnn_llm_gpt_ctx>& ctx) {
+    if (!enabled() || !ctx || n_blocks == 0 || n_blocks > blocks.size()) return;
+    if (llm_ctx_kv_bytes(*ctx) == 0) return;
+
+    uint64_t key = kFnvOffset;
+    size_t prefix_len = 0;
+    for (size_t i = 0; i < n_blocks; ++i) {
+        key = chain_hash(key, blocks[i]);
+        prefix_len += blocks[i].size();
+    }
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        if (index_.count(key)) return;
+    }
+
+    Entry e;
+    e.key = key;
+    e.prefix.reserve(prefix_len);
+    for (size_t i = 0; i < n_blocks; ++i) e.prefix += blocks[i];
+    e.snap = LlmKvSnapshot::capture(*ctx, mode_, allocator_);
+    e.tokens = e.snap->tokens();
+    e.bytes = e.snap->bytes();
+    if (e.bytes > budget_bytes_) return;
+    const size_t bytes = e.bytes;
+
+    std::list<Entry> evicted;
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        if (index_.count(key)) return;
+        lru_.push_front(std::move(e));
+        index_[key] = lru_.begin();
+        stats_.bytes += bytes;
+        ++stats_.inserts;
+        while (stats_.bytes > budget_bytes_ && lru_.size() > 1) {
+            auto last = std::prev(lru_.end());
+            stats_.bytes -= last->bytes;
+            index_.erase(last->key);
+            evicted.splice(evicted.begin(), lru_, last);
+            ++stats_.evictions;
+        }
+        stats_.entries = lru_.size();
+    }
+    // Evicted KV memory is released here, after the lock is dropped.
+}
+
+LlmPrefixCacheStats LlmPrefixCache::stats() const {
+    std::lock_guard<std::mutex> lock(mu_);
+    return stats_;
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include "llm_kv_quant.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct ncnn_llm_gpt_ctx;
+namespace ncnn {
+class Allocator;
+}
+
+struct LlmPrefixCacheStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t inserts = 0;
+    uint64_t evictions = 0;
+    uint64_t saved_tokens = 0; // prompt tokens restored instead of prefilled, summed over hits
+    size_t entries = 0;
+    size_t bytes = 0;
+    size_t budget_bytes = 0;
+};
+
+// KV-cache snapshots of prompt prefixes, shared across requests. A prompt is prefilled as a
+// sequence of text blocks; an entry stores the context after its first N blocks, keyed by a
+// chained hash of those blocks, so a new prompt can resume from its longest cached run of
+// leading blocks. Entries are copies stored in the given KvStoreMode and are evicted
+// least-recently-used once their KV bytes exceed the budget. Thread-safe.
+class LlmPrefixCache {
+public:
+    // `allocator` (optional) backs the stored snapshots and the contexts restored from them.
+    explicit LlmPrefixCache(size_t budget_bytes, KvStoreMode mode = KvStoreMode::Float32, ncnn::Allocator* allocator = nullptr);
+
+    bool enabled() const { return budget_bytes_ > 0; }
+
+    // Finds the longest cached prefix of blocks[0 .. max_blocks) and returns how many blocks it
+    // covers (0 = miss). *ctx receives a private copy of the snapshot and *tokens its length.
+    size_t lookup(const std::vector<std::string>& blocks,
+                  size_t max_blocks,
+                  std::shared_ptr<ncnn_llm_gpt_ctx>* ctx,
+                  size_t* tokens);
+
+    // Stores a copy of `ctx` as the state after blocks[0 .. n_blocks).
+    void insert(const std::vector<std::string>& blocks, size_t n_blocks, const std::shared_ptr<ncnn_llm_gpt_ctx>& ctx);
+
+    LlmPrefixCacheStats stats() const;
+
+private:
+    struct Entry {
+        uint64_t key = 0;
+        std::string prefix; // concatenated block text, checked on lookup against hash collisions
+        std::shared_ptr<const LlmKvSnapshot> snap;
+        size_t tokens = 0;
+        size_t bytes = 0;
+    };
+
+    size_t budget_bytes_;
+    KvStoreMode mode_;
+    ncnn::Allocator* allocator_;
+    mutable std::mutex mu_;
+    std::list<Entry> lru_; // most recently used first
+    std::unordered_map<uint64_t, std::list<Entry>::iterator> index_;
+    LlmPrefixCacheStats stats_;
+};
+
+// Deep copy of a context (KV blobs included), so the copy and the source never share KV memory.
+std::shared_ptr<ncnn_llm_gpt_ctx> clone_llm_ctx(const ncnn_llm_gpt_ctx& ctx, ncnn::Allocator* allocator = nullptr);
+size_t llm_ctx_kv_bytes(const ncnn_llm_gpt_ctx& ctx);
+size_t llm_ctx_tokens(const ncnn_llm_gpt_ctx& ctx);
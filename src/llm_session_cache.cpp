@@ -0,0 +1,110 @@
+#include "llm_session_cache.h"
+
+#include <algorithm>
+#include <chrono>
+
+namespace {
+
+int64_t steady_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+} // namespace
+
+bool messages_extend(const std::vector<Message>& history, const std::vector<Message>& messages) {
+    if (history.empty() || history.size() >= messages.size()) return false;
+    for (size_t i = 0; i < history.size(); ++i) {
+        if (history[i].role != messages[i].role || history[i].content != messages[i].content) return false;
+    }
+    return true;
+}
+
+LlmSessionCache::LlmSessionCache(size_t budget_bytes, int idle_timeout_sec, KvStoreMode mode, ncnn::Allocator* allocator)
+    : budget_bytes_(budget_bytes),
+      idle_timeout_ms_(static_cast<int64_t>(std::max(0, idle_timeout_sec)) * 1000),
+      mode_(mode),
+      allocator_(allocator) {
+    stats_.budget_bytes = budget_bytes;
+}
+
+void LlmSessionCache::evict_locked(int64_t now_ms, size_t extra, std::vector<LlmSession>* dropped) {
+    if (idle_timeout_ms_ > 0) {
+        for (auto it = slots_.begin(); it != slots_.end();) {
+            if (now_ms - it->second.last_used_ms > idle_timeout_ms_) {
+                stats_.bytes -= it->second.session.bytes;
+                dropped->push_back(std::move(it->second.session));
+                it = slots_.erase(it);
+                ++stats_.idle_evictions;
+            } else {
+                ++it;
+            }
+        }
+    }
+    while (!slots_.empty() && stats_.bytes + extra > budget_bytes_) {
+        auto oldest = std::min_element(slots_.begin(), slots_.end(), [](const auto& a, const auto& b) {
+            return a.second.last_used_tick < b.second.last_used_tick;
+        });
+        stats_.bytes -= oldest->second.session.bytes;
+        dropped->push_back(std::move(oldest->second.session));
+        slots_.erase(oldest);
+        ++stats_.evictions;
+    }
+    stats_.sessions = slots_.size();
+}
+
+bool LlmSessionCache::take(const std::string& id, LlmSession* out) {
+    if (!enabled() || id.empty()) return false;
+    std::vector<LlmSession> dropped;
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        evict_locked(steady_ms(), 0, &dropped);
+        auto it = slots_.find(id);
+        if (it == slots_.end()) {
+            ++stats_.misses;
+            return false;
+        }
+        stats_.bytes -= it->second.session.bytes;
+        *out = std::move(it->second.session);
+        slots_.erase(it);
+        stats_.sessions = slots_.size();
+        ++stats_.hits;
+    }
+    if (out->packed) {
+        out->ctx = out->packed->restore(allocator_);
+        out->packed.reset();
+    }
+    return true;
+}
+
+void LlmSessionCache::put(const std::string& id, LlmSession session) {
+    if (!enabled() || id.empty() || !session.ctx) return;
+    if (mode_ != KvStoreMode::Float32) {
+        // Converted before taking the lock; the live fp32 context is released here.
+        session.packed = LlmKvSnapshot::capture(*session.ctx, mode_);
+        session.ctx.reset();
+        session.bytes = session.packed->bytes();
+    }
+    if (session.bytes > budget_bytes_) return;
+    std::vector<LlmSession> dropped;
+    std::lock_guard<std::mutex> lock(mu_);
+    const int64_t now = steady_ms();
+    auto it = slots_.find(id);
+    if (it != slots_.end()) {
+        // A concurrent turn of the same session finished first; keep the newer state.
+        stats_.bytes -= it->second.session.bytes;
+        dropped.push_back(std::move(it->second.session));
+        slots_.erase(it);
+    }
+    evict_locked(now, session.bytes, &dropped);
+    stats_.bytes += session.bytes;
+    Slot& slot = slots_[id];
+    slot.session = std::move(session);
+    slot.last_used_ms = now;
+    slot.last_used_tick = ++tick_;
+    stats_.sessions = slots_.size();
+}
+
+LlmSessionCacheStats LlmSessionCache::stats() const {
+    std::lock_guard<std::mutex> lock(mu_);
+    return stats_;
+}
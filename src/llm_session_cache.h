@@ -0,0 +1,81 @@
+#pragma once
+
+#include "llm_kv_quant.h"
+#include "utils/prompt.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct ncnn_llm_gpt_ctx;
+
+// KV state left behind by the last turn of a conversation.
+struct LlmSession {
+    std::vector<Message> client_messages; // history as the client sends it, incl. the last reply
+    std::vector<Message> prompt_messages; // the same turns as they were rendered for the model
+    std::string text;                     // templated text whose KV is held in ctx
+    std::shared_ptr<ncnn_llm_gpt_ctx> ctx;
+    std::shared_ptr<const LlmKvSnapshot> packed; // replaces ctx while stored in a non-fp32 mode
+    size_t tokens = 0;
+    size_t bytes = 0;
+};
+
+struct LlmSessionCacheStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;      // dropped to stay under the memory cap
+    uint64_t idle_evictions = 0; // dropped after the idle timeout
+    size_t sessions = 0;
+    size_t bytes = 0;
+    size_t budget_bytes = 0;
+};
+
+// Per-session KV caches for multi-turn chat, keyed by the client's session_id. A turn takes the
+// session's state out of the cache (so concurrent turns of one session never share a context)
+// and puts the updated state back after generation. Sessions idle for longer than the timeout
+// are dropped on the next access, and the least recently used ones are dropped whenever the
+// total KV bytes exceed the budget. With a non-fp32 KvStoreMode, stored states are converted on
+// put and restored to fp32 on take. Thread-safe.
+class LlmSessionCache {
+public:
+    // `allocator` (optional) backs the contexts restored from non-fp32 states.
+    LlmSessionCache(size_t budget_bytes,
+                    int idle_timeout_sec,
+                    KvStoreMode mode = KvStoreMode::Float32,
+                    ncnn::Allocator* allocator = nullptr);
+
+    bool enabled() const { return budget_bytes_ > 0; }
+
+    // Moves the session's state into *out. Returns false when there is none.
+    bool take(const std::string& id, LlmSession* out);
+    void put(const std::string& id, LlmSession session);
+
+    LlmSessionCacheStats stats() const;
+
+private:
+    struct Slot {
+        LlmSession session;
+        int64_t last_used_ms = 0;
+        uint64_t last_used_tick = 0; // LRU order; ms stamps tie within a millisecond
+    };
+
+    size_t budget_bytes_;
+    int64_t idle_timeout_ms_;
+    KvStoreMode mode_;
+    ncnn::Allocator* allocator_;
+    mutable std::mutex mu_;
+    std::unordered_map<std::string, Slot> slots_;
+    LlmSessionCacheStats stats_;
+    uint64_t tick_ = 0;
+
+    // Removes idle sessions, then LRU ones until `extra` more bytes fit. Caller holds mu_;
+    // the dropped states are moved to *dropped so they are freed after the lock is released.
+    void evict_locked(int64_t now_ms, size_t extra, std::vector<LlmSession>* dropped);
+};
+
+// True when `history` is a strict prefix of `messages` (same roles and contents).
+bool messages_extend(const std::vector<Message>& history, const std::vector<Message>& messages);
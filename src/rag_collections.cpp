@@ -0,0 +1,298 @@
+#include "rag_collections.h"
+
+#include "rag_vector_db.h"
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+
+struct RagCollections::Handle::Entry {
+    std::string name;
+    std::string path;
+    bool is_default = false;
+
+    // Per-collection lock; plays the role of the global RAG mutex for this store only.
+    std::mutex mu;
+    std::unique_ptr<RagVectorDb> db; // owned store of a named collection, changed under mu
+    RagVectorDb* external_db = nullptr;
+    std::mutex* external_mu = nullptr;
+
+    // Guarded by RagCollections::mu_.
+    int pins = 0;
+    bool loaded = false;
+    uint64_t last_used_tick = 0;
+    int64_t last_used_ms = 0;
+};
+
+namespace {
+
+constexpr size_t kMaxNameLength = 64;
+
+int64_t now_epoch_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+} // namespace
+
+RagCollections::Handle::~Handle() {
+    release();
+}
+
+RagCollections::Handle::Handle(Handle&& other) noexcept
+    : owner_(other.owner_), entry_(std::move(other.entry_)), db_(other.db_), mu_(other.mu_) {
+    other.owner_ = nullptr;
+    other.db_ = nullptr;
+    other.mu_ = nullptr;
+}
+
+RagCollections::Handle& RagCollections::Handle::operator=(Handle&& other) noexcept {
+    if (this != &other) {
+        release();
+        owner_ = other.owner_;
+        entry_ = std::move(other.entry_);
+        db_ = other.db_;
+        mu_ = other.mu_;
+        other.owner_ = nullptr;
+        other.db_ = nullptr;
+        other.mu_ = nullptr;
+    }
+    return *this;
+}
+
+const std::string& RagCollections::Handle::name() const {
+    static const std::string empty;
+    return entry_ ? entry_->name : empty;
+}
+
+bool RagCollections::Handle::is_default() const {
+    return entry_ && entry_->is_default;
+}
+
+void RagCollections::Handle::release() {
+    if (owner_ && entry_) owner_->unpin(entry_.get());
+    owner_ = nullptr;
+    entry_.reset();
+    db_ = nullptr;
+    mu_ = nullptr;
+}
+
+RagCollections::RagCollections(std::string root_dir, int embed_dim, int near_dup_bits, size_t max_loaded)
+    : root_dir_(std::move(root_dir)),
+      embed_dim_(embed_dim),
+      near_dup_bits_(near_dup_bits),
+      max_loaded_(std::max<size_t>(1, max_loaded)) {}
+
+RagCollections::~RagCollections() = default;
+
+bool RagCollections::valid_name(const std::string& name) {
+    if (name.empty() || name.size() > kMaxNameLength) return false;
+    for (char c : name) {
+        bool ok = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' || c == '-';
+        if (!ok) return false;
+    }
+    return true;
+}
+
+std::string RagCollections::path_for(const std::string& name) const {
+    return (std::filesystem::path(root_dir_) / (name + ".sqlite")).string();
+}
+
+void RagCollections::add_default(RagVectorDb* db, std::mutex* mu) {
+    auto e = std::make_shared<Entry>();
+    e->name = kDefaultName;
+    e->is_default = true;
+    e->external_db = db;
+    e->external_mu = mu;
+    e->loaded = true;
+    std::lock_guard<std::mutex> lock(mu_);
+    entries_[kDefaultName] = std::move(e);
+}
+
+bool RagCollections::acquire(const std::string& name, bool create, Handle* out, bool* not_found, std::string* err) {
+    if (not_found) *not_found = false;
+    const std::string key = name.empty() ? std::string(kDefaultName) : name;
+    if (key != kDefaultName && !valid_name(key)) {
+        if (err) *err = "invalid collection name (use 1-64 chars of A-Z a-z 0-9 _ -)";
+        return false;
+    }
+
+    Handle h;
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        auto it = entries_.find(key);
+        if (it == entries_.end()) {
+            if (key == kDefaultName) {
+                if (not_found) *not_found = true;
+                if (err) *err = "default collection is not available";
+                return false;
+            }
+            std::string path = path_for(key);
+            std::error_code ec;
+            if (!create && !std::filesystem::exists(path, ec)) {
+                if (not_found) *not_found = true;
+                if (err) *err = "collection not found: " + key;
+                return false;
+            }
+            auto e = std::make_shared<Entry>();
+            e->name = key;
+            e->path = std::move(path);
+            it = entries_.emplace(key, std::move(e)).first;
+        }
+        Entry* e = it->second.get();
+        ++e->pins;
+        e->last_used_tick = ++tick_;
+        e->last_used_ms = now_epoch_ms();
+        h.owner_ = this;
+        h.entry_ = it->second;
+    }
+
+    Entry* e = h.entry_.get();
+    if (e->is_default) {
+        h.db_ = e->external_db;
+        h.mu_ = e->external_mu;
+        *out = std::move(h);
+        return true;
+    }
+
+    bool opened = false;
+    {
+        // Only callers of this collection wait for it to open; other collections are unaffected.
+        std::lock_guard<std::mutex> lock(e->mu);
+        if (!e->db) {
+            std::error_code ec;
+            if (!create && !std::filesystem::exists(e->path, ec)) {
+                if (not_found) *not_found = true;
+                if (err) *err = "collection not found: " + e->name;
+                return false;
+            }
+            std::filesystem::create_directories(root_dir_, ec);
+            auto db = std::make_unique<RagVectorDb>();
+            db->set_near_dup_distance(near_dup_bits_);
+            if (!db->open(e->path, embed_dim_, err)) return false;
+            e->db = std::move(db);
+            opened = true;
+        }
+        h.db_ = e->db.get();
+        h.mu_ = &e->mu;
+    }
+    if (opened) {
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+            e->loaded = true;
+        }
+        evict_idle();
+    }
+    *out = std::move(h);
+    return true;
+}
+
+void RagCollections::unpin(Entry* entry) {
+    bool evict = false;
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        --entry->pins;
+        evict = !entry->is_default && entry->pins == 0;
+    }
+    // A collection that was pinned when the limit was crossed can only be closed now.
+    if (evict) evict_idle();
+}
+
+void RagCollections::evict_idle() {
+    std::vector<std::shared_ptr<Entry>> victims;
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        std::vector<std::shared_ptr<Entry>> idle;
+        size_t loaded = 0;
+        for (auto& kv : entries_) {
+            Entry* e = kv.second.get();
+            if (e->is_default || !e->loaded) continue;
+            ++loaded;
+            if (e->pins == 0) idle.push_back(kv.second);
+        }
+        if (loaded <= max_loaded_) return;
+        std::sort(idle.begin(), idle.end(), [](const std::shared_ptr<Entry>& a, const std::shared_ptr<Entry>& b) {
+            return a->last_used_tick < b->last_used_tick;
+        });
+        for (auto& e : idle) {
+            if (loaded <= max_loaded_) break;
+            // Unpinned entries are normally unlocked; skip one that is still finishing an open.
+            if (!e->mu.try_lock()) continue;
+            e->loaded = false;
+            victims.push_back(e);
+            --loaded;
+        }
+    }
+    // Closing checkpoints the WAL, so it happens outside the registry lock. The entry lock stays
+    // held until the connection is gone: a request that re-pins the collection meanwhile waits
+    // and then reopens it, instead of racing the close for the database file.
+    for (auto& e : victims) {
+        e->db.reset();
+        e->mu.unlock();
+    }
+}
+
+std::vector<RagCollectionInfo> RagCollections::list() {
+    std::vector<RagCollectionInfo> out;
+    std::vector<Handle> pinned;
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        for (auto& kv : entries_) {
+            Entry* e = kv.second.get();
+            RagCollectionInfo info;
+            info.name = e->name;
+            info.loaded = e->loaded;
+            info.is_default = e->is_default;
+            info.last_used_ms = e->last_used_ms;
+            out.push_back(std::move(info));
+            if (e->loaded) {
+                // Pin loaded collections so their counters can be read after the registry lock is released.
+                Handle h;
+                ++e->pins;
+                h.owner_ = this;
+                h.entry_ = kv.second;
+                h.db_ = e->is_default ? e->external_db : e->db.get();
+                h.mu_ = e->is_default ? e->external_mu : &e->mu;
+                pinned.push_back(std::move(h));
+            }
+        }
+    }
+
+    std::error_code ec;
+    for (std::filesystem::directory_iterator it(root_dir_, ec), end; !ec && it != end; it.increment(ec)) {
+        const auto& p = it->path();
+        if (p.extension() != ".sqlite") continue;
+        std::string name = p.stem().string();
+        if (!valid_name(name) || name == kDefaultName) continue;
+        bool known = std::any_of(out.begin(), out.end(), [&](const RagCollectionInfo& c) { return c.name == name; });
+        if (known) continue;
+        RagCollectionInfo info;
+        info.name = std::move(name);
+        out.push_back(std::move(info));
+    }
+
+    for (auto& h : pinned) {
+        if (!h.db_) continue;
+        std::lock_guard<std::mutex> lock(h.mutex());
+        for (auto& info : out) {
+            if (info.name != h.name()) continue;
+            info.doc_count = h.db().doc_count();
+            info.chunk_count = h.db().chunk_count();
+        }
+    }
+    pinned.clear();
+
+    std::sort(out.begin(), out.end(), [](const RagCollectionInfo& a, const RagCollectionInfo& b) {
+        if (a.is_default != b.is_default) return a.is_default;
+        return a.name < b.name;
+    });
+    return out;
+}
+
+size_t RagCollections::loaded_count() {
+    std::lock_guard<std::mutex> lock(mu_);
+    size_t n = 0;
+    for (auto& kv : entries_) {
+        if (!kv.second->is_default && kv.second->loaded) ++n;
+    }
+    return n;
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class RagVectorDb;
+
+struct RagCollectionInfo {
+    std::string name;
+    bool loaded = false;
+    bool is_default = false;
+    size_t doc_count = 0;   // only filled in for loaded collections
+    size_t chunk_count = 0;
+    int64_t last_used_ms = 0; // 0 = not used since startup
+};
+
+// Named RAG collections. Each one is an independent RagVectorDb stored as "<root>/<name>.sqlite"
+// with its own lock, so ingest into one collection never waits on queries against another.
+// Collections are opened on first use; once more than `max_loaded` are open, the least recently
+// used idle ones are closed again (dropping their SQLite caches and near-duplicate index).
+// The default collection is the server's main --db store, registered with add_default(); it is
+// never unloaded.
+class RagCollections {
+public:
+    static constexpr const char* kDefaultName = "default";
+
+    RagCollections(std::string root_dir, int embed_dim, int near_dup_bits, size_t max_loaded);
+    ~RagCollections();
+    RagCollections(const RagCollections&) = delete;
+    RagCollections& operator=(const RagCollections&) = delete;
+
+    // 1-64 chars of [A-Za-z0-9_-]; names map directly to file names.
+    static bool valid_name(const std::string& name);
+
+    // Keeps a collection loaded while alive. Lock mutex() around every use of db().
+    class Handle {
+    public:
+        Handle() = default;
+        ~Handle();
+        Handle(Handle&& other) noexcept;
+        Handle& operator=(Handle&& other) noexcept;
+        Handle(const Handle&) = delete;
+        Handle& operator=(const Handle&) = delete;
+
+        explicit operator bool() const { return db_ != nullptr; }
+        RagVectorDb& db() const { return *db_; }
+        std::mutex& mutex() const { return *mu_; }
+        const std::string& name() const;
+        bool is_default() const;
+
+    private:
+        friend class RagCollections;
+        struct Entry;
+        RagCollections* owner_ = nullptr;
+        std::shared_ptr<Entry> entry_;
+        RagVectorDb* db_ = nullptr;
+        std::mutex* mu_ = nullptr;
+
+        void release();
+    };
+
+    // Registers the server's main store under kDefaultName (and the empty name).
+    void add_default(RagVectorDb* db, std::mutex* mu);
+
+    // Pins the named collection, opening it if needed. With create=false a collection that has
+    // no file yet is reported as not found (*not_found set) instead of being created.
+    bool acquire(const std::string& name, bool create, Handle* out, bool* not_found, std::string* err);
+
+    // Known collections: the default one, every "<root>/*.sqlite" file and any loaded entry.
+    std::vector<RagCollectionInfo> list();
+
+    size_t loaded_count();
+    size_t max_loaded() const { return max_loaded_; }
+
+private:
+    using Entry = Handle::Entry;
+
+    std::string root_dir_;
+    int embed_dim_;
+    int near_dup_bits_;
+    size_t max_loaded_;
+
+    std::mutex mu_; // guards entries_ and the bookkeeping fields of each entry
+    std::unordered_map<std::string, std::shared_ptr<Entry>> entries_;
+    uint64_t tick_ = 0;
+
+    std::string path_for(const std::string& name) const;
+    void unpin(Entry* entry);
+    void evict_idle();
+};
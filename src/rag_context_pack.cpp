@@ -0,0 +1,138 @@
+#include "rag_context_pack.h"
+
+#include <algorithm>
+#include <unordered_map>
+
+namespace {
+
+// Starting point for Qwen-style BPE vocabularies: ~4 ASCII bytes per token, ~1.4 CJK characters
+// per token, ~2 bytes per token for other scripts. Calibration corrects the overall level.
+constexpr double kTokensPerAsciiByte = 0.25;
+constexpr double kTokensPerCjkChar = 0.7;
+constexpr double kTokensPerOtherByte = 0.5;
+// Weight of a new observation; a prompt already holds thousands of characters, so a few
+// requests are enough to settle.
+constexpr double kCalibrationRate = 0.2;
+
+double raw_estimate(const std::string& text) {
+    size_t ascii = 0;
+    size_t cjk = 0;
+    size_t other = 0;
+    for (size_t i = 0; i < text.size();) {
+        unsigned char c = static_cast<unsigned char>(text[i]);
+        if (c < 0x80) {
+            ++ascii;
+            ++i;
+        } else if (c >= 0xE3 && c <= 0xE9 && i + 2 < text.size()) {
+            // U+3000..U+9FFF: CJK punctuation, kana, unified ideographs.
+            ++cjk;
+            i += 3;
+        } else {
+            ++other;
+            ++i;
+        }
+    }
+    return ascii * kTokensPerAsciiByte + cjk * kTokensPerCjkChar + other * kTokensPerOtherByte;
+}
+
+size_t utf8_floor(const std::string& s, size_t pos) {
+    if (pos >= s.size()) return s.size();
+    while (pos > 0 && (static_cast<unsigned char>(s[pos]) & 0xC0) == 0x80) --pos;
+    return pos;
+}
+
+// Longest prefix of `text` estimated to fit `tokens`, cut after a newline or space when one is
+// close to the limit.
+std::string cut_to_tokens(const std::string& text, size_t tokens, const TokenEstimator& estimator) {
+    size_t lo = 0;
+    size_t hi = text.size();
+    while (lo < hi) {
+        size_t mid = utf8_floor(text, lo + (hi - lo + 1) / 2);
+        if (mid <= lo) break;
+        if (estimator.estimate(text.substr(0, mid)) <= tokens) lo = mid;
+        else hi = mid - 1;
+    }
+    size_t end = utf8_floor(text, lo);
+    size_t window = std::min<size_t>(end, 200);
+    for (size_t i = end; i > end - window; --i) {
+        char c = text[i - 1];
+        if (c == '\n' || c == ' ') {
+            end = i;
+            break;
+        }
+    }
+    return text.substr(0, end);
+}
+
+} // namespace
+
+size_t TokenEstimator::estimate(const std::string& text) const {
+    double s;
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        s = scale_;
+    }
+    return static_cast<size_t>(raw_estimate(text) * s + 0.5);
+}
+
+void TokenEstimator::observe(const std::string& text, size_t actual_tokens) {
+    const double raw = raw_estimate(text);
+    if (raw < 1.0 || actual_tokens == 0) return;
+    const double ratio = std::max(0.25, std::min(4.0, actual_tokens / raw));
+    std::lock_guard<std::mutex> lock(mu_);
+    scale_ = samples_ == 0 ? ratio : scale_ + (ratio - scale_) * kCalibrationRate;
+    ++samples_;
+}
+
+double TokenEstimator::scale() const {
+    std::lock_guard<std::mutex> lock(mu_);
+    return scale_;
+}
+
+std::string rag_context_header(size_t index, const std::string& source) {
+    return "[" + std::to_string(index) + "] Source: " + source + "\n";
+}
+
+RagPackResult pack_rag_hits(std::vector<RagSearchHit>* hits, const RagPackOptions& opt, const TokenEstimator& estimator) {
+    RagPackResult r;
+    r.candidates = hits->size();
+    std::stable_sort(hits->begin(), hits->end(), [](const RagSearchHit& a, const RagSearchHit& b) { return a.score > b.score; });
+
+    std::vector<RagSearchHit> kept;
+    std::unordered_map<size_t, size_t> per_doc;
+    bool full = false;
+    for (auto& hit : *hits) {
+        if (opt.min_score > 0.0 && hit.score < opt.min_score) {
+            ++r.dropped_score;
+            continue;
+        }
+        if (opt.max_per_doc > 0 && per_doc[hit.doc_id] >= opt.max_per_doc) {
+            ++r.dropped_doc_cap;
+            continue;
+        }
+        if (full) {
+            ++r.dropped_budget;
+            continue;
+        }
+        const size_t header = estimator.estimate(rag_context_header(kept.size() + 1, hit.source)) + 1;
+        const size_t cost = header + estimator.estimate(hit.text);
+        if (opt.budget_tokens == 0 || r.used_tokens + cost <= opt.budget_tokens) {
+            r.used_tokens += cost;
+        } else {
+            const size_t left = opt.budget_tokens - std::min(opt.budget_tokens, r.used_tokens);
+            full = true;
+            if (left < header + opt.min_tail_tokens) {
+                ++r.dropped_budget;
+                continue;
+            }
+            const size_t ellipsis = estimator.estimate("...");
+            hit.text = cut_to_tokens(hit.text, left - header - std::min(ellipsis, left - header), estimator) + "...";
+            r.used_tokens += header + estimator.estimate(hit.text);
+            r.truncated = true;
+        }
+        ++per_doc[hit.doc_id];
+        kept.push_back(std::move(hit));
+    }
+    *hits = std::move(kept);
+    return r;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include "rag_vector_db.h"
+
+#include <cstddef>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Estimates how many LLM tokens a text costs. ncnn_llm does not expose its tokenizer, so the
+// estimate is a per-script character model (ASCII, CJK, other UTF-8) scaled by a factor that is
+// calibrated against the real prompt token counts observed after prefill. Thread-safe.
+class TokenEstimator {
+public:
+    size_t estimate(const std::string& text) const;
+    // Feeds the token count the model actually produced for `text`.
+    void observe(const std::string& text, size_t actual_tokens);
+    double scale() const;
+
+private:
+    mutable std::mutex mu_;
+    double scale_ = 1.0;
+    size_t samples_ = 0;
+};
+
+struct RagPackOptions {
+    size_t budget_tokens = 0;  // 0 = no budget
+    double min_score = 0.0;    // hits scoring below are dropped, 0 = keep all
+    size_t max_per_doc = 0;    // hits kept per document, 0 = unlimited
+    size_t min_tail_tokens = 64; // smallest truncated hit worth adding when the budget runs out
+};
+
+struct RagPackResult {
+    size_t candidates = 0;
+    size_t used_tokens = 0; // estimated, including the per-source headers
+    size_t dropped_score = 0;
+    size_t dropped_doc_cap = 0;
+    size_t dropped_budget = 0;
+    bool truncated = false;
+};
+
+// Header build_rag_context() writes before hit number `index` (1-based).
+std::string rag_context_header(size_t index, const std::string& source);
+
+// Greedily keeps the best-scoring hits that fit the token budget, best first. The first hit that
+// does not fit is cut at a word or line boundary when at least min_tail_tokens remain.
+RagPackResult pack_rag_hits(std::vector<RagSearchHit>* hits, const RagPackOptions& opt, const TokenEstimator& estimator);
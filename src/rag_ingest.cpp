@@ -2,19 +2,34 @@
 
 #include "rag_text.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cstdlib>
 #include <cstdio>
 #include <cstdint>
 #include <filesystem>
 #include <fstream>
+#include <map>
+#include <mutex>
 #include <sstream>
 #include <string>
+#include <thread>
+#include <vector>
 
 #if defined(_WIN32)
 #include <windows.h>
 #else
 #include <iconv.h>
 #include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char** environ;
 #endif
 
 namespace fs = std::filesystem;
@@ -257,6 +272,26 @@ std::string shell_escape(const std::string& s) {
 #endif
 }
 
+// Length of the longest prefix of `s` that does not end inside a multi-byte UTF-8 sequence.
+size_t utf8_complete_prefix_len(const std::string& s) {
+    const size_t n = s.size();
+    size_t i = n;
+    while (i > 0 && n - i < 4) {
+        unsigned char c = static_cast<unsigned char>(s[i - 1]);
+        if ((c & 0xC0) != 0x80) {
+            size_t need = 1;
+            if (c >= 0xF0) need = 4;
+            else if (c >= 0xE0) need = 3;
+            else if (c >= 0xC0) need = 2;
+            return (n - (i - 1) >= need) ? n : i - 1;
+        }
+        --i;
+    }
+    return n;
+}
+
+constexpr size_t kTextReadBlock = 64 * 1024;
+
 bool command_exists(const std::string& name) {
 #ifdef _WIN32
     std::string cmd = "where " + name + " >nul 2>nul";
@@ -267,6 +302,146 @@ bool command_exists(const std::string& name) {
 #endif
 }
 
+// command_exists() spawns a shell, so probe each tool once per process.
+bool tool_available(const std::string& name) {
+    static std::mutex mu;
+    static std::map<std::string, bool> cache;
+    std::lock_guard<std::mutex> lock(mu);
+    auto it = cache.find(name);
+    if (it != cache.end()) return it->second;
+    bool ok = command_exists(name);
+    cache.emplace(name, ok);
+    return ok;
+}
+
+// Runs a tool (looked up in PATH) and captures its stdout; stderr is discarded. Fails on spawn
+// error, non-zero exit, or when the tool is still running after timeout_ms (it is then killed).
+bool run_capture(const std::vector<std::string>& args, int timeout_ms, std::string* out, std::string* err) {
+    out->clear();
+#ifdef _WIN32
+    // No timeout here: popen() gives no handle to the child.
+    (void)timeout_ms;
+    std::string cmd;
+    for (const auto& a : args) {
+        if (!cmd.empty()) cmd.push_back(' ');
+        cmd += (&a == &args.front()) ? a : shell_escape(a);
+    }
+    FILE* pipe = popen(cmd.c_str(), "r");
+    if (!pipe) {
+        if (err) *err = "failed to execute " + args.front();
+        return false;
+    }
+    char buf[4096];
+    while (true) {
+        size_t n = fread(buf, 1, sizeof(buf), pipe);
+        if (n > 0) out->append(buf, n);
+        if (n < sizeof(buf)) break;
+    }
+    if (pclose(pipe) != 0) {
+        if (err) *err = args.front() + " failed";
+        return false;
+    }
+    return true;
+#else
+    // Both ends close-on-exec: several extractions run concurrently, and a write end leaked into
+    // another child would hold off EOF on this pipe until that child exits.
+    int fds[2];
+#if defined(__linux__)
+    if (pipe2(fds, O_CLOEXEC) != 0) {
+#else
+    if (pipe(fds) != 0) {
+#endif
+        if (err) *err = "pipe failed";
+        return false;
+    }
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+    posix_spawn_file_actions_addclose(&actions, fds[1]);
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+
+    std::vector<char*> argv;
+    argv.reserve(args.size() + 1);
+    for (const auto& a : args) argv.push_back(const_cast<char*>(a.c_str()));
+    argv.push_back(nullptr);
+
+    // Own process group, so a timeout kills anything the tool started as well.
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+    posix_spawnattr_setpgroup(&attr, 0);
+
+    pid_t pid = 0;
+    int rc = posix_spawnp(&pid, argv[0], &actions, &attr, argv.data(), environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    ::close(fds[1]);
+    if (rc != 0) {
+        ::close(fds[0]);
+        if (err) *err = "failed to execute " + args.front();
+        return false;
+    }
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    bool timed_out = false;
+    char buf[16 * 1024];
+    while (true) {
+        int wait_ms = -1;
+        if (timeout_ms > 0) {
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+            if (left <= 0) {
+                timed_out = true;
+                break;
+            }
+            wait_ms = static_cast<int>(left);
+        }
+        struct pollfd pfd = {fds[0], POLLIN, 0};
+        int prc = ::poll(&pfd, 1, wait_ms);
+        if (prc < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (prc == 0) continue;
+        ssize_t n = ::read(fds[0], buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        out->append(buf, static_cast<size_t>(n));
+    }
+    ::close(fds[0]);
+    if (timed_out) ::kill(-pid, SIGKILL);
+
+    int status = 0;
+    while (::waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+    }
+    if (timed_out) {
+        if (err) *err = args.front() + " timed out";
+        return false;
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        if (err) *err = args.front() + " failed";
+        return false;
+    }
+    return true;
+#endif
+}
+
+// Page count from `pdfinfo`, or 0 when it is unavailable or the output has no "Pages:" line.
+int pdf_page_count(const fs::path& path, int timeout_ms) {
+    if (!tool_available("pdfinfo")) return 0;
+    std::string info;
+    if (!run_capture({"pdfinfo", path.string()}, timeout_ms, &info, nullptr)) return 0;
+    std::istringstream iss(info);
+    std::string line;
+    while (std::getline(iss, line)) {
+        if (line.compare(0, 6, "Pages:") != 0) continue;
+        return std::atoi(line.c_str() + 6);
+    }
+    return 0;
+}
+
 } // namespace
 
 bool normalize_utf8(std::string* s, std::string* err) {
@@ -372,31 +547,83 @@ bool read_text_file(const fs::path& path, std::string* out, std::string* err) {
 }
 
 bool extract_pdf_text(const fs::path& path, std::string* out, std::string* err) {
-    if (!command_exists("pdftotext")) {
+    return extract_pdf_text(path, PdfExtractOptions(), out, err);
+}
+
+bool extract_pdf_text(const fs::path& path, const PdfExtractOptions& opt, std::string* out, std::string* err) {
+    if (!tool_available("pdftotext")) {
         if (err) *err = "pdftotext not found; please install poppler-utils";
         return false;
     }
-    std::string cmd = "pdftotext -layout -q -enc UTF-8 " + shell_escape(path.string()) + " -";
-    FILE* pipe = popen(cmd.c_str(), "r");
-    if (!pipe) {
-        if (err) *err = "failed to execute pdftotext";
-        return false;
-    }
-
+    const int page_timeout_ms = std::max(1, opt.page_timeout_sec) * 1000;
+    const std::string file = path.string();
+
+    // Small or unknown page counts: one pdftotext over the whole file.
+    int pages = pdf_page_count(path, page_timeout_ms);
+    int workers = opt.workers > 0 ? opt.workers : static_cast<int>(std::thread::hardware_concurrency());
+    workers = std::max(1, workers);
+    const int min_pages_per_job = std::max(1, opt.min_pages_per_job);
     std::string result;
-    char buf[4096];
-    while (true) {
-        size_t n = fread(buf, 1, sizeof(buf), pipe);
-        if (n > 0) result.append(buf, n);
-        if (n < sizeof(buf)) break;
-    }
-    int rc = pclose(pipe);
-    if (rc != 0) {
-        if (err) *err = "pdftotext failed";
-        return false;
+    if (pages <= min_pages_per_job || workers == 1) {
+        int timeout_ms = pages > 0 ? page_timeout_ms * pages + 10000 : 0;
+        if (!run_capture({"pdftotext", "-layout", "-q", "-enc", "UTF-8", file, "-"}, timeout_ms, &result, err)) {
+            return false;
+        }
+    } else {
+        // Page ranges handed out to a bounded pool of pdftotext processes. Roughly four jobs per
+        // worker keeps the tail short when some pages are much slower than others.
+        int per_job = std::max(min_pages_per_job, (pages + workers * 4 - 1) / (workers * 4));
+        struct Job {
+            int first = 0;
+            int last = 0;
+            std::string text;
+            std::string err;
+            bool ok = false;
+        };
+        std::vector<Job> jobs;
+        for (int first = 1; first <= pages; first += per_job) {
+            Job job;
+            job.first = first;
+            job.last = std::min(pages, first + per_job - 1);
+            jobs.push_back(std::move(job));
+        }
+        workers = std::min(workers, static_cast<int>(jobs.size()));
+
+        std::atomic<size_t> next{0};
+        std::atomic<bool> failed{false};
+        auto run_jobs = [&]() {
+            while (!failed) {
+                size_t i = next.fetch_add(1);
+                if (i >= jobs.size()) break;
+                Job& job = jobs[i];
+                int timeout_ms = page_timeout_ms * (job.last - job.first + 1);
+                job.ok = run_capture({"pdftotext", "-layout", "-q", "-enc", "UTF-8",
+                                      "-f", std::to_string(job.first), "-l", std::to_string(job.last),
+                                      file, "-"},
+                                     timeout_ms, &job.text, &job.err);
+                if (!job.ok) failed = true;
+            }
+        };
+        std::vector<std::thread> pool;
+        pool.reserve(static_cast<size_t>(workers));
+        for (int i = 0; i < workers; ++i) pool.emplace_back(run_jobs);
+        for (auto& t : pool) t.join();
+
+        size_t total = 0;
+        for (const auto& job : jobs) {
+            if (!job.ok && !job.err.empty()) {
+                if (err) *err = job.err + " (pages " + std::to_string(job.first) + "-" + std::to_string(job.last) + ")";
+                return false;
+            }
+            total += job.text.size();
+        }
+        // Each range ends with its own form feed, so concatenating in page order matches the
+        // output of a single whole-document run.
+        result.reserve(total);
+        for (const auto& job : jobs) result += job.text;
     }
 
-    *out = result;
+    *out = std::move(result);
     std::string norm_err;
     if (!normalize_utf8(out, &norm_err)) {
         if (err) *err = norm_err;
@@ -409,3 +636,153 @@ bool extract_pdf_text(const fs::path& path, std::string* out, std::string* err)
     }
     return true;
 }
+
+bool hash_file_contents(const fs::path& path, std::string* out_hex, std::string* err) {
+    std::ifstream ifs(path, std::ios::in | std::ios::binary);
+    if (!ifs) {
+        if (err) *err = "failed to open file";
+        return false;
+    }
+    uint64_t h = 14695981039346656037ull;
+    std::string block(kTextReadBlock, '\0');
+    while (ifs) {
+        ifs.read(&block[0], static_cast<std::streamsize>(block.size()));
+        const size_t n = static_cast<size_t>(ifs.gcount());
+        for (size_t i = 0; i < n; ++i) {
+            h ^= static_cast<unsigned char>(block[i]);
+            h *= 1099511628211ull;
+        }
+    }
+    if (ifs.bad()) {
+        if (err) *err = "failed to read file";
+        return false;
+    }
+    char buf[17];
+    std::snprintf(buf, sizeof(buf), "%016llx", static_cast<unsigned long long>(h));
+    if (out_hex) *out_hex = buf;
+    return true;
+}
+
+bool Utf8TextReader::open(const fs::path& path, std::string* err) {
+    ifs_.close();
+    ifs_.clear();
+    carry_.clear();
+    buffered_.clear();
+    eof_ = false;
+    encoding_ = Encoding::Utf8;
+
+    ifs_.open(path, std::ios::in | std::ios::binary);
+    if (!ifs_) {
+        if (err) *err = "failed to open file";
+        return false;
+    }
+
+    unsigned char bom[3] = {0, 0, 0};
+    ifs_.read(reinterpret_cast<char*>(bom), 3);
+    const std::streamsize got = ifs_.gcount();
+    std::streamoff body_start = 0;
+    if (got >= 3 && bom[0] == 0xEF && bom[1] == 0xBB && bom[2] == 0xBF) {
+        body_start = 3;
+    } else if (got >= 2 && bom[0] == 0xFF && bom[1] == 0xFE) {
+        encoding_ = Encoding::Utf16LE;
+        body_start = 2;
+    } else if (got >= 2 && bom[0] == 0xFE && bom[1] == 0xFF) {
+        encoding_ = Encoding::Utf16BE;
+        body_start = 2;
+    }
+    ifs_.clear();
+    ifs_.seekg(body_start);
+
+    if (encoding_ == Encoding::Utf8) {
+        // Validate in one streaming pass first so that non-UTF-8 input can still be routed through
+        // the legacy-encoding fallback before any text has been handed out.
+        std::string block(kTextReadBlock, '\0');
+        std::string pending;
+        bool valid = true;
+        while (valid && ifs_) {
+            ifs_.read(&block[0], static_cast<std::streamsize>(block.size()));
+            const size_t n = static_cast<size_t>(ifs_.gcount());
+            if (n == 0) break;
+            pending.append(block.data(), n);
+            const size_t cut = utf8_complete_prefix_len(pending);
+            valid = is_valid_utf8(pending.substr(0, cut));
+            pending.erase(0, cut);
+        }
+        if (valid && !pending.empty()) valid = is_valid_utf8(pending);
+
+        ifs_.clear();
+        ifs_.seekg(body_start);
+        if (!valid) {
+            encoding_ = Encoding::Buffered;
+            ifs_.seekg(0);
+            std::ostringstream oss;
+            oss << ifs_.rdbuf();
+            buffered_ = oss.str();
+            ifs_.close();
+            std::string norm_err;
+            if (!normalize_utf8(&buffered_, &norm_err)) {
+                if (err) *err = norm_err;
+                buffered_.clear();
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+bool Utf8TextReader::read(std::string* out, std::string* err) {
+    if (!out) return false;
+    out->clear();
+    if (eof_) return false;
+
+    if (encoding_ == Encoding::Buffered) {
+        eof_ = true;
+        out->swap(buffered_);
+        return !out->empty();
+    }
+
+    std::string block(kTextReadBlock, '\0');
+    ifs_.read(&block[0], static_cast<std::streamsize>(block.size()));
+    const size_t n = static_cast<size_t>(ifs_.gcount());
+    if (ifs_.bad()) {
+        if (err) *err = "failed to read file";
+        eof_ = true;
+        return false;
+    }
+    std::string data = carry_;
+    data.append(block.data(), n);
+    carry_.clear();
+    const bool last = (n == 0) || ifs_.eof();
+
+    if (encoding_ == Encoding::Utf8) {
+        size_t cut = last ? data.size() : utf8_complete_prefix_len(data);
+        carry_ = data.substr(cut);
+        data.resize(cut);
+        *out = std::move(data);
+    } else {
+        const bool big_endian = (encoding_ == Encoding::Utf16BE);
+        size_t units = data.size() / 2;
+        if (!last && units > 0) {
+            // Keep a trailing high surrogate back until its low half arrives.
+            const unsigned char* p = reinterpret_cast<const unsigned char*>(data.data()) + (units - 1) * 2;
+            uint16_t u = big_endian ? static_cast<uint16_t>((p[0] << 8) | p[1])
+                                    : static_cast<uint16_t>((p[1] << 8) | p[0]);
+            if (u >= 0xD800 && u <= 0xDBFF) --units;
+        }
+        if (last && data.size() % 2 != 0) {
+            if (err) *err = big_endian ? "invalid UTF-16BE byte length" : "invalid UTF-16LE byte length";
+            eof_ = true;
+            return false;
+        }
+        carry_ = data.substr(units * 2);
+        const uint16_t* words = reinterpret_cast<const uint16_t*>(data.data());
+        if (!utf16_to_utf8(words, units, big_endian, out) || !is_valid_utf8(*out)) {
+            if (err) *err = big_endian ? "failed to decode UTF-16BE" : "failed to decode UTF-16LE";
+            eof_ = true;
+            return false;
+        }
+    }
+
+    if (last && carry_.empty()) eof_ = true;
+    return !out->empty() || !eof_;
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <filesystem>
+#include <fstream>
 #include <string>
 
 // Normalize a string to valid UTF-8 if possible (handles BOM/UTF-16, and best-effort legacy encodings).
@@ -8,4 +9,39 @@
 bool normalize_utf8(std::string* s, std::string* err);
 
 bool read_text_file(const std::filesystem::path& path, std::string* out, std::string* err);
+// PDF extraction via poppler's pdftotext. When pdfinfo reports the page count, page ranges are
+// extracted by a bounded pool of pdftotext processes and merged in page order.
+struct PdfExtractOptions {
+    int workers = 0;           // concurrent pdftotext processes, 0 = hardware concurrency
+    int page_timeout_sec = 10; // time allowed per page of a range before the process is killed
+    int min_pages_per_job = 8; // documents up to this size are extracted in one run
+};
+
 bool extract_pdf_text(const std::filesystem::path& path, std::string* out, std::string* err);
+bool extract_pdf_text(const std::filesystem::path& path,
+                      const PdfExtractOptions& opt,
+                      std::string* out,
+                      std::string* err);
+
+// Content fingerprint (64-bit FNV-1a, hex) used to detect modified files during docs sync.
+bool hash_file_contents(const std::filesystem::path& path, std::string* out_hex, std::string* err);
+
+// Reads a text file as UTF-8 in bounded blocks so large files can be chunked without holding them
+// in memory. UTF-8 (with or without BOM) and BOM-marked UTF-16 are decoded incrementally; other
+// legacy encodings fall back to normalize_utf8() on the whole file.
+class Utf8TextReader {
+public:
+    bool open(const std::filesystem::path& path, std::string* err);
+    // Replaces *out with the next decoded piece (never splitting a code point).
+    // Returns false at end of input, or on failure with *err set.
+    bool read(std::string* out, std::string* err);
+
+private:
+    enum class Encoding { Utf8, Utf16LE, Utf16BE, Buffered };
+
+    std::ifstream ifs_;
+    Encoding encoding_ = Encoding::Utf8;
+    std::string carry_;
+    std::string buffered_;
+    bool eof_ = false;
+};
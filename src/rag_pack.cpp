@@ -0,0 +1,191 @@
+#include "rag_pack.h"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+inline uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+bool string_in_bounds(const RagPackString& s, uint64_t strings_size) {
+    return s.offset <= strings_size && s.size <= strings_size - s.offset;
+}
+
+} // namespace
+
+uint64_t rag_pack_checksum_update(uint64_t h, const void* data, size_t size) {
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t w;
+        std::memcpy(&w, p + i, 8);
+        h ^= rotl64(w * 0x87c37b91114253d5ull, 31) * 0x4cf5ad432745937full;
+        h = rotl64(h, 27) * 5 + 0x52dce729;
+    }
+    if (i < size) {
+        uint64_t w = 0;
+        std::memcpy(&w, p + i, size - i);
+        h ^= rotl64(w * 0x87c37b91114253d5ull, 31) * 0x4cf5ad432745937full;
+        h = rotl64(h, 27) * 5 + 0x52dce729;
+    }
+    return h;
+}
+
+RagPack::~RagPack() {
+    close();
+}
+
+void RagPack::close() {
+    if (!base_) return;
+#if defined(_WIN32)
+    UnmapViewOfFile(base_);
+    if (mapping_) CloseHandle(static_cast<HANDLE>(mapping_));
+    if (file_) CloseHandle(static_cast<HANDLE>(file_));
+    mapping_ = nullptr;
+    file_ = nullptr;
+#else
+    munmap(const_cast<unsigned char*>(base_), size_);
+#endif
+    base_ = nullptr;
+    size_ = 0;
+}
+
+bool RagPack::open(const std::string& path, bool verify, std::string* err) {
+    close();
+#if defined(_WIN32)
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                              FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        if (err) *err = "failed to open pack file";
+        return false;
+    }
+    LARGE_INTEGER li;
+    if (!GetFileSizeEx(file, &li) || li.QuadPart < static_cast<LONGLONG>(sizeof(RagPackHeader))) {
+        CloseHandle(file);
+        if (err) *err = "pack file too small";
+        return false;
+    }
+    HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!mapping) {
+        CloseHandle(file);
+        if (err) *err = "failed to map pack file";
+        return false;
+    }
+    void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!view) {
+        CloseHandle(mapping);
+        CloseHandle(file);
+        if (err) *err = "failed to map pack file";
+        return false;
+    }
+    file_ = file;
+    mapping_ = mapping;
+    base_ = static_cast<const unsigned char*>(view);
+    size_ = static_cast<size_t>(li.QuadPart);
+#else
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (err) *err = "failed to open pack file";
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(sizeof(RagPackHeader))) {
+        ::close(fd);
+        if (err) *err = "pack file too small";
+        return false;
+    }
+    void* addr = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (addr == MAP_FAILED) {
+        if (err) *err = "failed to map pack file";
+        return false;
+    }
+    base_ = static_cast<const unsigned char*>(addr);
+    size_ = static_cast<size_t>(st.st_size);
+#endif
+
+    auto fail = [&](const char* msg) {
+        close();
+        if (err) *err = msg;
+        return false;
+    };
+
+    const RagPackHeader& h = header();
+    if (std::memcmp(h.magic, kRagPackMagic, sizeof(h.magic)) != 0) return fail("not a rag index pack");
+    if (h.version != kRagPackVersion) return fail("unsupported pack version");
+    if (h.file_size != size_) return fail("pack file truncated");
+    if (h.embed_dim == 0) return fail("invalid pack embed dim");
+
+    // Section bounds, so later accesses through the mapping cannot run off the end.
+    auto section_ok = [&](uint64_t offset, uint64_t count, uint64_t elem) {
+        if (offset > size_ || offset % 8 != 0) return false;
+        if (elem && count > (size_ - offset) / elem) return false;
+        return true;
+    };
+    if (!section_ok(h.docs_offset, h.doc_count, sizeof(RagPackDoc)) ||
+        !section_ok(h.chunks_offset, h.chunk_count, sizeof(RagPackChunk)) ||
+        !section_ok(h.vector_map_offset, h.vector_count, sizeof(RagPackVector)) ||
+        !section_ok(h.vectors_offset, h.vector_count, static_cast<uint64_t>(h.embed_dim) * sizeof(float)) ||
+        !section_ok(h.strings_offset, h.strings_size, 1)) {
+        return fail("pack section out of bounds");
+    }
+
+    if (verify) {
+#if !defined(_WIN32)
+        madvise(const_cast<unsigned char*>(base_), size_, MADV_SEQUENTIAL);
+#endif
+        uint64_t sum = rag_pack_checksum_update(kRagPackChecksumSeed, base_ + sizeof(RagPackHeader),
+                                                size_ - sizeof(RagPackHeader));
+        if (sum != h.payload_checksum) return fail("pack checksum mismatch");
+    }
+
+    // Row references are checked once here (cheap next to the vector matrix) instead of on every query.
+    const RagPackDoc* d = docs();
+    for (uint64_t i = 0; i < h.doc_count; ++i) {
+        if (d[i].first_chunk > h.chunk_count || d[i].chunk_count > h.chunk_count - d[i].first_chunk ||
+            !string_in_bounds(d[i].filename, h.strings_size) || !string_in_bounds(d[i].mime, h.strings_size) ||
+            !string_in_bounds(d[i].source_path, h.strings_size)) {
+            return fail("pack doc table corrupt");
+        }
+    }
+    const RagPackChunk* c = chunks();
+    for (uint64_t i = 0; i < h.chunk_count; ++i) {
+        if (!string_in_bounds(c[i].source, h.strings_size) || !string_in_bounds(c[i].text, h.strings_size)) {
+            return fail("pack chunk table corrupt");
+        }
+    }
+    const RagPackVector* v = vector_map();
+    for (uint64_t i = 0; i < h.vector_count; ++i) {
+        if (v[i].chunk_row >= h.chunk_count) return fail("pack vector table corrupt");
+    }
+
+#if !defined(_WIN32)
+    // Queries scan the whole matrix; ask for it up front.
+    size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    size_t vec_start = static_cast<size_t>(h.vectors_offset) / page * page;
+    madvise(const_cast<unsigned char*>(base_) + vec_start, size_ - vec_start, MADV_WILLNEED);
+#endif
+    return true;
+}
+
+const RagPackDoc* RagPack::find_doc(uint64_t doc_id) const {
+    if (!base_) return nullptr;
+    const RagPackDoc* begin = docs();
+    const RagPackDoc* end = begin + header().doc_count;
+    const RagPackDoc* it = std::lower_bound(begin, end, doc_id, [](const RagPackDoc& d, uint64_t id) {
+        return d.id < id;
+    });
+    if (it == end || it->id != doc_id) return nullptr;
+    return it;
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Read-only snapshot of a RagVectorDb ("index pack"), designed to be mmap'd and queried in
+// place. The tables are the structs below written as-is, so a pack is only readable on a
+// little-endian host with the same layout (checked below). Sections, in this order:
+//
+//   RagPackHeader
+//   RagPackDoc[doc_count]        sorted by id
+//   RagPackChunk[chunk_count]    sorted by (doc_id, chunk_index), so a doc's chunks are contiguous
+//   RagPackVector[vector_count]  chunk row and dedup group of each stored vector
+//   float[vector_count][dim]     64-byte aligned vector matrix
+//   string blob                  UTF-8 text referenced by offset/length from the tables above
+//
+// payload_checksum covers every byte after the header. Bump kRagPackVersion when the layout
+// changes; readers reject versions they do not know.
+
+constexpr char kRagPackMagic[8] = {'N', 'C', 'R', 'A', 'G', 'P', 'K', '\0'};
+constexpr uint32_t kRagPackVersion = 1;
+
+struct RagPackHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t embed_dim;
+    uint64_t doc_count;
+    uint64_t chunk_count;
+    uint64_t vector_count;
+    uint64_t near_dup_count;
+    uint64_t docs_offset;
+    uint64_t chunks_offset;
+    uint64_t vector_map_offset;
+    uint64_t vectors_offset;
+    uint64_t strings_offset;
+    uint64_t strings_size;
+    uint64_t file_size;
+    uint64_t payload_checksum;
+    uint64_t reserved[2];
+};
+
+struct RagPackString {
+    uint64_t offset;
+    uint64_t size;
+};
+
+struct RagPackDoc {
+    uint64_t id;
+    int64_t added_at;
+    uint64_t first_chunk; // row in the chunk table
+    uint64_t chunk_count; // rows in the chunk table (may differ from the stored docs.chunk_count)
+    uint64_t stored_chunk_count;
+    RagPackString filename;
+    RagPackString mime;
+    RagPackString source_path;
+};
+
+struct RagPackChunk {
+    uint64_t doc_id;
+    int64_t chunk_index;
+    RagPackString source;
+    RagPackString text;
+};
+
+struct RagPackVector {
+    uint64_t chunk_row;
+    int64_t group;
+};
+
+static_assert(sizeof(RagPackHeader) == 128, "pack header layout changed");
+static_assert(sizeof(RagPackDoc) == 88, "pack doc layout changed");
+static_assert(sizeof(RagPackChunk) == 48, "pack chunk layout changed");
+static_assert(sizeof(RagPackVector) == 16, "pack vector layout changed");
+#if defined(__BYTE_ORDER__) && defined(__ORDER_LITTLE_ENDIAN__)
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "index packs are little-endian host structs");
+#endif
+
+// Checksum used for pack payloads (64-bit, processes 8 bytes per step). Streaming: feed
+// consecutive pieces through update() starting from kRagPackChecksumSeed; pieces must be
+// multiples of 8 bytes except the last.
+constexpr uint64_t kRagPackChecksumSeed = 0x9e3779b97f4a7c15ull;
+uint64_t rag_pack_checksum_update(uint64_t h, const void* data, size_t size);
+
+// Read-only memory mapping of a pack file.
+class RagPack {
+public:
+    RagPack() = default;
+    ~RagPack();
+    RagPack(const RagPack&) = delete;
+    RagPack& operator=(const RagPack&) = delete;
+
+    // Maps the file and validates header and section bounds; `verify` also checks the payload
+    // checksum (one sequential pass over the file).
+    bool open(const std::string& path, bool verify, std::string* err);
+    void close();
+    bool is_open() const { return base_ != nullptr; }
+
+    const RagPackHeader& header() const { return *reinterpret_cast<const RagPackHeader*>(base_); }
+    const RagPackDoc* docs() const { return reinterpret_cast<const RagPackDoc*>(base_ + header().docs_offset); }
+    const RagPackChunk* chunks() const { return reinterpret_cast<const RagPackChunk*>(base_ + header().chunks_offset); }
+    const RagPackVector* vector_map() const {
+        return reinterpret_cast<const RagPackVector*>(base_ + header().vector_map_offset);
+    }
+    const float* vectors() const { return reinterpret_cast<const float*>(base_ + header().vectors_offset); }
+    std::string str(const RagPackString& s) const {
+        return std::string(reinterpret_cast<const char*>(base_ + header().strings_offset + s.offset), s.size);
+    }
+    // Doc table row for `doc_id`, or nullptr.
+    const RagPackDoc* find_doc(uint64_t doc_id) const;
+
+private:
+    const unsigned char* base_ = nullptr;
+    size_t size_ = 0;
+#if defined(_WIN32)
+    void* file_ = nullptr;
+    void* mapping_ = nullptr;
+#endif
+};
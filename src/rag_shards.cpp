@@ -0,0 +1,170 @@
+#include "rag_shards.h"
+
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+
+namespace {
+
+constexpr const char* kManifestHeader = "ncnn_llm_rag shards v1";
+constexpr int kMaxShards = 256;
+
+} // namespace
+
+std::string rag_shard_manifest_path(const std::string& db_path) {
+    return db_path + ".shards";
+}
+
+bool rag_path_exists(const std::string& path) {
+    std::error_code ec;
+    return std::filesystem::exists(path, ec);
+}
+
+bool read_rag_shard_manifest(const std::string& db_path, RagShardManifest* out, std::string* err) {
+    *out = RagShardManifest();
+    std::string path = rag_shard_manifest_path(db_path);
+    std::ifstream in(path);
+    if (!in) return true;
+
+    // Format: header line, "shards=N", then one "shard=<file name>" line per shard.
+    std::string line;
+    if (!std::getline(in, line) || line != kManifestHeader) {
+        if (err) *err = "invalid shard manifest: " + path;
+        return false;
+    }
+    std::filesystem::path dir = std::filesystem::path(path).parent_path();
+    int count = 0;
+    std::vector<std::string> files;
+    while (std::getline(in, line)) {
+        if (line.empty() || line[0] == '#') continue;
+        auto eq = line.find('=');
+        if (eq == std::string::npos) continue;
+        std::string key = line.substr(0, eq);
+        std::string value = line.substr(eq + 1);
+        if (key == "shards") {
+            count = std::atoi(value.c_str());
+        } else if (key == "shard") {
+            files.push_back((dir / value).string());
+        }
+    }
+    if (count <= 0 || count > kMaxShards || static_cast<int>(files.size()) != count) {
+        if (err) *err = "invalid shard manifest: " + path;
+        return false;
+    }
+    out->shard_count = count;
+    out->files = std::move(files);
+    return true;
+}
+
+bool create_rag_shard_manifest(const std::string& db_path, int shard_count, RagShardManifest* out, std::string* err) {
+    if (shard_count <= 1 || shard_count > kMaxShards) {
+        if (err) *err = "shard count must be between 2 and " + std::to_string(kMaxShards);
+        return false;
+    }
+    std::string path = rag_shard_manifest_path(db_path);
+    std::filesystem::path dir = std::filesystem::path(path).parent_path();
+    std::string base = std::filesystem::path(db_path).filename().string();
+
+    RagShardManifest m;
+    m.shard_count = shard_count;
+    std::ostringstream body;
+    body << kManifestHeader << "\n"
+         << "shards=" << shard_count << "\n";
+    for (int i = 0; i < shard_count; ++i) {
+        std::string name = base + ".shard" + std::to_string(i);
+        body << "shard=" << name << "\n";
+        m.files.push_back((dir / name).string());
+    }
+
+    // Written under a temporary name and renamed, so a crash never leaves a partial manifest.
+    std::string tmp = path + ".tmp";
+    {
+        std::ofstream f(tmp, std::ios::binary | std::ios::trunc);
+        if (!f) {
+            if (err) *err = "failed to write shard manifest: " + path;
+            return false;
+        }
+        f << body.str();
+        if (!f.flush()) {
+            if (err) *err = "failed to write shard manifest: " + path;
+            return false;
+        }
+    }
+    std::error_code ec;
+    std::filesystem::rename(tmp, path, ec);
+    if (ec) {
+        std::filesystem::remove(tmp, ec);
+        if (err) *err = "failed to write shard manifest: " + path;
+        return false;
+    }
+    *out = std::move(m);
+    return true;
+}
+
+RagTaskPool::RagTaskPool(size_t workers) {
+    threads_.reserve(workers);
+    for (size_t i = 0; i < workers; ++i) {
+        threads_.emplace_back([this]() {
+            std::unique_lock<std::mutex> lock(mu_);
+            for (;;) {
+                cv_.wait(lock, [&]() { return stop_ || !queue_.empty(); });
+                if (queue_.empty()) return;
+                auto task = std::move(queue_.front());
+                queue_.pop_front();
+                lock.unlock();
+                task();
+                lock.lock();
+            }
+        });
+    }
+}
+
+RagTaskPool::~RagTaskPool() {
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        stop_ = true;
+    }
+    cv_.notify_all();
+    for (auto& t : threads_) t.join();
+}
+
+bool RagTaskPool::run_one() {
+    std::function<void()> task;
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        if (queue_.empty()) return false;
+        task = std::move(queue_.front());
+        queue_.pop_front();
+    }
+    task();
+    return true;
+}
+
+void RagTaskPool::run(size_t n, const std::function<void(size_t)>& fn) {
+    if (n == 0) return;
+    std::mutex done_mu;
+    std::condition_variable done_cv;
+    size_t left = n;
+    auto finish = [&]() {
+        std::lock_guard<std::mutex> lock(done_mu);
+        if (--left == 0) done_cv.notify_all();
+    };
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        for (size_t i = 1; i < n; ++i) {
+            queue_.push_back([&, i]() {
+                fn(i);
+                finish();
+            });
+        }
+    }
+    cv_.notify_all();
+    fn(0);
+    finish();
+    // Help drain the queue instead of idling; covers pools without workers and busy pools.
+    while (run_one()) {
+    }
+    std::unique_lock<std::mutex> lock(done_mu);
+    done_cv.wait(lock, [&]() { return left == 0; });
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// On-disk layout of a sharded RagVectorDb: a text manifest at "<db path>.shards" listing N
+// SQLite shard files (one RagVectorDb each) stored next to it. The shard count is fixed when the
+// manifest is created; documents are assigned to shards by a hash of their id.
+struct RagShardManifest {
+    int shard_count = 0;           // 0 = no manifest (plain single-file DB)
+    std::vector<std::string> files; // resolved shard paths
+};
+
+std::string rag_shard_manifest_path(const std::string& db_path);
+// Reads the manifest for `db_path`. A missing manifest is not an error (shard_count stays 0).
+bool read_rag_shard_manifest(const std::string& db_path, RagShardManifest* out, std::string* err);
+// Creates a manifest for `shard_count` shards named "<db file>.shard<i>" and writes it.
+bool create_rag_shard_manifest(const std::string& db_path, int shard_count, RagShardManifest* out, std::string* err);
+bool rag_path_exists(const std::string& path);
+
+// Fixed-size worker pool for fan-out work (per-shard search). run() may be called from several
+// threads at once; the calling thread takes part, so a pool with no workers runs inline.
+class RagTaskPool {
+public:
+    explicit RagTaskPool(size_t workers);
+    ~RagTaskPool();
+    RagTaskPool(const RagTaskPool&) = delete;
+    RagTaskPool& operator=(const RagTaskPool&) = delete;
+
+    // Runs fn(0) .. fn(n - 1) and returns once all of them have finished.
+    void run(size_t n, const std::function<void(size_t)>& fn);
+
+private:
+    std::mutex mu_;
+    std::condition_variable cv_;
+    std::deque<std::function<void()>> queue_;
+    bool stop_ = false;
+    std::vector<std::thread> threads_;
+
+    bool run_one();
+};
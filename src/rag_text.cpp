@@ -2,7 +2,6 @@
 
 #include <algorithm>
 #include <cctype>
-#include <sstream>
 #include <string_view>
 
 std::string trim_text(const std::string& s);
@@ -33,22 +32,6 @@ size_t utf8_safe_cut_pos(const std::string& s, size_t pos) {
     return pos;
 }
 
-std::string normalize_newlines(std::string s) {
-    // Convert CRLF/CR to LF.
-    std::string out;
-    out.reserve(s.size());
-    for (size_t i = 0; i < s.size(); ++i) {
-        char c = s[i];
-        if (c == '\r') {
-            if (i + 1 < s.size() && s[i + 1] == '\n') ++i;
-            out.push_back('\n');
-        } else {
-            out.push_back(c);
-        }
-    }
-    return out;
-}
-
 bool starts_with(std::string_view s, std::string_view prefix) {
     return s.size() >= prefix.size() && s.substr(0, prefix.size()) == prefix;
 }
@@ -178,15 +161,22 @@ size_t find_last_sentence_boundary(const std::string& s, size_t start, size_t en
     return start;
 }
 
-std::vector<std::string> split_long_block(const std::string& block, size_t max_chars) {
+// Splits `block` into pieces of at most max_chars, preferring sentence boundaries.
+// Stops before starting a piece at or beyond `stop_at` and reports that offset via `out_pos`,
+// so a block that is still growing can be split incrementally.
+std::vector<std::string> split_long_block(const std::string& block,
+                                          size_t max_chars,
+                                          size_t stop_at,
+                                          size_t* out_pos) {
     std::vector<std::string> out;
     if (block.size() <= max_chars) {
         out.push_back(block);
+        if (out_pos) *out_pos = block.size();
         return out;
     }
 
     size_t pos = 0;
-    while (pos < block.size()) {
+    while (pos < block.size() && pos < stop_at) {
         size_t remaining = block.size() - pos;
         size_t want = std::min(max_chars, remaining);
         size_t end = pos + want;
@@ -203,6 +193,7 @@ std::vector<std::string> split_long_block(const std::string& block, size_t max_c
         if (!piece.empty()) out.push_back(std::move(piece));
         pos = end;
     }
+    if (out_pos) *out_pos = pos;
     return out;
 }
 
@@ -223,78 +214,203 @@ std::string shorten_text(const std::string& s, size_t max_chars) {
     return s.substr(0, cut) + "...";
 }
 
-std::vector<std::string> split_text_chunks(const std::string& text, size_t max_chars) {
-    if (max_chars == 0) max_chars = 512;
-    std::vector<std::string> blocks;
-    std::istringstream iss(normalize_newlines(text));
-    std::string line;
-    std::string cur_block;
-    enum class BlockType { Paragraph, List, Table } cur_type = BlockType::Paragraph;
-
-    auto flush_block = [&]() {
-        std::string trimmed = trim_text(cur_block);
-        if (!trimmed.empty()) blocks.push_back(std::move(trimmed));
-        cur_block.clear();
-        cur_type = BlockType::Paragraph;
-    };
-
-    while (std::getline(iss, line)) {
-        std::string trimmed = trim_text(line);
-        if (trimmed.empty()) {
-            if (!cur_block.empty()) flush_block();
-            continue;
+void TextChunker::LineShape::add(const std::string& s) {
+    for (char c : s) {
+        if (c == '|') ++pipes;
+        if (c == ' ' || c == '\t') {
+            ++run;
+        } else {
+            if (run >= 3) ++space_runs;
+            run = 0;
         }
+    }
+}
+
+bool TextChunker::LineShape::table() const {
+    return pipes >= 2 || space_runs + (run >= 3 ? 1 : 0) >= 2;
+}
 
-        // Headings become hard boundaries.
-        if (looks_like_heading(trimmed)) {
-            if (!cur_block.empty()) flush_block();
-            cur_block = trimmed;
-            flush_block();
+TextChunker::TextChunker(size_t max_chars)
+    : max_chars_(max_chars == 0 ? 512 : max_chars),
+      line_limit_(std::max<size_t>(max_chars_ * 8, 4096)),
+      line_check_at_(line_limit_) {
+    current_.reserve(max_chars_ + 64);
+}
+
+void TextChunker::feed(const char* data, size_t size, std::vector<std::string>* out) {
+    for (size_t i = 0; i < size; ++i) {
+        char c = data[i];
+        // Convert CRLF/CR to LF, also when the pair straddles two feeds.
+        if (pending_cr_) {
+            pending_cr_ = false;
+            if (c == '\n') continue;
+        }
+        if (c == '\r' || c == '\n') {
+            pending_cr_ = (c == '\r');
+            on_line(out);
             continue;
         }
+        line_.push_back(c);
+        if (line_.size() >= line_check_at_) on_long_line(out);
+    }
+}
 
-        BlockType t = BlockType::Paragraph;
-        if (looks_like_table_line(line)) t = BlockType::Table;
-        else if (looks_like_list_item(line)) t = BlockType::List;
+void TextChunker::finish(std::vector<std::string>* out) {
+    if (!line_.empty() || line_open_) on_line(out);
+    pending_cr_ = false;
+    if (!cur_block_.empty()) flush_block(out);
+    if (!current_.empty()) flush_chunk(out);
+}
 
-        if (!cur_block.empty() && t != cur_type) {
-            flush_block();
-        }
-        cur_type = t;
+void TextChunker::on_line(std::vector<std::string>* out) {
+    line_check_at_ = line_limit_;
+    if (line_open_) {
+        // The rest of a long line; the next line is compared against its final type.
+        line_open_ = false;
+        line_shape_.add(line_);
+        if (line_shape_.table()) cur_type_ = BlockType::Table;
+        cur_block_ += line_;
+        line_.clear();
+        split_growing_block(out);
+        return;
+    }
 
-        if (!cur_block.empty()) cur_block.push_back('\n');
-        cur_block += line;
+    std::string line;
+    line.swap(line_);
+    std::string trimmed = trim_text(line);
+    if (trimmed.empty()) {
+        if (!cur_block_.empty()) flush_block(out);
+        return;
     }
-    if (!cur_block.empty()) flush_block();
 
-    // Assemble blocks into final chunks near max_chars.
-    std::vector<std::string> chunks;
-    std::string current;
-    current.reserve(max_chars + 64);
+    // Headings become hard boundaries.
+    if (looks_like_heading(trimmed)) {
+        if (!cur_block_.empty()) flush_block(out);
+        cur_block_ = trimmed;
+        flush_block(out);
+        return;
+    }
 
-    auto flush_chunk = [&]() {
-        std::string trimmed = trim_text(current);
-        if (!trimmed.empty()) chunks.push_back(std::move(trimmed));
-        current.clear();
-    };
+    BlockType t = BlockType::Paragraph;
+    if (looks_like_table_line(line)) t = BlockType::Table;
+    else if (looks_like_list_item(line)) t = BlockType::List;
 
-    for (const auto& b : blocks) {
-        if (b.size() > max_chars) {
-            if (!current.empty()) flush_chunk();
-            auto pieces = split_long_block(b, max_chars);
-            for (auto& p : pieces) chunks.push_back(std::move(p));
-            continue;
+    if (!cur_block_.empty() && t != cur_type_) {
+        flush_block(out);
+    }
+    cur_type_ = t;
+
+    if (!cur_block_.empty()) cur_block_.push_back('\n');
+    cur_block_ += line;
+
+    // A block without blank lines can be arbitrarily long (e.g. a whole file on a few lines).
+    if (cur_block_.size() > max_chars_ * 8) split_growing_block(out);
+}
+
+void TextChunker::on_long_line(std::vector<std::string>* out) {
+    if (!line_open_) {
+        // A short trimmed line may still be blank or a heading; keep buffering (it is mostly
+        // whitespace) and look again after another line_limit_ bytes.
+        std::string trimmed = trim_text(line_);
+        if (trimmed.size() <= 120) {
+            line_check_at_ = line_.size() + line_limit_;
+            return;
+        }
+        BlockType t = BlockType::Paragraph;
+        if (looks_like_table_line(line_)) t = BlockType::Table;
+        else if (looks_like_list_item(line_)) t = BlockType::List;
+        if (!cur_block_.empty() && t != cur_type_) {
+            flush_block(out);
         }
+        cur_type_ = t;
+        if (!cur_block_.empty()) cur_block_.push_back('\n');
+        line_open_ = true;
+        line_shape_ = LineShape();
+    }
+    line_shape_.add(line_);
+    cur_block_ += line_;
+    line_.clear();
+    line_check_at_ = line_limit_;
+    split_growing_block(out);
+}
 
-        size_t extra = b.size() + (current.empty() ? 0 : 2);
-        if (!current.empty() && current.size() + extra > max_chars) {
-            flush_chunk();
+void TextChunker::split_growing_block(std::vector<std::string>* out) {
+    // Once the block is certainly over the limit, emit its leading pieces now so memory stays
+    // bounded. The cut points must be the ones split_long_block() picks on the complete, trimmed
+    // block: trailing whitespace may yet be trimmed off, so only pieces ending before the last
+    // non-space byte are final.
+    size_t end = cur_block_.size();
+    while (end > 0 && std::isspace(static_cast<unsigned char>(cur_block_[end - 1]))) --end;
+    size_t start = 0;
+    if (!long_block_) {
+        while (start < end && std::isspace(static_cast<unsigned char>(cur_block_[start]))) ++start;
+    }
+    if (end - start <= max_chars_ * 8) return;
+    if (!long_block_) {
+        // Only leading whitespace: the tail may still be followed by more lines.
+        cur_block_.erase(0, start);
+        end -= start;
+        if (!current_.empty()) flush_chunk(out);
+        long_block_ = true;
+    }
+    size_t keep_from = 0;
+    auto pieces = split_long_block(cur_block_, max_chars_, end - max_chars_, &keep_from);
+    for (auto& p : pieces) out->push_back(std::move(p));
+    cur_block_.erase(0, keep_from);
+}
+
+void TextChunker::flush_block(std::vector<std::string>* out) {
+    std::string block;
+    block.swap(cur_block_);
+    cur_type_ = BlockType::Paragraph;
+    if (long_block_) {
+        // The head was already trimmed (and partly emitted); only the tail needs trimming, as
+        // stripping the remainder's leading whitespace would shift the remaining cut points.
+        long_block_ = false;
+        size_t end = block.size();
+        while (end > 0 && std::isspace(static_cast<unsigned char>(block[end - 1]))) --end;
+        block.resize(end);
+        if (block.size() <= max_chars_) {
+            std::string last = trim_text(block);
+            if (!last.empty()) out->push_back(std::move(last));
+            return;
         }
-        if (!current.empty()) current += "\n\n";
-        current += b;
+        auto pieces = split_long_block(block, max_chars_, std::string::npos, nullptr);
+        for (auto& p : pieces) out->push_back(std::move(p));
+        return;
+    }
+    std::string trimmed = trim_text(block);
+    if (!trimmed.empty()) add_block(trimmed, out);
+}
+
+void TextChunker::add_block(const std::string& b, std::vector<std::string>* out) {
+    // Assemble blocks into final chunks near max_chars.
+    if (b.size() > max_chars_) {
+        if (!current_.empty()) flush_chunk(out);
+        auto pieces = split_long_block(b, max_chars_, std::string::npos, nullptr);
+        for (auto& p : pieces) out->push_back(std::move(p));
+        return;
     }
-    if (!current.empty()) flush_chunk();
 
+    size_t extra = b.size() + (current_.empty() ? 0 : 2);
+    if (!current_.empty() && current_.size() + extra > max_chars_) {
+        flush_chunk(out);
+    }
+    if (!current_.empty()) current_ += "\n\n";
+    current_ += b;
+}
+
+void TextChunker::flush_chunk(std::vector<std::string>* out) {
+    std::string trimmed = trim_text(current_);
+    if (!trimmed.empty()) out->push_back(std::move(trimmed));
+    current_.clear();
+}
+
+std::vector<std::string> split_text_chunks(const std::string& text, size_t max_chars) {
+    std::vector<std::string> chunks;
+    TextChunker chunker(max_chars);
+    chunker.feed(text.data(), text.size(), &chunks);
+    chunker.finish(&chunks);
     return chunks;
 }
 
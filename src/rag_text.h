@@ -7,3 +7,47 @@ std::string trim_text(const std::string& s);
 std::string shorten_text(const std::string& s, size_t max_chars);
 std::vector<std::string> split_text_chunks(const std::string& text, size_t max_chars);
 std::vector<std::string> tokenize_text(const std::string& text);
+
+// Incremental form of split_text_chunks(): text can be fed in arbitrary pieces (e.g. while a
+// large upload is being read) and finished chunks are appended to `out` as soon as they are known.
+// Memory stays bounded also for text without newlines: a line longer than
+// max(8 * max_chars, 4096) bytes is moved into the block as it arrives. Whether such a line is a
+// list or table line when it joins the block before it is then decided from that head; only
+// the comparison with the next line sees its final type.
+class TextChunker {
+public:
+    explicit TextChunker(size_t max_chars);
+    void feed(const char* data, size_t size, std::vector<std::string>* out);
+    void finish(std::vector<std::string>* out);
+
+private:
+    enum class BlockType { Paragraph, List, Table };
+
+    // Table-line counters (see looks_like_table_line()) of a line that is too long to buffer.
+    struct LineShape {
+        int pipes = 0;
+        int space_runs = 0;
+        int run = 0;
+        void add(const std::string& s);
+        bool table() const;
+    };
+
+    size_t max_chars_;
+    size_t line_limit_;
+    size_t line_check_at_;
+    std::string line_;
+    bool line_open_ = false; // the current line's head is already in cur_block_
+    LineShape line_shape_;
+    bool pending_cr_ = false;
+    std::string cur_block_;
+    BlockType cur_type_ = BlockType::Paragraph;
+    bool long_block_ = false;
+    std::string current_;
+
+    void on_line(std::vector<std::string>* out);
+    void on_long_line(std::vector<std::string>* out);
+    void split_growing_block(std::vector<std::string>* out);
+    void flush_block(std::vector<std::string>* out);
+    void add_block(const std::string& block, std::vector<std::string>* out);
+    void flush_chunk(std::vector<std::string>* out);
+};
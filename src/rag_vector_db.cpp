@@ -1,12 +1,19 @@
 #include "rag_vector_db.h"
 
+#include "rag_pack.h"
+#include "rag_shards.h"
 #include "rag_text.h"
 
 #include <algorithm>
 #include <cmath>
 #include <cstdint>
+#include <cstdio>
 #include <cstring>
+#include <fstream>
+#include <mutex>
+#include <thread>
 #include <unordered_map>
+#include <unordered_set>
 
 #include <sqlite3.h>
 
@@ -37,6 +44,108 @@ uint32_t hash_token(const std::string& s) {
     return h;
 }
 
+uint64_t hash_text64(const std::string& s) {
+    uint64_t h = 1469598103934665603ull;
+    for (unsigned char c : s) {
+        h ^= c;
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+// splitmix64 finalizer: FNV alone leaves the per-bit distribution too uneven for SimHash.
+uint64_t mix64(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ull;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebull;
+    x ^= x >> 31;
+    return x;
+}
+
+constexpr size_t kSimHashMinTokens = 8;
+// SimHash bands for the LSH table. Six bands cover all 64 bits, so by pigeonhole two fingerprints
+// within 5 bits of each other always share at least one band.
+constexpr int kNearDupBands = 6;
+constexpr int kNearDupBandBits[kNearDupBands] = {11, 11, 11, 11, 10, 10};
+
+// 64-bit SimHash over token bigrams. Returns 0 for chunks too short to fingerprint reliably.
+uint64_t simhash_text(const std::string& text) {
+    std::vector<std::string> tokens = tokenize_text(text);
+    if (tokens.size() < kSimHashMinTokens) return 0;
+
+    int weights[64] = {0};
+    std::string feature;
+    for (size_t i = 0; i + 1 < tokens.size(); ++i) {
+        feature = tokens[i];
+        feature.push_back('\x1f');
+        feature += tokens[i + 1];
+        uint64_t h = mix64(hash_text64(feature));
+        for (int b = 0; b < 64; ++b) {
+            weights[b] += (h >> b) & 1 ? 1 : -1;
+        }
+    }
+    uint64_t out = 0;
+    for (int b = 0; b < 64; ++b) {
+        if (weights[b] > 0) out |= 1ull << b;
+    }
+    return out;
+}
+
+int hamming64(uint64_t a, uint64_t b) {
+    uint64_t x = a ^ b;
+    int n = 0;
+    while (x) {
+        x &= x - 1;
+        ++n;
+    }
+    return n;
+}
+
+uint32_t band_key(uint64_t simhash, int band) {
+    int shift = 0;
+    for (int b = 0; b < band; ++b) shift += kNearDupBandBits[b];
+    uint64_t mask = (1ull << kNearDupBandBits[band]) - 1;
+    return (static_cast<uint32_t>(band) << 16) | static_cast<uint32_t>((simhash >> shift) & mask);
+}
+
+// Renders chunk rows (sorted by chunk index) for expand_range(): the matched chunk first so
+// truncation keeps the most important part, then its preceding and following neighbors.
+std::string format_expanded_rows(const std::vector<std::pair<int, std::string>>& rows, int center_chunk_index) {
+    if (rows.empty()) return {};
+
+    auto append_chunk = [&](std::string& out, int idx, const std::string& text, bool matched) {
+        if (!out.empty()) out += "\n\n";
+        out += matched ? "(matched chunk " : "(neighbor chunk ";
+        out += std::to_string(idx) + ")\n";
+        out += text;
+    };
+
+    std::string out;
+    int center_pos = -1;
+    for (size_t i = 0; i < rows.size(); ++i) {
+        if (rows[i].first == center_chunk_index) {
+            center_pos = static_cast<int>(i);
+            break;
+        }
+    }
+    if (center_pos < 0) {
+        for (const auto& r : rows) append_chunk(out, r.first, r.second, false);
+        return out;
+    }
+
+    append_chunk(out, rows[static_cast<size_t>(center_pos)].first, rows[static_cast<size_t>(center_pos)].second, true);
+    for (int i = center_pos - 1; i >= 0; --i) {
+        append_chunk(out, rows[static_cast<size_t>(i)].first, rows[static_cast<size_t>(i)].second, false);
+    }
+    for (size_t i = static_cast<size_t>(center_pos) + 1; i < rows.size(); ++i) {
+        append_chunk(out, rows[i].first, rows[i].second, false);
+    }
+    return out;
+}
+
+const char* kReadOnlyPackErr = "index pack is read-only";
+
 } // namespace
 
 RagEmbedder::RagEmbedder(int dim) : dim_(dim > 0 ? dim : 256) {}
@@ -60,29 +169,155 @@ std::vector<float> RagEmbedder::embed(const std::string& text) const {
     return l2_normalize(std::move(vec));
 }
 
+struct RagShard {
+    std::mutex mu;
+    RagVectorDb db;
+};
+
 RagVectorDb::RagVectorDb() = default;
 
 RagVectorDb::~RagVectorDb() {
+    if (bulk_) end_bulk(nullptr);
+    close_shards();
     if (db_) sqlite3_close(db_);
 }
 
 bool RagVectorDb::open(const std::string& path, int embed_dim, std::string* err) {
+    if (bulk_) end_bulk(nullptr);
+    pack_.reset();
+    close_shards();
     if (db_) {
         sqlite3_close(db_);
         db_ = nullptr;
     }
+    embed_dim_ = embed_dim > 0 ? embed_dim : 256;
+
+    RagShardManifest manifest;
+    if (!read_rag_shard_manifest(path, &manifest, err)) return false;
+    if (manifest.shard_count == 0 && requested_shards_ > 1 && !rag_path_exists(path)) {
+        if (!create_rag_shard_manifest(path, requested_shards_, &manifest, err)) return false;
+    }
+    if (manifest.shard_count > 0) return open_shards(manifest.files, err);
     if (sqlite3_open(path.c_str(), &db_) != SQLITE_OK) {
         if (err) *err = sqlite3_errmsg(db_ ? db_ : nullptr);
         if (db_) sqlite3_close(db_);
         db_ = nullptr;
         return false;
     }
-    embed_dim_ = embed_dim > 0 ? embed_dim : 256;
     if (!ensure_schema(err)) return false;
+    if (!backfill_fingerprints(err)) return false;
+    if (!load_near_dup_index(err)) return false;
     if (!load_counts(err)) return false;
     return true;
 }
 
+bool RagVectorDb::begin_write(std::string* err) {
+    // Inside bulk mode each document becomes a savepoint within the long-running transaction, so a
+    // failed document still rolls back on its own.
+    return exec(bulk_ ? "SAVEPOINT doc_write;" : "BEGIN TRANSACTION;", err);
+}
+
+bool RagVectorDb::commit_write(std::string* err) {
+    return exec(bulk_ ? "RELEASE doc_write;" : "COMMIT;", err);
+}
+
+void RagVectorDb::rollback_write() {
+    exec(bulk_ ? "ROLLBACK TO doc_write; RELEASE doc_write;" : "ROLLBACK;", nullptr);
+}
+
+bool RagVectorDb::begin_bulk(std::string* err) {
+    if (pack_) {
+        if (err) *err = kReadOnlyPackErr;
+        return false;
+    }
+    if (!shards_.empty()) {
+        if (bulk_) return true;
+        for (size_t i = 0; i < shards_.size(); ++i) {
+            std::lock_guard<std::mutex> lock(shards_[i]->mu);
+            if (!shards_[i]->db.begin_bulk(err)) {
+                for (size_t j = 0; j < i; ++j) {
+                    std::lock_guard<std::mutex> undo(shards_[j]->mu);
+                    shards_[j]->db.end_bulk(nullptr);
+                }
+                return false;
+            }
+        }
+        bulk_ = true;
+        return true;
+    }
+    if (!db_) {
+        if (err) *err = "database not initialized";
+        return false;
+    }
+    if (bulk_) return true;
+
+    {
+        Stmt stmt;
+        if (sqlite3_prepare_v2(db_, "PRAGMA synchronous;", -1, &stmt.stmt, nullptr) == SQLITE_OK &&
+            sqlite3_step(stmt.stmt) == SQLITE_ROW) {
+            saved_synchronous_ = sqlite3_column_int(stmt.stmt, 0);
+        }
+    }
+    {
+        Stmt stmt;
+        if (sqlite3_prepare_v2(db_, "PRAGMA cache_size;", -1, &stmt.stmt, nullptr) == SQLITE_OK &&
+            sqlite3_step(stmt.stmt) == SQLITE_ROW) {
+            saved_cache_size_ = sqlite3_column_int64(stmt.stmt, 0);
+        }
+    }
+    if (!exec("PRAGMA synchronous=OFF;", err)) return false;
+    if (!exec("PRAGMA cache_size=-262144;", err)) return false; // 256 MiB
+    // Secondary indexes that only serve reads/deletes are rebuilt in one pass by end_bulk().
+    // idx_chunks_text_hash stays: dedup looks chunks up by hash during the load. (v2 tables are
+    // clustered by document and need no doc index.)
+    if (!exec("DROP INDEX IF EXISTS idx_chunks_doc;", err)) return false;
+    if (!exec("DROP INDEX IF EXISTS idx_chunks_vector;", err)) return false;
+    if (!exec("BEGIN TRANSACTION;", err)) return false;
+    bulk_ = true;
+    bulk_pending_rows_ = 0;
+    return true;
+}
+
+bool RagVectorDb::end_bulk(std::string* err) {
+    if (!bulk_) return true;
+    bulk_ = false;
+    if (!shards_.empty()) {
+        bool ok = true;
+        for (const auto& shard : shards_) {
+            std::lock_guard<std::mutex> lock(shard->mu);
+            ok = shard->db.end_bulk(ok ? err : nullptr) && ok;
+        }
+        return ok;
+    }
+    bool ok = exec("COMMIT;", err);
+    if (!ok) exec("ROLLBACK;", nullptr);
+    // Restore the indexes and settings even after a failed commit so the DB stays usable.
+    ok = create_chunk_indexes(ok ? err : nullptr) && ok;
+    if (ok) ok = exec("ANALYZE;", err);
+    if (ok) ok = exec("PRAGMA wal_checkpoint(TRUNCATE);", err);
+    exec("PRAGMA synchronous=" + std::to_string(saved_synchronous_) + ";", nullptr);
+    exec("PRAGMA cache_size=" + std::to_string(saved_cache_size_) + ";", nullptr);
+    return ok;
+}
+
+void RagVectorDb::bulk_flush_if_needed(size_t rows) {
+    if (!bulk_) return;
+    // Commit the outer transaction now and then so the WAL can be checkpointed and a crash
+    // loses at most one batch.
+    bulk_pending_rows_ += rows;
+    if (bulk_pending_rows_ < kBulkCommitRows) return;
+    if (exec("COMMIT;", nullptr)) exec("BEGIN TRANSACTION;", nullptr);
+    bulk_pending_rows_ = 0;
+}
+
+void RagVectorDb::set_near_dup_distance(int bits) {
+    near_dup_distance_ = std::max(0, std::min(bits, kNearDupBands - 1));
+    for (const auto& shard : shards_) {
+        std::lock_guard<std::mutex> lock(shard->mu);
+        shard->db.set_near_dup_distance(bits);
+    }
+}
+
 bool RagVectorDb::exec(const std::string& sql, std::string* err) const {
     char* errmsg = nullptr;
     if (sqlite3_exec(db_, sql.c_str(), nullptr, nullptr, &errmsg) != SQLITE_OK) {
@@ -94,6 +329,11 @@ bool RagVectorDb::exec(const std::string& sql, std::string* err) const {
 }
 
 bool RagVectorDb::ensure_schema(std::string* err) {
+    // page_size and auto_vacuum only take effect on a new (empty) DB; existing ones switch
+    // auto_vacuum in vacuum_full(). 16 KiB pages keep a chunk's text and vector rows inline in the
+    // clustered (WITHOUT ROWID) tables instead of spilling to overflow pages.
+    if (!exec("PRAGMA page_size=16384;", err)) return false;
+    if (!exec("PRAGMA auto_vacuum=INCREMENTAL;", err)) return false;
     if (!exec("PRAGMA journal_mode=WAL;", err)) return false;
     if (!exec("CREATE TABLE IF NOT EXISTS meta(key TEXT PRIMARY KEY, value TEXT);", err)) return false;
     if (!exec("CREATE TABLE IF NOT EXISTS docs("
@@ -102,17 +342,88 @@ bool RagVectorDb::ensure_schema(std::string* err) {
               "mime TEXT,"
               "added_at INTEGER,"
               "chunk_count INTEGER);", err)) return false;
-    if (!exec("CREATE TABLE IF NOT EXISTS chunks("
-              "id INTEGER PRIMARY KEY AUTOINCREMENT,"
-              "doc_id INTEGER,"
-              "chunk_index INTEGER,"
-              "source TEXT,"
-              "text TEXT);", err)) return false;
-    if (!exec("CREATE TABLE IF NOT EXISTS vectors("
-              "chunk_id INTEGER PRIMARY KEY,"
-              "dim INTEGER,"
-              "vec BLOB);", err)) return false;
-    if (!exec("CREATE INDEX IF NOT EXISTS idx_chunks_doc ON chunks(doc_id);", err)) return false;
+    // Source manifest for documents synced from the docs directory (NULL for uploads). Rows of
+    // an older DB cannot tell seeded documents from uploads; remember which ones they are so the
+    // next docs sync can adopt them by filename once.
+    bool manifest_added = false;
+    if (!ensure_column("docs", "source_path", "TEXT", err, &manifest_added)) return false;
+    if (manifest_added &&
+        !exec("INSERT OR REPLACE INTO meta(key, value) "
+              "SELECT 'legacy_doc_max_id', id FROM docs ORDER BY id DESC LIMIT 1;", err)) {
+        return false;
+    }
+    if (!ensure_column("docs", "source_size", "INTEGER", err)) return false;
+    if (!ensure_column("docs", "source_mtime", "INTEGER", err)) return false;
+    if (!ensure_column("docs", "content_hash", "TEXT", err)) return false;
+    if (!exec("CREATE INDEX IF NOT EXISTS idx_docs_source ON docs(source_path);", err)) return false;
+
+    // Chunk/vector schema, versioned with PRAGMA user_version:
+    //   0  unversioned (chunks/vectors keyed by chunk rowid, fingerprint columns maybe missing)
+    //   1  rowid tables with fingerprint columns
+    //   2  WITHOUT ROWID tables clustered by (doc_id, chunk_index)
+    // A new DB starts at the latest version. Steps that only alter the schema run here; the
+    // 1 -> 2 step copies every row, so for non-empty DBs it runs online through migrate_step()
+    // and the DB is served from the v1 tables until it completes.
+    int version = 0;
+    {
+        Stmt stmt;
+        if (sqlite3_prepare_v2(db_, "PRAGMA user_version;", -1, &stmt.stmt, nullptr) != SQLITE_OK ||
+            sqlite3_step(stmt.stmt) != SQLITE_ROW) {
+            if (err) *err = sqlite3_errmsg(db_);
+            return false;
+        }
+        version = sqlite3_column_int(stmt.stmt, 0);
+    }
+    if (version > kSchemaVersion) {
+        if (err) *err = "database schema is newer than this build (version " + std::to_string(version) + ")";
+        return false;
+    }
+    bool fresh = false;
+    if (version == 0) {
+        Stmt stmt;
+        if (sqlite3_prepare_v2(db_, "SELECT 1 FROM sqlite_master WHERE type='table' AND name='chunks';", -1,
+                               &stmt.stmt, nullptr) != SQLITE_OK) {
+            if (err) *err = sqlite3_errmsg(db_);
+            return false;
+        }
+        fresh = sqlite3_step(stmt.stmt) != SQLITE_ROW;
+    }
+    if (fresh) {
+        if (!exec("BEGIN TRANSACTION;", err)) return false;
+        if (!create_chunk_tables_v2("", err) || !exec("PRAGMA user_version=" + std::to_string(kSchemaVersion) + ";", err)) {
+            exec("ROLLBACK;", nullptr);
+            return false;
+        }
+        if (!exec("COMMIT;", err)) return false;
+        version = kSchemaVersion;
+    }
+    if (version < 1) {
+        if (!migrate_to_v1(err)) return false;
+        version = 1;
+    }
+    schema_version_ = version;
+    // Left behind by a migration or compaction that did not finish.
+    if (!exec("DROP TABLE IF EXISTS chunks_v2;", err)) return false;
+    if (!exec("DROP TABLE IF EXISTS vectors_v2;", err)) return false;
+    if (!exec("DROP TABLE IF EXISTS vectors_compact;", err)) return false;
+    if (!create_chunk_indexes(err)) return false;
+
+    {
+        Stmt stmt;
+        if (sqlite3_prepare_v2(db_, "SELECT MAX(id) FROM chunks;", -1, &stmt.stmt, nullptr) != SQLITE_OK ||
+            sqlite3_step(stmt.stmt) != SQLITE_ROW) {
+            if (err) *err = sqlite3_errmsg(db_);
+            return false;
+        }
+        next_chunk_id_ = sqlite3_column_int64(stmt.stmt, 0) + 1;
+    }
+    // An empty v1 DB has nothing to copy; upgrade it on the spot.
+    if (schema_version_ < kSchemaVersion && next_chunk_id_ == 1) {
+        bool done = false;
+        while (!done) {
+            if (!migrate_step(1024, &done, err)) return false;
+        }
+    }
 
     const char* sql = "SELECT value FROM meta WHERE key='embed_dim';";
     Stmt stmt;
@@ -147,7 +458,151 @@ bool RagVectorDb::ensure_schema(std::string* err) {
     return true;
 }
 
+bool RagVectorDb::create_chunk_indexes(std::string* err) {
+    if (!exec("CREATE INDEX IF NOT EXISTS idx_chunks_text_hash ON chunks(text_hash);", err)) return false;
+    if (schema_version_ >= 2) {
+        if (!exec("CREATE UNIQUE INDEX IF NOT EXISTS idx_chunks_id ON chunks(id);", err)) return false;
+    } else {
+        if (!exec("CREATE INDEX IF NOT EXISTS idx_chunks_doc ON chunks(doc_id);", err)) return false;
+    }
+    if (!exec("CREATE INDEX IF NOT EXISTS idx_chunks_vector ON chunks(vector_id) WHERE vector_id IS NOT NULL;", err)) return false;
+    return true;
+}
+
+const char* RagVectorDb::vector_join() const {
+    return schema_version_ >= 2
+               ? "vectors.doc_id = chunks.doc_id AND vectors.chunk_index = chunks.chunk_index"
+               : "vectors.chunk_id = chunks.id";
+}
+
+bool RagVectorDb::migrate_to_v1(std::string* err) {
+    if (!exec("CREATE TABLE IF NOT EXISTS chunks("
+              "id INTEGER PRIMARY KEY AUTOINCREMENT,"
+              "doc_id INTEGER,"
+              "chunk_index INTEGER,"
+              "source TEXT,"
+              "text TEXT);", err)) return false;
+    if (!exec("CREATE TABLE IF NOT EXISTS vectors("
+              "chunk_id INTEGER PRIMARY KEY,"
+              "dim INTEGER,"
+              "vec BLOB);", err)) return false;
+    // Chunk fingerprints for dedup. vector_id is NULL when the chunk owns its row in `vectors`,
+    // otherwise it names the (exact duplicate) chunk that does. dup_group is NULL unless the
+    // chunk is a near-duplicate, in which case it names the chunk it collapses into.
+    if (!ensure_column("chunks", "text_hash", "INTEGER", err)) return false;
+    if (!ensure_column("chunks", "simhash", "INTEGER", err)) return false;
+    if (!ensure_column("chunks", "vector_id", "INTEGER", err)) return false;
+    if (!ensure_column("chunks", "dup_group", "INTEGER", err)) return false;
+    return exec("PRAGMA user_version=1;", err);
+}
+
+bool RagVectorDb::create_chunk_tables_v2(const char* suffix, std::string* err) {
+    // Both tables are clustered by (doc_id, chunk_index): a document's chunks (and its vectors)
+    // are one contiguous key range, so neighbor expansion, document reads and deletes are range
+    // scans. `id` stays a stable per-chunk key for the dedup references (vector_id, dup_group).
+    // A vector row sits under the key of the chunk that owns it; exact duplicates have none.
+    std::string s = suffix;
+    return exec("CREATE TABLE chunks" + s + "("
+                "doc_id INTEGER NOT NULL,"
+                "chunk_index INTEGER NOT NULL,"
+                "id INTEGER NOT NULL,"
+                "source TEXT,"
+                "text TEXT,"
+                "text_hash INTEGER,"
+                "simhash INTEGER,"
+                "vector_id INTEGER,"
+                "dup_group INTEGER,"
+                "PRIMARY KEY(doc_id, chunk_index)) WITHOUT ROWID;", err) &&
+           exec("CREATE TABLE vectors" + s + "("
+                "doc_id INTEGER NOT NULL,"
+                "chunk_index INTEGER NOT NULL,"
+                "chunk_id INTEGER NOT NULL,"
+                "dim INTEGER,"
+                "vec BLOB,"
+                "PRIMARY KEY(doc_id, chunk_index)) WITHOUT ROWID;", err);
+}
+
+bool RagVectorDb::ensure_column(const char* table, const char* column, const char* decl, std::string* err, bool* added) {
+    if (added) *added = false;
+    std::string sql = std::string("PRAGMA table_info(") + table + ");";
+    Stmt stmt;
+    if (sqlite3_prepare_v2(db_, sql.c_str(), -1, &stmt.stmt, nullptr) != SQLITE_OK) {
+        if (err) *err = sqlite3_errmsg(db_);
+        return false;
+    }
+    while (sqlite3_step(stmt.stmt) == SQLITE_ROW) {
+        const unsigned char* name = sqlite3_column_text(stmt.stmt, 1);
+        if (name && std::strcmp(reinterpret_cast<const char*>(name), column) == 0) return true;
+    }
+    if (!exec(std::string("ALTER TABLE ") + table + " ADD COLUMN " + column + " " + decl + ";", err)) return false;
+    if (added) *added = true;
+    return true;
+}
+
 bool RagVectorDb::load_counts(std::string* err) {
+    // Counters are kept in `meta` and updated in the same transaction as each write, so opening
+    // (and deleting) never needs COUNT(*) scans. DBs without them are counted once.
+    const char* sql =
+        "SELECT key, value FROM meta WHERE key IN ('doc_count', 'chunk_count', 'vector_count', 'near_dup_count');";
+    Stmt stmt;
+    if (sqlite3_prepare_v2(db_, sql, -1, &stmt.stmt, nullptr) != SQLITE_OK) {
+        if (err) *err = sqlite3_errmsg(db_);
+        return false;
+    }
+    RagCounts counts;
+    int found = 0;
+    while (sqlite3_step(stmt.stmt) == SQLITE_ROW) {
+        const char* key = reinterpret_cast<const char*>(sqlite3_column_text(stmt.stmt, 0));
+        size_t value = static_cast<size_t>(std::max<sqlite3_int64>(0, sqlite3_column_int64(stmt.stmt, 1)));
+        if (!key) continue;
+        if (std::strcmp(key, "doc_count") == 0) counts.docs = value;
+        else if (std::strcmp(key, "chunk_count") == 0) counts.chunks = value;
+        else if (std::strcmp(key, "vector_count") == 0) counts.vectors = value;
+        else if (std::strcmp(key, "near_dup_count") == 0) counts.near_dups = value;
+        else continue;
+        ++found;
+    }
+    if (found < 4) {
+        if (!recount(&counts, err)) return false;
+        if (!write_counts(counts, err)) return false;
+    }
+    apply_counts(counts);
+    return true;
+}
+
+bool RagVectorDb::write_counts(const RagCounts& counts, std::string* err) {
+    const char* sql = "INSERT OR REPLACE INTO meta(key, value) VALUES(?, ?);";
+    Stmt stmt;
+    if (sqlite3_prepare_v2(db_, sql, -1, &stmt.stmt, nullptr) != SQLITE_OK) {
+        if (err) *err = sqlite3_errmsg(db_);
+        return false;
+    }
+    const std::pair<const char*, size_t> rows[] = {
+        {"doc_count", counts.docs},
+        {"chunk_count", counts.chunks},
+        {"vector_count", counts.vectors},
+        {"near_dup_count", counts.near_dups},
+    };
+    for (const auto& row : rows) {
+        sqlite3_reset(stmt.stmt);
+        sqlite3_bind_text(stmt.stmt, 1, row.first, -1, SQLITE_STATIC);
+        sqlite3_bind_int64(stmt.stmt, 2, static_cast<sqlite3_int64>(row.second));
+        if (sqlite3_step(stmt.stmt) != SQLITE_DONE) {
+            if (err) *err = sqlite3_errmsg(db_);
+            return false;
+        }
+    }
+    return true;
+}
+
+void RagVectorDb::apply_counts(const RagCounts& counts) {
+    doc_count_ = counts.docs;
+    chunk_count_ = counts.chunks;
+    vector_count_ = counts.vectors;
+    near_dup_count_ = counts.near_dups;
+}
+
+bool RagVectorDb::recount(RagCounts* out, std::string* err) const {
     const char* doc_sql = "SELECT COUNT(*) FROM docs;";
     Stmt doc_stmt;
     if (sqlite3_prepare_v2(db_, doc_sql, -1, &doc_stmt.stmt, nullptr) != SQLITE_OK) {
@@ -155,7 +610,7 @@ bool RagVectorDb::load_counts(std::string* err) {
         return false;
     }
     if (sqlite3_step(doc_stmt.stmt) == SQLITE_ROW) {
-        doc_count_ = static_cast<size_t>(sqlite3_column_int64(doc_stmt.stmt, 0));
+        out->docs = static_cast<size_t>(sqlite3_column_int64(doc_stmt.stmt, 0));
     }
 
     const char* chunk_sql = "SELECT COUNT(*) FROM chunks;";
@@ -165,11 +620,138 @@ bool RagVectorDb::load_counts(std::string* err) {
         return false;
     }
     if (sqlite3_step(chunk_stmt.stmt) == SQLITE_ROW) {
-        chunk_count_ = static_cast<size_t>(sqlite3_column_int64(chunk_stmt.stmt, 0));
+        out->chunks = static_cast<size_t>(sqlite3_column_int64(chunk_stmt.stmt, 0));
+    }
+
+    const char* vec_sql = "SELECT COUNT(*) FROM vectors;";
+    Stmt vec_stmt;
+    if (sqlite3_prepare_v2(db_, vec_sql, -1, &vec_stmt.stmt, nullptr) != SQLITE_OK) {
+        if (err) *err = sqlite3_errmsg(db_);
+        return false;
+    }
+    if (sqlite3_step(vec_stmt.stmt) == SQLITE_ROW) {
+        out->vectors = static_cast<size_t>(sqlite3_column_int64(vec_stmt.stmt, 0));
+    }
+
+    const char* near_sql = "SELECT COUNT(*) FROM chunks WHERE vector_id IS NULL AND dup_group IS NOT NULL;";
+    Stmt near_stmt;
+    if (sqlite3_prepare_v2(db_, near_sql, -1, &near_stmt.stmt, nullptr) != SQLITE_OK) {
+        if (err) *err = sqlite3_errmsg(db_);
+        return false;
+    }
+    if (sqlite3_step(near_stmt.stmt) == SQLITE_ROW) {
+        out->near_dups = static_cast<size_t>(sqlite3_column_int64(near_stmt.stmt, 0));
+    }
+    return true;
+}
+
+bool RagVectorDb::backfill_fingerprints(std::string* err) {
+    // Chunks stored before fingerprints existed: hash them once so new ingests can match them.
+    // Their vectors and groups are left as they are.
+    const char* select_sql = "SELECT id, text FROM chunks WHERE text_hash IS NULL;";
+    const char* update_sql = "UPDATE chunks SET text_hash = ?, simhash = ? WHERE id = ?;";
+    Stmt sel;
+    if (sqlite3_prepare_v2(db_, select_sql, -1, &sel.stmt, nullptr) != SQLITE_OK) {
+        if (err) *err = sqlite3_errmsg(db_);
+        return false;
+    }
+    std::vector<std::pair<sqlite3_int64, std::string>> rows;
+    while (sqlite3_step(sel.stmt) == SQLITE_ROW) {
+        const unsigned char* text = sqlite3_column_text(sel.stmt, 1);
+        rows.emplace_back(sqlite3_column_int64(sel.stmt, 0), text ? reinterpret_cast<const char*>(text) : "");
+    }
+    if (rows.empty()) return true;
+
+    if (!begin_write(err)) return false;
+    Stmt upd;
+    if (sqlite3_prepare_v2(db_, update_sql, -1, &upd.stmt, nullptr) != SQLITE_OK) {
+        if (err) *err = sqlite3_errmsg(db_);
+        rollback_write();
+        return false;
+    }
+    for (const auto& row : rows) {
+        uint64_t simhash = simhash_text(row.second);
+        sqlite3_reset(upd.stmt);
+        sqlite3_bind_int64(upd.stmt, 1, static_cast<sqlite3_int64>(hash_text64(row.second)));
+        if (simhash) {
+            sqlite3_bind_int64(upd.stmt, 2, static_cast<sqlite3_int64>(simhash));
+        } else {
+            sqlite3_bind_null(upd.stmt, 2);
+        }
+        sqlite3_bind_int64(upd.stmt, 3, row.first);
+        if (sqlite3_step(upd.stmt) != SQLITE_DONE) {
+            if (err) *err = sqlite3_errmsg(db_);
+            rollback_write();
+            return false;
+        }
+    }
+    if (!commit_write(err)) {
+        rollback_write();
+        return false;
     }
     return true;
 }
 
+bool RagVectorDb::load_near_dup_index(std::string* err) {
+    near_dup_entries_.clear();
+    near_dup_bands_.clear();
+    const char* sql =
+        "SELECT id, simhash, COALESCE(dup_group, id) FROM chunks "
+        "WHERE vector_id IS NULL AND simhash IS NOT NULL;";
+    Stmt stmt;
+    if (sqlite3_prepare_v2(db_, sql, -1, &stmt.stmt, nullptr) != SQLITE_OK) {
+        if (err) *err = sqlite3_errmsg(db_);
+        return false;
+    }
+    while (sqlite3_step(stmt.stmt) == SQLITE_ROW) {
+        near_dup_insert(sqlite3_column_int64(stmt.stmt, 0),
+                        static_cast<uint64_t>(sqlite3_column_int64(stmt.stmt, 1)),
+                        sqlite3_column_int64(stmt.stmt, 2));
+    }
+    return true;
+}
+
+void RagVectorDb::near_dup_insert(int64_t chunk_id, uint64_t simhash, int64_t group) {
+    if (!simhash) return;
+    near_dup_entries_[chunk_id] = {simhash, group};
+    for (int b = 0; b < kNearDupBands; ++b) {
+        near_dup_bands_[band_key(simhash, b)].push_back(chunk_id);
+    }
+}
+
+void RagVectorDb::near_dup_erase(int64_t chunk_id) {
+    auto it = near_dup_entries_.find(chunk_id);
+    if (it == near_dup_entries_.end()) return;
+    for (int b = 0; b < kNearDupBands; ++b) {
+        auto bucket = near_dup_bands_.find(band_key(it->second.simhash, b));
+        if (bucket == near_dup_bands_.end()) continue;
+        auto& ids = bucket->second;
+        ids.erase(std::remove(ids.begin(), ids.end(), chunk_id), ids.end());
+        if (ids.empty()) near_dup_bands_.erase(bucket);
+    }
+    near_dup_entries_.erase(it);
+}
+
+bool RagVectorDb::find_near_dup(uint64_t simhash, int64_t* out_group) const {
+    if (!simhash || near_dup_distance_ <= 0) return false;
+    int best = near_dup_distance_ + 1;
+    for (int b = 0; b < kNearDupBands; ++b) {
+        auto bucket = near_dup_bands_.find(band_key(simhash, b));
+        if (bucket == near_dup_bands_.end()) continue;
+        for (int64_t id : bucket->second) {
+            auto it = near_dup_entries_.find(id);
+            if (it == near_dup_entries_.end()) continue;
+            int d = hamming64(simhash, it->second.simhash);
+            if (d < best) {
+                best = d;
+                *out_group = it->second.group;
+                if (d == 0) return true;
+            }
+        }
+    }
+    return best <= near_dup_distance_;
+}
+
 bool RagVectorDb::add_document(const std::string& filename,
                                const std::string& mime,
                                const std::string& text,
@@ -177,7 +759,11 @@ bool RagVectorDb::add_document(const std::string& filename,
                                std::string* err,
                                size_t* out_doc_id,
                                size_t* out_chunk_count) {
-    if (!db_) {
+    if (pack_) {
+        if (err) *err = kReadOnlyPackErr;
+        return false;
+    }
+    if (!db_ && shards_.empty()) {
         if (err) *err = "database not initialized";
         return false;
     }
@@ -188,119 +774,439 @@ bool RagVectorDb::add_document(const std::string& filename,
         return false;
     }
 
-    if (!exec("BEGIN TRANSACTION;", err)) return false;
+    size_t next = 0;
+    return add_document_stream(filename, mime,
+                               [&](std::string* chunk, std::string*) {
+                                   if (next >= chunks.size()) return false;
+                                   *chunk = std::move(chunks[next++]);
+                                   return true;
+                               },
+                               err, out_doc_id, out_chunk_count);
+}
 
-    const char* insert_doc_sql = "INSERT INTO docs(filename, mime, added_at, chunk_count) VALUES(?, ?, strftime('%s','now'), ?);";
-    Stmt doc_stmt;
-    if (sqlite3_prepare_v2(db_, insert_doc_sql, -1, &doc_stmt.stmt, nullptr) != SQLITE_OK) {
-        if (err) *err = sqlite3_errmsg(db_);
-        exec("ROLLBACK;", nullptr);
-        return false;
+bool RagVectorDb::add_document_stream(const std::string& filename,
+                                      const std::string& mime,
+                                      const RagChunkSource& next_chunk,
+                                      std::string* err,
+                                      size_t* out_doc_id,
+                                      size_t* out_chunk_count) {
+    if (!shards_.empty()) {
+        int64_t doc_id = next_doc_id_.fetch_add(1);
+        RagShard& shard = shard_for(static_cast<size_t>(doc_id));
+        std::lock_guard<std::mutex> lock(shard.mu);
+        return shard.db.add_document_as(doc_id, filename, mime, next_chunk, err, out_doc_id, out_chunk_count);
+    }
+    return add_document_as(0, filename, mime, next_chunk, err, out_doc_id, out_chunk_count);
+}
+
+bool RagVectorDb::add_document_as(int64_t doc_id_hint,
+                                  const std::string& filename,
+                                  const std::string& mime,
+                                  const RagChunkSource& next_chunk,
+                                  std::string* err,
+                                  size_t* out_doc_id,
+                                  size_t* out_chunk_count) {
+    if (pack_) {
+        if (err) *err = kReadOnlyPackErr;
+        return false;
+    }
+    if (!db_) {
+        if (err) *err = "database not initialized";
+        return false;
+    }
+
+    if (!begin_write(err)) return false;
+
+    // chunk_count is only known once the source is drained; it is filled in before COMMIT.
+    const char* insert_doc_sql =
+        "INSERT INTO docs(filename, mime, added_at, chunk_count, id) VALUES(?, ?, strftime('%s','now'), 0, ?);";
+    Stmt doc_stmt;
+    if (sqlite3_prepare_v2(db_, insert_doc_sql, -1, &doc_stmt.stmt, nullptr) != SQLITE_OK) {
+        if (err) *err = sqlite3_errmsg(db_);
+        rollback_write();
+        return false;
     }
     sqlite3_bind_text(doc_stmt.stmt, 1, filename.c_str(), -1, SQLITE_TRANSIENT);
     sqlite3_bind_text(doc_stmt.stmt, 2, mime.c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_bind_int(doc_stmt.stmt, 3, static_cast<int>(chunks.size()));
+    if (doc_id_hint > 0) {
+        sqlite3_bind_int64(doc_stmt.stmt, 3, doc_id_hint);
+    } else {
+        sqlite3_bind_null(doc_stmt.stmt, 3);
+    }
     if (sqlite3_step(doc_stmt.stmt) != SQLITE_DONE) {
         if (err) *err = sqlite3_errmsg(db_);
-        exec("ROLLBACK;", nullptr);
+        rollback_write();
         return false;
     }
     sqlite3_int64 doc_id = sqlite3_last_insert_rowid(db_);
 
-    const char* insert_chunk_sql = "INSERT INTO chunks(doc_id, chunk_index, source, text) VALUES(?, ?, ?, ?);";
-    const char* insert_vec_sql = "INSERT INTO vectors(chunk_id, dim, vec) VALUES(?, ?, ?);";
+    const char* insert_chunk_sql =
+        "INSERT INTO chunks(doc_id, chunk_index, source, text, text_hash, simhash, vector_id, dup_group, id) "
+        "VALUES(?, ?, ?, ?, ?, ?, ?, ?, ?);";
+    const char* insert_vec_sql = schema_version_ >= 2
+                                     ? "INSERT INTO vectors(chunk_id, dim, vec, doc_id, chunk_index) VALUES(?, ?, ?, ?, ?);"
+                                     : "INSERT INTO vectors(chunk_id, dim, vec) VALUES(?, ?, ?);";
+    const char* find_exact_sql = "SELECT id, vector_id, dup_group, text FROM chunks WHERE text_hash = ?;";
     Stmt chunk_stmt;
     Stmt vec_stmt;
+    Stmt exact_stmt;
     if (sqlite3_prepare_v2(db_, insert_chunk_sql, -1, &chunk_stmt.stmt, nullptr) != SQLITE_OK ||
-        sqlite3_prepare_v2(db_, insert_vec_sql, -1, &vec_stmt.stmt, nullptr) != SQLITE_OK) {
+        sqlite3_prepare_v2(db_, insert_vec_sql, -1, &vec_stmt.stmt, nullptr) != SQLITE_OK ||
+        sqlite3_prepare_v2(db_, find_exact_sql, -1, &exact_stmt.stmt, nullptr) != SQLITE_OK) {
         if (err) *err = sqlite3_errmsg(db_);
-        exec("ROLLBACK;", nullptr);
+        rollback_write();
         return false;
     }
 
+    // Chunks entered into the near-dup index by this call; taken out again if the document fails.
+    std::vector<int64_t> indexed;
+    auto rollback = [&]() {
+        rollback_write();
+        for (int64_t id : indexed) near_dup_erase(id);
+    };
+
     RagEmbedder embedder(embed_dim_);
+    // Chunk ids are handed out here (v2 tables have no rowid to do it); only consumed on commit.
+    int64_t next_chunk_id = next_chunk_id_;
     size_t idx = 0;
-    for (const auto& chunk : chunks) {
+    size_t new_vectors = 0;
+    size_t new_near_dups = 0;
+    std::string chunk;
+    std::string source_err;
+    while (next_chunk(&chunk, &source_err)) {
         std::string trimmed = trim_text(chunk);
         if (trimmed.empty()) continue;
         std::string source = filename + "#" + std::to_string(idx);
+        uint64_t text_hash = hash_text64(trimmed);
+
+        // Exact duplicate (same text anywhere in the DB): point at the owner's vector.
+        sqlite3_int64 shared_vector = 0;
+        sqlite3_int64 group = 0;
+        sqlite3_reset(exact_stmt.stmt);
+        sqlite3_bind_int64(exact_stmt.stmt, 1, static_cast<sqlite3_int64>(text_hash));
+        while (sqlite3_step(exact_stmt.stmt) == SQLITE_ROW) {
+            const unsigned char* text = sqlite3_column_text(exact_stmt.stmt, 3);
+            if (!text || trimmed != reinterpret_cast<const char*>(text)) continue;
+            sqlite3_int64 id = sqlite3_column_int64(exact_stmt.stmt, 0);
+            shared_vector = sqlite3_column_type(exact_stmt.stmt, 1) == SQLITE_NULL ? id : sqlite3_column_int64(exact_stmt.stmt, 1);
+            if (sqlite3_column_type(exact_stmt.stmt, 2) != SQLITE_NULL) group = sqlite3_column_int64(exact_stmt.stmt, 2);
+            break;
+        }
 
+        uint64_t simhash = simhash_text(trimmed);
+        if (!shared_vector) {
+            int64_t near_group = 0;
+            if (find_near_dup(simhash, &near_group)) group = near_group;
+        }
+
+        sqlite3_int64 chunk_id = next_chunk_id++;
         sqlite3_reset(chunk_stmt.stmt);
         sqlite3_bind_int64(chunk_stmt.stmt, 1, doc_id);
         sqlite3_bind_int(chunk_stmt.stmt, 2, static_cast<int>(idx));
         sqlite3_bind_text(chunk_stmt.stmt, 3, source.c_str(), -1, SQLITE_TRANSIENT);
         sqlite3_bind_text(chunk_stmt.stmt, 4, trimmed.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int64(chunk_stmt.stmt, 5, static_cast<sqlite3_int64>(text_hash));
+        if (simhash) {
+            sqlite3_bind_int64(chunk_stmt.stmt, 6, static_cast<sqlite3_int64>(simhash));
+        } else {
+            sqlite3_bind_null(chunk_stmt.stmt, 6);
+        }
+        if (shared_vector) {
+            sqlite3_bind_int64(chunk_stmt.stmt, 7, shared_vector);
+        } else {
+            sqlite3_bind_null(chunk_stmt.stmt, 7);
+        }
+        if (group) {
+            sqlite3_bind_int64(chunk_stmt.stmt, 8, group);
+        } else {
+            sqlite3_bind_null(chunk_stmt.stmt, 8);
+        }
+        sqlite3_bind_int64(chunk_stmt.stmt, 9, chunk_id);
         if (sqlite3_step(chunk_stmt.stmt) != SQLITE_DONE) {
             if (err) *err = sqlite3_errmsg(db_);
-            exec("ROLLBACK;", nullptr);
+            rollback();
             return false;
         }
+        if (shared_vector) {
+            ++idx;
+            continue;
+        }
 
-        sqlite3_int64 chunk_id = sqlite3_last_insert_rowid(db_);
         std::vector<float> vec = embedder.embed(trimmed);
 
         sqlite3_reset(vec_stmt.stmt);
         sqlite3_bind_int64(vec_stmt.stmt, 1, chunk_id);
         sqlite3_bind_int(vec_stmt.stmt, 2, embed_dim_);
         sqlite3_bind_blob(vec_stmt.stmt, 3, vec.data(), static_cast<int>(vec.size() * sizeof(float)), SQLITE_TRANSIENT);
+        if (schema_version_ >= 2) {
+            sqlite3_bind_int64(vec_stmt.stmt, 4, doc_id);
+            sqlite3_bind_int(vec_stmt.stmt, 5, static_cast<int>(idx));
+        }
+        ++idx;
         if (sqlite3_step(vec_stmt.stmt) != SQLITE_DONE) {
             if (err) *err = sqlite3_errmsg(db_);
-            exec("ROLLBACK;", nullptr);
+            rollback();
             return false;
         }
-        ++idx;
+        ++new_vectors;
+        if (group) ++new_near_dups;
+        if (simhash) {
+            near_dup_insert(chunk_id, simhash, group ? group : chunk_id);
+            indexed.push_back(chunk_id);
+        }
+    }
+    if (!source_err.empty()) {
+        if (err) *err = source_err;
+        rollback();
+        return false;
+    }
+    if (idx == 0) {
+        if (err) *err = "no text chunks generated";
+        rollback();
+        return false;
     }
 
-    if (!exec("COMMIT;", err)) {
-        exec("ROLLBACK;", nullptr);
+    {
+        const char* sql = "UPDATE docs SET chunk_count = ? WHERE id = ?;";
+        Stmt stmt;
+        if (sqlite3_prepare_v2(db_, sql, -1, &stmt.stmt, nullptr) != SQLITE_OK) {
+            if (err) *err = sqlite3_errmsg(db_);
+            rollback();
+            return false;
+        }
+        sqlite3_bind_int64(stmt.stmt, 1, static_cast<sqlite3_int64>(idx));
+        sqlite3_bind_int64(stmt.stmt, 2, doc_id);
+        if (sqlite3_step(stmt.stmt) != SQLITE_DONE) {
+            if (err) *err = sqlite3_errmsg(db_);
+            rollback();
+            return false;
+        }
+    }
+
+    RagCounts counts{doc_count_ + 1, chunk_count_ + idx, vector_count_ + new_vectors, near_dup_count_ + new_near_dups};
+    if (!write_counts(counts, err)) {
+        rollback();
         return false;
     }
 
-    doc_count_ += 1;
-    chunk_count_ += idx;
+    if (!commit_write(err)) {
+        rollback();
+        return false;
+    }
+    apply_counts(counts);
+    next_chunk_id_ = next_chunk_id;
+    bulk_flush_if_needed(idx);
     if (out_doc_id) *out_doc_id = static_cast<size_t>(doc_id);
     if (out_chunk_count) *out_chunk_count = idx;
     return true;
 }
 
 bool RagVectorDb::delete_doc(size_t doc_id, std::string* err) {
+    if (!shards_.empty()) {
+        RagShard& shard = shard_for(doc_id);
+        std::lock_guard<std::mutex> lock(shard.mu);
+        return shard.db.delete_doc(doc_id, err);
+    }
+    if (pack_) {
+        if (err) *err = kReadOnlyPackErr;
+        return false;
+    }
     if (!db_) {
         if (err) *err = "database not initialized";
         return false;
     }
 
-    if (!exec("BEGIN TRANSACTION;", err)) return false;
+    if (!begin_write(err)) return false;
 
     {
         const char* sql = "SELECT id FROM docs WHERE id = ?;";
         Stmt stmt;
         if (sqlite3_prepare_v2(db_, sql, -1, &stmt.stmt, nullptr) != SQLITE_OK) {
             if (err) *err = sqlite3_errmsg(db_);
-            exec("ROLLBACK;", nullptr);
+            rollback_write();
             return false;
         }
         sqlite3_bind_int64(stmt.stmt, 1, static_cast<sqlite3_int64>(doc_id));
         if (sqlite3_step(stmt.stmt) != SQLITE_ROW) {
             if (err) *err = "document not found";
-            exec("ROLLBACK;", nullptr);
+            rollback_write();
             return false;
         }
     }
 
+    // Vectors owned by this document may be shared by exact duplicates in other documents; hand
+    // each such vector over to the lowest surviving duplicate before the owner rows go away.
+    std::vector<int64_t> owners;
+    std::vector<int> owner_indexes;
+    std::vector<std::pair<int64_t, int64_t>> rehomed;
+    // Near-dup groups whose leader goes away with no exact duplicate to inherit it: the lowest
+    // surviving member leads them instead (old leader, new leader).
+    std::vector<std::pair<int64_t, int64_t>> promoted;
+    std::unordered_set<int64_t> near_dup_owners;
+    // Documents (other than this one) whose rows change; an online migration re-copies them.
+    std::vector<int64_t> touched_docs;
     {
-        const char* sql = "DELETE FROM vectors WHERE chunk_id IN (SELECT id FROM chunks WHERE doc_id = ?);";
+        const char* sql =
+            "SELECT id, dup_group IS NOT NULL, chunk_index FROM chunks WHERE doc_id = ? AND vector_id IS NULL;";
         Stmt stmt;
         if (sqlite3_prepare_v2(db_, sql, -1, &stmt.stmt, nullptr) != SQLITE_OK) {
             if (err) *err = sqlite3_errmsg(db_);
-            exec("ROLLBACK;", nullptr);
+            rollback_write();
+            return false;
+        }
+        sqlite3_bind_int64(stmt.stmt, 1, static_cast<sqlite3_int64>(doc_id));
+        while (sqlite3_step(stmt.stmt) == SQLITE_ROW) {
+            owners.push_back(sqlite3_column_int64(stmt.stmt, 0));
+            owner_indexes.push_back(sqlite3_column_int(stmt.stmt, 2));
+            if (sqlite3_column_int(stmt.stmt, 1)) near_dup_owners.insert(owners.back());
+        }
+    }
+    if (!owners.empty()) {
+        const char* find_sql =
+            "SELECT id, doc_id, chunk_index FROM chunks WHERE vector_id = ? AND doc_id != ? ORDER BY id LIMIT 1;";
+        // v2 vector rows are keyed by the owning chunk's position, so they move with ownership.
+        const char* move_vec_sql =
+            schema_version_ >= 2
+                ? "UPDATE vectors SET chunk_id = ?1, doc_id = ?3, chunk_index = ?4 WHERE doc_id = ?5 AND chunk_index = ?6;"
+                : "UPDATE vectors SET chunk_id = ?1 WHERE chunk_id = ?2;";
+        const char* own_sql = "UPDATE chunks SET vector_id = NULL WHERE id = ?;";
+        const char* repoint_sql = "UPDATE chunks SET vector_id = ? WHERE vector_id = ? AND doc_id != ?;";
+        const char* sharers_sql = "SELECT DISTINCT doc_id FROM chunks WHERE vector_id = ? AND doc_id != ?;";
+        // Near-duplicates that collapsed into the owner follow it to the heir (or new leader).
+        const char* regroup_sql = "UPDATE chunks SET dup_group = ?1 WHERE dup_group = ?2 AND doc_id != ?3 AND id != ?1;";
+        const char* groupmates_sql = "SELECT DISTINCT doc_id FROM chunks WHERE dup_group = ? AND doc_id != ?;";
+        const char* find_member_sql =
+            "SELECT id FROM chunks WHERE dup_group = ? AND doc_id != ? AND vector_id IS NULL ORDER BY id LIMIT 1;";
+        // The new leader and its exact duplicates carry no group, like any leader.
+        const char* lead_sql =
+            "UPDATE chunks SET dup_group = NULL WHERE dup_group = ?1 AND doc_id != ?3 AND (id = ?2 OR vector_id = ?2);";
+        Stmt find_stmt;
+        Stmt move_stmt;
+        Stmt own_stmt;
+        Stmt repoint_stmt;
+        Stmt sharers_stmt;
+        Stmt regroup_stmt;
+        Stmt groupmates_stmt;
+        Stmt find_member_stmt;
+        Stmt lead_stmt;
+        if (sqlite3_prepare_v2(db_, find_sql, -1, &find_stmt.stmt, nullptr) != SQLITE_OK ||
+            sqlite3_prepare_v2(db_, move_vec_sql, -1, &move_stmt.stmt, nullptr) != SQLITE_OK ||
+            sqlite3_prepare_v2(db_, own_sql, -1, &own_stmt.stmt, nullptr) != SQLITE_OK ||
+            sqlite3_prepare_v2(db_, repoint_sql, -1, &repoint_stmt.stmt, nullptr) != SQLITE_OK ||
+            sqlite3_prepare_v2(db_, sharers_sql, -1, &sharers_stmt.stmt, nullptr) != SQLITE_OK ||
+            sqlite3_prepare_v2(db_, regroup_sql, -1, &regroup_stmt.stmt, nullptr) != SQLITE_OK ||
+            sqlite3_prepare_v2(db_, groupmates_sql, -1, &groupmates_stmt.stmt, nullptr) != SQLITE_OK ||
+            sqlite3_prepare_v2(db_, find_member_sql, -1, &find_member_stmt.stmt, nullptr) != SQLITE_OK ||
+            sqlite3_prepare_v2(db_, lead_sql, -1, &lead_stmt.stmt, nullptr) != SQLITE_OK) {
+            if (err) *err = sqlite3_errmsg(db_);
+            rollback_write();
+            return false;
+        }
+        auto note_groupmates = [&](int64_t owner) {
+            if (!migrating_) return;
+            sqlite3_reset(groupmates_stmt.stmt);
+            sqlite3_bind_int64(groupmates_stmt.stmt, 1, owner);
+            sqlite3_bind_int64(groupmates_stmt.stmt, 2, static_cast<sqlite3_int64>(doc_id));
+            while (sqlite3_step(groupmates_stmt.stmt) == SQLITE_ROW) {
+                touched_docs.push_back(sqlite3_column_int64(groupmates_stmt.stmt, 0));
+            }
+        };
+        auto regroup = [&](int64_t owner, int64_t leader) -> bool {
+            sqlite3_reset(regroup_stmt.stmt);
+            sqlite3_bind_int64(regroup_stmt.stmt, 1, leader);
+            sqlite3_bind_int64(regroup_stmt.stmt, 2, owner);
+            sqlite3_bind_int64(regroup_stmt.stmt, 3, static_cast<sqlite3_int64>(doc_id));
+            return sqlite3_step(regroup_stmt.stmt) == SQLITE_DONE;
+        };
+        for (size_t i = 0; i < owners.size(); ++i) {
+            int64_t owner = owners[i];
+            sqlite3_reset(find_stmt.stmt);
+            sqlite3_bind_int64(find_stmt.stmt, 1, owner);
+            sqlite3_bind_int64(find_stmt.stmt, 2, static_cast<sqlite3_int64>(doc_id));
+            if (sqlite3_step(find_stmt.stmt) != SQLITE_ROW) {
+                if (near_dup_owners.count(owner)) continue;
+                sqlite3_reset(find_member_stmt.stmt);
+                sqlite3_bind_int64(find_member_stmt.stmt, 1, owner);
+                sqlite3_bind_int64(find_member_stmt.stmt, 2, static_cast<sqlite3_int64>(doc_id));
+                if (sqlite3_step(find_member_stmt.stmt) != SQLITE_ROW) continue;
+                sqlite3_int64 leader = sqlite3_column_int64(find_member_stmt.stmt, 0);
+                sqlite3_reset(lead_stmt.stmt);
+                sqlite3_bind_int64(lead_stmt.stmt, 1, owner);
+                sqlite3_bind_int64(lead_stmt.stmt, 2, leader);
+                sqlite3_bind_int64(lead_stmt.stmt, 3, static_cast<sqlite3_int64>(doc_id));
+                note_groupmates(owner);
+                if (sqlite3_step(lead_stmt.stmt) != SQLITE_DONE || !regroup(owner, leader)) {
+                    if (err) *err = sqlite3_errmsg(db_);
+                    rollback_write();
+                    return false;
+                }
+                promoted.emplace_back(owner, leader);
+                continue;
+            }
+            sqlite3_int64 heir = sqlite3_column_int64(find_stmt.stmt, 0);
+            sqlite3_int64 heir_doc = sqlite3_column_int64(find_stmt.stmt, 1);
+            int heir_index = sqlite3_column_int(find_stmt.stmt, 2);
+
+            if (migrating_) {
+                sqlite3_reset(sharers_stmt.stmt);
+                sqlite3_bind_int64(sharers_stmt.stmt, 1, owner);
+                sqlite3_bind_int64(sharers_stmt.stmt, 2, static_cast<sqlite3_int64>(doc_id));
+                while (sqlite3_step(sharers_stmt.stmt) == SQLITE_ROW) {
+                    touched_docs.push_back(sqlite3_column_int64(sharers_stmt.stmt, 0));
+                }
+            }
+            note_groupmates(owner);
+
+            sqlite3_reset(move_stmt.stmt);
+            sqlite3_bind_int64(move_stmt.stmt, 1, heir);
+            if (schema_version_ >= 2) {
+                sqlite3_bind_int64(move_stmt.stmt, 3, heir_doc);
+                sqlite3_bind_int(move_stmt.stmt, 4, heir_index);
+                sqlite3_bind_int64(move_stmt.stmt, 5, static_cast<sqlite3_int64>(doc_id));
+                sqlite3_bind_int(move_stmt.stmt, 6, owner_indexes[i]);
+            } else {
+                sqlite3_bind_int64(move_stmt.stmt, 2, owner);
+            }
+            sqlite3_reset(own_stmt.stmt);
+            sqlite3_bind_int64(own_stmt.stmt, 1, heir);
+            sqlite3_reset(repoint_stmt.stmt);
+            sqlite3_bind_int64(repoint_stmt.stmt, 1, heir);
+            sqlite3_bind_int64(repoint_stmt.stmt, 2, owner);
+            sqlite3_bind_int64(repoint_stmt.stmt, 3, static_cast<sqlite3_int64>(doc_id));
+            if (sqlite3_step(move_stmt.stmt) != SQLITE_DONE ||
+                sqlite3_step(own_stmt.stmt) != SQLITE_DONE ||
+                sqlite3_step(repoint_stmt.stmt) != SQLITE_DONE ||
+                !regroup(owner, heir)) {
+                if (err) *err = sqlite3_errmsg(db_);
+                rollback_write();
+                return false;
+            }
+            rehomed.emplace_back(owner, heir);
+            // The heir inherits the owner's group, so a near-duplicate stays one; if the owner led
+            // a group, the heir leads it now.
+            near_dup_owners.erase(owner);
+        }
+    }
+
+    size_t vectors_removed = 0;
+    size_t chunks_removed = 0;
+    {
+        const char* sql = schema_version_ >= 2
+                              ? "DELETE FROM vectors WHERE doc_id = ?;"
+                              : "DELETE FROM vectors WHERE chunk_id IN (SELECT id FROM chunks WHERE doc_id = ?);";
+        Stmt stmt;
+        if (sqlite3_prepare_v2(db_, sql, -1, &stmt.stmt, nullptr) != SQLITE_OK) {
+            if (err) *err = sqlite3_errmsg(db_);
+            rollback_write();
             return false;
         }
         sqlite3_bind_int64(stmt.stmt, 1, static_cast<sqlite3_int64>(doc_id));
         if (sqlite3_step(stmt.stmt) != SQLITE_DONE) {
             if (err) *err = sqlite3_errmsg(db_);
-            exec("ROLLBACK;", nullptr);
+            rollback_write();
             return false;
         }
+        vectors_removed = static_cast<size_t>(sqlite3_changes(db_));
     }
 
     {
@@ -308,15 +1214,16 @@ bool RagVectorDb::delete_doc(size_t doc_id, std::string* err) {
         Stmt stmt;
         if (sqlite3_prepare_v2(db_, sql, -1, &stmt.stmt, nullptr) != SQLITE_OK) {
             if (err) *err = sqlite3_errmsg(db_);
-            exec("ROLLBACK;", nullptr);
+            rollback_write();
             return false;
         }
         sqlite3_bind_int64(stmt.stmt, 1, static_cast<sqlite3_int64>(doc_id));
         if (sqlite3_step(stmt.stmt) != SQLITE_DONE) {
             if (err) *err = sqlite3_errmsg(db_);
-            exec("ROLLBACK;", nullptr);
+            rollback_write();
             return false;
         }
+        chunks_removed = static_cast<size_t>(sqlite3_changes(db_));
     }
 
     {
@@ -324,45 +1231,71 @@ bool RagVectorDb::delete_doc(size_t doc_id, std::string* err) {
         Stmt stmt;
         if (sqlite3_prepare_v2(db_, sql, -1, &stmt.stmt, nullptr) != SQLITE_OK) {
             if (err) *err = sqlite3_errmsg(db_);
-            exec("ROLLBACK;", nullptr);
+            rollback_write();
             return false;
         }
         sqlite3_bind_int64(stmt.stmt, 1, static_cast<sqlite3_int64>(doc_id));
         if (sqlite3_step(stmt.stmt) != SQLITE_DONE) {
             if (err) *err = sqlite3_errmsg(db_);
-            exec("ROLLBACK;", nullptr);
+            rollback_write();
             return false;
         }
     }
 
-    std::string local_err;
-    if (!load_counts(&local_err)) {
-        if (err) *err = local_err;
-        exec("ROLLBACK;", nullptr);
+    auto sub = [](size_t v, size_t d) { return v > d ? v - d : 0; };
+    RagCounts counts{sub(doc_count_, 1), sub(chunk_count_, chunks_removed), sub(vector_count_, vectors_removed),
+                     sub(near_dup_count_, near_dup_owners.size() + promoted.size())};
+    if (!write_counts(counts, err)) {
+        rollback_write();
         return false;
     }
 
-    if (!exec("COMMIT;", err)) {
-        exec("ROLLBACK;", nullptr);
+    if (!commit_write(err)) {
+        rollback_write();
         return false;
     }
+    apply_counts(counts);
+    if (migrating_) {
+        migrate_touched_docs_.insert(static_cast<int64_t>(doc_id));
+        migrate_touched_docs_.insert(touched_docs.begin(), touched_docs.end());
+    }
+
+    if (!rehomed.empty() || !promoted.empty()) {
+        std::unordered_map<int64_t, int64_t> heirs(rehomed.begin(), rehomed.end());
+        heirs.insert(promoted.begin(), promoted.end());
+        for (auto& e : near_dup_entries_) {
+            auto h = heirs.find(e.second.group);
+            if (h != heirs.end()) e.second.group = h->second;
+        }
+    }
+    for (const auto& r : rehomed) {
+        auto it = near_dup_entries_.find(r.first);
+        if (it == near_dup_entries_.end()) continue;
+        NearDupEntry entry = it->second;
+        near_dup_insert(r.second, entry.simhash, entry.group == r.first ? r.second : entry.group);
+    }
+    for (int64_t owner : owners) near_dup_erase(owner);
     return true;
 }
 
 std::vector<RagSearchHit> RagVectorDb::search(const std::vector<float>& query_vec, size_t top_k) const {
+    if (pack_) return search_pack(query_vec, top_k);
+    if (!shards_.empty()) return search_shards(query_vec, top_k);
     std::vector<RagSearchHit> out;
     if (!db_ || query_vec.empty() || top_k == 0) return out;
 
-    const char* sql =
-        "SELECT chunks.source, chunks.text, vectors.vec, vectors.dim, chunks.doc_id, chunks.chunk_index "
-        "FROM vectors JOIN chunks ON vectors.chunk_id = chunks.id;";
+    std::string sql =
+        std::string("SELECT chunks.source, chunks.text, vectors.vec, vectors.dim, chunks.doc_id, chunks.chunk_index, "
+                    "COALESCE(chunks.dup_group, chunks.id) "
+                    "FROM vectors JOIN chunks ON ") + vector_join() + ";";
     Stmt stmt;
-    if (sqlite3_prepare_v2(db_, sql, -1, &stmt.stmt, nullptr) != SQLITE_OK) {
+    if (sqlite3_prepare_v2(db_, sql.c_str(), -1, &stmt.stmt, nullptr) != SQLITE_OK) {
         return out;
     }
 
     struct Scored {
         RagSearchHit hit;
+        int64_t group = 0;
     };
     std::vector<Scored> scored;
 
@@ -373,6 +1306,7 @@ std::vector<RagSearchHit> RagVectorDb::search(const std::vector<float>& query_ve
         int dim = sqlite3_column_int(stmt.stmt, 3);
         sqlite3_int64 doc_id = sqlite3_column_int64(stmt.stmt, 4);
         int chunk_index = sqlite3_column_int(stmt.stmt, 5);
+        sqlite3_int64 group = sqlite3_column_int64(stmt.stmt, 6);
         int bytes = sqlite3_column_bytes(stmt.stmt, 2);
         if (!blob || dim <= 0 || bytes != dim * static_cast<int>(sizeof(float))) continue;
         if (static_cast<int>(query_vec.size()) != dim) continue;
@@ -390,16 +1324,18 @@ std::vector<RagSearchHit> RagVectorDb::search(const std::vector<float>& query_ve
         hit.score = score;
         hit.doc_id = static_cast<size_t>(doc_id);
         hit.chunk_index = chunk_index;
-        scored.push_back({std::move(hit)});
+        scored.push_back({std::move(hit), group});
     }
 
     if (scored.empty()) return out;
     std::sort(scored.begin(), scored.end(), [](const Scored& a, const Scored& b) {
         return a.hit.score > b.hit.score;
     });
-    size_t limit = std::min(top_k, scored.size());
-    out.reserve(limit);
-    for (size_t i = 0; i < limit; ++i) {
+    // Near-duplicate chunks share a group; only the best-scoring member of each group is returned.
+    std::unordered_set<int64_t> seen_groups;
+    out.reserve(std::min(top_k, scored.size()));
+    for (size_t i = 0; i < scored.size() && out.size() < top_k; ++i) {
+        if (!seen_groups.insert(scored[i].group).second) continue;
         RagSearchHit hit = scored[i].hit;
         hit.text = shorten_text(hit.text, 520);
         out.push_back(std::move(hit));
@@ -408,7 +1344,7 @@ std::vector<RagSearchHit> RagVectorDb::search(const std::vector<float>& query_ve
 }
 
 std::string RagVectorDb::expand_neighbors(size_t doc_id, int center_chunk_index, int neighbor_chunks) const {
-    if (!db_ || neighbor_chunks <= 0) return {};
+    if ((!db_ && !pack_ && shards_.empty()) || neighbor_chunks <= 0) return {};
     if (center_chunk_index < 0) return {};
 
     int start = center_chunk_index - neighbor_chunks;
@@ -421,6 +1357,12 @@ std::string RagVectorDb::expand_range(size_t doc_id,
                                      int start_chunk_index,
                                      int end_chunk_index,
                                      int center_chunk_index) const {
+    if (pack_) return expand_range_pack(doc_id, start_chunk_index, end_chunk_index, center_chunk_index);
+    if (!shards_.empty()) {
+        RagShard& shard = shard_for(doc_id);
+        std::lock_guard<std::mutex> lock(shard.mu);
+        return shard.db.expand_range(doc_id, start_chunk_index, end_chunk_index, center_chunk_index);
+    }
     if (!db_) return {};
     if (center_chunk_index < 0) return {};
     if (start_chunk_index < 0) start_chunk_index = 0;
@@ -447,43 +1389,19 @@ std::string RagVectorDb::expand_range(size_t doc_id,
         if (!text) continue;
         rows.emplace_back(idx, reinterpret_cast<const char*>(text));
     }
-    if (rows.empty()) return {};
-
-    auto append_chunk = [&](std::string& out, int idx, const std::string& text, bool matched) {
-        if (!out.empty()) out += "\n\n";
-        out += matched ? "(matched chunk " : "(neighbor chunk ";
-        out += std::to_string(idx) + ")\n";
-        out += text;
-    };
-
-    // Put the matched chunk first so truncation keeps the most important part.
-    std::string out;
-    int center_pos = -1;
-    for (size_t i = 0; i < rows.size(); ++i) {
-        if (rows[i].first == center_chunk_index) {
-            center_pos = static_cast<int>(i);
-            break;
-        }
-    }
-    if (center_pos < 0) {
-        for (const auto& r : rows) append_chunk(out, r.first, r.second, false);
-        return out;
-    }
-
-    append_chunk(out, rows[static_cast<size_t>(center_pos)].first, rows[static_cast<size_t>(center_pos)].second, true);
-    for (int i = center_pos - 1; i >= 0; --i) {
-        append_chunk(out, rows[static_cast<size_t>(i)].first, rows[static_cast<size_t>(i)].second, false);
-    }
-    for (size_t i = static_cast<size_t>(center_pos) + 1; i < rows.size(); ++i) {
-        append_chunk(out, rows[i].first, rows[i].second, false);
-    }
-    return out;
+    return format_expanded_rows(rows, center_chunk_index);
 }
 
 bool RagVectorDb::get_document_chunks(size_t doc_id,
                                       std::string* out_filename,
                                       std::vector<RagSearchHit>* out_chunks,
                                       std::string* err) const {
+    if (pack_) return get_document_chunks_pack(doc_id, out_filename, out_chunks, err);
+    if (!shards_.empty()) {
+        RagShard& shard = shard_for(doc_id);
+        std::lock_guard<std::mutex> lock(shard.mu);
+        return shard.db.get_document_chunks(doc_id, out_filename, out_chunks, err);
+    }
     if (!db_) {
         if (err) *err = "database not initialized";
         return false;
@@ -542,11 +1460,13 @@ bool RagVectorDb::get_document_chunks(size_t doc_id,
 }
 
 std::vector<RagDocInfo> RagVectorDb::list_docs(size_t limit, size_t offset) const {
+    if (pack_) return list_docs_pack(limit, offset);
+    if (!shards_.empty()) return list_docs_shards(limit, offset);
     std::vector<RagDocInfo> out;
     if (!db_ || limit == 0) return out;
 
     const char* sql =
-        "SELECT id, filename, mime, added_at, chunk_count "
+        "SELECT id, filename, mime, added_at, chunk_count, source_path "
         "FROM docs "
         "ORDER BY id DESC "
         "LIMIT ? OFFSET ?;";
@@ -563,6 +1483,7 @@ std::vector<RagDocInfo> RagVectorDb::list_docs(size_t limit, size_t offset) cons
         const unsigned char* mime = sqlite3_column_text(stmt.stmt, 2);
         sqlite3_int64 added_at = sqlite3_column_int64(stmt.stmt, 3);
         sqlite3_int64 chunk_count = sqlite3_column_int64(stmt.stmt, 4);
+        const unsigned char* source_path = sqlite3_column_text(stmt.stmt, 5);
 
         RagDocInfo info;
         info.id = static_cast<size_t>(id);
@@ -570,7 +1491,922 @@ std::vector<RagDocInfo> RagVectorDb::list_docs(size_t limit, size_t offset) cons
         info.mime = mime ? reinterpret_cast<const char*>(mime) : "";
         info.added_at = static_cast<int64_t>(added_at);
         info.chunk_count = chunk_count > 0 ? static_cast<size_t>(chunk_count) : 0;
+        info.source_path = source_path ? reinterpret_cast<const char*>(source_path) : "";
+        out.push_back(std::move(info));
+    }
+    return out;
+}
+
+std::vector<RagDocSource> RagVectorDb::list_doc_sources() const {
+    std::vector<RagDocSource> out;
+    if (!shards_.empty()) {
+        for (const auto& shard : shards_) {
+            std::lock_guard<std::mutex> lock(shard->mu);
+            auto part = shard->db.list_doc_sources();
+            out.insert(out.end(), std::make_move_iterator(part.begin()), std::make_move_iterator(part.end()));
+        }
+        return out;
+    }
+    if (!db_) return out;
+
+    const char* sql =
+        "SELECT id, source_path, source_size, source_mtime, content_hash "
+        "FROM docs "
+        "WHERE source_path IS NOT NULL;";
+    Stmt stmt;
+    if (sqlite3_prepare_v2(db_, sql, -1, &stmt.stmt, nullptr) != SQLITE_OK) {
+        return out;
+    }
+    while (sqlite3_step(stmt.stmt) == SQLITE_ROW) {
+        const unsigned char* path = sqlite3_column_text(stmt.stmt, 1);
+        const unsigned char* hash = sqlite3_column_text(stmt.stmt, 4);
+
+        RagDocSource src;
+        src.doc_id = static_cast<size_t>(sqlite3_column_int64(stmt.stmt, 0));
+        src.path = path ? reinterpret_cast<const char*>(path) : "";
+        src.size = static_cast<int64_t>(sqlite3_column_int64(stmt.stmt, 2));
+        src.mtime = static_cast<int64_t>(sqlite3_column_int64(stmt.stmt, 3));
+        src.content_hash = hash ? reinterpret_cast<const char*>(hash) : "";
+        out.push_back(std::move(src));
+    }
+    return out;
+}
+
+size_t RagVectorDb::legacy_doc_max_id() const {
+    // Shard and pack stores are always written with the manifest.
+    if (!db_ || !shards_.empty() || pack_) return 0;
+    const char* sql = "SELECT value FROM meta WHERE key='legacy_doc_max_id';";
+    Stmt stmt;
+    if (sqlite3_prepare_v2(db_, sql, -1, &stmt.stmt, nullptr) != SQLITE_OK) return 0;
+    if (sqlite3_step(stmt.stmt) != SQLITE_ROW) return 0;
+    return static_cast<size_t>(std::max<sqlite3_int64>(0, sqlite3_column_int64(stmt.stmt, 0)));
+}
+
+bool RagVectorDb::clear_legacy_docs(std::string* err) {
+    if (!db_ || !shards_.empty() || pack_) return true;
+    return exec("DELETE FROM meta WHERE key='legacy_doc_max_id';", err);
+}
+
+bool RagVectorDb::set_doc_source(const RagDocSource& src, std::string* err) {
+    if (!shards_.empty()) {
+        RagShard& shard = shard_for(src.doc_id);
+        std::lock_guard<std::mutex> lock(shard.mu);
+        return shard.db.set_doc_source(src, err);
+    }
+    if (pack_) {
+        if (err) *err = kReadOnlyPackErr;
+        return false;
+    }
+    if (!db_) {
+        if (err) *err = "database not initialized";
+        return false;
+    }
+
+    const char* sql =
+        "UPDATE docs SET source_path = ?, source_size = ?, source_mtime = ?, content_hash = ? "
+        "WHERE id = ?;";
+    Stmt stmt;
+    if (sqlite3_prepare_v2(db_, sql, -1, &stmt.stmt, nullptr) != SQLITE_OK) {
+        if (err) *err = sqlite3_errmsg(db_);
+        return false;
+    }
+    sqlite3_bind_text(stmt.stmt, 1, src.path.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int64(stmt.stmt, 2, static_cast<sqlite3_int64>(src.size));
+    sqlite3_bind_int64(stmt.stmt, 3, static_cast<sqlite3_int64>(src.mtime));
+    sqlite3_bind_text(stmt.stmt, 4, src.content_hash.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int64(stmt.stmt, 5, static_cast<sqlite3_int64>(src.doc_id));
+    if (sqlite3_step(stmt.stmt) != SQLITE_DONE) {
+        if (err) *err = sqlite3_errmsg(db_);
+        return false;
+    }
+    if (sqlite3_changes(db_) == 0) {
+        if (err) *err = "document not found";
+        return false;
+    }
+    return true;
+}
+
+bool RagVectorDb::open_pack(const std::string& path, bool verify, std::string* err) {
+    auto pack = std::make_unique<RagPack>();
+    if (!pack->open(path, verify, err)) return false;
+    if (bulk_) end_bulk(nullptr);
+    close_shards();
+    if (db_) {
+        sqlite3_close(db_);
+        db_ = nullptr;
+    }
+    near_dup_entries_.clear();
+    near_dup_bands_.clear();
+    const RagPackHeader& h = pack->header();
+    embed_dim_ = static_cast<int>(h.embed_dim);
+    doc_count_ = static_cast<size_t>(h.doc_count);
+    chunk_count_ = static_cast<size_t>(h.chunk_count);
+    vector_count_ = static_cast<size_t>(h.vector_count);
+    near_dup_count_ = static_cast<size_t>(h.near_dup_count);
+    pack_ = std::move(pack);
+    return true;
+}
+
+bool RagVectorDb::export_pack(const std::string& path, std::string* err) const {
+    if (!shards_.empty()) {
+        // Chunk ids and dedup groups are per shard; the pack format has one id space.
+        if (err) *err = "index pack export from a sharded store is not supported";
+        return false;
+    }
+    if (!db_) {
+        if (err) *err = "database not initialized";
+        return false;
+    }
+    const uint64_t dim = static_cast<uint64_t>(embed_dim_);
+    const uint64_t vec_bytes = dim * sizeof(float);
+
+    // Only rows that belong to an existing document (and vectors of the right size) are exported;
+    // the counts use the same filters as the passes below so the section offsets line up.
+    const char* doc_where = "";
+    const char* chunk_where = " WHERE doc_id IN (SELECT id FROM docs)";
+    std::string vec_where =
+        std::string(" FROM vectors JOIN chunks ON ") + vector_join() +
+        " WHERE chunks.doc_id IN (SELECT id FROM docs) AND vectors.dim = " + std::to_string(embed_dim_) +
+        " AND length(vectors.vec) = " + std::to_string(vec_bytes);
+    auto count = [&](const std::string& sql, uint64_t* out) {
+        Stmt stmt;
+        if (sqlite3_prepare_v2(db_, sql.c_str(), -1, &stmt.stmt, nullptr) != SQLITE_OK ||
+            sqlite3_step(stmt.stmt) != SQLITE_ROW) {
+            if (err) *err = sqlite3_errmsg(db_);
+            return false;
+        }
+        *out = static_cast<uint64_t>(sqlite3_column_int64(stmt.stmt, 0));
+        return true;
+    };
+
+    RagPackHeader h;
+    std::memset(&h, 0, sizeof(h));
+    std::memcpy(h.magic, kRagPackMagic, sizeof(h.magic));
+    h.version = kRagPackVersion;
+    h.embed_dim = static_cast<uint32_t>(dim);
+    if (!count(std::string("SELECT COUNT(*) FROM docs") + doc_where + ";", &h.doc_count)) return false;
+    if (!count(std::string("SELECT COUNT(*) FROM chunks") + chunk_where + ";", &h.chunk_count)) return false;
+    if (!count("SELECT COUNT(*)" + vec_where + ";", &h.vector_count)) return false;
+    if (!count("SELECT COUNT(*)" + vec_where + " AND chunks.dup_group IS NOT NULL;", &h.near_dup_count)) return false;
+
+    auto align = [](uint64_t v, uint64_t a) { return (v + a - 1) / a * a; };
+    h.docs_offset = sizeof(RagPackHeader);
+    h.chunks_offset = h.docs_offset + h.doc_count * sizeof(RagPackDoc);
+    h.vector_map_offset = h.chunks_offset + h.chunk_count * sizeof(RagPackChunk);
+    h.vectors_offset = align(h.vector_map_offset + h.vector_count * sizeof(RagPackVector), 64);
+    h.strings_offset = align(h.vectors_offset + h.vector_count * vec_bytes, 8);
+
+    // Written to a temp file and renamed, so an interrupted export never leaves a half pack behind.
+    const std::string tmp_path = path + ".tmp";
+    std::fstream out(tmp_path, std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!out) {
+        if (err) *err = "failed to create pack file";
+        return false;
+    }
+    auto fail = [&](const std::string& msg) {
+        out.close();
+        std::remove(tmp_path.c_str());
+        if (err) *err = msg;
+        return false;
+    };
+
+    out.seekp(static_cast<std::streamoff>(h.strings_offset));
+    uint64_t strings_size = 0;
+    auto put_string = [&](const unsigned char* text, int bytes) {
+        RagPackString ref{strings_size, 0};
+        if (text && bytes > 0) {
+            out.write(reinterpret_cast<const char*>(text), bytes);
+            ref.size = static_cast<uint64_t>(bytes);
+            strings_size += ref.size;
+        }
+        return ref;
+    };
+
+    std::vector<RagPackDoc> docs;
+    docs.reserve(static_cast<size_t>(h.doc_count));
+    {
+        const char* sql = "SELECT id, added_at, chunk_count, filename, mime, source_path FROM docs ORDER BY id;";
+        Stmt stmt;
+        if (sqlite3_prepare_v2(db_, sql, -1, &stmt.stmt, nullptr) != SQLITE_OK) return fail(sqlite3_errmsg(db_));
+        while (sqlite3_step(stmt.stmt) == SQLITE_ROW && docs.size() < h.doc_count) {
+            RagPackDoc d;
+            std::memset(&d, 0, sizeof(d));
+            d.id = static_cast<uint64_t>(sqlite3_column_int64(stmt.stmt, 0));
+            d.added_at = sqlite3_column_int64(stmt.stmt, 1);
+            d.stored_chunk_count = static_cast<uint64_t>(std::max<sqlite3_int64>(0, sqlite3_column_int64(stmt.stmt, 2)));
+            d.filename = put_string(sqlite3_column_text(stmt.stmt, 3), sqlite3_column_bytes(stmt.stmt, 3));
+            d.mime = put_string(sqlite3_column_text(stmt.stmt, 4), sqlite3_column_bytes(stmt.stmt, 4));
+            d.source_path = put_string(sqlite3_column_text(stmt.stmt, 5), sqlite3_column_bytes(stmt.stmt, 5));
+            docs.push_back(d);
+        }
+    }
+    if (docs.size() != h.doc_count) return fail("docs changed during export");
+
+    std::vector<RagPackChunk> chunks;
+    chunks.reserve(static_cast<size_t>(h.chunk_count));
+    std::unordered_map<int64_t, uint64_t> chunk_rows;
+    chunk_rows.reserve(static_cast<size_t>(h.chunk_count));
+    {
+        std::string sql = std::string("SELECT id, doc_id, chunk_index, source, text FROM chunks") + chunk_where +
+                          " ORDER BY doc_id, chunk_index;";
+        Stmt stmt;
+        if (sqlite3_prepare_v2(db_, sql.c_str(), -1, &stmt.stmt, nullptr) != SQLITE_OK) return fail(sqlite3_errmsg(db_));
+        size_t doc_pos = 0;
+        while (sqlite3_step(stmt.stmt) == SQLITE_ROW && chunks.size() < h.chunk_count) {
+            RagPackChunk c;
+            std::memset(&c, 0, sizeof(c));
+            c.doc_id = static_cast<uint64_t>(sqlite3_column_int64(stmt.stmt, 1));
+            c.chunk_index = sqlite3_column_int64(stmt.stmt, 2);
+            c.source = put_string(sqlite3_column_text(stmt.stmt, 3), sqlite3_column_bytes(stmt.stmt, 3));
+            c.text = put_string(sqlite3_column_text(stmt.stmt, 4), sqlite3_column_bytes(stmt.stmt, 4));
+
+            // Both tables are ordered by doc id, so the owning doc is found by walking forward.
+            while (doc_pos < docs.size() && docs[doc_pos].id < c.doc_id) ++doc_pos;
+            if (doc_pos < docs.size() && docs[doc_pos].id == c.doc_id) {
+                if (docs[doc_pos].chunk_count == 0) docs[doc_pos].first_chunk = chunks.size();
+                ++docs[doc_pos].chunk_count;
+            }
+            chunk_rows.emplace(sqlite3_column_int64(stmt.stmt, 0), chunks.size());
+            chunks.push_back(c);
+        }
+    }
+    if (chunks.size() != h.chunk_count) return fail("chunks changed during export");
+    h.strings_size = strings_size;
+    h.file_size = h.strings_offset + strings_size;
+
+    std::vector<RagPackVector> vector_map;
+    vector_map.reserve(static_cast<size_t>(h.vector_count));
+    {
+        std::string sql = "SELECT vectors.chunk_id, COALESCE(chunks.dup_group, chunks.id), vectors.vec" + vec_where +
+                          " ORDER BY vectors.chunk_id;";
+        Stmt stmt;
+        if (sqlite3_prepare_v2(db_, sql.c_str(), -1, &stmt.stmt, nullptr) != SQLITE_OK) return fail(sqlite3_errmsg(db_));
+        out.seekp(static_cast<std::streamoff>(h.vectors_offset));
+        while (sqlite3_step(stmt.stmt) == SQLITE_ROW && vector_map.size() < h.vector_count) {
+            auto row = chunk_rows.find(sqlite3_column_int64(stmt.stmt, 0));
+            if (row == chunk_rows.end()) return fail("vector without chunk during export");
+            vector_map.push_back({row->second, sqlite3_column_int64(stmt.stmt, 1)});
+            out.write(static_cast<const char*>(sqlite3_column_blob(stmt.stmt, 2)), static_cast<std::streamsize>(vec_bytes));
+        }
+    }
+    if (vector_map.size() != h.vector_count) return fail("vectors changed during export");
+
+    out.seekp(static_cast<std::streamoff>(h.docs_offset));
+    out.write(reinterpret_cast<const char*>(docs.data()), static_cast<std::streamsize>(docs.size() * sizeof(RagPackDoc)));
+    out.write(reinterpret_cast<const char*>(chunks.data()), static_cast<std::streamsize>(chunks.size() * sizeof(RagPackChunk)));
+    out.write(reinterpret_cast<const char*>(vector_map.data()),
+              static_cast<std::streamsize>(vector_map.size() * sizeof(RagPackVector)));
+    // Zero padding up to the aligned vector matrix (and a possibly empty string blob at EOF).
+    uint64_t pos = h.vector_map_offset + vector_map.size() * sizeof(RagPackVector);
+    std::string zeros(static_cast<size_t>(h.vectors_offset - pos), '\0');
+    out.write(zeros.data(), static_cast<std::streamsize>(zeros.size()));
+    if (h.vector_count == 0 && h.strings_offset > h.vectors_offset) {
+        zeros.assign(static_cast<size_t>(h.strings_offset - h.vectors_offset), '\0');
+        out.write(zeros.data(), static_cast<std::streamsize>(zeros.size()));
+    }
+    out.seekp(0);
+    out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+    out.flush();
+    if (!out) return fail("failed to write pack file");
+
+    // Checksum pass over what actually landed on disk.
+    uint64_t sum = kRagPackChecksumSeed;
+    {
+        out.seekg(static_cast<std::streamoff>(sizeof(RagPackHeader)));
+        std::vector<char> buf(1 << 20);
+        uint64_t left = h.file_size - sizeof(RagPackHeader);
+        while (left > 0) {
+            size_t n = static_cast<size_t>(std::min<uint64_t>(left, buf.size()));
+            out.read(buf.data(), static_cast<std::streamsize>(n));
+            if (!out) return fail("failed to read back pack file");
+            sum = rag_pack_checksum_update(sum, buf.data(), n);
+            left -= n;
+        }
+    }
+    h.payload_checksum = sum;
+    out.seekp(0);
+    out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+    out.close();
+    if (out.fail()) return fail("failed to write pack file");
+
+    std::remove(path.c_str());
+    if (std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+        std::remove(tmp_path.c_str());
+        if (err) *err = "failed to move pack file into place";
+        return false;
+    }
+    return true;
+}
+
+std::vector<RagSearchHit> RagVectorDb::search_pack(const std::vector<float>& query_vec, size_t top_k) const {
+    std::vector<RagSearchHit> out;
+    const RagPackHeader& h = pack_->header();
+    if (query_vec.size() != h.embed_dim || top_k == 0) return out;
+
+    const size_t dim = h.embed_dim;
+    const float* mat = pack_->vectors();
+    std::vector<std::pair<double, size_t>> scored;
+    for (size_t i = 0; i < h.vector_count; ++i) {
+        const float* vec = mat + i * dim;
+        double score = 0.0;
+        for (size_t j = 0; j < dim; ++j) {
+            score += static_cast<double>(query_vec[j]) * static_cast<double>(vec[j]);
+        }
+        if (score > 0.0) scored.emplace_back(score, i);
+    }
+    std::sort(scored.begin(), scored.end(), [](const std::pair<double, size_t>& a, const std::pair<double, size_t>& b) {
+        return a.first > b.first;
+    });
+
+    const RagPackVector* vmap = pack_->vector_map();
+    const RagPackChunk* chunks = pack_->chunks();
+    std::unordered_set<int64_t> seen_groups;
+    for (size_t i = 0; i < scored.size() && out.size() < top_k; ++i) {
+        const RagPackVector& v = vmap[scored[i].second];
+        if (!seen_groups.insert(v.group).second) continue;
+        const RagPackChunk& c = chunks[v.chunk_row];
+        RagSearchHit hit;
+        hit.source = pack_->str(c.source);
+        hit.text = shorten_text(pack_->str(c.text), 520);
+        hit.score = scored[i].first;
+        hit.doc_id = static_cast<size_t>(c.doc_id);
+        hit.chunk_index = static_cast<int>(c.chunk_index);
+        out.push_back(std::move(hit));
+    }
+    return out;
+}
+
+std::string RagVectorDb::expand_range_pack(size_t doc_id,
+                                          int start_chunk_index,
+                                          int end_chunk_index,
+                                          int center_chunk_index) const {
+    if (center_chunk_index < 0) return {};
+    if (start_chunk_index < 0) start_chunk_index = 0;
+    if (end_chunk_index < start_chunk_index) return {};
+    const RagPackDoc* d = pack_->find_doc(doc_id);
+    if (!d) return {};
+
+    const RagPackChunk* begin = pack_->chunks() + d->first_chunk;
+    const RagPackChunk* end = begin + d->chunk_count;
+    const RagPackChunk* it = std::lower_bound(begin, end, static_cast<int64_t>(start_chunk_index),
+                                              [](const RagPackChunk& c, int64_t idx) { return c.chunk_index < idx; });
+    std::vector<std::pair<int, std::string>> rows;
+    for (; it != end && it->chunk_index <= end_chunk_index; ++it) {
+        rows.emplace_back(static_cast<int>(it->chunk_index), pack_->str(it->text));
+    }
+    return format_expanded_rows(rows, center_chunk_index);
+}
+
+bool RagVectorDb::get_document_chunks_pack(size_t doc_id,
+                                           std::string* out_filename,
+                                           std::vector<RagSearchHit>* out_chunks,
+                                           std::string* err) const {
+    if (!out_filename || !out_chunks) {
+        if (err) *err = "invalid output pointers";
+        return false;
+    }
+    out_filename->clear();
+    out_chunks->clear();
+    const RagPackDoc* d = pack_->find_doc(doc_id);
+    if (!d) {
+        if (err) *err = "document not found";
+        return false;
+    }
+    *out_filename = pack_->str(d->filename);
+    const RagPackChunk* chunks = pack_->chunks() + d->first_chunk;
+    out_chunks->reserve(static_cast<size_t>(d->chunk_count));
+    for (uint64_t i = 0; i < d->chunk_count; ++i) {
+        RagSearchHit hit;
+        hit.doc_id = doc_id;
+        hit.chunk_index = static_cast<int>(chunks[i].chunk_index);
+        hit.source = pack_->str(chunks[i].source);
+        hit.text = pack_->str(chunks[i].text);
+        out_chunks->push_back(std::move(hit));
+    }
+    return true;
+}
+
+std::vector<RagDocInfo> RagVectorDb::list_docs_pack(size_t limit, size_t offset) const {
+    std::vector<RagDocInfo> out;
+    const uint64_t count = pack_->header().doc_count;
+    const RagPackDoc* docs = pack_->docs();
+    // Newest first, like the SQLite listing.
+    for (uint64_t i = offset; i < count && out.size() < limit; ++i) {
+        const RagPackDoc& d = docs[count - 1 - i];
+        RagDocInfo info;
+        info.id = static_cast<size_t>(d.id);
+        info.filename = pack_->str(d.filename);
+        info.mime = pack_->str(d.mime);
+        info.added_at = d.added_at;
+        info.chunk_count = static_cast<size_t>(d.stored_chunk_count);
+        info.source_path = pack_->str(d.source_path);
         out.push_back(std::move(info));
     }
     return out;
 }
+
+bool RagVectorDb::incremental_vacuum_enabled() const {
+    if (!shards_.empty()) {
+        for (const auto& shard : shards_) {
+            std::lock_guard<std::mutex> lock(shard->mu);
+            if (!shard->db.incremental_vacuum_enabled()) return false;
+        }
+        return true;
+    }
+    if (!db_) return false;
+    Stmt stmt;
+    if (sqlite3_prepare_v2(db_, "PRAGMA auto_vacuum;", -1, &stmt.stmt, nullptr) != SQLITE_OK) return false;
+    return sqlite3_step(stmt.stmt) == SQLITE_ROW && sqlite3_column_int(stmt.stmt, 0) == 2;
+}
+
+int64_t RagVectorDb::free_pages() const {
+    if (!shards_.empty()) {
+        int64_t total = 0;
+        for (const auto& shard : shards_) {
+            std::lock_guard<std::mutex> lock(shard->mu);
+            total += shard->db.free_pages();
+        }
+        return total;
+    }
+    if (!db_) return 0;
+    Stmt stmt;
+    if (sqlite3_prepare_v2(db_, "PRAGMA freelist_count;", -1, &stmt.stmt, nullptr) != SQLITE_OK) return 0;
+    if (sqlite3_step(stmt.stmt) != SQLITE_ROW) return 0;
+    return sqlite3_column_int64(stmt.stmt, 0);
+}
+
+bool RagVectorDb::incremental_vacuum(int max_pages, std::string* err) {
+    if (!shards_.empty()) {
+        for (const auto& shard : shards_) {
+            std::lock_guard<std::mutex> lock(shard->mu);
+            if (!shard->db.incremental_vacuum(max_pages, err)) return false;
+        }
+        return true;
+    }
+    if (pack_ || !db_ || bulk_) return true;
+    // The pragma returns one row per freed page; step it to completion.
+    std::string sql = "PRAGMA incremental_vacuum(" + std::to_string(std::max(1, max_pages)) + ");";
+    Stmt stmt;
+    if (sqlite3_prepare_v2(db_, sql.c_str(), -1, &stmt.stmt, nullptr) != SQLITE_OK) {
+        if (err) *err = sqlite3_errmsg(db_);
+        return false;
+    }
+    int rc;
+    while ((rc = sqlite3_step(stmt.stmt)) == SQLITE_ROW) {
+    }
+    if (rc != SQLITE_DONE) {
+        if (err) *err = sqlite3_errmsg(db_);
+        return false;
+    }
+    return true;
+}
+
+bool RagVectorDb::vacuum_full(std::string* err) {
+    if (pack_) {
+        if (err) *err = kReadOnlyPackErr;
+        return false;
+    }
+    if (!shards_.empty()) {
+        for (const auto& shard : shards_) {
+            std::lock_guard<std::mutex> lock(shard->mu);
+            if (!shard->db.vacuum_full(err)) return false;
+        }
+        return true;
+    }
+    if (!db_) {
+        if (err) *err = "database not initialized";
+        return false;
+    }
+    if (bulk_ || compacting_ || migrating_) {
+        if (err) *err = "database busy (bulk load, migration or compaction in progress)";
+        return false;
+    }
+    if (!exec("PRAGMA auto_vacuum=INCREMENTAL;", err)) return false;
+    return exec("VACUUM;", err);
+}
+
+bool RagVectorDb::begin_compact(std::string* err) {
+    if (pack_) {
+        if (err) *err = kReadOnlyPackErr;
+        return false;
+    }
+    if (!shards_.empty()) {
+        // Shards are compacted one after another; compact_step() walks them in order.
+        if (compacting_) {
+            if (err) *err = "database busy (bulk load, migration or compaction in progress)";
+            return false;
+        }
+        for (size_t i = 0; i < shards_.size(); ++i) {
+            std::lock_guard<std::mutex> lock(shards_[i]->mu);
+            if (!shards_[i]->db.begin_compact(err)) {
+                for (size_t j = 0; j < i; ++j) {
+                    std::lock_guard<std::mutex> undo(shards_[j]->mu);
+                    shards_[j]->db.abort_compact();
+                }
+                return false;
+            }
+        }
+        compacting_ = true;
+        compact_shard_ = 0;
+        return true;
+    }
+    if (!db_) {
+        if (err) *err = "database not initialized";
+        return false;
+    }
+    if (bulk_ || compacting_ || migrating_) {
+        if (err) *err = "database busy (bulk load, migration or compaction in progress)";
+        return false;
+    }
+    if (schema_version_ < kSchemaVersion) {
+        // The migration rewrites everything in clustered order anyway.
+        if (err) *err = "schema migration pending";
+        return false;
+    }
+    if (!exec("DROP TABLE IF EXISTS vectors_compact;", err)) return false;
+    if (!exec("CREATE TABLE vectors_compact("
+              "doc_id INTEGER NOT NULL,"
+              "chunk_index INTEGER NOT NULL,"
+              "chunk_id INTEGER NOT NULL,"
+              "dim INTEGER,"
+              "vec BLOB,"
+              "PRIMARY KEY(doc_id, chunk_index)) WITHOUT ROWID;", err)) return false;
+    compacting_ = true;
+    compact_cursor_doc_ = 0;
+    compact_cursor_index_ = -1;
+    return true;
+}
+
+bool RagVectorDb::compact_step(size_t max_rows, bool* done, std::string* err) {
+    *done = false;
+    if (!compacting_) {
+        if (err) *err = "no compaction in progress";
+        return false;
+    }
+    if (!shards_.empty()) {
+        if (compact_shard_ < shards_.size()) {
+            RagShard& shard = *shards_[compact_shard_];
+            std::lock_guard<std::mutex> lock(shard.mu);
+            bool shard_done = false;
+            if (!shard.db.compact_step(max_rows, &shard_done, err)) return false;
+            if (shard_done) ++compact_shard_;
+        }
+        *done = compact_shard_ >= shards_.size();
+        return true;
+    }
+    // Appending in key order lays the new table's pages out contiguously.
+    const char* sql =
+        "INSERT INTO vectors_compact(doc_id, chunk_index, chunk_id, dim, vec) "
+        "SELECT doc_id, chunk_index, chunk_id, dim, vec FROM vectors WHERE (doc_id, chunk_index) > (?, ?) "
+        "ORDER BY doc_id, chunk_index LIMIT ?;";
+    Stmt stmt;
+    if (sqlite3_prepare_v2(db_, sql, -1, &stmt.stmt, nullptr) != SQLITE_OK) {
+        if (err) *err = sqlite3_errmsg(db_);
+        return false;
+    }
+    sqlite3_bind_int64(stmt.stmt, 1, compact_cursor_doc_);
+    sqlite3_bind_int64(stmt.stmt, 2, compact_cursor_index_);
+    sqlite3_bind_int64(stmt.stmt, 3, static_cast<sqlite3_int64>(std::max<size_t>(1, max_rows)));
+    if (sqlite3_step(stmt.stmt) != SQLITE_DONE) {
+        if (err) *err = sqlite3_errmsg(db_);
+        return false;
+    }
+    size_t copied = static_cast<size_t>(sqlite3_changes(db_));
+    if (copied < max_rows) {
+        *done = true;
+        return true;
+    }
+
+    Stmt cur;
+    if (sqlite3_prepare_v2(db_, "SELECT doc_id, chunk_index FROM vectors_compact ORDER BY doc_id DESC, chunk_index DESC LIMIT 1;",
+                           -1, &cur.stmt, nullptr) != SQLITE_OK ||
+        sqlite3_step(cur.stmt) != SQLITE_ROW) {
+        if (err) *err = sqlite3_errmsg(db_);
+        return false;
+    }
+    compact_cursor_doc_ = sqlite3_column_int64(cur.stmt, 0);
+    compact_cursor_index_ = sqlite3_column_int64(cur.stmt, 1);
+    return true;
+}
+
+bool RagVectorDb::finish_compact(size_t* out_rows, std::string* err) {
+    if (!compacting_) {
+        if (err) *err = "no compaction in progress";
+        return false;
+    }
+    if (!shards_.empty()) {
+        bool ok = true;
+        size_t rows = 0;
+        for (const auto& shard : shards_) {
+            std::lock_guard<std::mutex> lock(shard->mu);
+            size_t shard_rows = 0;
+            if (ok) {
+                ok = shard->db.finish_compact(&shard_rows, err);
+                rows += shard_rows;
+            } else {
+                shard->db.abort_compact();
+            }
+        }
+        compacting_ = false;
+        if (out_rows) *out_rows = rows;
+        return ok;
+    }
+    // Catch up with writes made between steps: rows deleted (or moved to another owner) since
+    // they were copied, and rows added after the cursor passed them. A row's contents never
+    // change under the same key and chunk id, so that is all that can differ.
+    if (!exec("BEGIN TRANSACTION;", err)) return false;
+    if (!exec("DELETE FROM vectors_compact WHERE NOT EXISTS (SELECT 1 FROM vectors v "
+              "WHERE v.doc_id = vectors_compact.doc_id AND v.chunk_index = vectors_compact.chunk_index "
+              "AND v.chunk_id = vectors_compact.chunk_id);", err) ||
+        !exec("INSERT INTO vectors_compact(doc_id, chunk_index, chunk_id, dim, vec) "
+              "SELECT doc_id, chunk_index, chunk_id, dim, vec FROM vectors v WHERE NOT EXISTS (SELECT 1 FROM vectors_compact c "
+              "WHERE c.doc_id = v.doc_id AND c.chunk_index = v.chunk_index) ORDER BY doc_id, chunk_index;", err) ||
+        !exec("DROP TABLE vectors;", err) ||
+        !exec("ALTER TABLE vectors_compact RENAME TO vectors;", err)) {
+        exec("ROLLBACK;", nullptr);
+        abort_compact();
+        return false;
+    }
+    if (!exec("COMMIT;", err)) {
+        exec("ROLLBACK;", nullptr);
+        abort_compact();
+        return false;
+    }
+    compacting_ = false;
+    if (out_rows) *out_rows = vector_count_;
+    return true;
+}
+
+bool RagVectorDb::copy_docs_v2(int64_t after_doc, int64_t last_doc, std::string* err) {
+    // Rows of documents in (after_doc, last_doc], appended in clustered order. OR IGNORE skips
+    // legacy rows the v2 keys cannot hold (NULL or repeated positions); migrate_step() counts
+    // them when it swaps the tables in.
+    const char* chunk_sql =
+        "INSERT OR IGNORE INTO chunks_v2(doc_id, chunk_index, id, source, text, text_hash, simhash, vector_id, dup_group) "
+        "SELECT doc_id, chunk_index, id, source, text, text_hash, simhash, vector_id, dup_group FROM chunks "
+        "WHERE doc_id > ?1 AND doc_id <= ?2 ORDER BY doc_id, chunk_index;";
+    const char* vec_sql =
+        "INSERT OR IGNORE INTO vectors_v2(doc_id, chunk_index, chunk_id, dim, vec) "
+        "SELECT chunks.doc_id, chunks.chunk_index, vectors.chunk_id, vectors.dim, vectors.vec "
+        "FROM chunks JOIN vectors ON vectors.chunk_id = chunks.id "
+        "WHERE chunks.doc_id > ?1 AND chunks.doc_id <= ?2 ORDER BY chunks.doc_id, chunks.chunk_index;";
+    for (const char* sql : {chunk_sql, vec_sql}) {
+        Stmt stmt;
+        if (sqlite3_prepare_v2(db_, sql, -1, &stmt.stmt, nullptr) != SQLITE_OK) {
+            if (err) *err = sqlite3_errmsg(db_);
+            return false;
+        }
+        sqlite3_bind_int64(stmt.stmt, 1, after_doc);
+        sqlite3_bind_int64(stmt.stmt, 2, last_doc);
+        if (sqlite3_step(stmt.stmt) != SQLITE_DONE) {
+            if (err) *err = sqlite3_errmsg(db_);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool RagVectorDb::migrate_step(size_t max_docs, bool* done, std::string* err) {
+    *done = false;
+    if (!shards_.empty()) {
+        int version = kSchemaVersion;
+        bool stepped = false;
+        for (const auto& shard : shards_) {
+            std::lock_guard<std::mutex> lock(shard->mu);
+            if (!stepped && shard->db.migration_pending()) {
+                bool shard_done = false;
+                if (!shard->db.migrate_step(max_docs, &shard_done, err)) return false;
+                stepped = true;
+            }
+            version = std::min(version, shard->db.schema_version());
+        }
+        schema_version_ = version;
+        *done = version >= kSchemaVersion;
+        return true;
+    }
+    if (schema_version_ >= kSchemaVersion) {
+        *done = true;
+        return true;
+    }
+    if (pack_ || !db_) {
+        if (err) *err = "database not initialized";
+        return false;
+    }
+    if (bulk_ || compacting_) {
+        if (err) *err = "database busy (bulk load or compaction in progress)";
+        return false;
+    }
+    if (!migrating_) {
+        if (!exec("DROP TABLE IF EXISTS chunks_v2;", err) || !exec("DROP TABLE IF EXISTS vectors_v2;", err) ||
+            !create_chunk_tables_v2("_v2", err)) {
+            return false;
+        }
+        migrating_ = true;
+        migrate_cursor_ = 0;
+        migrate_touched_docs_.clear();
+    }
+
+    if (!exec("BEGIN TRANSACTION;", err)) return false;
+    auto fail = [&]() {
+        exec("ROLLBACK;", nullptr);
+        return false;
+    };
+
+    // Documents are copied in id order; ids only grow (AUTOINCREMENT), so documents added during
+    // the migration land ahead of the cursor and are picked up by a later step.
+    int64_t last_doc = 0;
+    {
+        const char* sql = "SELECT MAX(id) FROM (SELECT id FROM docs WHERE id > ? ORDER BY id LIMIT ?);";
+        Stmt stmt;
+        if (sqlite3_prepare_v2(db_, sql, -1, &stmt.stmt, nullptr) != SQLITE_OK) {
+            if (err) *err = sqlite3_errmsg(db_);
+            return fail();
+        }
+        sqlite3_bind_int64(stmt.stmt, 1, migrate_cursor_);
+        sqlite3_bind_int64(stmt.stmt, 2, static_cast<sqlite3_int64>(std::max<size_t>(1, max_docs)));
+        if (sqlite3_step(stmt.stmt) == SQLITE_ROW && sqlite3_column_type(stmt.stmt, 0) != SQLITE_NULL) {
+            last_doc = sqlite3_column_int64(stmt.stmt, 0);
+        }
+    }
+    if (last_doc > migrate_cursor_) {
+        if (!copy_docs_v2(migrate_cursor_, last_doc, err)) return fail();
+        if (!exec("COMMIT;", err)) return fail();
+        migrate_cursor_ = last_doc;
+        return true;
+    }
+
+    // Everything is copied: redo the documents that changed behind the cursor, then swap.
+    for (int64_t doc : migrate_touched_docs_) {
+        if (doc > migrate_cursor_) continue;
+        std::string id = std::to_string(doc);
+        if (!exec("DELETE FROM chunks_v2 WHERE doc_id = " + id + ";", err) ||
+            !exec("DELETE FROM vectors_v2 WHERE doc_id = " + id + ";", err) || !copy_docs_v2(doc - 1, doc, err)) {
+            return fail();
+        }
+    }
+    // copy_docs_v2() skips what the v2 keys cannot hold; count it before the old tables go.
+    size_t dropped_chunks = 0;
+    size_t dropped_vectors = 0;
+    {
+        const char* sql =
+            "SELECT (SELECT COUNT(*) FROM chunks) - (SELECT COUNT(*) FROM chunks_v2), "
+            "(SELECT COUNT(*) FROM vectors) - (SELECT COUNT(*) FROM vectors_v2);";
+        Stmt stmt;
+        if (sqlite3_prepare_v2(db_, sql, -1, &stmt.stmt, nullptr) != SQLITE_OK) {
+            if (err) *err = sqlite3_errmsg(db_);
+            return fail();
+        }
+        if (sqlite3_step(stmt.stmt) == SQLITE_ROW) {
+            dropped_chunks = static_cast<size_t>(std::max<sqlite3_int64>(0, sqlite3_column_int64(stmt.stmt, 0)));
+            dropped_vectors = static_cast<size_t>(std::max<sqlite3_int64>(0, sqlite3_column_int64(stmt.stmt, 1)));
+        }
+    }
+    schema_version_ = kSchemaVersion;
+    if (!exec("DROP TABLE vectors;", err) || !exec("DROP TABLE chunks;", err) ||
+        !exec("ALTER TABLE chunks_v2 RENAME TO chunks;", err) || !exec("ALTER TABLE vectors_v2 RENAME TO vectors;", err) ||
+        !create_chunk_indexes(err) || !exec("PRAGMA user_version=" + std::to_string(kSchemaVersion) + ";", err)) {
+        schema_version_ = 1;
+        return fail();
+    }
+    // The stored counters (and the near-dup index) still include the rows that were dropped.
+    RagCounts counts;
+    if ((dropped_chunks || dropped_vectors) && (!recount(&counts, err) || !write_counts(counts, err))) {
+        schema_version_ = 1;
+        return fail();
+    }
+    if (!exec("COMMIT;", err)) {
+        schema_version_ = 1;
+        return fail();
+    }
+    if (dropped_chunks || dropped_vectors) {
+        apply_counts(counts);
+        load_near_dup_index(nullptr);
+    }
+    migrate_dropped_chunks_ = dropped_chunks;
+    migrate_dropped_vectors_ = dropped_vectors;
+    migrating_ = false;
+    migrate_touched_docs_.clear();
+    *done = true;
+    return true;
+}
+
+size_t RagVectorDb::migrate_dropped_chunks() const {
+    size_t n = migrate_dropped_chunks_;
+    for (const auto& shard : shards_) {
+        std::lock_guard<std::mutex> lock(shard->mu);
+        n += shard->db.migrate_dropped_chunks();
+    }
+    return n;
+}
+
+size_t RagVectorDb::migrate_dropped_vectors() const {
+    size_t n = migrate_dropped_vectors_;
+    for (const auto& shard : shards_) {
+        std::lock_guard<std::mutex> lock(shard->mu);
+        n += shard->db.migrate_dropped_vectors();
+    }
+    return n;
+}
+
+void RagVectorDb::abort_compact() {
+    if (!compacting_) return;
+    compacting_ = false;
+    if (!shards_.empty()) {
+        for (const auto& shard : shards_) {
+            std::lock_guard<std::mutex> lock(shard->mu);
+            shard->db.abort_compact();
+        }
+        return;
+    }
+    exec("DROP TABLE IF EXISTS vectors_compact;", nullptr);
+}
+
+int64_t RagVectorDb::max_doc_id() const {
+    if (!db_) return 0;
+    // sqlite_sequence remembers ids of deleted rows too; it only exists once a row was inserted.
+    int64_t max_id = 0;
+    for (const char* sql : {"SELECT MAX(id) FROM docs;", "SELECT MAX(seq) FROM sqlite_sequence WHERE name = 'docs';"}) {
+        Stmt stmt;
+        if (sqlite3_prepare_v2(db_, sql, -1, &stmt.stmt, nullptr) != SQLITE_OK) continue;
+        if (sqlite3_step(stmt.stmt) == SQLITE_ROW) max_id = std::max<int64_t>(max_id, sqlite3_column_int64(stmt.stmt, 0));
+    }
+    return max_id;
+}
+
+void RagVectorDb::close_shards() {
+    shard_pool_.reset();
+    shards_.clear();
+    compact_shard_ = 0;
+}
+
+bool RagVectorDb::open_shards(const std::vector<std::string>& files, std::string* err) {
+    std::vector<std::unique_ptr<RagShard>> shards;
+    int64_t max_id = 0;
+    int version = kSchemaVersion;
+    for (size_t i = 0; i < files.size(); ++i) {
+        auto shard = std::make_unique<RagShard>();
+        shard->db.set_near_dup_distance(near_dup_distance_);
+        std::string shard_err;
+        if (!shard->db.open(files[i], embed_dim_, &shard_err)) {
+            if (err) *err = "shard " + std::to_string(i) + " (" + files[i] + "): " + shard_err;
+            return false;
+        }
+        max_id = std::max(max_id, shard->db.max_doc_id());
+        version = std::min(version, shard->db.schema_version());
+        shards.push_back(std::move(shard));
+    }
+    // Doc ids are global: one counter hands them out and the id picks the shard.
+    next_doc_id_ = max_id + 1;
+    schema_version_ = version;
+    shards_ = std::move(shards);
+    size_t hw = std::max(1u, std::thread::hardware_concurrency());
+    shard_pool_ = std::make_unique<RagTaskPool>(std::min(shards_.size(), hw) - 1);
+    return true;
+}
+
+RagShard& RagVectorDb::shard_for(size_t doc_id) const {
+    return *shards_[static_cast<size_t>(mix64(static_cast<uint64_t>(doc_id)) % shards_.size())];
+}
+
+size_t RagVectorDb::shard_total(size_t RagVectorDb::*counter) const {
+    size_t total = 0;
+    for (const auto& shard : shards_) {
+        std::lock_guard<std::mutex> lock(shard->mu);
+        total += shard->db.*counter;
+    }
+    return total;
+}
+
+std::vector<RagSearchHit> RagVectorDb::search_shards(const std::vector<float>& query_vec, size_t top_k) const {
+    std::vector<std::vector<RagSearchHit>> parts(shards_.size());
+    shard_pool_->run(shards_.size(), [&](size_t i) {
+        std::lock_guard<std::mutex> lock(shards_[i]->mu);
+        parts[i] = shards_[i]->db.search(query_vec, top_k);
+    });
+
+    // Each shard returns its own top_k, so the global top_k is among them.
+    std::vector<RagSearchHit> out;
+    for (auto& part : parts) {
+        out.insert(out.end(), std::make_move_iterator(part.begin()), std::make_move_iterator(part.end()));
+    }
+    std::stable_sort(out.begin(), out.end(), [](const RagSearchHit& a, const RagSearchHit& b) {
+        return a.score > b.score;
+    });
+    if (out.size() > top_k) out.resize(top_k);
+    return out;
+}
+
+std::vector<RagDocInfo> RagVectorDb::list_docs_shards(size_t limit, size_t offset) const {
+    std::vector<RagDocInfo> out;
+    if (limit == 0) return out;
+    for (const auto& shard : shards_) {
+        std::lock_guard<std::mutex> lock(shard->mu);
+        auto part = shard->db.list_docs(limit + offset, 0);
+        out.insert(out.end(), std::make_move_iterator(part.begin()), std::make_move_iterator(part.end()));
+    }
+    std::sort(out.begin(), out.end(), [](const RagDocInfo& a, const RagDocInfo& b) { return a.id > b.id; });
+    if (offset >= out.size()) return {};
+    out.erase(out.begin(), out.begin() + static_cast<std::ptrdiff_t>(offset));
+    if (out.size() > limit) out.resize(limit);
+    return out;
+}
@@ -1,7 +1,13 @@
 #pragma once
 
+#include <atomic>
 #include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 struct RagSearchHit {
@@ -18,8 +24,22 @@ struct RagDocInfo {
     std::string mime;
     int64_t added_at = 0;
     size_t chunk_count = 0;
+    std::string source_path; // empty for uploads; set for documents synced from the docs directory
 };
 
+// Manifest entry tying a document to the file it was ingested from, for incremental sync.
+struct RagDocSource {
+    size_t doc_id = 0;
+    std::string path;
+    int64_t size = 0;
+    int64_t mtime = 0;
+    std::string content_hash;
+};
+
+// Pulls the next chunk text into *chunk. Returns false when exhausted; setting *err as well
+// marks a failure and aborts the document.
+using RagChunkSource = std::function<bool(std::string* chunk, std::string* err)>;
+
 class RagEmbedder {
 public:
     explicit RagEmbedder(int dim);
@@ -30,6 +50,10 @@ private:
     int dim_;
 };
 
+class RagPack;
+class RagTaskPool;
+struct RagShard;
+
 class RagVectorDb {
 public:
     RagVectorDb();
@@ -38,6 +62,19 @@ public:
     RagVectorDb& operator=(const RagVectorDb&) = delete;
 
     bool open(const std::string& path, int embed_dim, std::string* err);
+    // Sharding (set before open()). Creating a new DB with n > 1 lays it out as n SQLite shard
+    // files next to `path`, recorded in the manifest "<path>.shards" (see rag_shards.h); an
+    // existing DB keeps the layout it was created with. Documents go to a shard by a hash of
+    // their id, searches fan out across shards in parallel. A sharded store may be called from
+    // several threads at once (each shard has its own lock); a single-file one may not.
+    // Dedup (shared vectors, near-duplicate collapse) works within a shard.
+    void set_shard_count(int n) { requested_shards_ = n; }
+    size_t shard_count() const { return shards_.empty() ? 1 : shards_.size(); }
+    // Serve from a read-only index pack (see rag_pack.h) instead of SQLite. The pack is mmap'd and
+    // queried in place; write operations fail with "index pack is read-only".
+    bool open_pack(const std::string& path, bool verify, std::string* err);
+    bool export_pack(const std::string& path, std::string* err) const;
+    bool read_only() const { return pack_ != nullptr; }
     bool add_document(const std::string& filename,
                       const std::string& mime,
                       const std::string& text,
@@ -45,6 +82,14 @@ public:
                       std::string* err,
                       size_t* out_doc_id,
                       size_t* out_chunk_count);
+    // Streaming variant of add_document(): chunks are embedded and stored as they are pulled, so
+    // the whole document text never has to be in memory at once.
+    bool add_document_stream(const std::string& filename,
+                             const std::string& mime,
+                             const RagChunkSource& next_chunk,
+                             std::string* err,
+                             size_t* out_doc_id,
+                             size_t* out_chunk_count);
 
     std::vector<RagSearchHit> search(const std::vector<float>& query_vec, size_t top_k) const;
     std::string expand_neighbors(size_t doc_id, int center_chunk_index, int neighbor_chunks) const;
@@ -55,18 +100,152 @@ public:
                              std::string* err) const;
     std::vector<RagDocInfo> list_docs(size_t limit = 200, size_t offset = 0) const;
     bool delete_doc(size_t doc_id, std::string* err);
+    std::vector<RagDocSource> list_doc_sources() const;
+    bool set_doc_source(const RagDocSource& src, std::string* err);
+    // Highest doc id that predates the source manifest (0 if none, or once cleared). Only those
+    // rows may be adopted by the docs sync; later unsourced rows are uploads.
+    size_t legacy_doc_max_id() const;
+    bool clear_legacy_docs(std::string* err);
+
+    // Bulk-load mode for seeding/re-indexing: relaxed durability (synchronous=OFF), a large page
+    // cache, documents grouped into long transactions and the chunk secondary indexes dropped.
+    // end_bulk() commits, rebuilds the indexes, runs ANALYZE and checkpoints the WAL. Deleting
+    // documents while in bulk mode works but scans the chunks table.
+    bool begin_bulk(std::string* err);
+    bool end_bulk(std::string* err);
+    bool in_bulk() const { return bulk_; }
+
+    // Space reclamation. New DBs use auto_vacuum=INCREMENTAL, so pages freed by deletes can be
+    // handed back a few at a time (incremental_vacuum) between other work. vacuum_full() rebuilds
+    // the whole file (blocking) and switches older DBs to incremental mode.
+    bool incremental_vacuum_enabled() const;
+    int64_t free_pages() const;
+    bool incremental_vacuum(int max_pages, std::string* err);
+    bool vacuum_full(std::string* err);
 
-    size_t doc_count() const { return doc_count_; }
-    size_t chunk_count() const { return chunk_count_; }
+    // Online schema upgrade of DBs created before the clustered (v2) chunk layout. Each call copies
+    // up to `max_docs` documents into the new tables in one short transaction, so callers can
+    // release their lock between calls; the call that finds nothing left to copy re-copies
+    // documents changed in the meantime and swaps the tables in (*done = true). Until then the
+    // DB keeps serving from the old tables.
+    bool migration_pending() const { return schema_version_ < kSchemaVersion; }
+    int schema_version() const { return schema_version_; }
+    bool migrate_step(size_t max_docs, bool* done, std::string* err);
+    // Legacy rows the v2 keys cannot hold (NULL or repeated (doc_id, chunk_index)), left behind
+    // by the finished migration.
+    size_t migrate_dropped_chunks() const;
+    size_t migrate_dropped_vectors() const;
+
+    // Online compaction of the vectors table: rows are copied in key order into a fresh table,
+    // one batch per compact_step() call, so callers can release their lock between batches and
+    // let searches run. finish_compact() applies writes made in the meantime and swaps tables.
+    bool begin_compact(std::string* err);
+    bool compact_step(size_t max_rows, bool* done, std::string* err);
+    bool finish_compact(size_t* out_rows, std::string* err);
+    void abort_compact();
+
+    // Max SimHash Hamming distance for two chunks to count as near-duplicates (0..5, 0 = exact
+    // duplicates only). Near-duplicates keep their own vector but are collapsed in search().
+    void set_near_dup_distance(int bits);
+
+    size_t doc_count() const { return shards_.empty() ? doc_count_ : shard_total(&RagVectorDb::doc_count_); }
+    size_t chunk_count() const { return shards_.empty() ? chunk_count_ : shard_total(&RagVectorDb::chunk_count_); }
+    // Chunks that own a stored vector; exact duplicate chunks share their owner's vector.
+    size_t vector_count() const { return shards_.empty() ? vector_count_ : shard_total(&RagVectorDb::vector_count_); }
+    size_t near_dup_count() const {
+        return shards_.empty() ? near_dup_count_ : shard_total(&RagVectorDb::near_dup_count_);
+    }
     int embed_dim() const { return embed_dim_; }
 
+    static constexpr int kSchemaVersion = 2;
+
 private:
+    struct NearDupEntry {
+        uint64_t simhash = 0;
+        int64_t group = 0;
+    };
+
     struct sqlite3* db_ = nullptr;
+    std::unique_ptr<RagPack> pack_;
+    int requested_shards_ = 1;
+    std::vector<std::unique_ptr<RagShard>> shards_;
+    std::unique_ptr<RagTaskPool> shard_pool_;
+    std::atomic<int64_t> next_doc_id_{1};
+    size_t compact_shard_ = 0;
     int embed_dim_ = 0;
     size_t doc_count_ = 0;
     size_t chunk_count_ = 0;
+    size_t vector_count_ = 0;
+    size_t near_dup_count_ = 0;
+    int near_dup_distance_ = 4;
+    static constexpr size_t kBulkCommitRows = 50000;
+    bool bulk_ = false;
+    int schema_version_ = 0;
+    int64_t next_chunk_id_ = 1;
+    bool migrating_ = false;
+    int64_t migrate_cursor_ = 0;
+    std::unordered_set<int64_t> migrate_touched_docs_;
+    size_t migrate_dropped_chunks_ = 0;
+    size_t migrate_dropped_vectors_ = 0;
+    bool compacting_ = false;
+    int64_t compact_cursor_doc_ = 0;
+    int64_t compact_cursor_index_ = -1;
+    size_t bulk_pending_rows_ = 0;
+    int saved_synchronous_ = 2;
+    int64_t saved_cache_size_ = -2000;
+    // LSH over the SimHash of vector-owning chunks, keyed by (band, band bits).
+    std::unordered_map<int64_t, NearDupEntry> near_dup_entries_;
+    std::unordered_map<uint32_t, std::vector<int64_t>> near_dup_bands_;
 
     bool exec(const std::string& sql, std::string* err) const;
+    // Adds a document under an explicit id (0 = next AUTOINCREMENT id); used by the shard router.
+    bool add_document_as(int64_t doc_id,
+                         const std::string& filename,
+                         const std::string& mime,
+                         const RagChunkSource& next_chunk,
+                         std::string* err,
+                         size_t* out_doc_id,
+                         size_t* out_chunk_count);
+    int64_t max_doc_id() const;
+    void close_shards();
+    bool open_shards(const std::vector<std::string>& files, std::string* err);
+    RagShard& shard_for(size_t doc_id) const;
+    size_t shard_total(size_t RagVectorDb::*counter) const;
+    std::vector<RagSearchHit> search_shards(const std::vector<float>& query_vec, size_t top_k) const;
+    std::vector<RagDocInfo> list_docs_shards(size_t limit, size_t offset) const;
     bool ensure_schema(std::string* err);
+    bool migrate_to_v1(std::string* err);
+    bool create_chunk_tables_v2(const char* suffix, std::string* err);
+    bool copy_docs_v2(int64_t after_doc, int64_t last_doc, std::string* err);
+    bool create_chunk_indexes(std::string* err);
+    // JOIN condition between `chunks` and `vectors` for the current schema version.
+    const char* vector_join() const;
+    bool begin_write(std::string* err);
+    bool commit_write(std::string* err);
+    void rollback_write();
+    void bulk_flush_if_needed(size_t rows);
+    bool ensure_column(const char* table, const char* column, const char* decl, std::string* err, bool* added = nullptr);
+    struct RagCounts {
+        size_t docs = 0;
+        size_t chunks = 0;
+        size_t vectors = 0;
+        size_t near_dups = 0;
+    };
     bool load_counts(std::string* err);
+    bool recount(RagCounts* out, std::string* err) const;
+    bool write_counts(const RagCounts& counts, std::string* err);
+    void apply_counts(const RagCounts& counts);
+    bool backfill_fingerprints(std::string* err);
+    bool load_near_dup_index(std::string* err);
+    void near_dup_insert(int64_t chunk_id, uint64_t simhash, int64_t group);
+    void near_dup_erase(int64_t chunk_id);
+    bool find_near_dup(uint64_t simhash, int64_t* out_group) const;
+
+    std::vector<RagSearchHit> search_pack(const std::vector<float>& query_vec, size_t top_k) const;
+    std::string expand_range_pack(size_t doc_id, int start_chunk_index, int end_chunk_index, int center_chunk_index) const;
+    bool get_document_chunks_pack(size_t doc_id,
+                                  std::string* out_filename,
+                                  std::vector<RagSearchHit>* out_chunks,
+                                  std::string* err) const;
+    std::vector<RagDocInfo> list_docs_pack(size_t limit, size_t offset) const;
 };
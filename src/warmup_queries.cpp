@@ -0,0 +1,89 @@
+#include "warmup_queries.h"
+
+#include <nlohmann/json.hpp>
+
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+
+using nlohmann::json;
+
+namespace {
+
+constexpr int64_t kSaveIntervalMs = 60 * 1000;
+// Replay only needs the shared prefixes; longer prompts are not kept whole.
+constexpr size_t kMaxPromptBytes = 64 * 1024;
+
+int64_t steady_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+} // namespace
+
+WarmupQueryLog::WarmupQueryLog(std::string path, size_t capacity) : path_(std::move(path)), capacity_(capacity) {
+    for (auto& q : load()) recent_.push_back(std::move(q));
+    while (recent_.size() > capacity_) recent_.pop_front();
+}
+
+std::vector<WarmupQuery> WarmupQueryLog::load() const {
+    std::vector<WarmupQuery> out;
+    std::ifstream f(path_, std::ios::binary);
+    if (!f) return out;
+    json arr = json::parse(f, nullptr, false);
+    if (!arr.is_array()) return out;
+    for (const auto& item : arr) {
+        if (!item.is_object()) continue;
+        WarmupQuery q;
+        q.query = item.value("query", std::string());
+        q.prompt = item.value("prompt", std::string());
+        if (!q.prompt.empty()) out.push_back(std::move(q));
+    }
+    if (out.size() > capacity_) out.erase(out.begin(), out.end() - static_cast<std::ptrdiff_t>(capacity_));
+    return out;
+}
+
+void WarmupQueryLog::record(const std::string& query, const std::string& prompt) {
+    if (capacity_ == 0 || prompt.empty() || prompt.size() > kMaxPromptBytes) return;
+    std::lock_guard<std::mutex> lock(mu_);
+    recent_.push_back(WarmupQuery{query, prompt});
+    while (recent_.size() > capacity_) recent_.pop_front();
+    dirty_ = true;
+    if (steady_ms() - last_save_ms_ >= kSaveIntervalMs) save_locked(nullptr);
+}
+
+bool WarmupQueryLog::save(std::string* err) {
+    std::lock_guard<std::mutex> lock(mu_);
+    return save_locked(err);
+}
+
+bool WarmupQueryLog::save_locked(std::string* err) {
+    if (!dirty_) return true;
+    last_save_ms_ = steady_ms();
+    json arr = json::array();
+    for (const auto& q : recent_) arr.push_back({{"query", q.query}, {"prompt", q.prompt}});
+
+    std::string tmp = path_ + ".tmp";
+    {
+        std::ofstream f(tmp, std::ios::binary | std::ios::trunc);
+        if (!f) {
+            if (err) *err = "cannot write " + tmp;
+            return false;
+        }
+        f << arr.dump();
+        if (!f.flush()) {
+            if (err) *err = "write failed: " + tmp;
+            std::error_code ec;
+            std::filesystem::remove(tmp, ec);
+            return false;
+        }
+    }
+    std::error_code ec;
+    std::filesystem::rename(tmp, path_, ec);
+    if (ec) {
+        if (err) *err = "rename failed: " + ec.message();
+        std::filesystem::remove(tmp, ec);
+        return false;
+    }
+    dirty_ = false;
+    return true;
+}
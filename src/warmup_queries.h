@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// A real chat request kept for replay at the next startup.
+struct WarmupQuery {
+    std::string query;  // last user message, used for the retrieval warm-up
+    std::string prompt; // templated local prompt, prefilled to refill the prefix cache
+};
+
+// The most recent `capacity` local chat requests, persisted to a JSON file so the warm-up at the
+// next start can replay production traffic. Written at most once a minute and on save().
+// Thread-safe.
+class WarmupQueryLog {
+public:
+    WarmupQueryLog(std::string path, size_t capacity);
+
+    // Entries saved by the previous run, oldest first.
+    std::vector<WarmupQuery> load() const;
+
+    void record(const std::string& query, const std::string& prompt);
+    bool save(std::string* err = nullptr);
+
+private:
+    std::string path_;
+    size_t capacity_;
+    std::mutex mu_;
+    std::deque<WarmupQuery> recent_;
+    bool dirty_ = false;
+    int64_t last_save_ms_ = 0;
+
+    bool save_locked(std::string* err);
+};